@@ -1,41 +1,173 @@
 #pragma once
 
-#include <cmath>
+#include <cstddef>
+#include <span>
+
+#include "simd.hpp"
 
 namespace nnets {
 
-struct RelU {
-  float operator()(float x) const {
-    return std::max(0.0f, x);
+// Activation function types of the layers
+// operator()(x) and derivative(x, y), where y = f(x), evaluate one value.
+// apply() and gradient() run whole spans of potentials through the vector
+// kernels of simd.hpp, size is the number of outputs of a sample (only
+// softmax needs it).
+class ElementwiseActivation
+{
+public:
+  explicit constexpr ElementwiseActivation(Activation activation)
+    : activation_{ activation }
+  {}
+
+  float
+  operator()(float x) const
+  {
+    return detail::scalar::activate(activation_, x);
   }
 
-  float derivative(float x) const {
-    return x >= 0.0f ? 1.0f : 0.0f;
+  float
+  derivative(float x, float y) const
+  {
+    return detail::scalar::activate_grad(activation_, x, y);
   }
-};
 
-struct UnitStep {
-  float operator()(float x) const {
-    return x >= 0.0f ? 1.0f : 0.0f;
+  // output = f(potential)
+  void
+  apply(std::span<const float> potential,
+        std::span<float> output,
+        std::size_t /*size*/) const
+  {
+    kernels().activate(
+      activation_, potential.data(), output.data(), potential.size());
   }
 
-  float derivative(float x) const {
-    return 0.0f;
+  // potential_grad = output_grad * f'(potential), output = f(potential)
+  void
+  gradient(std::span<const float> potential,
+           std::span<const float> output,
+           std::span<const float> output_grad,
+           std::span<float> potential_grad,
+           std::size_t /*size*/) const
+  {
+    kernels().activate_grad(activation_,
+                            potential.data(),
+                            output.data(),
+                            output_grad.data(),
+                            potential_grad.data(),
+                            potential.size());
   }
+
+  [[nodiscard]] const Activation&
+  activation() const
+  {
+    return activation_;
+  }
+
+private:
+  Activation activation_;
 };
 
-struct LogisticSigmoid {
-  float lambda = 1.0f;
+// Linear output, e.g. for the logits of SoftmaxCrossEntropy (see loss.hpp)
+struct Identity : ElementwiseActivation
+{
+  constexpr Identity()
+    : ElementwiseActivation{ { ActivationKind::Identity } }
+  {}
+};
 
-  float operator()(float x) const {
-    return 1.0f / (1.0f + std::exp(lambda * -x));
+struct RelU : ElementwiseActivation
+{
+  constexpr RelU()
+    : ElementwiseActivation{ { ActivationKind::Relu } }
+  {}
+};
+
+struct LeakyRelU : ElementwiseActivation
+{
+  constexpr LeakyRelU()
+    : LeakyRelU{ 0.01f }
+  {}
+
+  explicit constexpr LeakyRelU(float slope)
+    : ElementwiseActivation{ { ActivationKind::LeakyRelu, slope } }
+  {}
+};
+
+struct UnitStep : ElementwiseActivation
+{
+  constexpr UnitStep()
+    : ElementwiseActivation{ { ActivationKind::Step } }
+  {}
+};
+
+struct LogisticSigmoid : ElementwiseActivation
+{
+  constexpr LogisticSigmoid()
+    : LogisticSigmoid{ 1.0f }
+  {}
+
+  explicit constexpr LogisticSigmoid(float lambda,
+                                     Accuracy accuracy = Accuracy::Precise)
+    : ElementwiseActivation{ { ActivationKind::Sigmoid, lambda, accuracy } }
+  {}
+};
+
+struct Tanh : ElementwiseActivation
+{
+  constexpr Tanh()
+    : Tanh{ Accuracy::Precise }
+  {}
+
+  explicit constexpr Tanh(Accuracy accuracy)
+    : ElementwiseActivation{ { ActivationKind::Tanh, 0.0f, accuracy } }
+  {}
+};
+
+struct Gelu : ElementwiseActivation
+{
+  constexpr Gelu()
+    : Gelu{ Accuracy::Precise }
+  {}
+
+  explicit constexpr Gelu(Accuracy accuracy)
+    : ElementwiseActivation{ { ActivationKind::Gelu, 0.0f, accuracy } }
+  {}
+};
+
+// Softmax over the outputs of each sample
+// Not element-wise, so only for layers using apply() and gradient().
+struct Softmax
+{
+  Accuracy accuracy = Accuracy::Precise;
+
+  void
+  apply(std::span<const float> potential,
+        std::span<float> output,
+        std::size_t size) const
+  {
+    for (std::size_t i = 0; i < potential.size(); i += size) {
+      kernels().softmax(
+        accuracy, potential.data() + i, output.data() + i, size);
+    }
   }
 
-  float derivative(float x) const {
-    float val = (*this)(x);
-    return val * (1.0f - val);
+  // potential_grad = output * (output_grad - dot(output_grad, output)) per
+  // sample
+  void
+  gradient(std::span<const float> /*potential*/,
+           std::span<const float> output,
+           std::span<const float> output_grad,
+           std::span<float> potential_grad,
+           std::size_t size) const
+  {
+    for (std::size_t i = 0; i < output.size(); i += size) {
+      float projection =
+        kernels().dot(output_grad.data() + i, output.data() + i, size);
+      for (std::size_t j = i; j < i + size; ++j) {
+        potential_grad[j] = output[j] * (output_grad[j] - projection);
+      }
+    }
   }
 };
 
-
-}
\ No newline at end of file
+}
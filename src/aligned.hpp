@@ -0,0 +1,65 @@
+#pragma once
+
+#include <cstddef>
+#include <memory>
+#include <new>
+#include <vector>
+
+namespace nnets {
+
+// Allocator returning memory aligned to Alignment bytes (cache line by
+// default), so vector kernels and prefetching work on whole lines
+template<typename T, std::size_t Alignment = 64>
+struct AlignedAllocator
+{
+  using value_type = T;
+
+  template<typename U>
+  struct rebind
+  {
+    using other = AlignedAllocator<U, Alignment>;
+  };
+
+  AlignedAllocator() = default;
+
+  template<typename U>
+  AlignedAllocator(const AlignedAllocator<U, Alignment>&) noexcept
+  {}
+
+  [[nodiscard]] T*
+  allocate(std::size_t n)
+  {
+    return static_cast<T*>(
+      ::operator new(n * sizeof(T), std::align_val_t{ Alignment }));
+  }
+
+  void
+  deallocate(T* ptr, std::size_t) noexcept
+  {
+    ::operator delete(ptr, std::align_val_t{ Alignment });
+  }
+
+  friend bool
+  operator==(const AlignedAllocator&, const AlignedAllocator&)
+  {
+    return true;
+  }
+};
+
+// Vector with cache line aligned storage
+template<typename T>
+using AlignedVector = std::vector<T, AlignedAllocator<T>>;
+
+// Shared array of n value-initialized T with cache line aligned storage
+template<typename T>
+[[nodiscard]] std::shared_ptr<T[]>
+make_aligned_shared(std::size_t n)
+{
+  auto allocator = AlignedAllocator<T>{};
+  T* data = allocator.allocate(n);
+  std::uninitialized_value_construct_n(data, n);
+  return std::shared_ptr<T[]>(
+    data, [n](T* ptr) { AlignedAllocator<T>{}.deallocate(ptr, n); });
+}
+
+}
@@ -0,0 +1,494 @@
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <cstddef>
+#include <memory>
+#include <span>
+#include <stdexcept>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "activation_functions.hpp"
+#include "aligned.hpp"
+#include "dropout.hpp"
+#include "fully_connected.hpp"
+#include "module.hpp"
+#include "sequence.hpp"
+#include "simd.hpp"
+
+namespace nnets {
+
+// Options of a BatchNorm1d
+struct BatchNormConfig
+{
+  // Weight of a batch in the running statistics (after the first batches,
+  // which are averaged)
+  float momentum = 0.1f;
+  // Added to the variance before its square root
+  float epsilon = 1e-5f;
+};
+
+// Batch normalization of every feature of row-major samples, followed by an
+// activation function
+// In training mode features are normalized with the mean and variance of the
+// mini-batch (of the shard under DataParallel), in inference mode with
+// running statistics of the training batches. Those are part of the
+// parameters, so replicas and checkpoints share them, but not of
+// parameters(), so optimizers leave them alone.
+// The gradient slots of the running statistics accumulate the moments of the
+// training batches instead, so zero_grad() resets and add_grad() sums them
+// like gradients, and parameters_updated() (after an optimizer step) folds
+// them into the running statistics.
+// Follow a FullyConnected<Identity> to let fold_for_inference() fuse both.
+// See IModule for method documentation
+// See activation_functions.hpp for possible ActivationFn types
+template<typename ActivationFn = Identity>
+class BatchNorm1d : public IModule
+{
+public:
+  explicit BatchNorm1d(std::size_t size,
+                       BatchNormConfig config = {},
+                       ActivationFn activation_fn = {})
+    : size_{ size }
+    , config_{ config }
+    , activation_fn_{ activation_fn }
+  {
+    if (not(config.momentum > 0.0f and config.momentum <= 1.0f) or
+        not(config.epsilon > 0.0f)) {
+      throw std::invalid_argument{ "invalid batch normalization config" };
+    }
+
+    set_parameters(make_aligned_shared<float>(parameter_size()));
+    set_grads(make_aligned_shared<float>(parameter_size()));
+    std::ranges::fill(gamma_, 1.0f);
+    std::ranges::fill(running_var_, 1.0f);
+
+    mean_.resize(size);
+    inv_std_.resize(size);
+    scale_.resize(size);
+    shift_.resize(size);
+    sum_.resize(size);
+    x_hat_grad_sum_.resize(size);
+    resize_batch(1);
+  }
+
+  void
+  forward(std::span<const float> input) override
+  {
+    forward_batch(input, 1);
+  }
+
+  void
+  backward(std::span<const float> output_grad) override
+  {
+    backward_batch(output_grad, 1);
+  }
+
+  void
+  forward_batch(std::span<const float> inputs, std::size_t batch) override
+  {
+    resize_batch(batch);
+    batch_statistics_ = training_;
+
+    if (training_) {
+      // Two-pass mean and biased variance of the batch, moments for the
+      // running statistics
+      std::ranges::fill(mean_, 0.0f);
+      for (std::size_t b = 0; b < batch; ++b) {
+        kernels().axpy(1.0f, inputs.data() + b * size_, mean_.data(), size_);
+      }
+      float inv_batch = 1.0f / static_cast<float>(batch);
+      for (std::size_t j = 0; j < size_; ++j) {
+        mean_[j] *= inv_batch;
+      }
+
+      std::ranges::fill(sum_, 0.0f);
+      for (std::size_t b = 0; b < batch; ++b) {
+        const float* x = inputs.data() + b * size_;
+        for (std::size_t j = 0; j < size_; ++j) {
+          float centered = x[j] - mean_[j];
+          sum_[j] += centered * centered;
+        }
+      }
+      for (std::size_t j = 0; j < size_; ++j) {
+        float variance = sum_[j] * inv_batch;
+        inv_std_[j] = 1.0f / std::sqrt(variance + config_.epsilon);
+        mean_sum_[j] += static_cast<float>(batch) * mean_[j];
+        square_sum_[j] +=
+          static_cast<float>(batch) * (variance + mean_[j] * mean_[j]);
+      }
+      count_[0] += static_cast<float>(batch);
+    } else {
+      for (std::size_t j = 0; j < size_; ++j) {
+        mean_[j] = running_mean_[j];
+        inv_std_[j] = 1.0f / std::sqrt(running_var_[j] + config_.epsilon);
+      }
+    }
+
+    // y = gamma * (x - mean) * inv_std + beta = scale * x + shift
+    for (std::size_t j = 0; j < size_; ++j) {
+      scale_[j] = gamma_[j] * inv_std_[j];
+      shift_[j] = beta_[j] - mean_[j] * scale_[j];
+    }
+    for (std::size_t b = 0; b < batch; ++b) {
+      const float* x = inputs.data() + b * size_;
+      float* y = potential_.data() + b * size_;
+      for (std::size_t j = 0; j < size_; ++j) {
+        y[j] = scale_[j] * x[j] + shift_[j];
+      }
+    }
+    input_ = inputs.first(batch * size_);
+
+    std::size_t size = batch * size_;
+    activation_fn_.apply(std::span{ potential_ }.first(size),
+                         std::span{ output_ }.first(size),
+                         size_);
+  }
+
+  void
+  backward_batch(std::span<const float> output_grads,
+                 std::size_t batch) override
+  {
+    std::size_t size = batch * size_;
+    activation_fn_.gradient(std::span{ potential_ }.first(size),
+                            std::span{ output_ }.first(size),
+                            output_grads.first(size),
+                            std::span{ potential_grad_ }.first(size),
+                            size_);
+
+    // beta_grad += sum(dy), gamma_grad += sum(dy * x_hat) with the
+    // normalized input x_hat = (x - mean) * inv_std
+    std::ranges::fill(sum_, 0.0f);
+    std::ranges::fill(x_hat_grad_sum_, 0.0f);
+    for (std::size_t b = 0; b < batch; ++b) {
+      const float* x = input_.data() + b * size_;
+      const float* dy = potential_grad_.data() + b * size_;
+      for (std::size_t j = 0; j < size_; ++j) {
+        sum_[j] += dy[j];
+        x_hat_grad_sum_[j] += dy[j] * (x[j] - mean_[j]) * inv_std_[j];
+      }
+    }
+    for (std::size_t j = 0; j < size_; ++j) {
+      beta_grad_[j] += sum_[j];
+      gamma_grad_[j] += x_hat_grad_sum_[j];
+    }
+
+    if (not batch_statistics_) {
+      // Constant statistics, the normalization is affine
+      for (std::size_t b = 0; b < batch; ++b) {
+        const float* dy = potential_grad_.data() + b * size_;
+        float* dx = input_grad_.data() + b * size_;
+        for (std::size_t j = 0; j < size_; ++j) {
+          dx[j] = scale_[j] * dy[j];
+        }
+      }
+      return;
+    }
+
+    // dx = scale * (dy - mean(dy) - x_hat * mean(dy * x_hat))
+    float inv_batch = 1.0f / static_cast<float>(batch);
+    for (std::size_t j = 0; j < size_; ++j) {
+      sum_[j] *= inv_batch;
+      x_hat_grad_sum_[j] *= inv_batch;
+    }
+    for (std::size_t b = 0; b < batch; ++b) {
+      const float* x = input_.data() + b * size_;
+      const float* dy = potential_grad_.data() + b * size_;
+      float* dx = input_grad_.data() + b * size_;
+      for (std::size_t j = 0; j < size_; ++j) {
+        float x_hat = (x[j] - mean_[j]) * inv_std_[j];
+        dx[j] = scale_[j] * (dy[j] - sum_[j] - x_hat * x_hat_grad_sum_[j]);
+      }
+    }
+  }
+
+  void
+  set_training(bool training) override
+  {
+    training_ = training;
+  }
+
+  void
+  init_weights(Random& /*random*/) override
+  {
+    std::ranges::fill(gamma_, 1.0f);
+    std::ranges::fill(beta_, 0.0f);
+    std::ranges::fill(running_mean_, 0.0f);
+    std::ranges::fill(running_var_, 1.0f);
+    updates_[0] = 0.0f;
+  }
+
+  void
+  zero_grad() override
+  {
+    std::fill_n(grads_.get(), parameter_size(), 0.0f);
+  }
+
+  [[nodiscard]] std::shared_ptr<IModule>
+  replicate() const override
+  {
+    // Copies share the parameter storage, gradients are their own
+    auto replica = std::make_shared<BatchNorm1d>(*this);
+    replica->set_grads(make_aligned_shared<float>(parameter_size()));
+    return replica;
+  }
+
+  void
+  add_grad(const IModule& replica) override
+  {
+    const auto& other = static_cast<const BatchNorm1d&>(replica);
+
+    kernels().axpy(1.0f, other.grads_.get(), grads_.get(), parameter_size());
+  }
+
+  [[nodiscard]] std::vector<Parameter>
+  parameters() override
+  {
+    return {
+      { gamma_, gamma_grad_, 1.0f, false },
+      { beta_, beta_grad_, 1.0f, false },
+    };
+  }
+
+  // Fold the moments of the training batches since the last call into the
+  // running statistics
+  void
+  parameters_updated() override
+  {
+    float count = count_[0];
+    if (count == 0.0f) {
+      return;
+    }
+
+    // Cumulative average over the first batches, then exponential
+    float weight = std::max(config_.momentum, 1.0f / (updates_[0] + 1.0f));
+    float unbiased = count > 1.0f ? count / (count - 1.0f) : 1.0f;
+    for (std::size_t j = 0; j < size_; ++j) {
+      float mean = mean_sum_[j] / count;
+      float variance =
+        std::max(square_sum_[j] / count - mean * mean, 0.0f) * unbiased;
+      running_mean_[j] += weight * (mean - running_mean_[j]);
+      running_var_[j] += weight * (variance - running_var_[j]);
+    }
+    updates_[0] += 1.0f;
+
+    std::ranges::fill(mean_sum_, 0.0f);
+    std::ranges::fill(square_sum_, 0.0f);
+    count_[0] = 0.0f;
+  }
+
+  [[nodiscard]] std::size_t
+  parameter_size() const override
+  {
+    return 4 * size_ + 1;
+  }
+
+  void
+  bind_parameters(std::shared_ptr<float[]> storage) override
+  {
+    std::copy_n(parameters_.get(), parameter_size(), storage.get());
+    set_parameters(std::move(storage));
+  }
+
+  void
+  bind_grads(std::shared_ptr<float[]> storage) override
+  {
+    std::copy_n(grads_.get(), parameter_size(), storage.get());
+    set_grads(std::move(storage));
+  }
+
+  void
+  attach_parameters(std::shared_ptr<float[]> storage) override
+  {
+    set_parameters(std::move(storage));
+  }
+
+  [[nodiscard]] std::span<const float>
+  output() const override
+  {
+    return std::span{ output_ }.first(batch_size_ * size_);
+  }
+
+  [[nodiscard]] std::span<const float>
+  input_grad() const override
+  {
+    return std::span{ input_grad_ }.first(batch_size_ * size_);
+  }
+
+  [[nodiscard]] std::string
+  name() const override
+  {
+    return "batch_norm1d_" + std::to_string(size_);
+  }
+
+  [[nodiscard]] std::size_t
+  size() const
+  {
+    return size_;
+  }
+
+  [[nodiscard]] const BatchNormConfig&
+  config() const
+  {
+    return config_;
+  }
+
+  [[nodiscard]] const ActivationFn&
+  activation_fn() const
+  {
+    return activation_fn_;
+  }
+
+  [[nodiscard]] std::span<float>
+  gamma()
+  {
+    return gamma_;
+  }
+
+  [[nodiscard]] std::span<float>
+  beta()
+  {
+    return beta_;
+  }
+
+  [[nodiscard]] std::span<const float>
+  running_mean() const
+  {
+    return running_mean_;
+  }
+
+  [[nodiscard]] std::span<const float>
+  running_var() const
+  {
+    return running_var_;
+  }
+
+private:
+  // Gamma, beta, running mean, running variance and number of updates
+  void
+  set_parameters(std::shared_ptr<float[]> storage)
+  {
+    parameters_ = std::move(storage);
+    float* p = parameters_.get();
+    gamma_ = { p, size_ };
+    beta_ = { p + size_, size_ };
+    running_mean_ = { p + 2 * size_, size_ };
+    running_var_ = { p + 3 * size_, size_ };
+    updates_ = { p + 4 * size_, 1 };
+  }
+
+  // Gamma gradient, beta gradient, sum of batch means and of batch second
+  // moments weighted by their sizes, number of samples
+  void
+  set_grads(std::shared_ptr<float[]> storage)
+  {
+    grads_ = std::move(storage);
+    float* g = grads_.get();
+    gamma_grad_ = { g, size_ };
+    beta_grad_ = { g + size_, size_ };
+    mean_sum_ = { g + 2 * size_, size_ };
+    square_sum_ = { g + 3 * size_, size_ };
+    count_ = { g + 4 * size_, 1 };
+  }
+
+  // Grow per-sample buffers to hold a mini-batch (never shrinks)
+  void
+  resize_batch(std::size_t batch)
+  {
+    batch_size_ = batch;
+
+    if (potential_.size() < batch * size_) {
+      potential_.resize(batch * size_);
+      output_.resize(batch * size_);
+      potential_grad_.resize(batch * size_);
+      input_grad_.resize(batch * size_);
+    }
+  }
+
+  std::size_t size_;
+  BatchNormConfig config_;
+  ActivationFn activation_fn_;
+  std::size_t batch_size_ = 1;
+  bool training_ = false;
+  // Whether the last forward pass normalized with batch statistics
+  bool batch_statistics_ = false;
+  std::shared_ptr<float[]> parameters_;
+  std::span<float> gamma_;
+  std::span<float> beta_;
+  std::span<float> running_mean_;
+  std::span<float> running_var_;
+  std::span<float> updates_;
+  std::shared_ptr<float[]> grads_;
+  std::span<float> gamma_grad_;
+  std::span<float> beta_grad_;
+  std::span<float> mean_sum_;
+  std::span<float> square_sum_;
+  std::span<float> count_;
+  // Statistics of the last forward pass and per-feature scratch
+  std::vector<float> mean_;
+  std::vector<float> inv_std_;
+  std::vector<float> scale_;
+  std::vector<float> shift_;
+  std::vector<float> sum_;
+  std::vector<float> x_hat_grad_sum_;
+  std::vector<float> potential_;
+  std::vector<float> output_;
+  std::vector<float> potential_grad_;
+  std::vector<float> input_grad_;
+  std::span<const float> input_;
+};
+
+// Copy of a network for inference: Dropout modules are left out and every
+// FullyConnected<Identity> followed by a BatchNorm1d<ActivationFn> becomes
+// one FullyConnected<ActivationFn> with the normalization folded into its
+// weights and bias
+// Other modules are replicas sharing the network's parameter values at the
+// time of the call.
+template<typename ActivationFn>
+[[nodiscard]] Sequence
+fold_for_inference(const Sequence& net)
+{
+  using Linear = FullyConnected<Identity>;
+  using Norm = BatchNorm1d<ActivationFn>;
+
+  auto modules = std::vector<std::shared_ptr<IModule>>{};
+  auto layers = net.modules();
+  for (std::size_t l = 0; l < layers.size(); ++l) {
+    if (dynamic_cast<const Dropout*>(layers[l].get()) != nullptr) {
+      continue;
+    }
+
+    auto* linear = dynamic_cast<Linear*>(layers[l].get());
+    auto* norm = l + 1 < layers.size()
+                   ? dynamic_cast<Norm*>(layers[l + 1].get())
+                   : nullptr;
+    if (linear == nullptr or norm == nullptr) {
+      modules.push_back(layers[l]->replicate());
+      continue;
+    }
+
+    // gamma * (W x + b - mean) / sqrt(var + epsilon) + beta
+    std::size_t output_size = linear->bias().size();
+    std::size_t input_size = linear->weights().size() / output_size;
+    auto folded = std::make_shared<FullyConnected<ActivationFn>>(
+      input_size, output_size, norm->activation_fn());
+    for (std::size_t i = 0; i < output_size; ++i) {
+      float scale = norm->gamma()[i] /
+                    std::sqrt(norm->running_var()[i] + norm->config().epsilon);
+      for (std::size_t j = 0; j < input_size; ++j) {
+        folded->weights()[i * input_size + j] =
+          scale * linear->weights()[i * input_size + j];
+      }
+      folded->bias()[i] =
+        scale * (linear->bias()[i] - norm->running_mean()[i]) +
+        norm->beta()[i];
+    }
+    modules.push_back(std::move(folded));
+    ++l;
+  }
+  return Sequence{ std::move(modules) };
+}
+
+}
@@ -0,0 +1,99 @@
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <span>
+#include <vector>
+
+#include "aligned.hpp"
+
+namespace nnets {
+
+// Reusable staging buffer gathering samples picked by index into one
+// contiguous row-major float matrix for the batched forward pass
+// Works with any dataset providing input(i) and label(i), e.g. Dataset or
+// MappedDataset (uint8 inputs are converted to float while copying)
+class BatchStager
+{
+public:
+  BatchStager(std::size_t max_batch_size, std::size_t input_size)
+    : input_size_{ input_size }
+    , inputs_(max_batch_size * input_size)
+    , labels_(max_batch_size)
+  {}
+
+  // Copy the samples at indices into the staging buffer, inputs multiplied
+  // by scale (e.g. 1 / 255 to normalize uint8 pixels)
+  // Returns the gathered inputs, labels are available with labels()
+  template<typename DatasetT>
+  std::span<const float>
+  gather(const DatasetT& dataset,
+         std::span<const std::size_t> indices,
+         float scale = 1.0f)
+  {
+    // Rows are scattered over the dataset, so fetch a few rows ahead
+    constexpr std::size_t prefetch_distance = 4;
+
+    batch_size_ = indices.size();
+
+    for (std::size_t i = 0; i < batch_size_; ++i) {
+      if (i + prefetch_distance < batch_size_) {
+        prefetch(dataset.input(indices[i + prefetch_distance]));
+      }
+
+      auto input = dataset.input(indices[i]);
+      auto row = inputs_.begin() + i * input_size_;
+      if (scale == 1.0f) {
+        std::ranges::copy(input, row);
+      } else {
+        std::ranges::transform(
+          input, row, [scale](auto value) { return scale * value; });
+      }
+      labels_[i] = dataset.label(indices[i]);
+    }
+
+    return inputs();
+  }
+
+  // Inputs of the last gathered batch, row-major
+  [[nodiscard]] std::span<const float>
+  inputs() const
+  {
+    return std::span{ inputs_ }.first(batch_size_ * input_size_);
+  }
+
+  [[nodiscard]] std::span<float>
+  inputs()
+  {
+    return std::span{ inputs_ }.first(batch_size_ * input_size_);
+  }
+
+  // Labels of the last gathered batch
+  [[nodiscard]] std::span<const int>
+  labels() const
+  {
+    return std::span{ labels_ }.first(batch_size_);
+  }
+
+private:
+  template<typename T>
+  static void
+  prefetch(std::span<const T> row)
+  {
+#if defined(__GNUC__)
+    constexpr std::size_t cache_line = 64;
+    const auto* bytes = reinterpret_cast<const char*>(row.data());
+    for (std::size_t offset = 0; offset < row.size_bytes();
+         offset += cache_line) {
+      __builtin_prefetch(bytes + offset);
+    }
+#endif
+  }
+
+  std::size_t input_size_;
+  std::size_t batch_size_ = 0;
+  AlignedVector<float> inputs_;
+  std::vector<int> labels_;
+};
+
+}
@@ -0,0 +1,652 @@
+#include <algorithm>
+#include <cstdint>
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <memory>
+#include <numeric>
+#include <span>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include "activation_functions.hpp"
+#include "batch_stager.hpp"
+#include "benchmark.hpp"
+#include "conv2d.hpp"
+#include "csv_parser.hpp"
+#include "data_loader.hpp"
+#include "data_parallel.hpp"
+#include "fully_connected.hpp"
+#include "gemm.hpp"
+#include "max_pool2d.hpp"
+#include "optimizer.hpp"
+#include "random.hpp"
+#include "sequence.hpp"
+#include "simd.hpp"
+#include "sparse_inference.hpp"
+#include "thread_pool.hpp"
+
+namespace {
+
+// Layer shapes of the Fashion-MNIST topology
+constexpr std::size_t layer_shapes[][2] = {
+  { 784, 300 },
+  { 300, 200 },
+  { 200, 100 },
+  { 100, 10 },
+};
+constexpr std::size_t batch_sizes[] = { 1, 32, 200 };
+
+// In-memory uint8 dataset like MappedDataset, without a file
+struct ByteDataset
+{
+  std::size_t num_columns = 0;
+  std::vector<std::uint8_t> inputs;
+  std::vector<std::uint8_t> labels;
+
+  [[nodiscard]] std::size_t
+  size() const
+  {
+    return labels.size();
+  }
+
+  [[nodiscard]] std::size_t
+  input_size() const
+  {
+    return num_columns;
+  }
+
+  [[nodiscard]] std::span<const std::uint8_t>
+  input(std::size_t i) const
+  {
+    return std::span{ inputs }.subspan(i * num_columns, num_columns);
+  }
+
+  [[nodiscard]] int
+  label(std::size_t i) const
+  {
+    return labels[i];
+  }
+};
+
+ByteDataset
+random_dataset(nnets::Random& random, std::size_t size, std::size_t input_size)
+{
+  auto values = std::vector<float>(size * input_size);
+  random.generate_uniform(values, 0.0f, 255.0f);
+  auto dataset = ByteDataset{ input_size, {}, {} };
+  for (float value : values) {
+    dataset.inputs.push_back(static_cast<std::uint8_t>(value));
+  }
+  for (std::size_t i = 0; i < size; ++i) {
+    dataset.labels.push_back(static_cast<std::uint8_t>(i % 10));
+  }
+  return dataset;
+}
+
+// Thread counts from 1 doubling up to the hardware concurrency
+std::vector<std::size_t>
+thread_counts()
+{
+  std::size_t max_threads =
+    std::max<std::size_t>(std::thread::hardware_concurrency(), 1);
+  auto counts = std::vector<std::size_t>{};
+  for (std::size_t n = 1; n < max_threads; n *= 2) {
+    counts.push_back(n);
+  }
+  counts.push_back(max_threads);
+  return counts;
+}
+
+template<typename ActivationFn>
+void
+benchmark_layers(nnets::BenchmarkSuite& suite,
+                 nnets::Random& random,
+                 const char* activation)
+{
+  for (const auto& [input_size, output_size] : layer_shapes) {
+    for (std::size_t batch : batch_sizes) {
+      auto layer =
+        nnets::FullyConnected<ActivationFn>{ input_size, output_size };
+      layer.init_weights(random);
+      auto inputs = std::vector<float>(batch * input_size);
+      auto output_grads = std::vector<float>(batch * output_size);
+      random.generate_normal(inputs, 0.0f, 1.0f);
+      random.generate_normal(output_grads, 0.0f, 1.0f);
+
+      double macs = static_cast<double>(batch * input_size * output_size);
+      double weight_bytes = 4.0 * input_size * output_size;
+      double input_bytes = 4.0 * batch * input_size;
+      double output_bytes = 4.0 * batch * output_size;
+      auto params = std::vector<nnets::BenchmarkParam>{
+        { "input", input_size },
+        { "output", output_size },
+        { "batch", batch },
+        { "activation", activation },
+      };
+
+      suite.run("fully_connected_forward",
+                params,
+                { 2.0 * macs, weight_bytes + input_bytes + output_bytes },
+                [&] { layer.forward_batch(inputs, batch); });
+
+      // Weight gradient and input gradient GEMMs
+      layer.forward_batch(inputs, batch);
+      suite.run("fully_connected_backward",
+                params,
+                { 4.0 * macs,
+                  3.0 * weight_bytes + 2.0 * input_bytes + output_bytes },
+                [&] { layer.backward_batch(output_grads, batch); });
+    }
+  }
+}
+
+// First layer on inputs with a share of zeros (about half for Fashion-MNIST),
+// dense GEMMs against InputSparsity::Sparse
+void
+benchmark_sparse_input(nnets::BenchmarkSuite& suite, nnets::Random& random)
+{
+  constexpr std::size_t input_size = 784;
+  constexpr std::size_t output_size = 300;
+  for (std::size_t percent : { 25, 50 }) {
+    for (std::size_t batch : { 1, 8, 32, 200 }) {
+      auto inputs = std::vector<float>(batch * input_size);
+      auto keep = std::vector<float>(batch * input_size);
+      auto output_grads = std::vector<float>(batch * output_size);
+      random.generate_normal(inputs, 0.0f, 1.0f);
+      random.generate_uniform(keep, 0.0f, 1.0f);
+      random.generate_normal(output_grads, 0.0f, 1.0f);
+      for (std::size_t i = 0; i < inputs.size(); ++i) {
+        inputs[i] = keep[i] * 100.0f < percent ? inputs[i] : 0.0f;
+      }
+
+      for (auto sparsity :
+           { nnets::InputSparsity::Dense, nnets::InputSparsity::Sparse }) {
+        bool sparse = sparsity == nnets::InputSparsity::Sparse;
+        auto layer = nnets::FullyConnected<nnets::RelU>{
+          input_size, output_size, {}, {}, sparsity
+        };
+        layer.init_weights(random);
+
+        double macs = static_cast<double>(batch * input_size * output_size);
+        auto params = std::vector<nnets::BenchmarkParam>{
+          { "batch", batch },
+          { "density_percent", percent },
+          { "sparsity", sparse ? "sparse" : "dense" },
+        };
+        suite.run("sparse_input_forward",
+                  params,
+                  { 2.0 * macs, 4.0 * input_size * output_size },
+                  [&] { layer.forward_batch(inputs, batch); });
+
+        layer.forward_batch(inputs, batch);
+        suite.run("sparse_input_backward",
+                  params,
+                  { 4.0 * macs, 8.0 * input_size * output_size },
+                  [&] { layer.backward_batch(output_grads, batch); });
+      }
+    }
+  }
+}
+
+// Inference of a pruned 784x300 layer: dense GEMM against the Csr format on
+// randomly zeroed weights and the Block format on zeroed blocks
+void
+benchmark_sparse_inference(nnets::BenchmarkSuite& suite, nnets::Random& random)
+{
+  constexpr std::size_t input_size = 784;
+  constexpr std::size_t output_size = 300;
+  constexpr std::size_t block = nnets::sparse_block_size;
+  for (std::size_t percent : { 50, 80, 90, 95 }) {
+    auto weights = std::vector<float>(input_size * output_size);
+    auto bias = std::vector<float>(output_size);
+    auto keep = std::vector<float>(weights.size());
+    random.generate_normal(weights, 0.0f, 0.1f);
+    random.generate_normal(bias, 0.0f, 0.1f);
+    random.generate_uniform(keep, 0.0f, 100.0f);
+    auto csr_weights = weights;
+    auto block_weights = weights;
+    for (std::size_t i = 0; i < weights.size(); ++i) {
+      std::size_t j = i / input_size;
+      std::size_t k = i % input_size;
+      if (keep[i] < percent) {
+        csr_weights[i] = 0.0f;
+      }
+      // Blocks share the keep value of their first output
+      if (keep[j / block * block * input_size + k] < percent) {
+        block_weights[i] = 0.0f;
+      }
+    }
+
+    auto layer = nnets::FullyConnected<nnets::RelU>{ input_size, output_size };
+    std::ranges::copy(csr_weights, layer.weights().begin());
+    std::ranges::copy(bias, layer.bias().begin());
+    layer.parameters_updated();
+    auto csr = nnets::SparseFullyConnected<nnets::RelU>{
+      csr_weights, bias, {}, nnets::SparseFormat::Csr
+    };
+    auto blocks = nnets::SparseFullyConnected<nnets::RelU>{
+      block_weights, bias, {}, nnets::SparseFormat::Block
+    };
+
+    for (std::size_t batch : { 1, 32 }) {
+      auto inputs = std::vector<float>(batch * input_size);
+      random.generate_normal(inputs, 0.0f, 1.0f);
+      double macs = static_cast<double>(batch * input_size * output_size);
+      auto run = [&](const char* format, double bytes, auto&& fn) {
+        auto params = std::vector<nnets::BenchmarkParam>{
+          { "sparsity_percent", percent },
+          { "batch", batch },
+          { "format", format },
+        };
+        suite.run("sparse_inference", params, { 2.0 * macs, bytes }, fn);
+      };
+      run("dense", 4.0 * input_size * output_size, [&] {
+        layer.forward_batch(inputs, batch);
+      });
+      run("csr", static_cast<double>(csr.weight_bytes()), [&] {
+        csr.forward_batch(inputs, batch);
+      });
+      run("block", static_cast<double>(blocks.weight_bytes()), [&] {
+        blocks.forward_batch(inputs, batch);
+      });
+    }
+  }
+}
+
+void
+benchmark_activations(nnets::BenchmarkSuite& suite, nnets::Random& random)
+{
+  struct Kind
+  {
+    const char* name;
+    nnets::ActivationKind kind;
+    float parameter;
+  };
+  constexpr Kind kinds[] = {
+    { "relu", nnets::ActivationKind::Relu, 0.0f },
+    { "leaky_relu", nnets::ActivationKind::LeakyRelu, 0.01f },
+    { "sigmoid", nnets::ActivationKind::Sigmoid, 1.0f },
+    { "tanh", nnets::ActivationKind::Tanh, 0.0f },
+    { "gelu", nnets::ActivationKind::Gelu, 0.0f },
+  };
+  constexpr std::pair<const char*, nnets::Accuracy> accuracies[] = {
+    { "precise", nnets::Accuracy::Precise },
+    { "balanced", nnets::Accuracy::Balanced },
+    { "fast", nnets::Accuracy::Fast },
+  };
+
+  // A batch of 200 outputs of the first hidden layer
+  constexpr std::size_t n = 200 * 300;
+  auto x = std::vector<float>(n);
+  auto y = std::vector<float>(n);
+  auto dy = std::vector<float>(n);
+  auto dx = std::vector<float>(n);
+  random.generate_normal(x, 0.0f, 2.0f);
+  random.generate_normal(dy, 0.0f, 1.0f);
+
+  for (const auto& kind : kinds) {
+    for (const auto& [accuracy_name, accuracy] : accuracies) {
+      auto f = nnets::Activation{ kind.kind, kind.parameter, accuracy };
+      auto params = std::vector<nnets::BenchmarkParam>{
+        { "kind", kind.name },
+        { "accuracy", accuracy_name },
+        { "elements", n },
+      };
+      suite.run("activation_forward", params, { 0.0, 8.0 * n }, [&] {
+        nnets::kernels().activate(f, x.data(), y.data(), n);
+      });
+      suite.run("activation_backward", params, { 0.0, 16.0 * n }, [&] {
+        nnets::kernels().activate_grad(
+          f, x.data(), y.data(), dy.data(), dx.data(), n);
+      });
+    }
+  }
+
+  for (const auto& [accuracy_name, accuracy] : accuracies) {
+    auto params = std::vector<nnets::BenchmarkParam>{
+      { "accuracy", accuracy_name },
+      { "rows", 200 },
+      { "size", 10 },
+    };
+    suite.run("softmax", params, { 0.0, 8.0 * 200 * 10 }, [&] {
+      for (std::size_t row = 0; row < 200; ++row) {
+        nnets::kernels().softmax(
+          accuracy, x.data() + row * 10, y.data() + row * 10, 10);
+      }
+    });
+  }
+
+  // Counter-based dropout kernel against a mask drawn from Random
+  auto dropout_params = std::vector<nnets::BenchmarkParam>{
+    { "rate", "0.5" },
+    { "elements", n },
+  };
+  suite.run("dropout_kernel", dropout_params, { 0.0, 8.0 * n }, [&] {
+    nnets::kernels().dropout(12345u, 1u << 23, 2.0f, x.data(), y.data(), n);
+  });
+  suite.run("dropout_uniform_mask", dropout_params, { 0.0, 12.0 * n }, [&] {
+    random.generate_uniform(dx, 0.0f, 1.0f);
+    for (std::size_t i = 0; i < n; ++i) {
+      y[i] = dx[i] >= 0.5f ? 2.0f * x[i] : 0.0f;
+    }
+  });
+}
+
+void
+benchmark_gemm(nnets::BenchmarkSuite& suite, nnets::Random& random)
+{
+  constexpr std::size_t shapes[][3] = {
+    { 200, 300, 784 }, { 200, 200, 300 }, { 256, 256, 256 },
+    { 512, 512, 512 }, { 1, 300, 784 },
+  };
+
+  for (const auto& [m, n, k] : shapes) {
+    auto a = std::vector<float>(m * k);
+    auto b = std::vector<float>(n * k);
+    auto c = std::vector<float>(m * n);
+    random.generate_normal(a, 0.0f, 1.0f);
+    random.generate_normal(b, 0.0f, 1.0f);
+
+    suite.run("gemm",
+              { { "m", m }, { "n", n }, { "k", k } },
+              { 2.0 * m * n * k, 4.0 * (m * k + n * k + m * n) },
+              [&] {
+                nnets::gemm(nnets::Transpose::No,
+                            nnets::Transpose::Yes,
+                            m,
+                            n,
+                            k,
+                            1.0f,
+                            a.data(),
+                            k,
+                            b.data(),
+                            k,
+                            0.0f,
+                            c.data(),
+                            n);
+              });
+  }
+}
+
+void
+benchmark_conv(nnets::BenchmarkSuite& suite, nnets::Random& random)
+{
+  // Input channels, image size, output channels, kernel size
+  constexpr std::size_t shapes[][4] = {
+    { 1, 28, 8, 3 },  { 1, 28, 8, 5 },   { 3, 32, 16, 3 },
+    { 8, 14, 16, 3 }, { 16, 14, 32, 3 }, { 32, 7, 64, 3 },
+  };
+  constexpr std::size_t batch = 32;
+  constexpr std::pair<nnets::ConvAlgorithm, const char*> algorithms[] = {
+    { nnets::ConvAlgorithm::Im2col, "im2col" },
+    { nnets::ConvAlgorithm::Direct, "direct" },
+  };
+  constexpr std::pair<nnets::ImageLayout, const char*> layouts[] = {
+    { nnets::ImageLayout::Nchw, "nchw" },
+    { nnets::ImageLayout::Nhwc, "nhwc" },
+  };
+
+  for (const auto& [channels, size, output_channels, kernel] : shapes) {
+    for (const auto& [layout, layout_name] : layouts) {
+      for (const auto& [algorithm, algorithm_name] : algorithms) {
+        if (algorithm == nnets::ConvAlgorithm::Direct and
+            layout != nnets::ImageLayout::Nchw) {
+          continue;
+        }
+        for (std::size_t threads : thread_counts()) {
+          auto pool = nnets::ThreadPool{ threads };
+          auto config = nnets::Conv2DConfig{};
+          config.input_channels = channels;
+          config.input_height = size;
+          config.input_width = size;
+          config.output_channels = output_channels;
+          config.kernel_height = kernel;
+          config.kernel_width = kernel;
+          config.padding = kernel / 2;
+          config.layout = layout;
+          config.algorithm = algorithm;
+          auto layer = nnets::Conv2D<nnets::RelU>{ config, {}, &pool };
+          layer.init_weights(random);
+          // Same padding, the output has the size of the input
+          auto inputs = std::vector<float>(batch * channels * size * size);
+          auto output_grads =
+            std::vector<float>(batch * output_channels * size * size);
+          random.generate_normal(inputs, 0.0f, 1.0f);
+          random.generate_normal(output_grads, 0.0f, 1.0f);
+
+          double macs = static_cast<double>(batch * output_channels * size *
+                                            size * channels * kernel * kernel);
+          double bytes = 4.0 * (inputs.size() + output_grads.size());
+          auto params = std::vector<nnets::BenchmarkParam>{
+            { "channels", channels },
+            { "size", size },
+            { "output_channels", output_channels },
+            { "kernel", kernel },
+            { "layout", layout_name },
+            { "algorithm", algorithm_name },
+            { "threads", threads },
+          };
+
+          suite.run("conv2d_forward", params, { 2.0 * macs, bytes }, [&] {
+            layer.forward_batch(inputs, batch);
+          });
+
+          // Weight gradient and input gradient
+          layer.forward_batch(inputs, batch);
+          suite.run(
+            "conv2d_backward", params, { 4.0 * macs, 2.0 * bytes }, [&] {
+              layer.zero_grad();
+              layer.backward_batch(output_grads, batch);
+            });
+        }
+      }
+    }
+
+    auto pooling = nnets::MaxPool2D{ { output_channels, size, size } };
+    auto inputs = std::vector<float>(batch * output_channels * size * size);
+    random.generate_normal(inputs, 0.0f, 1.0f);
+    auto values = static_cast<double>(inputs.size());
+    suite.run("max_pool2d_forward",
+              { { "channels", output_channels }, { "size", size } },
+              { values, 4.0 * values * 5.0 / 4.0 },
+              [&] { pooling.forward_batch(inputs, batch); });
+  }
+}
+
+void
+benchmark_optimizers(nnets::BenchmarkSuite& suite, nnets::Random& random)
+{
+  struct Kind
+  {
+    const char* name;
+    nnets::OptimizerKind kind;
+    // Parameter sized arrays read or written per element
+    double streams;
+  };
+  constexpr Kind kinds[] = {
+    { "sgd", nnets::OptimizerKind::Sgd, 5 },
+    { "rms_prop", nnets::OptimizerKind::RmsProp, 5 },
+    { "adam", nnets::OptimizerKind::Adam, 7 },
+    { "adamw", nnets::OptimizerKind::AdamW, 7 },
+  };
+
+  for (const auto& kind : kinds) {
+    auto net = nnets::Sequence{ {
+      std::make_shared<nnets::FullyConnected<nnets::RelU>>(784, 300),
+      std::make_shared<nnets::FullyConnected<nnets::RelU>>(300, 200),
+      std::make_shared<nnets::FullyConnected<nnets::RelU>>(200, 100),
+      std::make_shared<nnets::FullyConnected<nnets::RelU>>(100, 10),
+    } };
+    net.init_weights(random);
+    random.generate_normal(net.grad_arena(), 0.0f, 1e-3f);
+    auto optimizer = nnets::Optimizer{
+      net, { .kind = kind.kind, .learning_rate = 1e-9f, .momentum = 0.9f }
+    };
+
+    double n = static_cast<double>(net.parameter_size());
+    suite.run("optimizer_step",
+              { { "kind", kind.name }, { "parameters", net.parameter_size() } },
+              { 0.0, 4.0 * kind.streams * n },
+              [&] { optimizer.step(); });
+  }
+}
+
+void
+benchmark_training(nnets::BenchmarkSuite& suite, nnets::Random& random)
+{
+  constexpr std::size_t batch = 200;
+  constexpr std::size_t num_categories = 10;
+
+  auto inputs = std::vector<float>(batch * 784);
+  random.generate_uniform(inputs, 0.0f, 255.0f);
+  auto loss_grad = [&](std::size_t,
+                       std::span<const float> output,
+                       std::span<float> error_grad) {
+    std::ranges::copy(output, error_grad.begin());
+    return 0.0f;
+  };
+
+  double macs = 0.0;
+  for (const auto& [input_size, output_size] : layer_shapes) {
+    macs += static_cast<double>(batch * input_size * output_size);
+  }
+
+  for (std::size_t num_threads : thread_counts()) {
+    auto net = nnets::Sequence{ {
+      std::make_shared<nnets::FullyConnected<nnets::RelU>>(784, 300),
+      std::make_shared<nnets::FullyConnected<nnets::RelU>>(300, 200),
+      std::make_shared<nnets::FullyConnected<nnets::RelU>>(200, 100),
+      std::make_shared<nnets::FullyConnected<nnets::RelU>>(100,
+                                                           num_categories),
+    } };
+    net.init_weights(random);
+    auto pool = nnets::ThreadPool{ num_threads };
+    auto trainer = nnets::DataParallel{ net, pool };
+
+    // Forward, backward and the gradient reduction of one batch
+    suite.run("train_batch",
+              { { "batch", batch }, { "threads", num_threads } },
+              { 6.0 * macs, 0.0 },
+              [&] {
+                trainer.zero_grad();
+                trainer.train_batch(inputs, batch, 0, loss_grad);
+              });
+  }
+}
+
+void
+benchmark_data(nnets::BenchmarkSuite& suite, nnets::Random& random)
+{
+  constexpr std::size_t input_size = 784;
+  constexpr std::size_t batch = 200;
+  const auto dataset = random_dataset(random, 6000, input_size);
+
+  // CSV text of the dataset inputs
+  auto text = std::string{};
+  for (std::size_t i = 0; i < dataset.size(); ++i) {
+    for (std::size_t j = 0; j < input_size; ++j) {
+      text += std::to_string(dataset.input(i)[j]);
+      text += j + 1 < input_size ? ',' : '\n';
+    }
+  }
+
+  auto matrix = nnets::CsvMatrix<float>{};
+  for (std::size_t num_threads : thread_counts()) {
+    auto pool = nnets::ThreadPool{ num_threads };
+    suite.run("parse_csv",
+              { { "rows", dataset.size() }, { "threads", num_threads } },
+              { 0.0, text.size() + 4.0 * dataset.inputs.size() },
+              [&] { nnets::parse_csv(text, matrix, &pool); });
+  }
+
+  auto indices = std::vector<std::size_t>(dataset.size());
+  std::iota(indices.begin(), indices.end(), 0);
+  std::ranges::shuffle(indices, random.rng());
+  auto stager = nnets::BatchStager{ batch, input_size };
+  std::size_t offset = 0;
+  suite.run("batch_gather",
+            { { "batch", batch }, { "input", input_size } },
+            { 0.0, 5.0 * batch * input_size },
+            [&] {
+              offset = offset + batch <= indices.size() ? offset : 0;
+              stager.gather(
+                dataset, std::span{ indices }.subspan(offset, batch), 1.0f);
+              offset += batch;
+            });
+
+  // Batches the trainer receives per second, limited by the producer
+  auto loader = nnets::DataLoader{
+    dataset,
+    indices,
+    { .batch_size = batch, .num_epochs = 1 << 20, .num_categories = 10 },
+    random.rng()
+  };
+  suite.run("data_loader_next",
+            { { "batch", batch }, { "input", input_size } },
+            { 0.0, 5.0 * batch * input_size },
+            [&] { static_cast<void>(loader.next()); });
+}
+
+}
+
+// Microbenchmarks of layers, GEMM, optimizers, training and data loading,
+// written as JSON for comparing versions
+// Usage: nnets_benchmark [--filter substring] [--min-time seconds]
+//        [--repetitions n] [--output file.json]
+int
+main(int argc, char** argv)
+{
+  auto options = nnets::BenchmarkSuite::Options{};
+  std::string output_path;
+  for (int i = 1; i + 1 < argc; i += 2) {
+    auto flag = std::string_view{ argv[i] };
+    if (flag == "--filter") {
+      options.filter = argv[i + 1];
+    } else if (flag == "--min-time") {
+      options.min_time = std::atof(argv[i + 1]);
+    } else if (flag == "--repetitions") {
+      options.repetitions = std::max(std::atoi(argv[i + 1]), 1);
+    } else if (flag == "--output") {
+      output_path = argv[i + 1];
+    } else {
+      std::cerr << "unknown option " << flag << "\n";
+      return 1;
+    }
+  }
+
+  auto random = nnets::Random{};
+  random.seed(42);
+
+  auto suite = nnets::BenchmarkSuite{ options };
+  benchmark_layers<nnets::RelU>(suite, random, "relu");
+  benchmark_layers<nnets::LogisticSigmoid>(suite, random, "sigmoid");
+  benchmark_layers<nnets::Tanh>(suite, random, "tanh");
+  benchmark_layers<nnets::Gelu>(suite, random, "gelu");
+  benchmark_sparse_input(suite, random);
+  benchmark_sparse_inference(suite, random);
+  benchmark_activations(suite, random);
+  benchmark_gemm(suite, random);
+  benchmark_conv(suite, random);
+  benchmark_optimizers(suite, random);
+  benchmark_training(suite, random);
+  benchmark_data(suite, random);
+
+  auto context = std::vector<nnets::BenchmarkParam>{
+    { "isa", nnets::isa_name(nnets::kernels().isa) },
+    { "hardware_threads",
+      static_cast<std::size_t>(std::thread::hardware_concurrency()) },
+    { "repetitions", options.repetitions },
+  };
+  if (output_path.empty()) {
+    suite.write_json(std::cout, context);
+  } else {
+    auto file = std::ofstream{ output_path };
+    suite.write_json(file, context);
+  }
+
+  return 0;
+}
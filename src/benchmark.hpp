@@ -0,0 +1,211 @@
+#pragma once
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstddef>
+#include <cstdio>
+#include <functional>
+#include <iostream>
+#include <ostream>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+namespace nnets {
+
+// Parameter of a benchmark case, the value is stored JSON encoded
+struct BenchmarkParam
+{
+  BenchmarkParam(std::string key, std::size_t value)
+    : key{ std::move(key) }
+    , value{ std::to_string(value) }
+  {}
+
+  BenchmarkParam(std::string key, std::string_view value)
+    : key{ std::move(key) }
+    , value{ "\"" + std::string{ value } + "\"" }
+  {}
+
+  std::string key;
+  std::string value;
+};
+
+// Amount of work done by one call of a benchmark case, used to report
+// achieved throughput (0 if not meaningful)
+struct BenchmarkWork
+{
+  double flops = 0.0;
+  // Bytes read plus bytes written, counting every operand once
+  double bytes = 0.0;
+};
+
+// Timing statistics of a benchmark case
+struct BenchmarkResult
+{
+  std::string name;
+  std::vector<BenchmarkParam> params;
+  BenchmarkWork work;
+  // Calls per timed sample
+  std::size_t iterations = 0;
+  // Seconds per call of every sample, sorted
+  std::vector<double> seconds;
+
+  // Nearest-rank percentile of the per-call time, p in [0, 100]
+  [[nodiscard]] double
+  percentile(double p) const
+  {
+    auto rank = static_cast<std::size_t>(
+      std::ceil(p / 100.0 * static_cast<double>(seconds.size())));
+    return seconds[std::clamp<std::size_t>(rank, 1, seconds.size()) - 1];
+  }
+
+  [[nodiscard]] double
+  mean() const
+  {
+    double sum = 0.0;
+    for (double s : seconds) {
+      sum += s;
+    }
+    return sum / static_cast<double>(seconds.size());
+  }
+};
+
+// Runs microbenchmarks and writes their results as JSON
+// Every case is warmed up, then called in samples of enough iterations to
+// last min_time seconds each, so percentiles over the samples show the
+// noise. Throughput is reported at the median.
+class BenchmarkSuite
+{
+public:
+  struct Options
+  {
+    // Only run cases whose id (see id()) contains filter
+    std::string filter;
+    double min_time = 0.02;
+    std::size_t repetitions = 15;
+  };
+
+  explicit BenchmarkSuite(Options options)
+    : options_{ std::move(options) }
+  {}
+
+  // Case id: name followed by the parameter values, e.g.
+  // "fully_connected_forward/784/300/200/relu"
+  [[nodiscard]] static std::string
+  id(const std::string& name, const std::vector<BenchmarkParam>& params)
+  {
+    auto result = name;
+    for (const auto& param : params) {
+      result += "/";
+      result += param.value.front() == '"'
+                  ? param.value.substr(1, param.value.size() - 2)
+                  : param.value;
+    }
+    return result;
+  }
+
+  // Time fn(), unless filtered out
+  void
+  run(const std::string& name,
+      std::vector<BenchmarkParam> params,
+      BenchmarkWork work,
+      const std::function<void()>& fn)
+  {
+    auto case_id = id(name, params);
+    if (case_id.find(options_.filter) == std::string::npos) {
+      return;
+    }
+    std::cerr << case_id << std::endl;
+
+    // Warm up caches and grow buffers, then find the iteration count
+    fn();
+    std::size_t iterations = 1;
+    while (time(fn, iterations) < options_.min_time and iterations < 1 << 30) {
+      iterations *= 2;
+    }
+
+    auto result =
+      BenchmarkResult{ name, std::move(params), work, iterations, {} };
+    for (std::size_t r = 0; r < options_.repetitions; ++r) {
+      result.seconds.push_back(time(fn, iterations) /
+                               static_cast<double>(iterations));
+    }
+    std::ranges::sort(result.seconds);
+    results_.push_back(std::move(result));
+  }
+
+  [[nodiscard]] const std::vector<BenchmarkResult>&
+  results() const
+  {
+    return results_;
+  }
+
+  // Write all results, context holds JSON encoded values describing the
+  // machine and build
+  void
+  write_json(std::ostream& out,
+             const std::vector<BenchmarkParam>& context) const
+  {
+    out << "{\n  \"context\": {";
+    write_params(out, context);
+    out << "},\n  \"benchmarks\": [";
+    for (std::size_t i = 0; i < results_.size(); ++i) {
+      const auto& result = results_[i];
+      double median = result.percentile(50);
+      out << (i == 0 ? "\n" : ",\n") << "    {\"id\": \""
+          << id(result.name, result.params) << "\", \"name\": \""
+          << result.name << "\", \"params\": {";
+      write_params(out, result.params);
+      out << "}, \"iterations\": " << result.iterations
+          << ", \"repetitions\": " << result.seconds.size()
+          << ", \"seconds\": {\"min\": " << number(result.seconds.front())
+          << ", \"mean\": " << number(result.mean())
+          << ", \"p50\": " << number(median)
+          << ", \"p90\": " << number(result.percentile(90))
+          << ", \"p99\": " << number(result.percentile(99))
+          << ", \"max\": " << number(result.seconds.back())
+          << "}, \"flops_per_second\": " << number(result.work.flops / median)
+          << ", \"bytes_per_second\": " << number(result.work.bytes / median)
+          << "}";
+    }
+    out << "\n  ]\n}\n";
+  }
+
+private:
+  static double
+  time(const std::function<void()>& fn, std::size_t iterations)
+  {
+    auto start_time = std::chrono::steady_clock::now();
+    for (std::size_t i = 0; i < iterations; ++i) {
+      fn();
+    }
+    auto end_time = std::chrono::steady_clock::now();
+    return std::chrono::duration<double>(end_time - start_time).count();
+  }
+
+  static void
+  write_params(std::ostream& out, const std::vector<BenchmarkParam>& params)
+  {
+    for (std::size_t i = 0; i < params.size(); ++i) {
+      out << (i == 0 ? "" : ", ") << "\"" << params[i].key
+          << "\": " << params[i].value;
+    }
+  }
+
+  // Fixed format with 6 significant digits, independent of the locale and
+  // stream state
+  static std::string
+  number(double value)
+  {
+    char buffer[32];
+    std::snprintf(buffer, sizeof(buffer), "%.6g", value);
+    return buffer;
+  }
+
+  Options options_;
+  std::vector<BenchmarkResult> results_;
+};
+
+}
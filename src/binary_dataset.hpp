@@ -0,0 +1,418 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <cstdint>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <span>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <system_error>
+#include <vector>
+
+#include "dataset.hpp"
+#include "mapped_file.hpp"
+#include "thread_pool.hpp"
+
+namespace nnets {
+
+// Header of a binary dataset file
+// The file layout is the header, num_samples * input_size uint8 inputs
+// (row-major) and num_samples uint8 labels, all in native byte order
+struct BinaryDatasetHeader
+{
+  static constexpr std::array<char, 8> expected_magic = { 'N', 'N', 'E', 'T',
+                                                          'S', 'D', 'S', 0 };
+  static constexpr std::uint32_t current_version = 1;
+
+  std::array<char, 8> magic = expected_magic;
+  std::uint32_t version = current_version;
+  std::uint32_t input_size = 0;
+  std::uint64_t num_samples = 0;
+  // checksum() of the inputs followed by the labels
+  std::uint64_t checksum = 0;
+  // Pads the header to a cache line so the inputs start aligned
+  std::array<std::uint8_t, 32> reserved = {};
+};
+
+static_assert(sizeof(BinaryDatasetHeader) == 64);
+
+// FNV-1a over 8 byte words, continuing from a previous hash value
+[[nodiscard]] inline std::uint64_t
+checksum(std::span<const std::uint8_t> data,
+         std::uint64_t hash = 0xcbf29ce484222325ull)
+{
+  constexpr std::uint64_t prime = 0x100000001b3ull;
+
+  std::size_t words = data.size() / sizeof(std::uint64_t);
+  for (std::size_t i = 0; i < words; ++i) {
+    std::uint64_t word;
+    std::memcpy(&word, data.data() + i * sizeof(word), sizeof(word));
+    hash = (hash ^ word) * prime;
+  }
+  for (std::size_t i = words * sizeof(std::uint64_t); i < data.size(); ++i) {
+    hash = (hash ^ data[i]) * prime;
+  }
+  return hash;
+}
+
+// Write a binary dataset file from row-major uint8 inputs and labels
+inline void
+write_binary_dataset(const std::filesystem::path& path,
+                     std::span<const std::uint8_t> inputs,
+                     std::span<const std::uint8_t> labels)
+{
+  auto header = BinaryDatasetHeader{};
+  header.num_samples = labels.size();
+  header.input_size =
+    labels.empty() ? 0
+                   : static_cast<std::uint32_t>(inputs.size() / labels.size());
+  header.checksum = checksum(labels, checksum(inputs));
+
+  auto file = std::ofstream{ path, std::ios::binary };
+  file.write(reinterpret_cast<const char*>(&header), sizeof(header));
+  file.write(reinterpret_cast<const char*>(inputs.data()),
+             static_cast<std::streamsize>(inputs.size()));
+  file.write(reinterpret_cast<const char*>(labels.data()),
+             static_cast<std::streamsize>(labels.size()));
+
+  if (not file) {
+    throw std::runtime_error{ "cannot write " + path.string() };
+  }
+}
+
+// checksum() computed over data arriving in consecutive pieces
+class ChecksumBuilder
+{
+public:
+  explicit ChecksumBuilder(std::uint64_t hash = 0xcbf29ce484222325ull)
+    : hash_{ hash }
+  {}
+
+  void
+  update(std::span<const std::uint8_t> data)
+  {
+    // Complete a word started by the previous piece
+    while (num_pending_ > 0 and num_pending_ < pending_.size() and
+           not data.empty()) {
+      pending_[num_pending_++] = data.front();
+      data = data.subspan(1);
+    }
+    if (num_pending_ == pending_.size()) {
+      hash_ = checksum(pending_, hash_);
+      num_pending_ = 0;
+    }
+
+    std::size_t whole = data.size() / pending_.size() * pending_.size();
+    hash_ = checksum(data.first(whole), hash_);
+    for (std::uint8_t byte : data.subspan(whole)) {
+      pending_[num_pending_++] = byte;
+    }
+  }
+
+  // Hash of all data so far
+  [[nodiscard]] std::uint64_t
+  finish() const
+  {
+    return checksum(std::span{ pending_ }.first(num_pending_), hash_);
+  }
+
+private:
+  std::uint64_t hash_;
+  std::array<std::uint8_t, sizeof(std::uint64_t)> pending_ = {};
+  std::size_t num_pending_ = 0;
+};
+
+namespace detail {
+
+// Removes a temporary file however the scope that wrote it ends (nothing if
+// it was renamed)
+struct FileRemover
+{
+  const std::filesystem::path& path;
+
+  ~FileRemover()
+  {
+    auto error = std::error_code{};
+    std::filesystem::remove(path, error);
+  }
+};
+
+// Position after the next num_rows non-blank lines of text from pos
+inline std::size_t
+skip_csv_rows(std::string_view text, std::size_t pos, std::size_t num_rows)
+{
+  while (num_rows > 0 and pos < text.size()) {
+    std::size_t line_end = std::min(text.find('\n', pos), text.size());
+    if (not csv_blank(text.data() + pos, text.data() + line_end)) {
+      --num_rows;
+    }
+    pos = line_end + 1;
+  }
+  return std::min(pos, text.size());
+}
+
+}
+
+// Convert a CSV dataset (see read_dataset()) into a binary dataset file
+// The CSV files are parsed in chunks of whole lines and written out as they
+// go, so memory use does not grow with the size of the dataset. Labels are
+// spooled to a temporary file next to binary_path until all inputs are
+// written.
+inline void
+import_csv_dataset(const std::filesystem::path& inputs_path,
+                   const std::filesystem::path& outputs_path,
+                   const std::filesystem::path& binary_path,
+                   ThreadPool* pool = nullptr)
+{
+  constexpr std::size_t chunk_size = 16 << 20;
+
+  auto inputs_file = MappedFile{ inputs_path };
+  auto outputs_file = MappedFile{ outputs_path };
+  auto inputs_text = inputs_file.text();
+  auto outputs_text = outputs_file.text();
+
+  auto labels_path = binary_path;
+  labels_path += ".labels";
+  auto spool_remover = detail::FileRemover{ labels_path };
+  auto file = std::ofstream{ binary_path, std::ios::binary };
+  auto labels_file = std::ofstream{ labels_path, std::ios::binary };
+
+  // Header is rewritten once the sizes are known
+  auto header = BinaryDatasetHeader{};
+  file.write(reinterpret_cast<const char*>(&header), sizeof(header));
+
+  auto input_checksum = ChecksumBuilder{};
+  auto input_rows = CsvMatrix<int>{};
+  auto output_rows = CsvMatrix<int>{};
+  auto inputs = std::vector<std::uint8_t>{};
+  auto labels = std::vector<std::uint8_t>{};
+  std::size_t input_pos = 0;
+  std::size_t output_pos = 0;
+
+  // Like read_dataset(), stop at the end of the shorter file
+  while (input_pos < inputs_text.size() and output_pos < outputs_text.size()) {
+    std::size_t input_end = inputs_text.find('\n', input_pos + chunk_size);
+    input_end = std::min(input_end, inputs_text.size() - 1) + 1;
+    parse_csv(
+      inputs_text.substr(input_pos, input_end - input_pos), input_rows, pool);
+
+    std::size_t output_end =
+      detail::skip_csv_rows(outputs_text, output_pos, input_rows.num_rows);
+    parse_csv(outputs_text.substr(output_pos, output_end - output_pos),
+              output_rows,
+              pool);
+
+    // Release the parsed text, pages are read again only if touched again
+    inputs_file.discard(input_pos, input_end - input_pos);
+    outputs_file.discard(output_pos, output_end - output_pos);
+    input_pos = input_end;
+    output_pos = output_end;
+
+    if (input_rows.num_rows == 0) {
+      continue;
+    }
+    if (output_rows.num_columns > 1) {
+      throw std::runtime_error{ "expected one category per line in " +
+                                outputs_path.string() };
+    }
+    if (header.input_size == 0) {
+      header.input_size = static_cast<std::uint32_t>(input_rows.num_columns);
+    } else if (input_rows.num_columns != header.input_size) {
+      throw std::runtime_error{ "malformed CSV row" };
+    }
+
+    std::size_t num_rows = std::min(input_rows.num_rows, output_rows.num_rows);
+    inputs.clear();
+    labels.clear();
+    for (int value : std::span{ input_rows.values }.first(
+           num_rows * input_rows.num_columns)) {
+      if (value < 0 or value > 255) {
+        throw std::runtime_error{ "input value out of uint8 range in " +
+                                  inputs_path.string() };
+      }
+      inputs.push_back(static_cast<std::uint8_t>(value));
+    }
+    for (int label : std::span{ output_rows.values }.first(num_rows)) {
+      if (label < 0 or label > 255) {
+        throw std::runtime_error{ "category out of uint8 range in " +
+                                  outputs_path.string() };
+      }
+      labels.push_back(static_cast<std::uint8_t>(label));
+    }
+
+    input_checksum.update(inputs);
+    file.write(reinterpret_cast<const char*>(inputs.data()),
+               static_cast<std::streamsize>(inputs.size()));
+    labels_file.write(reinterpret_cast<const char*>(labels.data()),
+                      static_cast<std::streamsize>(labels.size()));
+    header.num_samples += num_rows;
+  }
+
+  // Append the labels after the inputs
+  labels_file.close();
+  {
+    auto spool = std::ifstream{ labels_path, std::ios::binary };
+    auto label_checksum = ChecksumBuilder{ input_checksum.finish() };
+    auto buffer = std::vector<std::uint8_t>(chunk_size);
+    while (spool) {
+      spool.read(reinterpret_cast<char*>(buffer.data()),
+                 static_cast<std::streamsize>(buffer.size()));
+      auto count = static_cast<std::size_t>(spool.gcount());
+      label_checksum.update(std::span{ buffer }.first(count));
+      file.write(reinterpret_cast<const char*>(buffer.data()),
+                 static_cast<std::streamsize>(count));
+    }
+    header.checksum = label_checksum.finish();
+  }
+
+  file.seekp(0);
+  file.write(reinterpret_cast<const char*>(&header), sizeof(header));
+
+  if (not file) {
+    throw std::runtime_error{ "cannot write " + binary_path.string() };
+  }
+}
+
+// Read-only memory mapping of a binary dataset file
+// Inputs and labels are views into the mapping, nothing is copied
+class MappedDataset
+{
+public:
+  explicit MappedDataset(const std::filesystem::path& path,
+                         bool verify_checksum = true)
+    : file_{ path }
+  {
+    auto bytes = file_.bytes();
+    if (bytes.size() < sizeof(header_)) {
+      throw std::runtime_error{ "not a binary dataset: " + path.string() };
+    }
+    std::memcpy(&header_, bytes.data(), sizeof(header_));
+
+    std::size_t data_size = header_.num_samples * (header_.input_size + 1);
+    if (header_.magic != BinaryDatasetHeader::expected_magic or
+        header_.version != BinaryDatasetHeader::current_version or
+        bytes.size() != sizeof(header_) + data_size) {
+      throw std::runtime_error{ "not a binary dataset: " + path.string() };
+    }
+
+    inputs_ = bytes.subspan(sizeof(header_),
+                            header_.num_samples * header_.input_size);
+    labels_ = bytes.subspan(sizeof(header_) + inputs_.size());
+
+    if (verify_checksum and
+        checksum(labels_, checksum(inputs_)) != header_.checksum) {
+      throw std::runtime_error{ "checksum mismatch in " + path.string() };
+    }
+  }
+
+  // Number of samples
+  [[nodiscard]] std::size_t
+  size() const
+  {
+    return header_.num_samples;
+  }
+
+  // Length of every input vector
+  [[nodiscard]] std::size_t
+  input_size() const
+  {
+    return header_.input_size;
+  }
+
+  // Input vector of the i-th sample
+  [[nodiscard]] std::span<const std::uint8_t>
+  input(std::size_t i) const
+  {
+    return inputs_.subspan(i * header_.input_size, header_.input_size);
+  }
+
+  // Expected category of the i-th sample
+  [[nodiscard]] int
+  label(std::size_t i) const
+  {
+    return labels_[i];
+  }
+
+  // All input vectors, row-major
+  [[nodiscard]] std::span<const std::uint8_t>
+  inputs() const
+  {
+    return inputs_;
+  }
+
+  // All expected categories
+  [[nodiscard]] std::span<const std::uint8_t>
+  labels() const
+  {
+    return labels_;
+  }
+
+private:
+  MappedFile file_;
+  BinaryDatasetHeader header_;
+  std::span<const std::uint8_t> inputs_;
+  std::span<const std::uint8_t> labels_;
+};
+
+// Map a binary dataset, converting it from the CSV files first if it is
+// missing or older than one of them
+// With num_categories, throws if a label is not below it (e.g. test labels
+// the network has no output for).
+[[nodiscard]] inline MappedDataset
+load_binary_dataset(const std::filesystem::path& binary_path,
+                    const std::filesystem::path& inputs_path,
+                    const std::filesystem::path& outputs_path,
+                    ThreadPool* pool = nullptr,
+                    std::size_t num_categories = 0)
+{
+  auto stale = [&] {
+    if (not std::filesystem::exists(binary_path)) {
+      return true;
+    }
+    // Without the CSV files the binary file is all there is
+    auto built = std::filesystem::last_write_time(binary_path);
+    for (const auto& source : { inputs_path, outputs_path }) {
+      if (std::filesystem::exists(source) and
+          std::filesystem::last_write_time(source) > built) {
+        return true;
+      }
+    }
+    return false;
+  };
+  if (stale()) {
+    // Rename at the end so an interrupted import leaves no partial file, a
+    // failed one is removed
+    auto tmp_path = binary_path;
+    tmp_path += ".tmp";
+    auto tmp_remover = detail::FileRemover{ tmp_path };
+    import_csv_dataset(inputs_path, outputs_path, tmp_path, pool);
+    std::filesystem::rename(tmp_path, binary_path);
+  }
+
+  auto dataset = MappedDataset{ binary_path };
+  if (num_categories > 0 and
+      std::ranges::any_of(dataset.labels(), [&](std::uint8_t label) {
+        return label >= num_categories;
+      })) {
+    throw std::runtime_error{ "category out of range in " +
+                              binary_path.string() };
+  }
+  return dataset;
+}
+
+// Count the total number of categories in a dataset
+inline int
+num_categories(const MappedDataset& dataset)
+{
+  int max_cat = 0;
+  for (int label : dataset.labels()) {
+    max_cat = std::max(max_cat, label);
+  }
+  return max_cat + 1;
+}
+
+}
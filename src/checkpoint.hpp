@@ -0,0 +1,466 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <cstdint>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <memory>
+#include <span>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "binary_dataset.hpp"
+#include "dropout.hpp"
+#include "fully_connected.hpp"
+#include "mapped_file.hpp"
+#include "optimizer.hpp"
+#include "random.hpp"
+#include "sequence.hpp"
+
+namespace nnets {
+
+// Header of a checkpoint file
+// The file layout is the header, metadata_size bytes of metadata, padding to
+// a multiple of 64 bytes, parameter_size floats of parameters (the arena of
+// a Sequence) and optimizer_state_size floats of optimizer state, all in
+// native byte order. The metadata holds the topology, one entry per module
+// (uint64 parameter size, uint32 name length, name, see IModule::name(),
+// then IModule::describe() as uint32 kind, uint64 input and output sizes,
+// uint32 1 if there is an activation, uint32 activation kind, float
+// parameter and uint32 accuracy), then the training state (uint64 epoch,
+// uint64 optimizer steps, uint32 optimizer kind, float learning rate, uint32
+// length and text of the RNG state). Parameters start cache line aligned, so
+// they can be used in place from a mapping of the file.
+struct CheckpointHeader
+{
+  static constexpr std::array<char, 8> expected_magic = { 'N', 'N', 'E', 'T',
+                                                          'S', 'C', 'K', 0 };
+  static constexpr std::uint32_t current_version = 2;
+
+  std::array<char, 8> magic = expected_magic;
+  std::uint32_t version = current_version;
+  std::uint32_t num_modules = 0;
+  std::uint64_t metadata_size = 0;
+  std::uint64_t parameter_size = 0;
+  // 0 if no optimizer was saved
+  std::uint64_t optimizer_state_size = 0;
+  // checksum() of everything after the header
+  std::uint64_t checksum = 0;
+  std::array<std::uint8_t, 16> reserved = {};
+
+  // Offset of the parameters in the file
+  [[nodiscard]] std::size_t
+  parameters_offset() const
+  {
+    return (sizeof(CheckpointHeader) + metadata_size + 63) / 64 * 64;
+  }
+
+  [[nodiscard]] std::size_t
+  file_size() const
+  {
+    return parameters_offset() +
+           (parameter_size + optimizer_state_size) * sizeof(float);
+  }
+};
+
+static_assert(sizeof(CheckpointHeader) == 64);
+
+// Module entry of the topology saved in a checkpoint
+struct CheckpointModule
+{
+  // See IModule::name()
+  std::string name;
+  std::size_t parameter_size = 0;
+  ModuleDescription description;
+};
+
+// Training progress stored with a checkpoint besides the parameters
+struct CheckpointState
+{
+  // Number of completed epochs
+  std::size_t epoch = 0;
+};
+
+namespace detail {
+
+// Append the raw bytes of a value
+template<typename T>
+void
+append_bytes(std::string& out, const T& value)
+{
+  out.append(reinterpret_cast<const char*>(&value), sizeof(value));
+}
+
+// Append a module description as read by MetadataReader::read_description()
+inline void
+append_description(std::string& out, const ModuleDescription& description)
+{
+  auto activation = description.activation.value_or(Activation{});
+  append_bytes(out, static_cast<std::uint32_t>(description.kind));
+  append_bytes(out, static_cast<std::uint64_t>(description.input_size));
+  append_bytes(out, static_cast<std::uint64_t>(description.output_size));
+  append_bytes(out,
+               static_cast<std::uint32_t>(description.activation ? 1 : 0));
+  append_bytes(out, static_cast<std::uint32_t>(activation.kind));
+  append_bytes(out, activation.parameter);
+  append_bytes(out, static_cast<std::uint32_t>(activation.accuracy));
+}
+
+// Reads metadata values in order, throws if they run past the end
+class MetadataReader
+{
+public:
+  MetadataReader(std::span<const std::uint8_t> data,
+                 const std::filesystem::path& path)
+    : data_{ data }
+    , path_{ path }
+  {}
+
+  template<typename T>
+  T
+  read()
+  {
+    T value;
+    std::memcpy(&value, take(sizeof(value)).data(), sizeof(value));
+    return value;
+  }
+
+  ModuleDescription
+  read_description()
+  {
+    auto description = ModuleDescription{};
+    description.kind = static_cast<ModuleKind>(read<std::uint32_t>());
+    description.input_size = read<std::uint64_t>();
+    description.output_size = read<std::uint64_t>();
+    bool has_activation = read<std::uint32_t>() != 0;
+    auto activation = Activation{};
+    activation.kind = static_cast<ActivationKind>(read<std::uint32_t>());
+    activation.parameter = read<float>();
+    activation.accuracy = static_cast<Accuracy>(read<std::uint32_t>());
+    if (has_activation) {
+      description.activation = activation;
+    }
+    return description;
+  }
+
+  std::string
+  read_string()
+  {
+    auto bytes = take(read<std::uint32_t>());
+    return { bytes.begin(), bytes.end() };
+  }
+
+private:
+  std::span<const std::uint8_t>
+  take(std::size_t size)
+  {
+    if (size > data_.size()) {
+      throw std::runtime_error{ "truncated checkpoint " + path_.string() };
+    }
+    auto bytes = data_.first(size);
+    data_ = data_.subspan(size);
+    return bytes;
+  }
+
+  std::span<const std::uint8_t> data_;
+  const std::filesystem::path& path_;
+};
+
+// Read the topology from the start of the metadata, throws if it differs
+// from the network
+inline void
+check_topology(MetadataReader& reader,
+               const CheckpointHeader& header,
+               const Sequence& net,
+               const std::filesystem::path& path)
+{
+  auto modules = net.modules();
+  bool same_topology = header.num_modules == modules.size() and
+                       header.parameter_size == net.parameter_size();
+  for (std::size_t i = 0; i < header.num_modules; ++i) {
+    auto parameter_size = reader.read<std::uint64_t>();
+    auto name = reader.read_string();
+    auto description = reader.read_description();
+    same_topology = same_topology and
+                    parameter_size == modules[i]->parameter_size() and
+                    name == modules[i]->name() and
+                    description == modules[i]->describe();
+  }
+  if (not same_topology) {
+    throw std::runtime_error{ "network topology differs from checkpoint " +
+                              path.string() };
+  }
+}
+
+// Map a checkpoint file and check its header
+inline std::shared_ptr<MappedFile>
+map_checkpoint_file(const std::filesystem::path& path,
+                    bool verify_checksum,
+                    CheckpointHeader& header)
+{
+  auto file = std::make_shared<MappedFile>(path);
+  auto bytes = file->bytes();
+  if (bytes.size() < sizeof(header)) {
+    throw std::runtime_error{ "not a checkpoint: " + path.string() };
+  }
+  std::memcpy(&header, bytes.data(), sizeof(header));
+  if (header.magic != CheckpointHeader::expected_magic or
+      header.version != CheckpointHeader::current_version or
+      bytes.size() != header.file_size()) {
+    throw std::runtime_error{ "not a checkpoint: " + path.string() };
+  }
+  if (verify_checksum and
+      checksum(bytes.subspan(sizeof(header))) != header.checksum) {
+    throw std::runtime_error{ "checksum mismatch in " + path.string() };
+  }
+  return file;
+}
+
+}
+
+// Write the parameters of a network, and optionally the state of its
+// optimizer and RNG, to a checkpoint file
+// The file is written next to path and renamed over it when complete, so an
+// interrupted save leaves the previous checkpoint intact.
+inline void
+save_checkpoint(const std::filesystem::path& path,
+                Sequence& net,
+                Optimizer* optimizer = nullptr,
+                Random* random = nullptr,
+                CheckpointState state = {})
+{
+  auto header = CheckpointHeader{};
+  auto parameters = net.parameter_arena();
+  header.parameter_size = parameters.size();
+
+  auto metadata = std::string{};
+  for (const auto& module : net.modules()) {
+    auto name = module->name();
+    detail::append_bytes(metadata,
+                         static_cast<std::uint64_t>(module->parameter_size()));
+    detail::append_bytes(metadata, static_cast<std::uint32_t>(name.size()));
+    metadata += name;
+    detail::append_description(metadata, module->describe());
+    ++header.num_modules;
+  }
+
+  auto optimizer_state = std::vector<std::span<float>>{};
+  if (optimizer) {
+    optimizer_state = optimizer->state();
+  }
+  for (auto state_arena : optimizer_state) {
+    header.optimizer_state_size += state_arena.size();
+  }
+
+  auto rng_state = std::ostringstream{};
+  if (random) {
+    rng_state << random->rng();
+  }
+  detail::append_bytes(metadata, static_cast<std::uint64_t>(state.epoch));
+  detail::append_bytes(
+    metadata,
+    static_cast<std::uint64_t>(optimizer ? optimizer->num_steps() : 0));
+  detail::append_bytes(
+    metadata,
+    static_cast<std::uint32_t>(optimizer ? optimizer->config().kind
+                                         : OptimizerKind{}));
+  detail::append_bytes(metadata,
+                       optimizer ? optimizer->learning_rate() : 0.0f);
+  detail::append_bytes(metadata,
+                       static_cast<std::uint32_t>(rng_state.str().size()));
+  metadata += rng_state.str();
+  header.metadata_size = metadata.size();
+  // Zero padding up to the parameters
+  metadata.resize(header.parameters_offset() - sizeof(header), '\0');
+
+  auto as_bytes = [](std::span<const float> values) {
+    return std::span{ reinterpret_cast<const std::uint8_t*>(values.data()),
+                      values.size_bytes() };
+  };
+  auto hash = ChecksumBuilder{};
+  hash.update({ reinterpret_cast<const std::uint8_t*>(metadata.data()),
+                metadata.size() });
+  hash.update(as_bytes(parameters));
+  for (auto state_arena : optimizer_state) {
+    hash.update(as_bytes(state_arena));
+  }
+  header.checksum = hash.finish();
+
+  auto temp_path = path;
+  temp_path += ".tmp";
+  {
+    auto file = std::ofstream{ temp_path, std::ios::binary };
+    auto write = [&](std::span<const std::uint8_t> data) {
+      file.write(reinterpret_cast<const char*>(data.data()),
+                 static_cast<std::streamsize>(data.size()));
+    };
+    file.write(reinterpret_cast<const char*>(&header), sizeof(header));
+    file << metadata;
+    write(as_bytes(parameters));
+    for (auto state_arena : optimizer_state) {
+      write(as_bytes(state_arena));
+    }
+    if (not file.flush()) {
+      throw std::runtime_error{ "cannot write " + temp_path.string() };
+    }
+  }
+  std::filesystem::rename(temp_path, path);
+}
+
+// Resume training from a checkpoint written by save_checkpoint()
+// Copies the parameters into the network, which must have the same topology,
+// and restores the optimizer (same kind and registered modules) and RNG if
+// given and saved. Returns the saved training progress.
+inline CheckpointState
+load_checkpoint(const std::filesystem::path& path,
+                Sequence& net,
+                Optimizer* optimizer = nullptr,
+                Random* random = nullptr)
+{
+  auto header = CheckpointHeader{};
+  auto file = detail::map_checkpoint_file(path, true, header);
+  auto bytes = file->bytes();
+
+  auto reader = detail::MetadataReader{
+    bytes.subspan(sizeof(header), header.metadata_size), path
+  };
+  detail::check_topology(reader, header, net, path);
+  auto state = CheckpointState{};
+  state.epoch = reader.read<std::uint64_t>();
+  auto num_steps = reader.read<std::uint64_t>();
+  auto kind = static_cast<OptimizerKind>(reader.read<std::uint32_t>());
+  auto learning_rate = reader.read<float>();
+  auto rng_state = reader.read_string();
+
+  const auto* values =
+    reinterpret_cast<const float*>(bytes.data() + header.parameters_offset());
+  std::ranges::copy(std::span{ values, header.parameter_size },
+                    net.parameter_arena().begin());
+  net.parameters_updated();
+
+  if (optimizer and header.optimizer_state_size > 0) {
+    auto optimizer_state = optimizer->state();
+    std::size_t state_size = 0;
+    for (auto state_arena : optimizer_state) {
+      state_size += state_arena.size();
+    }
+    if (kind != optimizer->config().kind or
+        state_size != header.optimizer_state_size) {
+      throw std::runtime_error{ "optimizer differs from checkpoint " +
+                                path.string() };
+    }
+
+    const float* saved = values + header.parameter_size;
+    for (auto state_arena : optimizer_state) {
+      std::copy_n(saved, state_arena.size(), state_arena.begin());
+      saved += state_arena.size();
+    }
+    optimizer->set_num_steps(num_steps);
+    optimizer->set_learning_rate(learning_rate);
+  }
+
+  if (random and not rng_state.empty()) {
+    auto stream = std::istringstream{ rng_state };
+    stream >> random->rng();
+  }
+  return state;
+}
+
+// Load a checkpoint for inference: the network uses the parameters in place
+// from a read-only mapping of the file, which stays mapped as long as the
+// network (or a replica) lives
+// Nothing is copied, so startup time does not depend on the network size.
+// Verifying the checksum reads the whole file, skip it for the fastest
+// start. The network must not be trained afterwards.
+inline void
+map_checkpoint(const std::filesystem::path& path,
+               Sequence& net,
+               bool verify_checksum = true)
+{
+  auto header = CheckpointHeader{};
+  auto file = detail::map_checkpoint_file(path, verify_checksum, header);
+  auto reader = detail::MetadataReader{
+    file->bytes().subspan(sizeof(header), header.metadata_size), path
+  };
+  detail::check_topology(reader, header, net, path);
+
+  // The mapping is read-only, parameters are never written in inference
+  auto* values = reinterpret_cast<float*>(const_cast<std::uint8_t*>(
+    file->bytes().data() + header.parameters_offset()));
+  net.attach_parameters(std::shared_ptr<float[]>{ file, values });
+}
+
+// Topology saved in a checkpoint, reading only the start of the file
+inline std::vector<CheckpointModule>
+read_checkpoint_topology(const std::filesystem::path& path)
+{
+  auto header = CheckpointHeader{};
+  auto file = detail::map_checkpoint_file(path, false, header);
+  auto reader = detail::MetadataReader{
+    file->bytes().subspan(sizeof(header), header.metadata_size), path
+  };
+
+  auto modules = std::vector<CheckpointModule>{};
+  for (std::size_t i = 0; i < header.num_modules; ++i) {
+    auto parameter_size = reader.read<std::uint64_t>();
+    auto name = reader.read_string();
+    modules.push_back(
+      { std::move(name), parameter_size, reader.read_description() });
+  }
+  return modules;
+}
+
+// Sequence of FullyConnected<ActivationFn> layers with the topology saved in
+// a checkpoint (e.g. by main), the last one a
+// FullyConnected<OutputActivationFn>, with uninitialized weights
+// Dropout modules are kept for the topology check, they pass values through
+// at inference. A first layer skips zero inputs (see InputSparsity), which
+// pays off most for the small batches of serving. Throws if the checkpoint holds other modules or layers whose
+// activation differs from ActivationFn{} (OutputActivationFn{}).
+template<typename ActivationFn, typename OutputActivationFn = ActivationFn>
+Sequence
+make_checkpoint_sequence(const std::filesystem::path& path)
+{
+  auto modules = std::vector<std::shared_ptr<IModule>>{};
+  auto topology = read_checkpoint_topology(path);
+  for (const auto& module : topology) {
+    const auto& description = module.description;
+    auto add_layer = [&]<typename Fn>(Fn activation_fn) {
+      auto sparsity =
+        modules.empty() ? InputSparsity::Sparse : InputSparsity::Dense;
+      auto layer = std::make_shared<FullyConnected<Fn>>(description.input_size,
+                                                        description.output_size,
+                                                        activation_fn,
+                                                        Fp32Precision{},
+                                                        sparsity);
+      if (layer->describe() != description) {
+        throw std::runtime_error{ "activation of " + module.name + " in " +
+                                  path.string() + " differs" };
+      }
+      modules.push_back(std::move(layer));
+    };
+    switch (description.kind) {
+      case ModuleKind::Dropout:
+        modules.push_back(
+          std::make_shared<Dropout>(description.input_size, 0.0f));
+        break;
+      case ModuleKind::FullyConnected:
+        if (&module == &topology.back()) {
+          add_layer(OutputActivationFn{});
+        } else {
+          add_layer(ActivationFn{});
+        }
+        break;
+      default:
+        throw std::runtime_error{ "unsupported module " + module.name +
+                                  " in " + path.string() };
+    }
+  }
+  return Sequence{ std::move(modules) };
+}
+
+}
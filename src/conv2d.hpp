@@ -0,0 +1,838 @@
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <span>
+#include <stdexcept>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "aligned.hpp"
+#include "gemm.hpp"
+#include "module.hpp"
+#include "simd.hpp"
+#include "thread_pool.hpp"
+
+namespace nnets {
+
+// Memory order of a batch of images
+enum class ImageLayout
+{
+  // Sample, channel, row, column
+  Nchw,
+  // Sample, row, column, channel
+  Nhwc
+};
+
+// How Conv2D computes its convolutions
+enum class ConvAlgorithm
+{
+  // Direct if supported and the kernel patch is small, im2col otherwise
+  Auto,
+  // Unfold the input patches into a matrix and run one GEMM per sample
+  Im2col,
+  // Accumulate shifted input planes with the vector kernels, NCHW with
+  // stride 1 only
+  Direct
+};
+
+// Shape and options of a Conv2D
+struct Conv2DConfig
+{
+  std::size_t input_channels = 1;
+  std::size_t input_height = 0;
+  std::size_t input_width = 0;
+  std::size_t output_channels = 1;
+  std::size_t kernel_height = 3;
+  std::size_t kernel_width = 3;
+  std::size_t stride = 1;
+  // Zero padding on every side
+  std::size_t padding = 0;
+  ImageLayout layout = ImageLayout::Nchw;
+  ConvAlgorithm algorithm = ConvAlgorithm::Auto;
+
+  [[nodiscard]] std::size_t
+  output_height() const
+  {
+    return (input_height + 2 * padding - kernel_height) / stride + 1;
+  }
+
+  [[nodiscard]] std::size_t
+  output_width() const
+  {
+    return (input_width + 2 * padding - kernel_width) / stride + 1;
+  }
+};
+
+// 2D convolution layer over batches of images
+// Inputs and outputs are images in config.layout, flattened per sample.
+// Weights are output_channels filters of input_channels x kernel_height x
+// kernel_width (NCHW) or kernel_height x kernel_width x input_channels (NHWC)
+// floats, after the bias as in FullyConnected.
+// With a pool, batches are split over its threads by sample and output
+// channel. Leave it out under DataParallel, whose workers already run on the
+// pool (replicas never use one).
+// See IModule for method documentation
+// See activation_functions.hpp for possible ActivationFn types
+template<typename ActivationFn>
+class Conv2D : public IModule
+{
+public:
+  // Largest input_channels * kernel_height * kernel_width that
+  // ConvAlgorithm::Auto runs direct, above it the GEMM is faster
+  static constexpr std::size_t direct_max_patch = 32;
+
+  explicit Conv2D(Conv2DConfig config,
+                  ActivationFn activation_fn = {},
+                  ThreadPool* pool = nullptr)
+    : config_{ config }
+    , activation_fn_{ activation_fn }
+    , pool_{ pool }
+  {
+    if (config.input_channels == 0 or config.output_channels == 0 or
+        config.kernel_height == 0 or config.kernel_width == 0 or
+        config.stride == 0 or
+        config.kernel_height > config.input_height + 2 * config.padding or
+        config.kernel_width > config.input_width + 2 * config.padding) {
+      throw std::invalid_argument{ "invalid convolution shape" };
+    }
+
+    bool direct_supported =
+      config.layout == ImageLayout::Nchw and config.stride == 1;
+    if (config.algorithm == ConvAlgorithm::Direct and not direct_supported) {
+      throw std::invalid_argument{
+        "direct convolution needs NCHW and stride 1"
+      };
+    }
+
+    patch_size_ =
+      config.input_channels * config.kernel_height * config.kernel_width;
+    positions_ = config.output_height() * config.output_width();
+    input_size_ =
+      config.input_channels * config.input_height * config.input_width;
+    output_size_ = config.output_channels * positions_;
+    padded_height_ = config.input_height + 2 * config.padding;
+    padded_width_ = config.input_width + 2 * config.padding;
+    // Rows of the last channel run over its end by up to kernel_width - 1
+    padded_size_ = config.input_channels * padded_height_ * padded_width_ +
+                   config.kernel_width;
+    direct_ = config.algorithm == ConvAlgorithm::Direct or
+              (config.algorithm == ConvAlgorithm::Auto and direct_supported and
+               patch_size_ <= direct_max_patch);
+
+    set_parameters(make_aligned_shared<float>(parameter_size()));
+    set_grads(make_aligned_shared<float>(parameter_size()));
+    resize_batch(1);
+  }
+
+  void
+  forward(std::span<const float> input) override
+  {
+    forward_batch(input, 1);
+  }
+
+  void
+  backward(std::span<const float> output_grad) override
+  {
+    backward_batch(output_grad, 1);
+  }
+
+  void
+  forward_batch(std::span<const float> inputs, std::size_t batch) override
+  {
+    resize_batch(batch);
+    input_ = inputs.first(batch * input_size_);
+
+    // Unfold or pad every sample, then one task per sample and block of
+    // output channels
+    run(batch, [&](std::size_t n) {
+      if (direct_) {
+        pad_input(n);
+      } else {
+        im2col(n);
+      }
+    });
+
+    std::size_t blocks = channel_blocks(batch);
+    run(batch * blocks, [&](std::size_t task) {
+      auto [first, last] = channel_range(task % blocks, blocks);
+      if (direct_) {
+        forward_direct(task / blocks, first, last);
+      } else {
+        forward_im2col(task / blocks, first, last);
+      }
+    });
+
+    run(batch, [&](std::size_t n) {
+      activation_fn_.apply(
+        std::span{ potential_ }.subspan(n * output_size_, output_size_),
+        std::span{ output_ }.subspan(n * output_size_, output_size_),
+        output_size_);
+    });
+  }
+
+  void
+  backward_batch(std::span<const float> output_grads,
+                 std::size_t batch) override
+  {
+    run(batch, [&](std::size_t n) {
+      std::size_t offset = n * output_size_;
+      activation_fn_.gradient(
+        std::span{ potential_ }.subspan(offset, output_size_),
+        std::span{ output_ }.subspan(offset, output_size_),
+        output_grads.subspan(offset, output_size_),
+        std::span{ potential_grad_ }.subspan(offset, output_size_),
+        output_size_);
+    });
+
+    // Weight gradient by blocks of output channels over all samples, then
+    // input gradient by sample (overwriting the unfolded inputs)
+    std::size_t blocks = channel_blocks(1);
+    run(blocks, [&](std::size_t block) {
+      auto [first, last] = channel_range(block, blocks);
+      for (std::size_t n = 0; n < batch; ++n) {
+        if (direct_) {
+          weight_grad_direct(n, first, last);
+        } else {
+          weight_grad_im2col(n, first, last);
+        }
+      }
+    });
+
+    run(batch, [&](std::size_t n) {
+      if (direct_) {
+        input_grad_direct(n);
+      } else {
+        input_grad_im2col(n);
+      }
+    });
+  }
+
+  void
+  init_weights(Random& random) override
+  {
+    random.generate_normal(
+      weights_, 0.0f, std::sqrt(2.0f / static_cast<float>(patch_size_)));
+  }
+
+  void
+  zero_grad() override
+  {
+    std::fill_n(grads_.get(), parameter_size(), 0.0f);
+  }
+
+  [[nodiscard]] std::shared_ptr<IModule>
+  replicate() const override
+  {
+    // Copies share the parameter storage, gradients are their own
+    auto replica = std::make_shared<Conv2D>(*this);
+    replica->set_grads(make_aligned_shared<float>(parameter_size()));
+    replica->pool_ = nullptr;
+    return replica;
+  }
+
+  void
+  add_grad(const IModule& replica) override
+  {
+    const auto& other = static_cast<const Conv2D&>(replica);
+
+    kernels().axpy(1.0f, other.grads_.get(), grads_.get(), parameter_size());
+  }
+
+  [[nodiscard]] std::vector<Parameter>
+  parameters() override
+  {
+    return {
+      { bias_, bias_grad_, 1.0f, false },
+      { weights_, weight_grad_, 1.0f, true },
+    };
+  }
+
+  void
+  parameters_updated() override
+  {}
+
+  [[nodiscard]] std::size_t
+  parameter_size() const override
+  {
+    return config_.output_channels * (1 + patch_size_);
+  }
+
+  void
+  bind_parameters(std::shared_ptr<float[]> storage) override
+  {
+    std::copy_n(parameters_.get(), parameter_size(), storage.get());
+    set_parameters(std::move(storage));
+  }
+
+  void
+  bind_grads(std::shared_ptr<float[]> storage) override
+  {
+    std::copy_n(grads_.get(), parameter_size(), storage.get());
+    set_grads(std::move(storage));
+  }
+
+  void
+  attach_parameters(std::shared_ptr<float[]> storage) override
+  {
+    set_parameters(std::move(storage));
+  }
+
+  [[nodiscard]] std::span<const float>
+  output() const override
+  {
+    return std::span{ output_ }.first(batch_size_ * output_size_);
+  }
+
+  [[nodiscard]] std::span<const float>
+  input_grad() const override
+  {
+    return std::span{ input_grad_ }.first(batch_size_ * input_size_);
+  }
+
+  [[nodiscard]] std::string
+  name() const override
+  {
+    return "conv2d_" + std::to_string(config_.input_channels) + "x" +
+           std::to_string(config_.input_height) + "x" +
+           std::to_string(config_.input_width) + "_" +
+           std::to_string(config_.output_channels) + "x" +
+           std::to_string(config_.kernel_height) + "x" +
+           std::to_string(config_.kernel_width);
+  }
+
+  [[nodiscard]] const Conv2DConfig&
+  config() const
+  {
+    return config_;
+  }
+
+  // Whether the direct algorithm is used
+  [[nodiscard]] bool
+  direct() const
+  {
+    return direct_;
+  }
+
+  [[nodiscard]] std::span<float>
+  weights()
+  {
+    return weights_;
+  }
+
+  [[nodiscard]] std::span<float>
+  bias()
+  {
+    return bias_;
+  }
+
+private:
+  static constexpr std::size_t padding_offset = SIZE_MAX;
+
+  // Call fn(i) for every i in [0, n), on the pool if there is one
+  template<typename Fn>
+  void
+  run(std::size_t n, Fn&& fn)
+  {
+    if (pool_ != nullptr and n > 1) {
+      pool_->parallel_for(n, fn);
+    } else {
+      for (std::size_t i = 0; i < n; ++i) {
+        fn(i);
+      }
+    }
+  }
+
+  // Blocks of output channels per sample, enough to keep all threads busy
+  std::size_t
+  channel_blocks(std::size_t batch) const
+  {
+    if (pool_ == nullptr or batch >= pool_->size()) {
+      return 1;
+    }
+    return std::min(config_.output_channels,
+                    (pool_->size() + batch - 1) / batch);
+  }
+
+  std::pair<std::size_t, std::size_t>
+  channel_range(std::size_t block, std::size_t blocks) const
+  {
+    return { block * config_.output_channels / blocks,
+             (block + 1) * config_.output_channels / blocks };
+  }
+
+  // Patches of sample n as the columns (NCHW) or rows (NHWC) of a
+  // patch_size x positions matrix
+  void
+  im2col(std::size_t n)
+  {
+    const float* image = input_.data() + n * input_size_;
+    float* cols = cols_.data() + n * patch_size_ * positions_;
+    for_each_patch_row(
+      [&](std::size_t row, std::size_t col, std::size_t offset,
+          std::size_t count) {
+        float* dst = config_.layout == ImageLayout::Nchw
+                       ? cols + row * positions_ + col
+                       : cols + col * patch_size_ + row;
+        if (offset == padding_offset) {
+          std::fill_n(dst, count, 0.0f);
+        } else {
+          std::copy_n(image + offset, count, dst);
+        }
+      });
+  }
+
+  // Adjoint of im2col(): sum the unfolded gradient of sample n into its
+  // input gradient
+  void
+  col2im(std::size_t n)
+  {
+    float* image = input_grad_.data() + n * input_size_;
+    const float* cols = cols_.data() + n * patch_size_ * positions_;
+    std::fill_n(image, input_size_, 0.0f);
+    for_each_patch_row(
+      [&](std::size_t row, std::size_t col, std::size_t offset,
+          std::size_t count) {
+        if (offset == padding_offset) {
+          return;
+        }
+        const float* src = config_.layout == ImageLayout::Nchw
+                             ? cols + row * positions_ + col
+                             : cols + col * patch_size_ + row;
+        kernels().axpy(1.0f, src, image + offset, count);
+      });
+  }
+
+  // Call fn(row, col, offset, count) for runs of count unfolded values
+  // that are contiguous in the image, offset is the image offset of the
+  // first one or padding_offset for zero padding
+  // NCHW runs along one output row of one patch element (stride 1), NHWC
+  // runs along the channels of one pixel.
+  template<typename Fn>
+  void
+  for_each_patch_row(Fn&& fn) const
+  {
+    const auto& c = config_;
+    std::size_t out_w = c.output_width();
+    auto in_image = [&](std::size_t padded, std::size_t size) {
+      return padded >= c.padding and padded - c.padding < size;
+    };
+
+    if (c.layout == ImageLayout::Nchw) {
+      for (std::size_t ch = 0; ch < c.input_channels; ++ch) {
+        for (std::size_t ky = 0; ky < c.kernel_height; ++ky) {
+          for (std::size_t kx = 0; kx < c.kernel_width; ++kx) {
+            std::size_t row = (ch * c.kernel_height + ky) * c.kernel_width + kx;
+            for (std::size_t oy = 0; oy < c.output_height(); ++oy) {
+              std::size_t py = oy * c.stride + ky;
+              for (std::size_t ox = 0; ox < out_w; ++ox) {
+                std::size_t px = ox * c.stride + kx;
+                if (not in_image(py, c.input_height) or
+                    not in_image(px, c.input_width)) {
+                  fn(row, oy * out_w + ox, padding_offset, 1);
+                } else if (c.stride == 1) {
+                  // The rest of the row up to the right padding
+                  std::size_t count = std::min(
+                    out_w - ox, c.input_width + c.padding - px);
+                  fn(row,
+                     oy * out_w + ox,
+                     (ch * c.input_height + py - c.padding) * c.input_width +
+                       px - c.padding,
+                     count);
+                  ox += count - 1;
+                } else {
+                  fn(row,
+                     oy * out_w + ox,
+                     (ch * c.input_height + py - c.padding) * c.input_width +
+                       px - c.padding,
+                     1);
+                }
+              }
+            }
+          }
+        }
+      }
+      return;
+    }
+
+    for (std::size_t oy = 0; oy < c.output_height(); ++oy) {
+      for (std::size_t ox = 0; ox < out_w; ++ox) {
+        for (std::size_t ky = 0; ky < c.kernel_height; ++ky) {
+          std::size_t py = oy * c.stride + ky;
+          for (std::size_t kx = 0; kx < c.kernel_width; ++kx) {
+            std::size_t px = ox * c.stride + kx;
+            std::size_t row = (ky * c.kernel_width + kx) * c.input_channels;
+            bool inside =
+              in_image(py, c.input_height) and in_image(px, c.input_width);
+            fn(row,
+               oy * out_w + ox,
+               inside ? ((py - c.padding) * c.input_width + px - c.padding) *
+                          c.input_channels
+                      : padding_offset,
+               c.input_channels);
+          }
+        }
+      }
+    }
+  }
+
+  // Bias, then potential += weights * patches for output channels
+  // [first, last) of sample n
+  void
+  forward_im2col(std::size_t n, std::size_t first, std::size_t last)
+  {
+    const float* cols = cols_.data() + n * patch_size_ * positions_;
+    float* potential = potential_.data() + n * output_size_;
+    std::size_t channels = config_.output_channels;
+
+    if (config_.layout == ImageLayout::Nchw) {
+      for (std::size_t o = first; o < last; ++o) {
+        std::fill_n(potential + o * positions_, positions_, bias_[o]);
+      }
+      gemm(Transpose::No,
+           Transpose::No,
+           last - first,
+           positions_,
+           patch_size_,
+           1.0f,
+           weights_.data() + first * patch_size_,
+           patch_size_,
+           cols,
+           positions_,
+           1.0f,
+           potential + first * positions_,
+           positions_);
+    } else {
+      for (std::size_t q = 0; q < positions_; ++q) {
+        std::copy(bias_.begin() + first,
+                  bias_.begin() + last,
+                  potential + q * channels + first);
+      }
+      gemm(Transpose::No,
+           Transpose::Yes,
+           positions_,
+           last - first,
+           patch_size_,
+           1.0f,
+           cols,
+           patch_size_,
+           weights_.data() + first * patch_size_,
+           patch_size_,
+           1.0f,
+           potential + first,
+           channels);
+    }
+  }
+
+  void
+  weight_grad_im2col(std::size_t n, std::size_t first, std::size_t last)
+  {
+    const float* cols = cols_.data() + n * patch_size_ * positions_;
+    const float* potential_grad = potential_grad_.data() + n * output_size_;
+    std::size_t channels = config_.output_channels;
+    bool nchw = config_.layout == ImageLayout::Nchw;
+
+    for (std::size_t o = first; o < last; ++o) {
+      float sum = 0.0f;
+      for (std::size_t q = 0; q < positions_; ++q) {
+        sum += nchw ? potential_grad[o * positions_ + q]
+                    : potential_grad[q * channels + o];
+      }
+      bias_grad_[o] += sum;
+    }
+
+    // weight_grad += potential_grad * patches^T
+    if (nchw) {
+      gemm(Transpose::No,
+           Transpose::Yes,
+           last - first,
+           patch_size_,
+           positions_,
+           1.0f,
+           potential_grad + first * positions_,
+           positions_,
+           cols,
+           positions_,
+           1.0f,
+           weight_grad_.data() + first * patch_size_,
+           patch_size_);
+    } else {
+      gemm(Transpose::Yes,
+           Transpose::No,
+           last - first,
+           patch_size_,
+           positions_,
+           1.0f,
+           potential_grad + first,
+           channels,
+           cols,
+           patch_size_,
+           1.0f,
+           weight_grad_.data() + first * patch_size_,
+           patch_size_);
+    }
+  }
+
+  void
+  input_grad_im2col(std::size_t n)
+  {
+    float* cols = cols_.data() + n * patch_size_ * positions_;
+    const float* potential_grad = potential_grad_.data() + n * output_size_;
+    std::size_t channels = config_.output_channels;
+
+    // Unfolded input gradient = weights^T * potential_grad
+    if (config_.layout == ImageLayout::Nchw) {
+      gemm(Transpose::Yes,
+           Transpose::No,
+           patch_size_,
+           positions_,
+           channels,
+           1.0f,
+           weights_.data(),
+           patch_size_,
+           potential_grad,
+           positions_,
+           0.0f,
+           cols,
+           positions_);
+    } else {
+      gemm(Transpose::No,
+           Transpose::No,
+           positions_,
+           patch_size_,
+           channels,
+           1.0f,
+           potential_grad,
+           channels,
+           weights_.data(),
+           patch_size_,
+           0.0f,
+           cols,
+           patch_size_);
+    }
+    col2im(n);
+  }
+
+  // Zero padded copy of sample n for the direct algorithm
+  void
+  pad_input(std::size_t n)
+  {
+    const float* image = input_.data() + n * input_size_;
+    float* padded = padded_.data() + n * padded_size_;
+    std::fill_n(padded, padded_size_, 0.0f);
+    for (std::size_t ch = 0; ch < config_.input_channels; ++ch) {
+      for (std::size_t y = 0; y < config_.input_height; ++y) {
+        std::copy_n(
+          image + (ch * config_.input_height + y) * config_.input_width,
+          config_.input_width,
+          padded + (ch * padded_height_ + y + config_.padding) *
+                     padded_width_ +
+            config_.padding);
+      }
+    }
+  }
+
+  // Direct planes are output_height rows of padded_width columns, of which
+  // the last kernel_width - 1 are outside the output, so every kernel tap is
+  // a single long axpy or dot over the padded input
+  std::size_t
+  plane_size() const
+  {
+    return config_.output_height() * padded_width_;
+  }
+
+  // Plane of output channel o of sample n's potential gradient, with zeros
+  // in the columns outside the output
+  void
+  widen_potential_grad(std::size_t n, std::size_t o, float* plane) const
+  {
+    const float* potential_grad =
+      potential_grad_.data() + n * output_size_ + o * positions_;
+    std::size_t out_w = config_.output_width();
+    std::fill_n(plane, plane_size(), 0.0f);
+    for (std::size_t oy = 0; oy < config_.output_height(); ++oy) {
+      std::copy_n(
+        potential_grad + oy * out_w, out_w, plane + oy * padded_width_);
+    }
+  }
+
+  void
+  forward_direct(std::size_t n, std::size_t first, std::size_t last)
+  {
+    thread_local std::vector<float> plane;
+    plane.resize(plane_size());
+    const auto& kernel = kernels();
+    const float* padded = padded_.data() + n * padded_size_;
+    float* potential = potential_.data() + n * output_size_;
+    std::size_t out_w = config_.output_width();
+    std::size_t channel_size = padded_height_ * padded_width_;
+
+    for (std::size_t o = first; o < last; ++o) {
+      std::ranges::fill(plane, 0.0f);
+      const float* w = weights_.data() + o * patch_size_;
+      for (std::size_t ch = 0; ch < config_.input_channels; ++ch) {
+        for (std::size_t ky = 0; ky < config_.kernel_height; ++ky) {
+          for (std::size_t kx = 0; kx < config_.kernel_width; ++kx) {
+            kernel.axpy(*w++,
+                        padded + ch * channel_size + ky * padded_width_ + kx,
+                        plane.data(),
+                        plane.size());
+          }
+        }
+      }
+      for (std::size_t oy = 0; oy < config_.output_height(); ++oy) {
+        for (std::size_t ox = 0; ox < out_w; ++ox) {
+          potential[(o * config_.output_height() + oy) * out_w + ox] =
+            plane[oy * padded_width_ + ox] + bias_[o];
+        }
+      }
+    }
+  }
+
+  void
+  weight_grad_direct(std::size_t n, std::size_t first, std::size_t last)
+  {
+    thread_local std::vector<float> plane;
+    plane.resize(plane_size());
+    const auto& kernel = kernels();
+    const float* padded = padded_.data() + n * padded_size_;
+    std::size_t channel_size = padded_height_ * padded_width_;
+
+    for (std::size_t o = first; o < last; ++o) {
+      widen_potential_grad(n, o, plane.data());
+      float sum = 0.0f;
+      for (float value : plane) {
+        sum += value;
+      }
+      bias_grad_[o] += sum;
+
+      float* w_grad = weight_grad_.data() + o * patch_size_;
+      for (std::size_t ch = 0; ch < config_.input_channels; ++ch) {
+        for (std::size_t ky = 0; ky < config_.kernel_height; ++ky) {
+          for (std::size_t kx = 0; kx < config_.kernel_width; ++kx) {
+            *w_grad++ += kernel.dot(
+              plane.data(),
+              padded + ch * channel_size + ky * padded_width_ + kx,
+              plane.size());
+          }
+        }
+      }
+    }
+  }
+
+  void
+  input_grad_direct(std::size_t n)
+  {
+    thread_local std::vector<float> plane;
+    plane.resize(plane_size());
+    const auto& kernel = kernels();
+    // The padded input is not needed anymore, accumulate the padded input
+    // gradient in its place
+    float* padded_grad = padded_.data() + n * padded_size_;
+    std::fill_n(padded_grad, padded_size_, 0.0f);
+    std::size_t channel_size = padded_height_ * padded_width_;
+
+    for (std::size_t o = 0; o < config_.output_channels; ++o) {
+      widen_potential_grad(n, o, plane.data());
+      const float* w = weights_.data() + o * patch_size_;
+      for (std::size_t ch = 0; ch < config_.input_channels; ++ch) {
+        for (std::size_t ky = 0; ky < config_.kernel_height; ++ky) {
+          for (std::size_t kx = 0; kx < config_.kernel_width; ++kx) {
+            kernel.axpy(*w++,
+                        plane.data(),
+                        padded_grad + ch * channel_size + ky * padded_width_ +
+                          kx,
+                        plane.size());
+          }
+        }
+      }
+    }
+
+    float* image_grad = input_grad_.data() + n * input_size_;
+    for (std::size_t ch = 0; ch < config_.input_channels; ++ch) {
+      for (std::size_t y = 0; y < config_.input_height; ++y) {
+        std::copy_n(padded_grad + (ch * padded_height_ + y + config_.padding) *
+                                    padded_width_ +
+                      config_.padding,
+                    config_.input_width,
+                    image_grad + (ch * config_.input_height + y) *
+                                   config_.input_width);
+      }
+    }
+  }
+
+  // Bias followed by weights
+  void
+  set_parameters(std::shared_ptr<float[]> storage)
+  {
+    parameters_ = std::move(storage);
+    bias_ = { parameters_.get(), config_.output_channels };
+    weights_ = { parameters_.get() + config_.output_channels,
+                 config_.output_channels * patch_size_ };
+  }
+
+  // Bias gradient followed by weight gradient
+  void
+  set_grads(std::shared_ptr<float[]> storage)
+  {
+    grads_ = std::move(storage);
+    bias_grad_ = { grads_.get(), config_.output_channels };
+    weight_grad_ = { grads_.get() + config_.output_channels,
+                     config_.output_channels * patch_size_ };
+  }
+
+  // Grow per-sample buffers to hold a mini-batch (never shrinks)
+  void
+  resize_batch(std::size_t batch)
+  {
+    batch_size_ = batch;
+
+    if (potential_.size() < batch * output_size_) {
+      potential_.resize(batch * output_size_);
+      output_.resize(batch * output_size_);
+      potential_grad_.resize(batch * output_size_);
+      input_grad_.resize(batch * input_size_);
+      if (direct_) {
+        padded_.resize(batch * padded_size_);
+      } else {
+        cols_.resize(batch * patch_size_ * positions_);
+      }
+    }
+  }
+
+  Conv2DConfig config_;
+  ActivationFn activation_fn_;
+  ThreadPool* pool_;
+  bool direct_ = false;
+  std::size_t patch_size_ = 0;
+  std::size_t positions_ = 0;
+  std::size_t input_size_ = 0;
+  std::size_t output_size_ = 0;
+  std::size_t padded_height_ = 0;
+  std::size_t padded_width_ = 0;
+  std::size_t padded_size_ = 0;
+  std::size_t batch_size_ = 1;
+  // Bias followed by weights, shared with replicas
+  std::shared_ptr<float[]> parameters_;
+  std::span<float> bias_;
+  std::span<float> weights_;
+  // Bias gradient followed by weight gradient
+  std::shared_ptr<float[]> grads_;
+  std::span<float> bias_grad_;
+  std::span<float> weight_grad_;
+  std::vector<float> potential_;
+  std::vector<float> output_;
+  std::vector<float> potential_grad_;
+  std::vector<float> input_grad_;
+  // Unfolded patches per sample (im2col), then their gradient
+  AlignedVector<float> cols_;
+  // Zero padded input per sample (direct), then its gradient
+  AlignedVector<float> padded_;
+  std::span<const float> input_;
+};
+
+}
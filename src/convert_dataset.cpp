@@ -0,0 +1,23 @@
+#include <iostream>
+
+#include "binary_dataset.hpp"
+
+// Convert a CSV dataset into the binary format used by nnets::MappedDataset
+// Usage: nnets_convert_dataset <vectors.csv> <labels.csv> <output.bin>
+int
+main(int argc, char** argv)
+{
+  if (argc != 4) {
+    std::cerr << "usage: " << argv[0]
+              << " <vectors.csv> <labels.csv> <output.bin>\n";
+    return 1;
+  }
+
+  nnets::import_csv_dataset(argv[1], argv[2], argv[3]);
+
+  const auto dataset = nnets::MappedDataset{ argv[3] };
+  std::cout << "samples=" << dataset.size()
+            << " input_size=" << dataset.input_size() << "\n";
+
+  return 0;
+}
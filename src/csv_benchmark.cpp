@@ -0,0 +1,76 @@
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <filesystem>
+#include <iostream>
+#include <thread>
+
+#include "dataset.hpp"
+#include "thread_pool.hpp"
+
+// CSV ingestion throughput of read_dataset() against the line by line
+// reference parser
+// Usage: nnets_csv_benchmark [vectors.csv labels.csv [num_threads]]
+int
+main(int argc, char** argv)
+{
+  constexpr int repetitions = 3;
+
+  std::filesystem::path inputs_path = "data/fashion_mnist_train_vectors.csv";
+  std::filesystem::path outputs_path = "data/fashion_mnist_train_labels.csv";
+  std::size_t num_threads = std::thread::hardware_concurrency();
+  if (argc > 2) {
+    inputs_path = argv[1];
+    outputs_path = argv[2];
+  }
+  if (argc > 3) {
+    num_threads = std::max(std::atoi(argv[3]), 1);
+  }
+
+  auto total_bytes = std::filesystem::file_size(inputs_path) +
+                     std::filesystem::file_size(outputs_path);
+  double megabytes = static_cast<double>(total_bytes) / 1e6;
+
+  auto reference = nnets::read_dataset_by_line(inputs_path, outputs_path);
+
+  // Best of a few runs, checking the result against the reference
+  auto measure = [&](const char* name, auto read) {
+    double best_seconds = 0.0;
+    for (int i = 0; i < repetitions; ++i) {
+      auto start_time = std::chrono::steady_clock::now();
+      auto dataset = read();
+      auto end_time = std::chrono::steady_clock::now();
+
+      if (not std::ranges::equal(dataset.inputs(), reference.inputs()) or
+          not std::ranges::equal(dataset.labels(), reference.labels())) {
+        std::cerr << name << ": result differs from the reference\n";
+        std::exit(1);
+      }
+
+      double seconds =
+        std::chrono::duration<double>(end_time - start_time).count();
+      best_seconds = i == 0 ? seconds : std::min(best_seconds, seconds);
+    }
+
+    std::cout << name << " " << best_seconds * 1e3 << " ms "
+              << megabytes / best_seconds << " MB/s" << std::endl;
+  };
+
+  std::cout << "rows=" << reference.size() << " size=" << megabytes
+            << " MB\n";
+
+  measure("read_dataset_by_line", [&] {
+    return nnets::read_dataset_by_line(inputs_path, outputs_path);
+  });
+  measure("read_dataset/1", [&] {
+    return nnets::read_dataset(inputs_path, outputs_path);
+  });
+
+  auto pool = nnets::ThreadPool{ num_threads };
+  auto name = "read_dataset/" + std::to_string(num_threads);
+  measure(name.c_str(), [&] {
+    return nnets::read_dataset(inputs_path, outputs_path, &pool);
+  });
+
+  return 0;
+}
@@ -0,0 +1,320 @@
+#pragma once
+
+#include <algorithm>
+#include <bit>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <functional>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+#include "aligned.hpp"
+#include "thread_pool.hpp"
+
+namespace nnets {
+
+// Matrix of integers parsed from CSV text, row-major
+template<typename T>
+struct CsvMatrix
+{
+  std::size_t num_rows = 0;
+  std::size_t num_columns = 0;
+  AlignedVector<T> values;
+};
+
+namespace detail {
+
+// Bit i is set if text[i] is one of the two characters (16 bytes)
+inline std::uint32_t
+csv_match_mask(const char* text, char first, char second)
+{
+#if defined(__SSE2__)
+  // SSE2 is part of the x86-64 baseline, no runtime dispatch needed
+  __m128i block = _mm_loadu_si128(reinterpret_cast<const __m128i*>(text));
+  __m128i matches =
+    _mm_or_si128(_mm_cmpeq_epi8(block, _mm_set1_epi8(first)),
+                 _mm_cmpeq_epi8(block, _mm_set1_epi8(second)));
+  return static_cast<std::uint32_t>(_mm_movemask_epi8(matches));
+#else
+  std::uint32_t mask = 0;
+  for (std::uint32_t i = 0; i < 16; ++i) {
+    if (text[i] == first or text[i] == second) {
+      mask |= 1u << i;
+    }
+  }
+  return mask;
+#endif
+}
+
+// Number of newlines in text
+inline std::size_t
+csv_count_lines(std::string_view text)
+{
+  std::size_t count = 0;
+  std::size_t i = 0;
+  for (; i + 16 <= text.size(); i += 16) {
+    count += static_cast<std::size_t>(
+      std::popcount(csv_match_mask(text.data() + i, '\n', '\n')));
+  }
+  for (; i < text.size(); ++i) {
+    count += text[i] == '\n' ? 1 : 0;
+  }
+  return count;
+}
+
+// Integer value of a field, surrounding whitespace is ignored
+// Sets ok to false if the field is not an integer
+template<typename T>
+inline T
+csv_parse_field_slow(const char* begin, const char* end, bool& ok)
+{
+  while (begin < end and (*begin == ' ' or *begin == '\t')) {
+    ++begin;
+  }
+  while (end > begin and (end[-1] == ' ' or end[-1] == '\t' or
+                          end[-1] == '\r')) {
+    --end;
+  }
+
+  bool negative = begin < end and *begin == '-';
+  begin += negative ? 1 : 0;
+  if (begin == end) {
+    ok = false;
+    return T{};
+  }
+
+  int value = 0;
+  for (; begin < end; ++begin) {
+    auto digit = static_cast<unsigned>(*begin - '0');
+    if (digit > 9) {
+      ok = false;
+      return T{};
+    }
+    value = value * 10 + static_cast<int>(digit);
+  }
+  return static_cast<T>(negative ? -value : value);
+}
+
+// Integer value of a field, with a branch-free path for 1 to 4 plain digits
+// (SWAR over one 32 bit load) that needs 4 readable bytes at begin
+template<typename T>
+inline T
+csv_parse_field(const char* begin, const char* end, const char* text_end,
+                bool& ok)
+{
+  auto length = static_cast<std::size_t>(end - begin);
+
+  if (length - 1 < 4 and text_end - begin >= 4) {
+    std::uint32_t word;
+    std::memcpy(&word, begin, sizeof(word));
+    if constexpr (std::endian::native == std::endian::big) {
+      word = __builtin_bswap32(word);
+    }
+
+    // Bytes of the field must be in '0'..'9'
+    std::uint32_t field_mask =
+      length == 4 ? 0xffffffffu : (1u << (8 * length)) - 1;
+    std::uint32_t invalid =
+      (((word & 0xf0f0f0f0u) ^ 0x30303030u) |
+       (((word + 0x06060606u) & 0xf0f0f0f0u) ^ 0x30303030u)) &
+      field_mask;
+
+    if (invalid == 0) {
+      // Right-align the digits into the top bytes, most significant first
+      std::uint32_t digits = (word & 0x0f0f0f0fu) << (8 * (4 - length));
+      int value = static_cast<int>((digits & 0xff) * 1000 +
+                                   ((digits >> 8) & 0xff) * 100 +
+                                   ((digits >> 16) & 0xff) * 10 +
+                                   (digits >> 24));
+      return static_cast<T>(value);
+    }
+  }
+
+  return csv_parse_field_slow<T>(begin, end, ok);
+}
+
+// Whether a line contains only whitespace
+inline bool
+csv_blank(const char* begin, const char* end)
+{
+  return std::all_of(begin, end, [](char c) {
+    return c == ' ' or c == '\t' or c == '\r';
+  });
+}
+
+// Parse the whole lines in text into out (row-major, num_columns values per
+// row), blank lines are skipped
+// Returns the number of rows, or num_rows_max + 1 for malformed input
+template<typename T>
+std::size_t
+csv_parse_rows(std::string_view text, std::size_t num_columns, T* out,
+               std::size_t num_rows_max)
+{
+  const char* const begin = text.data();
+  const char* const end = begin + text.size();
+  const char* field = begin;
+  T* dst = out;
+  T* row_start = out;
+  T* const out_end = out + num_rows_max * num_columns;
+  bool ok = true;
+
+  // Handle the delimiter at pos, which ends the field starting at field
+  auto on_delimiter = [&](const char* pos) {
+    auto column = static_cast<std::size_t>(dst - row_start);
+    if (*pos == ',') {
+      if (column + 1 < num_columns and dst < out_end) {
+        *dst++ = csv_parse_field<T>(field, pos, end, ok);
+      } else {
+        ok = false;
+      }
+    } else if (column > 0 or not csv_blank(field, pos)) {
+      if (column + 1 == num_columns and dst < out_end) {
+        *dst++ = csv_parse_field<T>(field, pos, end, ok);
+        row_start = dst;
+      } else {
+        ok = false;
+      }
+    }
+    field = pos + 1;
+  };
+
+  const char* block = begin;
+  for (; block + 16 <= end and ok; block += 16) {
+    std::uint32_t mask = csv_match_mask(block, ',', '\n');
+    while (mask != 0) {
+      on_delimiter(block + std::countr_zero(mask));
+      mask &= mask - 1;
+    }
+  }
+  for (const char* pos = block; pos < end and ok; ++pos) {
+    if (*pos == ',' or *pos == '\n') {
+      on_delimiter(pos);
+    }
+  }
+
+  // Last line without a trailing newline
+  if (ok and (dst > row_start or not csv_blank(field, end))) {
+    if (static_cast<std::size_t>(dst - row_start) + 1 == num_columns and
+        dst < out_end) {
+      *dst++ = csv_parse_field<T>(field, end, end, ok);
+      row_start = dst;
+    } else {
+      ok = false;
+    }
+  }
+
+  return ok ? static_cast<std::size_t>(row_start - out) / num_columns
+            : num_rows_max + 1;
+}
+
+}
+
+// Parse CSV text of integers into a row-major matrix, reusing its storage
+// (e.g. for a file parsed in pieces)
+// The text is split into one chunk per task at line boundaries. A first
+// parallel pass counts the lines of each chunk, a second pass parses every
+// chunk straight into its rows of the preallocated matrix.
+// Throws std::runtime_error for malformed or ragged input.
+template<typename T>
+void
+parse_csv(std::string_view text, CsvMatrix<T>& matrix, ThreadPool* pool)
+{
+  matrix.num_rows = 0;
+  matrix.num_columns = 0;
+  matrix.values.clear();
+
+  // Columns are given by the first non-blank line
+  std::size_t first_line = 0;
+  while (first_line < text.size()) {
+    std::size_t line_end = std::min(text.find('\n', first_line), text.size());
+    if (not detail::csv_blank(text.data() + first_line,
+                              text.data() + line_end)) {
+      auto line = text.substr(first_line, line_end - first_line);
+      matrix.num_columns = 1 + std::ranges::count(line, ',');
+      break;
+    }
+    first_line = line_end + 1;
+  }
+  if (matrix.num_columns == 0) {
+    return;
+  }
+
+  // Chunk boundaries moved forward to the start of the next line
+  constexpr std::size_t min_chunk_size = 1 << 20;
+  std::size_t num_chunks = std::clamp<std::size_t>(
+    text.size() / min_chunk_size, 1, pool ? 4 * pool->size() : 1);
+  auto bounds = std::vector<std::size_t>(num_chunks + 1, text.size());
+  bounds[0] = 0;
+  for (std::size_t c = 1; c < num_chunks; ++c) {
+    std::size_t pos = std::max(c * text.size() / num_chunks, bounds[c - 1]);
+    std::size_t newline = text.find('\n', pos);
+    bounds[c] = newline == std::string_view::npos ? text.size() : newline + 1;
+  }
+
+  auto chunk = [&](std::size_t c) {
+    return text.substr(bounds[c], bounds[c + 1] - bounds[c]);
+  };
+  auto run = [&](const std::function<void(std::size_t)>& fn) {
+    if (pool) {
+      pool->parallel_for(num_chunks, fn);
+    } else {
+      for (std::size_t c = 0; c < num_chunks; ++c) {
+        fn(c);
+      }
+    }
+  };
+
+  // Upper bound of rows per chunk: its newlines plus an unterminated line
+  auto row_offsets = std::vector<std::size_t>(num_chunks + 1, 0);
+  run([&](std::size_t c) {
+    auto lines = detail::csv_count_lines(chunk(c));
+    row_offsets[c + 1] = lines + (chunk(c).ends_with('\n') ? 0 : 1);
+  });
+  for (std::size_t c = 0; c < num_chunks; ++c) {
+    row_offsets[c + 1] += row_offsets[c];
+  }
+
+  matrix.values.resize(row_offsets.back() * matrix.num_columns);
+
+  auto rows = std::vector<std::size_t>(num_chunks);
+  run([&](std::size_t c) {
+    rows[c] = detail::csv_parse_rows(
+      chunk(c),
+      matrix.num_columns,
+      matrix.values.data() + row_offsets[c] * matrix.num_columns,
+      row_offsets[c + 1] - row_offsets[c]);
+  });
+
+  // Close gaps left by blank lines
+  for (std::size_t c = 0; c < num_chunks; ++c) {
+    if (rows[c] > row_offsets[c + 1] - row_offsets[c]) {
+      throw std::runtime_error{ "malformed CSV row" };
+    }
+    auto chunk_values =
+      matrix.values.begin() + row_offsets[c] * matrix.num_columns;
+    std::copy(chunk_values,
+              chunk_values + rows[c] * matrix.num_columns,
+              matrix.values.begin() + matrix.num_rows * matrix.num_columns);
+    matrix.num_rows += rows[c];
+  }
+  matrix.values.resize(matrix.num_rows * matrix.num_columns);
+}
+
+// Parse CSV text of integers into a new row-major matrix, see above
+template<typename T>
+[[nodiscard]] CsvMatrix<T>
+parse_csv(std::string_view text, ThreadPool* pool = nullptr)
+{
+  auto matrix = CsvMatrix<T>{};
+  parse_csv(text, matrix, pool);
+  return matrix;
+}
+
+}
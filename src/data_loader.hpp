@@ -0,0 +1,329 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <exception>
+#include <functional>
+#include <random>
+#include <span>
+#include <stdexcept>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include "aligned.hpp"
+#include "batch_stager.hpp"
+#include "profiler.hpp"
+
+namespace nnets {
+
+// Options of a DataLoader
+struct DataLoaderConfig
+{
+  std::size_t batch_size = 1;
+  // Number of passes over the sample indices
+  std::size_t num_epochs = 1;
+  // Epoch to start from, e.g. when resuming from a checkpoint (DataLoader
+  // only)
+  // The shuffles of the skipped epochs are still drawn, so later epochs see
+  // the same order as in an uninterrupted run, unless an augmentation draws
+  // from the RNG as well.
+  std::size_t first_epoch = 0;
+  // Length of the one-hot target vectors (none if 0)
+  std::size_t num_categories = 0;
+  // Factor applied to every input value (e.g. 1 / 255 for uint8 pixels)
+  float input_scale = 1.0f;
+  // Number of batches prepared ahead of the consumer
+  std::size_t prefetch = 2;
+  // Shuffle the indices before every epoch
+  bool shuffle = true;
+};
+
+// Mini-batch produced by a DataLoader
+struct LoaderBatch
+{
+  // Row-major input vectors
+  std::span<const float> inputs;
+  std::span<const int> labels;
+  // Row-major one-hot vectors of the labels
+  std::span<const float> targets;
+  std::size_t size = 0;
+  std::size_t epoch = 0;
+};
+
+namespace detail {
+
+// Ring of preallocated batch slots handed from one producer thread to one
+// consumer, synchronized only by two atomic counters
+class BatchRing
+{
+public:
+  using Rng = std::mt19937_64;
+  using Augmentation = std::function<void(std::span<float> input, Rng& rng)>;
+
+  BatchRing(const DataLoaderConfig& config,
+            std::size_t input_size,
+            Augmentation augmentation)
+    : config_{ config }
+    , augmentation_{ std::move(augmentation) }
+  {
+    if (config_.batch_size == 0) {
+      throw std::invalid_argument{ "batch size must be positive" };
+    }
+
+    // One more slot than prefetched batches for the batch in use
+    for (std::size_t i = 0; i < config_.prefetch + 1; ++i) {
+      slots_.push_back(Slot{
+        BatchStager{ config_.batch_size, input_size },
+        AlignedVector<float>(config_.batch_size * config_.num_categories),
+        {},
+        {} });
+    }
+  }
+
+  // Producer: prepare the samples at indices as the next batch
+  // Returns false if the ring was stopped.
+  template<typename DatasetT>
+  bool
+  produce(const DatasetT& dataset,
+          std::span<const std::size_t> indices,
+          std::size_t epoch,
+          Rng& rng)
+  {
+    Slot* slot = acquire_slot();
+    if (not slot) {
+      return false;
+    }
+    {
+      NNETS_PROFILE_SCOPE("loader.fill_batch");
+      fill(*slot, dataset, indices, epoch, rng);
+    }
+    publish();
+    return true;
+  }
+
+  // Producer: pass an exception on to the consumer
+  void
+  fail(std::exception_ptr error)
+  {
+    if (Slot* slot = acquire_slot()) {
+      slot->error = std::move(error);
+      publish();
+    }
+  }
+
+  // Consumer: wait for the next of num_batches batches (see DataLoader)
+  const LoaderBatch&
+  next(std::size_t num_batches)
+  {
+    auto head = head_.load(std::memory_order_relaxed);
+    if (holding_) {
+      // Hand the previous slot back to the producer
+      head_.store(++head, std::memory_order_release);
+      head_.notify_one();
+      holding_ = false;
+    }
+    if (head == num_batches) {
+      throw std::out_of_range{ "no batches left in DataLoader" };
+    }
+
+    auto tail = tail_.load(std::memory_order_acquire);
+    while (tail == head) {
+      tail_.wait(tail, std::memory_order_acquire);
+      tail = tail_.load(std::memory_order_acquire);
+    }
+
+    holding_ = true;
+    const auto& slot = slots_[head % slots_.size()];
+    if (slot.error) {
+      std::rethrow_exception(slot.error);
+    }
+    return slot.batch;
+  }
+
+  // Consumer: make a waiting or future produce() return false
+  void
+  stop()
+  {
+    // Free every slot to wake the producer, which then sees stopping_
+    stopping_.store(true);
+    head_.fetch_add(slots_.size(), std::memory_order_release);
+    head_.notify_one();
+  }
+
+private:
+  struct Slot
+  {
+    BatchStager stager;
+    AlignedVector<float> targets;
+    LoaderBatch batch;
+    std::exception_ptr error;
+  };
+
+  template<typename DatasetT>
+  void
+  fill(Slot& slot,
+       const DatasetT& dataset,
+       std::span<const std::size_t> indices,
+       std::size_t epoch,
+       Rng& rng)
+  {
+    auto& stager = slot.stager;
+    stager.gather(dataset, indices, config_.input_scale);
+
+    std::size_t input_size = dataset.input_size();
+    auto inputs = stager.inputs();
+    if (augmentation_) {
+      for (std::size_t i = 0; i < indices.size(); ++i) {
+        augmentation_(inputs.subspan(i * input_size, input_size), rng);
+      }
+    }
+
+    std::size_t num_categories = config_.num_categories;
+    auto targets =
+      std::span{ slot.targets }.first(indices.size() * num_categories);
+    if (num_categories > 0) {
+      std::ranges::fill(targets, 0.0f);
+      for (std::size_t i = 0; i < indices.size(); ++i) {
+        auto label = static_cast<std::size_t>(stager.labels()[i]);
+        if (label >= num_categories) {
+          throw std::out_of_range{ "label exceeds number of categories" };
+        }
+        targets[i * num_categories + label] = 1.0f;
+      }
+    }
+
+    slot.batch = { inputs, stager.labels(), targets, indices.size(), epoch };
+  }
+
+  // Wait for a free slot, nullptr when the ring was stopped
+  Slot*
+  acquire_slot()
+  {
+    auto tail = tail_.load(std::memory_order_relaxed);
+    auto head = head_.load(std::memory_order_acquire);
+    while (tail - head == slots_.size()) {
+      head_.wait(head, std::memory_order_acquire);
+      head = head_.load(std::memory_order_acquire);
+    }
+    if (stopping_.load()) {
+      return nullptr;
+    }
+    return &slots_[tail % slots_.size()];
+  }
+
+  void
+  publish()
+  {
+    tail_.fetch_add(1, std::memory_order_release);
+    tail_.notify_one();
+  }
+
+  DataLoaderConfig config_;
+  Augmentation augmentation_;
+  std::vector<Slot> slots_;
+  // Batches consumed (written by the consumer) and produced (written by the
+  // producer), slot of batch i is i % slots_.size()
+  std::atomic<std::size_t> head_ = 0;
+  std::atomic<std::size_t> tail_ = 0;
+  std::atomic<bool> stopping_ = false;
+  bool holding_ = false;
+};
+
+}
+
+// Mini-batches of a dataset prepared on a background thread
+// The producer thread shuffles the sample indices, gathers and scales the
+// inputs, runs the optional augmentation and builds one-hot targets up to
+// config.prefetch batches ahead of the trainer. Batches are handed over in a
+// single-producer single-consumer ring of preallocated slots synchronized
+// only by two atomic counters, nothing is allocated after construction.
+// Works with any dataset accepted by BatchStager.
+template<typename DatasetT>
+class DataLoader
+{
+public:
+  using Rng = detail::BatchRing::Rng;
+  // Called on the producer thread for the input vector of every sample
+  using Augmentation = detail::BatchRing::Augmentation;
+
+  // The dataset must outlive the loader, which starts producing right away
+  DataLoader(const DatasetT& dataset,
+             std::vector<std::size_t> indices,
+             DataLoaderConfig config,
+             Rng rng,
+             Augmentation augmentation = {})
+    : dataset_{ dataset }
+    , indices_{ std::move(indices) }
+    , config_{ config }
+    , rng_{ std::move(rng) }
+    , ring_{ config, dataset.input_size(), std::move(augmentation) }
+    , producer_{ [this] { produce(); } }
+  {}
+
+  DataLoader(const DataLoader&) = delete;
+  DataLoader& operator=(const DataLoader&) = delete;
+
+  ~DataLoader()
+  {
+    ring_.stop();
+    producer_.join();
+  }
+
+  [[nodiscard]] std::size_t
+  batches_per_epoch() const
+  {
+    return (indices_.size() + config_.batch_size - 1) / config_.batch_size;
+  }
+
+  // Wait for the next batch, which stays valid until the next call
+  // Rethrows exceptions of the producer thread, throws std::out_of_range
+  // after the last batch of the last epoch.
+  const LoaderBatch&
+  next()
+  {
+    std::size_t num_epochs =
+      config_.num_epochs - std::min(config_.first_epoch, config_.num_epochs);
+    return ring_.next(num_epochs * batches_per_epoch());
+  }
+
+private:
+  void
+  produce()
+  {
+    try {
+      for (std::size_t epoch = 0; epoch < config_.num_epochs; ++epoch) {
+        if (config_.shuffle) {
+          std::ranges::shuffle(indices_, rng_);
+        }
+        if (epoch < config_.first_epoch) {
+          continue;
+        }
+
+        for (std::size_t start = 0; start < indices_.size();
+             start += config_.batch_size) {
+          std::size_t size =
+            std::min(config_.batch_size, indices_.size() - start);
+          if (not ring_.produce(dataset_,
+                                std::span{ indices_ }.subspan(start, size),
+                                epoch,
+                                rng_)) {
+            return;
+          }
+        }
+      }
+    } catch (...) {
+      ring_.fail(std::current_exception());
+    }
+  }
+
+  const DatasetT& dataset_;
+  std::vector<std::size_t> indices_;
+  DataLoaderConfig config_;
+  Rng rng_;
+  detail::BatchRing ring_;
+  std::thread producer_;
+};
+
+}
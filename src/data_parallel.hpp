@@ -0,0 +1,122 @@
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <memory>
+#include <span>
+#include <vector>
+
+#include "module.hpp"
+#include "profiler.hpp"
+#include "thread_pool.hpp"
+
+namespace nnets {
+
+// Data-parallel training of a module over mini-batch shards
+// Every thread of the pool owns a replica of the module (see
+// IModule::replicate()) and runs a contiguous slice of the batch with the
+// shared weights. Replica gradients are summed in a fixed binary tree, so
+// results are bit-reproducible for a given number of threads.
+class DataParallel
+{
+public:
+  DataParallel(IModule& module, ThreadPool& pool)
+    : pool_{ pool }
+  {
+    workers_.push_back(&module);
+    for (std::size_t t = 1; t < pool_.size(); ++t) {
+      replicas_.push_back(module.replicate());
+      workers_.push_back(replicas_.back().get());
+    }
+    output_grads_.resize(workers_.size());
+    losses_.resize(workers_.size());
+  }
+
+  // Reset accumulated gradients of the module and all replicas
+  void
+  zero_grad()
+  {
+    pool_.parallel_for(workers_.size(),
+                       [&](std::size_t t) { workers_[t]->zero_grad(); });
+  }
+
+  // Forward pass, loss and backward pass of a mini-batch of row-major inputs
+  // loss_grad(first, outputs, output_grads) is called for every shard with the
+  // index of its first sample in the batch, fills output_grads with the loss
+  // gradient of the shard's outputs and returns the shard's loss.
+  // Workers run in training mode (see IModule::set_training()) and are back
+  // in inference mode afterwards, when the module holds the summed gradient
+  // of the whole batch. step is the number of optimizer steps taken so far
+  // (see IModule::set_step()).
+  // Returns the total loss of the batch.
+  template<typename LossGradFn>
+  float
+  train_batch(std::span<const float> inputs,
+              std::size_t batch,
+              std::size_t step,
+              LossGradFn&& loss_grad)
+  {
+    std::size_t input_size = inputs.size() / batch;
+    std::size_t num_workers = workers_.size();
+
+    pool_.parallel_for(num_workers, [&](std::size_t t) {
+      std::size_t first = t * batch / num_workers;
+      std::size_t count = (t + 1) * batch / num_workers - first;
+      losses_[t] = 0.0f;
+      if (count == 0) {
+        return;
+      }
+
+      auto& worker = *workers_[t];
+      worker.set_step(step);
+      worker.set_training(true);
+      worker.forward_batch(inputs.subspan(first * input_size), count);
+      auto outputs = worker.output();
+
+      auto& output_grads = output_grads_[t];
+      output_grads.resize(outputs.size());
+      {
+        NNETS_PROFILE_SCOPE("data_parallel.loss_grad");
+        losses_[t] = loss_grad(first, outputs, std::span{ output_grads });
+      }
+
+      worker.backward_batch(output_grads, count);
+      worker.set_training(false);
+    });
+
+    reduce_grad();
+
+    float loss = 0.0f;
+    for (float shard_loss : losses_) {
+      loss += shard_loss;
+    }
+    return loss;
+  }
+
+private:
+  // Sum replica gradients into the module (worker 0) pairwise
+  void
+  reduce_grad()
+  {
+    NNETS_PROFILE_SCOPE("data_parallel.reduce_grad");
+    std::size_t num_workers = workers_.size();
+
+    for (std::size_t stride = 1; stride < num_workers; stride *= 2) {
+      std::size_t pairs = (num_workers + 2 * stride - 1) / (2 * stride);
+      pool_.parallel_for(pairs, [&](std::size_t pair) {
+        std::size_t dst = pair * 2 * stride;
+        if (dst + stride < num_workers) {
+          workers_[dst]->add_grad(*workers_[dst + stride]);
+        }
+      });
+    }
+  }
+
+  ThreadPool& pool_;
+  std::vector<std::shared_ptr<IModule>> replicas_;
+  std::vector<IModule*> workers_;
+  std::vector<std::vector<float>> output_grads_;
+  std::vector<float> losses_;
+};
+
+}
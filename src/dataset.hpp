@@ -1,17 +1,124 @@
 #pragma once
 
 #include <algorithm>
+#include <charconv>
 #include <filesystem>
 #include <fstream>
+#include <numeric>
+#include <random>
 #include <span>
+#include <stdexcept>
 #include <string>
 #include <utility>
 #include <vector>
 
+#include "aligned.hpp"
+#include "csv_parser.hpp"
+#include "mapped_file.hpp"
+#include "thread_pool.hpp"
+
 namespace nnets {
 
-// Dataset is a set of pairs of input vectors and expected output categories
-using Dataset = std::vector<std::pair<std::vector<float>, int>>;
+// Dataset is a set of input vectors and expected output categories
+// Inputs are stored as one contiguous row-major matrix with a separate label
+// array, samples are referred to by index
+class Dataset
+{
+public:
+  Dataset() = default;
+
+  explicit Dataset(std::size_t input_size)
+    : input_size_{ input_size }
+  {}
+
+  // Take over a row-major input matrix and its labels
+  Dataset(std::size_t input_size,
+          AlignedVector<float> inputs,
+          std::vector<int> labels)
+    : input_size_{ input_size }
+    , inputs_{ std::move(inputs) }
+    , labels_{ std::move(labels) }
+  {
+    if (inputs_.size() != labels_.size() * input_size_) {
+      throw std::invalid_argument{ "input matrix size mismatch" };
+    }
+  }
+
+  // Append a sample, the first one fixes the input vector size
+  void
+  push_back(std::span<const float> input, int label)
+  {
+    if (labels_.empty() and input_size_ == 0) {
+      input_size_ = input.size();
+    }
+    if (input.size() != input_size_) {
+      throw std::invalid_argument{ "input vector size mismatch" };
+    }
+    inputs_.insert(inputs_.end(), input.begin(), input.end());
+    labels_.push_back(label);
+  }
+
+  // Preallocate storage for a number of samples
+  void
+  reserve(std::size_t num_samples)
+  {
+    inputs_.reserve(num_samples * input_size_);
+    labels_.reserve(num_samples);
+  }
+
+  // Number of samples
+  [[nodiscard]] std::size_t
+  size() const
+  {
+    return labels_.size();
+  }
+
+  [[nodiscard]] bool
+  empty() const
+  {
+    return labels_.empty();
+  }
+
+  // Length of every input vector
+  [[nodiscard]] std::size_t
+  input_size() const
+  {
+    return input_size_;
+  }
+
+  // Input vector of the i-th sample
+  [[nodiscard]] std::span<const float>
+  input(std::size_t i) const
+  {
+    return std::span{ inputs_ }.subspan(i * input_size_, input_size_);
+  }
+
+  // Expected category of the i-th sample
+  [[nodiscard]] int
+  label(std::size_t i) const
+  {
+    return labels_[i];
+  }
+
+  // All input vectors, row-major
+  [[nodiscard]] std::span<const float>
+  inputs() const
+  {
+    return inputs_;
+  }
+
+  // All expected categories
+  [[nodiscard]] std::span<const int>
+  labels() const
+  {
+    return labels_;
+  }
+
+private:
+  std::size_t input_size_ = 0;
+  AlignedVector<float> inputs_;
+  std::vector<int> labels_;
+};
 
 // "0,1,0,2" -> {0,1,0,2}
 [[nodiscard]] inline std::vector<float>
@@ -46,9 +153,10 @@ parse_input_vector(const std::string& input)
 }
 
 // Read dataset from vectors file and expected categories file
+// Reference implementation parsing line by line, see read_dataset()
 [[nodiscard]] inline Dataset
-read_dataset(const std::filesystem::path& inputs_path,
-             const std::filesystem::path& outputs_path)
+read_dataset_by_line(const std::filesystem::path& inputs_path,
+                     const std::filesystem::path& outputs_path)
 {
   auto dataset = Dataset{};
   auto inputs_file = std::ifstream{ inputs_path };
@@ -63,22 +171,69 @@ read_dataset(const std::filesystem::path& inputs_path,
       break;
     }
 
-    dataset.emplace_back(std::move(input_vector),
-                         std::atoi(output_line.c_str()));
+    dataset.push_back(input_vector, std::atoi(output_line.c_str()));
   }
 
   return dataset;
 }
 
-// Write predictions into a file
+// Read dataset from vectors file and expected categories file
+// Both files are memory mapped and parsed in parallel chunks when a thread
+// pool is given (see parse_csv())
+[[nodiscard]] inline Dataset
+read_dataset(const std::filesystem::path& inputs_path,
+             const std::filesystem::path& outputs_path,
+             ThreadPool* pool = nullptr)
+{
+  auto inputs = parse_csv<float>(MappedFile{ inputs_path }.text(), pool);
+  auto outputs = parse_csv<int>(MappedFile{ outputs_path }.text(), pool);
+
+  if (outputs.num_columns > 1) {
+    throw std::runtime_error{ "expected one category per line in " +
+                              outputs_path.string() };
+  }
+
+  // Like read_dataset_by_line(), stop at the end of the shorter file
+  std::size_t size = std::min(inputs.num_rows, outputs.num_rows);
+  inputs.values.resize(size * inputs.num_columns);
+  outputs.values.resize(size);
+
+  return Dataset{ inputs.num_columns,
+                  std::move(inputs.values),
+                  { outputs.values.begin(), outputs.values.end() } };
+}
+
+// Write predictions into a file, one per line
+// Numbers are formatted with std::to_chars into a buffer written in large
+// blocks, bypassing the locale-aware stream formatting.
 inline void
 write_predictions(const std::filesystem::path& predictions_path,
                   std::span<const int> predictions)
 {
-  auto predictions_file = std::ofstream{ predictions_path };
+  constexpr std::size_t buffer_size = 64 << 10;
+  // Longest int plus a newline
+  constexpr std::size_t max_line = 12;
+
+  auto predictions_file = std::ofstream{ predictions_path, std::ios::binary };
+  auto buffer = std::vector<char>(buffer_size);
+  std::size_t used = 0;
 
   for (int value : predictions) {
-    predictions_file << value << "\n";
+    if (used + max_line > buffer.size()) {
+      predictions_file.write(buffer.data(), static_cast<std::streamsize>(used));
+      used = 0;
+    }
+    char* end = std::to_chars(buffer.data() + used,
+                              buffer.data() + buffer.size(),
+                              value)
+                  .ptr;
+    *end++ = '\n';
+    used = static_cast<std::size_t>(end - buffer.data());
+  }
+  predictions_file.write(buffer.data(), static_cast<std::streamsize>(used));
+
+  if (not predictions_file) {
+    throw std::runtime_error{ "cannot write " + predictions_path.string() };
   }
 }
 
@@ -87,10 +242,37 @@ inline int
 num_categories(const Dataset& dataset)
 {
   int max_cat = 0;
-  for (const auto& [input, label] : dataset) {
+  for (int label : dataset.labels()) {
     max_cat = std::max(max_cat, label);
   }
   return max_cat + 1;
 }
 
+// Shuffled sample indices split into training and validation parts
+struct IndexSplit
+{
+  std::vector<std::size_t> train;
+  std::vector<std::size_t> validation;
+};
+
+// Shuffle indices of num_samples samples and reserve the last
+// validation_fraction of them for validation
+template<typename Rng>
+[[nodiscard]] IndexSplit
+split_indices(std::size_t num_samples, float validation_fraction, Rng& rng)
+{
+  auto split = IndexSplit{};
+  split.train.resize(num_samples);
+  std::iota(split.train.begin(), split.train.end(), 0);
+  std::ranges::shuffle(split.train, rng);
+
+  auto validation_start =
+    split.train.begin() +
+    static_cast<std::size_t>((1.0f - validation_fraction) * num_samples);
+  split.validation.assign(validation_start, split.train.end());
+  split.train.erase(validation_start, split.train.end());
+
+  return split;
+}
+
 }
@@ -0,0 +1,230 @@
+#pragma once
+
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <span>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "module.hpp"
+#include "simd.hpp"
+
+namespace nnets {
+
+// Inverted dropout: in training mode every value is zeroed with probability
+// rate and the others are scaled by 1 / (1 - rate), in inference mode values
+// pass through unchanged (without a copy)
+// Masks come from the counter-based dropout kernel of simd.hpp, keyed by a
+// seed drawn in init_weights(), the replica and the optimizer step (see
+// IModule::set_step()), so they are never stored, replicas draw independent
+// masks and a run resumed from a checkpoint draws the same ones.
+// See IModule for method documentation
+class Dropout : public IModule
+{
+public:
+  Dropout(std::size_t size, float rate)
+    : size_{ size }
+    , rate_{ rate }
+    , streams_{ std::make_shared<std::uint64_t>(0) }
+  {
+    if (not(rate >= 0.0f and rate < 1.0f)) {
+      throw std::invalid_argument{ "dropout rate must be in [0, 1)" };
+    }
+    // Probability of the 24 random bits of the kernel being below threshold
+    threshold_ = static_cast<std::uint32_t>(std::lround(rate * 0x1p24f));
+    scale_ = 1.0f / (1.0f - rate);
+    resize_batch(1);
+  }
+
+  void
+  forward(std::span<const float> input) override
+  {
+    forward_batch(input, 1);
+  }
+
+  void
+  backward(std::span<const float> output_grad) override
+  {
+    backward_batch(output_grad, 1);
+  }
+
+  void
+  forward_batch(std::span<const float> inputs, std::size_t batch) override
+  {
+    std::size_t size = batch * size_;
+    if (not active()) {
+      output_ = inputs.first(size);
+      return;
+    }
+
+    resize_batch(batch);
+    key_ = static_cast<std::uint32_t>(mix(seed_ ^ mix(stream_ ^ mix(step_))));
+    kernels().dropout(
+      key_, threshold_, scale_, inputs.data(), output_buffer_.data(), size);
+    output_ = std::span{ output_buffer_ }.first(size);
+  }
+
+  void
+  backward_batch(std::span<const float> output_grads,
+                 std::size_t batch) override
+  {
+    std::size_t size = batch * size_;
+    if (not active()) {
+      input_grad_ = output_grads.first(size);
+      return;
+    }
+
+    // Same key, same mask as the forward pass
+    kernels().dropout(key_,
+                      threshold_,
+                      scale_,
+                      output_grads.data(),
+                      input_grad_buffer_.data(),
+                      size);
+    input_grad_ = std::span{ input_grad_buffer_ }.first(size);
+  }
+
+  void
+  set_training(bool training) override
+  {
+    training_ = training;
+  }
+
+  void
+  set_step(std::size_t step) override
+  {
+    step_ = step;
+  }
+
+  void
+  init_weights(Random& random) override
+  {
+    seed_ = random.rng()();
+  }
+
+  void
+  zero_grad() override
+  {}
+
+  [[nodiscard]] std::shared_ptr<IModule>
+  replicate() const override
+  {
+    auto replica = std::make_shared<Dropout>(*this);
+    replica->stream_ = ++*streams_;
+    return replica;
+  }
+
+  void
+  add_grad(const IModule& /*replica*/) override
+  {}
+
+  [[nodiscard]] std::vector<Parameter>
+  parameters() override
+  {
+    return {};
+  }
+
+  void
+  parameters_updated() override
+  {}
+
+  [[nodiscard]] std::size_t
+  parameter_size() const override
+  {
+    return 0;
+  }
+
+  void
+  bind_parameters(std::shared_ptr<float[]> /*storage*/) override
+  {}
+
+  void
+  bind_grads(std::shared_ptr<float[]> /*storage*/) override
+  {}
+
+  void
+  attach_parameters(std::shared_ptr<float[]> /*storage*/) override
+  {}
+
+  [[nodiscard]] std::span<const float>
+  output() const override
+  {
+    return output_;
+  }
+
+  [[nodiscard]] std::span<const float>
+  input_grad() const override
+  {
+    return input_grad_;
+  }
+
+  [[nodiscard]] std::string
+  name() const override
+  {
+    return "dropout_" + std::to_string(size_);
+  }
+
+  [[nodiscard]] ModuleDescription
+  describe() const override
+  {
+    return { .kind = ModuleKind::Dropout,
+             .input_size = size_,
+             .output_size = size_,
+             .activation = std::nullopt };
+  }
+
+  [[nodiscard]] float
+  rate() const
+  {
+    return rate_;
+  }
+
+private:
+  bool
+  active() const
+  {
+    return training_ and threshold_ > 0;
+  }
+
+  // SplitMix64 finalizer
+  static constexpr std::uint64_t
+  mix(std::uint64_t x)
+  {
+    x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9u;
+    x = (x ^ (x >> 27)) * 0x94d049bb133111ebu;
+    return x ^ (x >> 31);
+  }
+
+  // Grow per-sample buffers to hold a mini-batch (never shrinks)
+  void
+  resize_batch(std::size_t batch)
+  {
+    if (output_buffer_.size() < batch * size_) {
+      output_buffer_.resize(batch * size_);
+      input_grad_buffer_.resize(batch * size_);
+    }
+  }
+
+  std::size_t size_;
+  float rate_;
+  float scale_ = 1.0f;
+  std::uint32_t threshold_ = 0;
+  bool training_ = false;
+  std::uint64_t seed_ = 0;
+  // Replica number, 0 for the original module
+  std::uint64_t stream_ = 0;
+  // Number of replicas created, shared with them
+  std::shared_ptr<std::uint64_t> streams_;
+  // Optimizer step of the next training pass and the key of the last one
+  std::uint64_t step_ = 0;
+  std::uint32_t key_ = 0;
+  std::vector<float> output_buffer_;
+  std::vector<float> input_grad_buffer_;
+  std::span<const float> output_;
+  std::span<const float> input_grad_;
+};
+
+}
@@ -0,0 +1,223 @@
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <memory>
+#include <numeric>
+#include <span>
+#include <stdexcept>
+#include <vector>
+
+#include "batch_stager.hpp"
+#include "module.hpp"
+#include "profiler.hpp"
+#include "thread_pool.hpp"
+
+namespace nnets {
+
+// Options of an Evaluator
+struct EvaluationConfig
+{
+  // Samples per batched forward pass of a thread
+  std::size_t batch_size = 256;
+  // A sample is a top-k hit if its label is among the top_k outputs
+  std::size_t top_k = 5;
+  // Factor applied to every input value, as in DataLoaderConfig
+  float input_scale = 1.0f;
+};
+
+// Classification metrics of an evaluation pass
+struct EvaluationResult
+{
+  std::size_t num_categories = 0;
+  std::size_t top_k = 0;
+  // Samples whose largest output is at their label
+  std::size_t correct = 0;
+  // Samples whose label is among the top_k largest outputs
+  std::size_t top_k_correct = 0;
+  // Row-major num_categories x num_categories counts of (label, predicted)
+  std::vector<std::size_t> confusion;
+  // Predicted category of every sample, in the order of the indices
+  std::vector<int> predictions;
+
+  [[nodiscard]] std::size_t
+  size() const
+  {
+    return predictions.size();
+  }
+
+  [[nodiscard]] float
+  accuracy() const
+  {
+    return static_cast<float>(correct) / static_cast<float>(size());
+  }
+
+  [[nodiscard]] float
+  top_k_accuracy() const
+  {
+    return static_cast<float>(top_k_correct) / static_cast<float>(size());
+  }
+
+  // Number of samples of category label predicted as predicted
+  [[nodiscard]] std::size_t
+  confusion_count(std::size_t label, std::size_t predicted) const
+  {
+    return confusion[label * num_categories + predicted];
+  }
+};
+
+// Evaluates a classifier on a dataset with all threads of a pool
+// The samples are split into one contiguous shard per thread, every thread
+// runs its shard in batches through a replica of the module (see
+// IModule::replicate()) with a staging buffer of its own. Metrics are
+// accumulated per thread and summed at the end, so results do not depend on
+// the number of threads.
+class Evaluator
+{
+public:
+  // The module and the pool must outlive the evaluator
+  Evaluator(IModule& module, ThreadPool& pool, EvaluationConfig config = {})
+    : pool_{ pool }
+    , config_{ config }
+  {
+    config_.batch_size = std::max<std::size_t>(config_.batch_size, 1);
+    workers_.emplace_back(&module);
+    for (std::size_t t = 1; t < pool_.size(); ++t) {
+      replicas_.push_back(module.replicate());
+      workers_.emplace_back(replicas_.back().get());
+    }
+  }
+
+  // Evaluate the samples at the given indices
+  template<typename DatasetT>
+  EvaluationResult
+  evaluate(const DatasetT& dataset, std::span<const std::size_t> indices)
+  {
+    NNETS_PROFILE_SCOPE("evaluate");
+    std::size_t num_workers = workers_.size();
+    auto result = EvaluationResult{};
+    result.top_k = config_.top_k;
+    result.predictions.resize(indices.size());
+
+    pool_.parallel_for(num_workers, [&](std::size_t t) {
+      std::size_t first = t * indices.size() / num_workers;
+      std::size_t last = (t + 1) * indices.size() / num_workers;
+      auto& worker = workers_[t];
+      worker.correct = 0;
+      worker.top_k_correct = 0;
+      worker.bad_label = false;
+      std::ranges::fill(worker.confusion, 0);
+      if (not worker.stager or worker.input_size != dataset.input_size()) {
+        worker.input_size = dataset.input_size();
+        worker.stager = std::make_unique<BatchStager>(config_.batch_size,
+                                                      worker.input_size);
+      }
+
+      for (std::size_t start = first; start < last;
+           start += config_.batch_size) {
+        std::size_t size = std::min(config_.batch_size, last - start);
+        auto inputs = worker.stager->gather(
+          dataset, indices.subspan(start, size), config_.input_scale);
+        worker.module->forward_batch(inputs, size);
+        score(worker,
+              worker.module->output(),
+              worker.stager->labels(),
+              std::span{ result.predictions }.subspan(start, size));
+      }
+    });
+
+    // Exceptions cannot cross the pool, so workers only flag bad labels
+    for (const auto& worker : workers_) {
+      if (worker.bad_label) {
+        throw std::out_of_range{ "label exceeds number of outputs" };
+      }
+      result.num_categories =
+        std::max(result.num_categories, worker.num_categories);
+    }
+    result.confusion.resize(result.num_categories * result.num_categories);
+    for (const auto& worker : workers_) {
+      result.correct += worker.correct;
+      result.top_k_correct += worker.top_k_correct;
+      for (std::size_t i = 0; i < worker.confusion.size(); ++i) {
+        result.confusion[i] += worker.confusion[i];
+      }
+    }
+    return result;
+  }
+
+  // Evaluate all samples of a dataset
+  template<typename DatasetT>
+  EvaluationResult
+  evaluate(const DatasetT& dataset)
+  {
+    auto indices = std::vector<std::size_t>(dataset.size());
+    std::iota(indices.begin(), indices.end(), 0);
+    return evaluate(dataset, indices);
+  }
+
+private:
+  struct Worker
+  {
+    explicit Worker(IModule* module)
+      : module{ module }
+    {}
+
+    IModule* module;
+    std::unique_ptr<BatchStager> stager;
+    std::vector<std::size_t> confusion;
+    std::size_t input_size = 0;
+    std::size_t num_categories = 0;
+    std::size_t correct = 0;
+    std::size_t top_k_correct = 0;
+    bool bad_label = false;
+  };
+
+  // Accumulate the metrics of a batch of outputs
+  void
+  score(Worker& worker,
+        std::span<const float> outputs,
+        std::span<const int> labels,
+        std::span<int> predictions) const
+  {
+    std::size_t num_categories = outputs.size() / labels.size();
+    if (worker.num_categories != num_categories) {
+      worker.num_categories = num_categories;
+      worker.confusion.assign(num_categories * num_categories, 0);
+    }
+
+    for (std::size_t i = 0; i < labels.size(); ++i) {
+      auto output = outputs.subspan(i * num_categories, num_categories);
+      auto label = static_cast<std::size_t>(labels[i]);
+      if (label >= num_categories) {
+        worker.bad_label = true;
+        continue;
+      }
+
+      // Rank of the label's output, ties go to the lower category like
+      // std::max_element
+      std::size_t rank = 0;
+      std::size_t predicted = 0;
+      for (std::size_t j = 0; j < num_categories; ++j) {
+        if (output[j] > output[label] or
+            (output[j] == output[label] and j < label)) {
+          ++rank;
+        }
+        if (output[j] > output[predicted]) {
+          predicted = j;
+        }
+      }
+
+      predictions[i] = static_cast<int>(predicted);
+      worker.correct += predicted == label ? 1 : 0;
+      worker.top_k_correct += rank < config_.top_k ? 1 : 0;
+      ++worker.confusion[label * num_categories + predicted];
+    }
+  }
+
+  ThreadPool& pool_;
+  EvaluationConfig config_;
+  std::vector<std::shared_ptr<IModule>> replicas_;
+  std::vector<Worker> workers_;
+};
+
+}
@@ -3,8 +3,10 @@
 #include <random>
 #include <utility>
 
+#include "activation_functions.hpp"
+#include "optimizer.hpp"
 #include "random.hpp"
-#include "xor_net.hpp"
+#include "static_sequence.hpp"
 
 int
 main()
@@ -13,7 +15,11 @@ main()
   auto random = nnets::Random{};
   random.seed(rdev());
 
-  auto net = nnets::XorNet{};
+  // Topology of XorNet, resolved at compile time
+  using Layer = nnets::StaticFullyConnected<2, 2, nnets::LogisticSigmoid>;
+  using OutputLayer =
+    nnets::StaticFullyConnected<2, 1, nnets::LogisticSigmoid>;
+  auto net = nnets::StaticSequence<Layer, OutputLayer>{};
   net.init_weights(random);
 
   auto train_data = std::array{
@@ -24,7 +30,7 @@ main()
   };
 
   int epochs = 10'000;
-  float learning_rate = 0.5f;
+  auto optimizer = nnets::Optimizer{ net, { .learning_rate = 0.5f } };
 
   for (int i = 0; i < epochs; ++i) {
     float error = 0.0f;
@@ -40,7 +46,7 @@ main()
       net.backward(std::array{ error_grad });
     }
 
-    net.step_grad(learning_rate);
+    optimizer.step();
 
     std::cout << "epoch=" << i << "; error=" << error << "\n";
   }
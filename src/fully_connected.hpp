@@ -1,81 +1,184 @@
 #pragma once
 
 #include <algorithm>
+#include <atomic>
 #include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <mutex>
 #include <span>
+#include <string>
+#include <type_traits>
+#include <utility>
 #include <vector>
 
+#include "aligned.hpp"
+#include "gemm.hpp"
+#include "half.hpp"
 #include "module.hpp"
+#include "simd.hpp"
 
 namespace nnets {
 
+// How a FullyConnected layer reads its inputs
+enum class InputSparsity
+{
+  // Dense GEMMs
+  Dense,
+  // Forward passes over batches with few nonzero inputs skip the zero ones:
+  // every input is compacted to its nonzero columns, which are multiplied
+  // with a column-major copy of the float weights (see Kernels::sparse_gemv).
+  // Only the forward pass is sparse. The weight gradient stays the dense
+  // GEMM, which outruns accumulating the nonzero columns and adding them to
+  // the row-major gradient at every batch size the sparse forward pass
+  // runs. The input gradient is not computed, so the layer must come first
+  // (see IModule::has_input_grad()).
+  Sparse
+};
+
 // Fully connected layer
 // See IModule for method documentation
 // See activation_functions.hpp for possible ActivationFn types
-template<typename ActivationFn>
+// See half.hpp for possible Precision policies
+template<typename ActivationFn, typename Precision = Fp32Precision>
 class FullyConnected : public IModule
 {
 public:
+  using Storage = typename Precision::storage_type;
+
+  // InputSparsity::Sparse runs a batch sparse if at most this share of its
+  // inputs and this many inputs' worth of values are nonzero, the packed
+  // GEMM is faster beyond (see the sparse_input benchmarks)
+  static constexpr float sparse_input_density = 0.6f;
+  static constexpr std::size_t sparse_input_max_rows = 12;
+
   FullyConnected(std::size_t input_size,
                  std::size_t output_size,
-                 ActivationFn activation_fn = {})
+                 ActivationFn activation_fn = {},
+                 Precision /*precision*/ = {},
+                 InputSparsity sparsity = InputSparsity::Dense)
     : input_size_{ input_size }
     , output_size_{ output_size }
     , activation_fn_{ activation_fn }
+    , sparsity_{ sparsity }
   {
-    bias_.resize(output_size);
-    weights_.resize(input_size * output_size);
+    set_parameters(make_aligned_shared<float>(parameter_size()));
+    set_grads(make_aligned_shared<float>(parameter_size()));
+
+    if constexpr (reduced_precision) {
+      stored_weights_ = std::make_shared<Storage[]>(input_size * output_size);
+    }
+    if (sparsity == InputSparsity::Sparse) {
+      new_transposed_weights();
+      columns_.resize(sparse_input_max_rows * input_size);
+      values_.resize(sparse_input_max_rows * input_size);
+    }
+
     potential_.resize(output_size);
     output_.resize(output_size);
-    output_derivative_.resize(output_size);
+    potential_grad_.resize(output_size);
     input_grad_.resize(input_size);
-    bias_grad_.resize(output_size);
-    bias_grad_history_.resize(output_size);
-    weight_grad_.resize(input_size * output_size);
-    weight_grad_history_.resize(input_size * output_size);
   }
 
   void
   forward(std::span<const float> input) override
   {
-    input_ = input;
+    forward_batch(input, 1);
+  }
 
-    for (std::size_t j = 0; j < output_size_; ++j) {
-      potential_[j] = bias_[j];
-      for (std::size_t i = 0; i < input_size_; ++i) {
-        potential_[j] += weights_[j * input_size_ + i] * input[i];
-      }
+  void
+  backward(std::span<const float> output_grad) override
+  {
+    backward_batch(output_grad, 1);
+  }
+
+  void
+  forward_batch(std::span<const float> inputs, std::size_t batch) override
+  {
+    resize_batch(batch);
+    input_ = inputs.first(batch * input_size_);
+
+    for (std::size_t b = 0; b < batch; ++b) {
+      std::ranges::copy(bias_, potential_.begin() + b * output_size_);
     }
 
-    for (std::size_t j = 0; j < output_size_; ++j) {
-      output_[j] = activation_fn_(potential_[j]);
+    if (sparsity_ == InputSparsity::Sparse and compact_inputs()) {
+      forward_sparse(batch);
+      return;
     }
+
+    // potential = inputs * weights^T + bias
+    gemm(Transpose::No,
+         Transpose::Yes,
+         batch,
+         output_size_,
+         input_size_,
+         1.0f,
+         input_.data(),
+         input_size_,
+         stored_weights(),
+         input_size_,
+         1.0f,
+         potential_.data(),
+         output_size_);
+
+    std::size_t size = batch * output_size_;
+    activation_fn_.apply(std::span{ potential_ }.first(size),
+                         std::span{ output_ }.first(size),
+                         output_size_);
   }
 
   void
-  backward(std::span<const float> output_grad) override
+  backward_batch(std::span<const float> output_grads,
+                 std::size_t batch) override
   {
-    for (std::size_t j = 0; j < output_size_; ++j) {
-      output_derivative_[j] = activation_fn_.derivative(potential_[j]);
-    }
+    std::size_t size = batch * output_size_;
+    activation_fn_.gradient(std::span{ potential_ }.first(size),
+                            std::span{ output_ }.first(size),
+                            output_grads.first(size),
+                            std::span{ potential_grad_ }.first(size),
+                            output_size_);
 
-    for (std::size_t j = 0; j < output_size_; ++j) {
-      bias_grad_[j] += output_grad[j] * output_derivative_[j];
-
-      for (std::size_t i = 0; i < input_size_; ++i) {
-        weight_grad_[j * input_size_ + i] +=
-          output_grad[j] * output_derivative_[j] * input_[i];
+    for (std::size_t b = 0; b < batch; ++b) {
+      for (std::size_t j = 0; j < output_size_; ++j) {
+        bias_grad_[j] += potential_grad_[b * output_size_ + j];
       }
     }
 
-    for (std::size_t j = 0; j < input_size_; ++j) {
-      input_grad_[j] = 0.0f;
+    // weight_grad += output_derivative^T * inputs, dense for sparse inputs too
+    // (see InputSparsity::Sparse)
+    gemm(Transpose::Yes,
+         Transpose::No,
+         output_size_,
+         input_size_,
+         batch,
+         1.0f,
+         potential_grad_.data(),
+         output_size_,
+         input_.data(),
+         input_size_,
+         1.0f,
+         weight_grad_.data(),
+         input_size_);
 
-      for (std::size_t r = 0; r < output_size_; ++r) {
-        input_grad_[j] += output_grad[r] * output_derivative_[r] *
-                          weights_[r * input_size_ + j];
-      }
+    if (sparsity_ == InputSparsity::Sparse) {
+      return;
     }
+
+    // input_grad = output_derivative * weights
+    gemm(Transpose::No,
+         Transpose::No,
+         batch,
+         input_size_,
+         output_size_,
+         1.0f,
+         potential_grad_.data(),
+         output_size_,
+         stored_weights(),
+         input_size_,
+         0.0f,
+         input_grad_.data(),
+         input_size_);
   }
 
   void
@@ -83,66 +186,119 @@ public:
   {
     random.generate_normal(
       weights_, 0.0f, std::sqrt(2.0f / (input_size_ * output_size_)));
+    sync_weights();
   }
 
   void
   zero_grad() override
   {
-    bias_grad_.assign(output_size_, 0.0f);
-    weight_grad_.assign(input_size_ * output_size_, 0.0f);
+    std::fill_n(grads_.get(), parameter_size(), 0.0f);
+  }
+
+  [[nodiscard]] std::shared_ptr<IModule>
+  replicate() const override
+  {
+    // Copies share the parameter storage, gradients are their own
+    auto replica = std::make_shared<FullyConnected>(*this);
+    replica->set_grads(make_aligned_shared<float>(parameter_size()));
+    return replica;
   }
 
   void
-  step_grad(float learning_rate) override
+  add_grad(const IModule& replica) override
   {
-    for (std::size_t j = 0; j < output_size_; ++j) {
-      bias_[j] -= learning_rate * bias_grad_[j];
+    const auto& other = static_cast<const FullyConnected&>(replica);
 
-      for (std::size_t i = 0; i < input_size_; ++i) {
-        weights_[j * input_size_ + i] -=
-          learning_rate * weight_grad_[j * input_size_ + i];
-      }
-    }
+    kernels().axpy(1.0f, other.grads_.get(), grads_.get(), parameter_size());
+  }
+
+  [[nodiscard]] std::vector<Parameter>
+  parameters() override
+  {
+    return {
+      { bias_, bias_grad_, 1.0f, false },
+      { weights_, weight_grad_, 1.0f, true },
+    };
   }
 
   void
-  step_grad_rms_prop(float learning_rate,
-                     float history_influence,
-                     float smoothing_term) override
+  parameters_updated() override
   {
-    for (std::size_t j = 0; j < output_size_; ++j) {
-      bias_grad_history_[j] =
-        history_influence * bias_grad_history_[j] +
-        (1.0f - history_influence) * bias_grad_[j] * bias_grad_[j];
-      bias_[j] -=
-        (learning_rate / std::sqrt(bias_grad_history_[j] + smoothing_term)) *
-        bias_grad_[j];
+    sync_weights();
+  }
 
-      for (std::size_t i = 0; i < input_size_; ++i) {
-        weight_grad_history_[j * input_size_ + i] =
-          history_influence * weight_grad_history_[j * input_size_ + i] +
-          (1.0f - history_influence) * weight_grad_[j * input_size_ + i] *
-            weight_grad_[j * input_size_ + i];
-        weights_[j * input_size_ + i] -=
-          (learning_rate / std::sqrt(weight_grad_history_[j * input_size_ + i] +
-                                     smoothing_term)) *
-          weight_grad_[j * input_size_ + i];
-      }
-    }
+  [[nodiscard]] std::size_t
+  parameter_size() const override
+  {
+    return output_size_ + input_size_ * output_size_;
+  }
+
+  void
+  bind_parameters(std::shared_ptr<float[]> storage) override
+  {
+    std::copy_n(parameters_.get(), parameter_size(), storage.get());
+    set_parameters(std::move(storage));
+    renew_weight_copies();
+  }
+
+  void
+  bind_grads(std::shared_ptr<float[]> storage) override
+  {
+    std::copy_n(grads_.get(), parameter_size(), storage.get());
+    set_grads(std::move(storage));
+  }
+
+  void
+  attach_parameters(std::shared_ptr<float[]> storage) override
+  {
+    set_parameters(std::move(storage));
+    renew_weight_copies();
   }
 
   [[nodiscard]] std::span<const float>
   output() const override
   {
-    return output_;
+    return std::span{ output_ }.first(batch_size_ * output_size_);
   }
 
+  // Empty for InputSparsity::Sparse
   [[nodiscard]] std::span<const float>
   input_grad() const override
   {
-    return input_grad_;
+    if (sparsity_ == InputSparsity::Sparse) {
+      return {};
+    }
+    return std::span{ input_grad_ }.first(batch_size_ * input_size_);
+  }
+
+  [[nodiscard]] bool
+  has_input_grad() const override
+  {
+    return sparsity_ != InputSparsity::Sparse;
+  }
+
+  [[nodiscard]] std::string
+  name() const override
+  {
+    return "fully_connected_" + std::to_string(input_size_) + "x" +
+           std::to_string(output_size_);
+  }
+
+  [[nodiscard]] ModuleDescription
+  describe() const override
+  {
+    auto description = ModuleDescription{ .kind = ModuleKind::FullyConnected,
+                                          .input_size = input_size_,
+                                          .output_size = output_size_,
+                                          .activation = std::nullopt };
+    if constexpr (requires { activation_fn_.activation(); }) {
+      description.activation = activation_fn_.activation();
+    }
+    return description;
   }
 
+  // Master copy of the weights
+  // With a reduced precision policy, call sync_weights() after modifying them
   [[nodiscard]] std::span<float>
   weights()
   {
@@ -155,20 +311,221 @@ public:
     return bias_;
   }
 
+  [[nodiscard]] const ActivationFn&
+  activation_fn() const
+  {
+    return activation_fn_;
+  }
+
+  // Round the master weights to the storage precision used by the GEMMs
+  // (for InputSparsity::Sparse, the transposed copy is rebuilt on the next
+  // sparse forward pass)
+  void
+  sync_weights()
+  {
+    if constexpr (std::is_same_v<Storage, BFloat16>) {
+      kernels().narrow_bf16(
+        weights_.data(), stored_weights_.get(), weights_.size());
+    } else if constexpr (std::is_same_v<Storage, Float16>) {
+      kernels().narrow_fp16(
+        weights_.data(), stored_weights_.get(), weights_.size());
+    }
+
+    if (transposed_) {
+      transposed_->stale.store(true, std::memory_order_release);
+    }
+  }
+
 private:
+  static constexpr bool reduced_precision = not std::is_same_v<Storage, float>;
+
+  // Weights as read by the forward and backward GEMMs
+  const Storage*
+  stored_weights() const
+  {
+    if constexpr (reduced_precision) {
+      return stored_weights_.get();
+    } else {
+      return weights_.data();
+    }
+  }
+
+  // Compact the inputs into nonzero columns and values per sample, returns
+  // false (and leaves them) if the batch is too dense to run sparse
+  bool
+  compact_inputs()
+  {
+    std::size_t batch = batch_size_;
+    row_starts_[0] = 0;
+
+    std::size_t max_nonzeros = std::min(
+      static_cast<std::size_t>(sparse_input_density *
+                               static_cast<float>(input_.size())),
+      columns_.size());
+    std::size_t nonzeros = 0;
+    for (std::size_t b = 0; b < batch; ++b) {
+      const float* input = input_.data() + b * input_size_;
+      for (std::size_t k = 0; k < input_size_; ++k) {
+        if (input[k] != 0.0f) {
+          if (nonzeros == max_nonzeros) {
+            return false;
+          }
+          columns_[nonzeros] = static_cast<std::uint32_t>(k);
+          values_[nonzeros] = input[k];
+          ++nonzeros;
+        }
+      }
+      row_starts_[b + 1] = nonzeros;
+    }
+    return true;
+  }
+
+  // Column-major weights, transposed again if they changed since the last
+  // call
+  // Replicas share the copy and may call this concurrently, the first one
+  // after a change transposes.
+  const float*
+  transposed_weights()
+  {
+    auto& transposed = *transposed_;
+    if (transposed.stale.load(std::memory_order_acquire)) {
+      auto lock = std::lock_guard{ transposed.mutex };
+      if (transposed.stale.load(std::memory_order_relaxed)) {
+        // Square tiles keep the reads and writes within a few cache lines
+        constexpr std::size_t tile = 32;
+        float* values = transposed.values.get();
+        for (std::size_t j0 = 0; j0 < output_size_; j0 += tile) {
+          std::size_t j1 = std::min(j0 + tile, output_size_);
+          for (std::size_t k0 = 0; k0 < input_size_; k0 += tile) {
+            std::size_t k1 = std::min(k0 + tile, input_size_);
+            for (std::size_t j = j0; j < j1; ++j) {
+              for (std::size_t k = k0; k < k1; ++k) {
+                values[k * output_size_ + j] = weights_[j * input_size_ + k];
+              }
+            }
+          }
+        }
+        transposed.stale.store(false, std::memory_order_release);
+      }
+    }
+    return transposed.values.get();
+  }
+
+  // potential += nonzero inputs * transposed weights
+  void
+  forward_sparse(std::size_t batch)
+  {
+    const auto& kernel = kernels();
+    const float* transposed = transposed_weights();
+    for (std::size_t b = 0; b < batch; ++b) {
+      std::size_t start = row_starts_[b];
+      kernel.sparse_gemv(row_starts_[b + 1] - start,
+                         columns_.data() + start,
+                         values_.data() + start,
+                         transposed,
+                         output_size_,
+                         potential_.data() + b * output_size_,
+                         output_size_);
+    }
+
+    std::size_t size = batch * output_size_;
+    activation_fn_.apply(std::span{ potential_ }.first(size),
+                         std::span{ output_ }.first(size),
+                         output_size_);
+  }
+
+  // Allocate a column-major weight copy of its own (see
+  // transposed_weights()), transposed on first use
+  void
+  new_transposed_weights()
+  {
+    transposed_ = std::make_shared<TransposedWeights>();
+    transposed_->values = make_aligned_shared<float>(weights_.size());
+  }
+
+  // Copies of the weights in their own storage after switching to new
+  // parameter storage, replicas of the old storage keep sharing theirs
+  void
+  renew_weight_copies()
+  {
+    if constexpr (reduced_precision) {
+      stored_weights_ = std::make_shared<Storage[]>(weights_.size());
+    }
+    if (transposed_) {
+      new_transposed_weights();
+    }
+    sync_weights();
+  }
+
+  // Bias followed by weights
+  void
+  set_parameters(std::shared_ptr<float[]> storage)
+  {
+    parameters_ = std::move(storage);
+    bias_ = { parameters_.get(), output_size_ };
+    weights_ = { parameters_.get() + output_size_, input_size_ * output_size_ };
+  }
+
+  // Bias gradient followed by weight gradient
+  void
+  set_grads(std::shared_ptr<float[]> storage)
+  {
+    grads_ = std::move(storage);
+    bias_grad_ = { grads_.get(), output_size_ };
+    weight_grad_ = { grads_.get() + output_size_, input_size_ * output_size_ };
+  }
+
+  // Grow per-sample buffers to hold a mini-batch (never shrinks)
+  void
+  resize_batch(std::size_t batch)
+  {
+    batch_size_ = batch;
+
+    if (potential_.size() < batch * output_size_) {
+      potential_.resize(batch * output_size_);
+      output_.resize(batch * output_size_);
+      potential_grad_.resize(batch * output_size_);
+      input_grad_.resize(batch * input_size_);
+    }
+    if (sparsity_ == InputSparsity::Sparse and
+        row_starts_.size() < batch + 1) {
+      row_starts_.resize(batch + 1);
+    }
+  }
+
   std::size_t input_size_;
   std::size_t output_size_;
+  std::size_t batch_size_ = 1;
   ActivationFn activation_fn_;
-  std::vector<float> bias_;
-  std::vector<float> weights_;
+  // Bias followed by weights, shared with replicas
+  std::shared_ptr<float[]> parameters_;
+  std::span<float> bias_;
+  std::span<float> weights_;
+  // Bias gradient followed by weight gradient
+  std::shared_ptr<float[]> grads_;
+  std::span<float> bias_grad_;
+  std::span<float> weight_grad_;
+  // Weights rounded to Storage, shared with replicas (reduced precision only)
+  std::shared_ptr<Storage[]> stored_weights_;
+  InputSparsity sparsity_;
+  // Column-major float weights, shared with replicas (sparse inputs only)
+  struct TransposedWeights
+  {
+    std::shared_ptr<float[]> values;
+    // Set when the weights change, the copy is rebuilt on its next use
+    std::atomic<bool> stale = true;
+    std::mutex mutex;
+  };
+  std::shared_ptr<TransposedWeights> transposed_;
+  // Nonzero inputs of the batch, columns_ and values_ from row_starts_[b]
+  // on for sample b
+  std::vector<std::size_t> row_starts_;
+  std::vector<std::uint32_t> columns_;
+  std::vector<float> values_;
   std::vector<float> potential_;
   std::vector<float> output_;
-  std::vector<float> output_derivative_;
+  std::vector<float> potential_grad_;
   std::vector<float> input_grad_;
-  std::vector<float> bias_grad_;
-  std::vector<float> bias_grad_history_;
-  std::vector<float> weight_grad_;
-  std::vector<float> weight_grad_history_;
   std::span<const float> input_;
 };
 
@@ -0,0 +1,255 @@
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <type_traits>
+#include <vector>
+
+#include "half.hpp"
+#include "simd.hpp"
+
+namespace nnets {
+
+// Operand layout for gemm()
+enum class Transpose
+{
+  No,
+  Yes
+};
+
+namespace detail {
+
+// Cache blocking: an MC x KC block of A is packed to stay in L2, a KC x NR
+// sliver of packed B is streamed through L1 for every micro-tile
+// (MC and NC are multiples of every register tile in simd.hpp)
+inline constexpr std::size_t gemm_mc = 96;
+inline constexpr std::size_t gemm_kc = 256;
+inline constexpr std::size_t gemm_nc = 2048;
+
+// Element (i, j) of op(X)
+inline float
+gemm_at(Transpose t, const float* x, std::size_t ld, std::size_t i,
+        std::size_t j)
+{
+  return t == Transpose::No ? x[i * ld + j] : x[j * ld + i];
+}
+
+// dst[i] = src[i] widened to float
+inline void
+widen(const BFloat16* src, float* dst, std::size_t n)
+{
+  kernels().widen_bf16(src, dst, n);
+}
+
+inline void
+widen(const Float16* src, float* dst, std::size_t n)
+{
+  kernels().widen_fp16(src, dst, n);
+}
+
+// Pack an mc x kc block of op(A) into mr-row micro-panels, zero padded
+inline void
+gemm_pack_a(Transpose ta, const float* a, std::size_t lda, std::size_t mc,
+            std::size_t kc, std::size_t mr, float* packed)
+{
+  for (std::size_t ir = 0; ir < mc; ir += mr) {
+    std::size_t rows = std::min(mr, mc - ir);
+    for (std::size_t p = 0; p < kc; ++p) {
+      for (std::size_t r = 0; r < mr; ++r) {
+        packed[p * mr + r] = r < rows ? gemm_at(ta, a, lda, ir + r, p) : 0.0f;
+      }
+    }
+    packed += kc * mr;
+  }
+}
+
+// Pack a kc x nc block of op(B) into nr-column micro-panels, zero padded
+inline void
+gemm_pack_b(Transpose tb, const float* b, std::size_t ldb, std::size_t kc,
+            std::size_t nc, std::size_t nr, float* packed)
+{
+  for (std::size_t jr = 0; jr < nc; jr += nr) {
+    std::size_t cols = std::min(nr, nc - jr);
+    for (std::size_t p = 0; p < kc; ++p) {
+      for (std::size_t c = 0; c < nr; ++c) {
+        packed[p * nr + c] = c < cols ? gemm_at(tb, b, ldb, p, jr + c) : 0.0f;
+      }
+    }
+    packed += kc * nr;
+  }
+}
+
+// Row vector times matrix for single rows, where packing does not pay off:
+// c[1 x n] += alpha * op(A)[1 x k] * op(B)[k x n]
+inline void
+gemv(Transpose ta, Transpose tb, std::size_t n, std::size_t k, float alpha,
+     const float* a, std::size_t lda, const float* b, std::size_t ldb,
+     float* c)
+{
+  std::size_t a_stride = ta == Transpose::No ? 1 : lda;
+
+  if (tb == Transpose::Yes and a_stride == 1) {
+    for (std::size_t j = 0; j < n; ++j) {
+      c[j] += alpha * kernels().dot(a, b + j * ldb, k);
+    }
+    return;
+  }
+
+  if (tb == Transpose::Yes) {
+    for (std::size_t j = 0; j < n; ++j) {
+      float sum = 0.0f;
+      for (std::size_t p = 0; p < k; ++p) {
+        sum += a[p * a_stride] * b[j * ldb + p];
+      }
+      c[j] += alpha * sum;
+    }
+    return;
+  }
+
+  for (std::size_t p = 0; p < k; ++p) {
+    kernels().axpy(alpha * a[p * a_stride], b + p * ldb, c, n);
+  }
+}
+
+// gemv() with a reduced precision B, widened one row at a time
+template<typename TB>
+inline void
+gemv(Transpose ta, Transpose tb, std::size_t n, std::size_t k, float alpha,
+     const float* a, std::size_t lda, const TB* b, std::size_t ldb, float* c)
+{
+  std::size_t a_stride = ta == Transpose::No ? 1 : lda;
+
+  thread_local std::vector<float> row;
+
+  if (tb == Transpose::Yes) {
+    row.resize(k);
+    for (std::size_t j = 0; j < n; ++j) {
+      widen(b + j * ldb, row.data(), k);
+      gemv(ta, tb, 1, k, alpha, a, lda, row.data(), k, c + j);
+    }
+    return;
+  }
+
+  row.resize(n);
+  for (std::size_t p = 0; p < k; ++p) {
+    widen(b + p * ldb, row.data(), n);
+    kernels().axpy(alpha * a[p * a_stride], row.data(), c, n);
+  }
+}
+
+// Epilogue of gemm() that leaves C as computed
+struct NoEpilogue
+{
+  void
+  operator()(std::size_t, std::size_t, float*, std::size_t) const
+  {}
+};
+
+}
+
+// Single precision general matrix multiplication on row-major matrices:
+// C[m x n] = alpha * op(A)[m x k] * op(B)[k x n] + beta * C
+// B may be stored as BFloat16 or Float16 (see half.hpp), the products are
+// still accumulated in float
+// epilogue(i, j, c, count) is called once for every finished element of C,
+// as row segments C[i][j..j+count) at c, while the micro-tile is still in
+// cache (e.g. to add a bias and apply an activation in the same pass)
+template<typename TB, typename Epilogue = detail::NoEpilogue>
+inline void
+gemm(Transpose ta, Transpose tb, std::size_t m, std::size_t n, std::size_t k,
+     float alpha, const float* a, std::size_t lda, const TB* b,
+     std::size_t ldb, float beta, float* c, std::size_t ldc,
+     Epilogue&& epilogue = {})
+{
+  using namespace detail;
+
+  if (beta != 1.0f) {
+    for (std::size_t i = 0; i < m; ++i) {
+      for (std::size_t j = 0; j < n; ++j) {
+        c[i * ldc + j] = beta == 0.0f ? 0.0f : beta * c[i * ldc + j];
+      }
+    }
+  }
+
+  if (m == 0 or n == 0) {
+    return;
+  }
+
+  const auto& kernel = kernels();
+  std::size_t mr = kernel.gemm_mr;
+  std::size_t nr = kernel.gemm_nr;
+
+  // Fewer rows than a micro-tile (e.g. small inference batches) would pay
+  // for packing all of B and for the zero padded rows, so run them one by
+  // one
+  if (m < mr or k == 0 or alpha == 0.0f) {
+    std::size_t a_row_stride = ta == Transpose::No ? lda : 1;
+    for (std::size_t i = 0; i < m; ++i) {
+      if (k != 0 and alpha != 0.0f) {
+        gemv(ta, tb, n, k, alpha, a + i * a_row_stride, lda, b, ldb,
+             c + i * ldc);
+      }
+      epilogue(i, 0, c + i * ldc, n);
+    }
+    return;
+  }
+
+  // Packing buffers are reused between calls
+  thread_local std::vector<float> packed_a;
+  thread_local std::vector<float> packed_b;
+  thread_local std::vector<float> widened_b;
+  packed_a.resize((gemm_mc + mr) * gemm_kc);
+  packed_b.resize((gemm_nc + nr) * gemm_kc);
+
+  for (std::size_t jc = 0; jc < n; jc += gemm_nc) {
+    std::size_t nc = std::min(gemm_nc, n - jc);
+
+    for (std::size_t pc = 0; pc < k; pc += gemm_kc) {
+      std::size_t kc = std::min(gemm_kc, k - pc);
+      const TB* b_block = tb == Transpose::No ? b + pc * ldb + jc
+                                              : b + jc * ldb + pc;
+      if constexpr (std::is_same_v<TB, float>) {
+        gemm_pack_b(tb, b_block, ldb, kc, nc, nr, packed_b.data());
+      } else {
+        // Widen the block row by row with the vector kernels, then pack
+        std::size_t rows = tb == Transpose::No ? kc : nc;
+        std::size_t cols = tb == Transpose::No ? nc : kc;
+        widened_b.resize(rows * cols);
+        for (std::size_t r = 0; r < rows; ++r) {
+          widen(b_block + r * ldb, widened_b.data() + r * cols, cols);
+        }
+        gemm_pack_b(tb, widened_b.data(), cols, kc, nc, nr, packed_b.data());
+      }
+
+      for (std::size_t ic = 0; ic < m; ic += gemm_mc) {
+        std::size_t mc = std::min(gemm_mc, m - ic);
+        const float* a_block = ta == Transpose::No ? a + ic * lda + pc
+                                                   : a + pc * lda + ic;
+        gemm_pack_a(ta, a_block, lda, mc, kc, mr, packed_a.data());
+
+        for (std::size_t jr = 0; jr < nc; jr += nr) {
+          for (std::size_t ir = 0; ir < mc; ir += mr) {
+            std::size_t rows = std::min(mr, mc - ir);
+            std::size_t cols = std::min(nr, nc - jr);
+            float* tile = c + (ic + ir) * ldc + jc + jr;
+            kernel.gemm_micro_kernel(kc,
+                                     alpha,
+                                     packed_a.data() + ir * kc,
+                                     packed_b.data() + jr * kc,
+                                     tile,
+                                     ldc,
+                                     rows,
+                                     cols);
+            if (pc + kc == k) {
+              for (std::size_t r = 0; r < rows; ++r) {
+                epilogue(ic + ir + r, jc + jr, tile + r * ldc, cols);
+              }
+            }
+          }
+        }
+      }
+    }
+  }
+}
+
+}
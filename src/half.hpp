@@ -0,0 +1,132 @@
+#pragma once
+
+#include <bit>
+#include <cstdint>
+
+namespace nnets {
+
+// bfloat16: upper half of an IEEE float (8 exponent bits, 7 mantissa bits)
+struct BFloat16
+{
+  std::uint16_t bits = 0;
+};
+
+// IEEE 754 half precision (5 exponent bits, 10 mantissa bits)
+struct Float16
+{
+  std::uint16_t bits = 0;
+};
+
+inline float
+to_float(float value)
+{
+  return value;
+}
+
+inline float
+to_float(BFloat16 value)
+{
+  return std::bit_cast<float>(static_cast<std::uint32_t>(value.bits) << 16);
+}
+
+inline float
+to_float(Float16 value)
+{
+  std::uint32_t sign = static_cast<std::uint32_t>(value.bits & 0x8000) << 16;
+  std::uint32_t exponent = (value.bits >> 10) & 0x1f;
+  std::uint32_t mantissa = value.bits & 0x3ff;
+
+  if (exponent == 0x1f) {
+    // Infinity or NaN
+    return std::bit_cast<float>(sign | 0x7f800000u | (mantissa << 13));
+  }
+  if (exponent == 0) {
+    // Zero or subnormal: mantissa * 2^-24
+    float magnitude = static_cast<float>(mantissa) * 0x1p-24f;
+    return sign ? -magnitude : magnitude;
+  }
+  return std::bit_cast<float>(sign | ((exponent + 112) << 23) |
+                              (mantissa << 13));
+}
+
+// Conversion from float with round to nearest even
+template<typename T>
+T
+from_float(float value);
+
+template<>
+inline float
+from_float<float>(float value)
+{
+  return value;
+}
+
+template<>
+inline BFloat16
+from_float<BFloat16>(float value)
+{
+  auto bits = std::bit_cast<std::uint32_t>(value);
+  if ((bits & 0x7fffffffu) > 0x7f800000u) {
+    // Keep NaN quiet instead of rounding it into infinity
+    return { static_cast<std::uint16_t>((bits >> 16) | 0x40) };
+  }
+  bits += 0x7fff + ((bits >> 16) & 1);
+  return { static_cast<std::uint16_t>(bits >> 16) };
+}
+
+template<>
+inline Float16
+from_float<Float16>(float value)
+{
+  auto bits = std::bit_cast<std::uint32_t>(value);
+  auto sign = static_cast<std::uint16_t>((bits >> 16) & 0x8000);
+  std::uint32_t magnitude = bits & 0x7fffffffu;
+
+  if (magnitude > 0x7f800000u) {
+    return { static_cast<std::uint16_t>(sign | 0x7e00) };
+  }
+  if (magnitude >= 0x477ff000u) {
+    // Rounds to a value beyond the largest half (65504)
+    return { static_cast<std::uint16_t>(sign | 0x7c00) };
+  }
+  if (magnitude < 0x38800000u) {
+    // Subnormal half: round magnitude / 2^-24 to an integer
+    float scaled = std::bit_cast<float>(magnitude) * 0x1p24f;
+    auto rounded = static_cast<std::uint32_t>(scaled);
+    float remainder = scaled - static_cast<float>(rounded);
+    if (remainder > 0.5f or (remainder == 0.5f and (rounded & 1))) {
+      ++rounded;
+    }
+    return { static_cast<std::uint16_t>(sign | rounded) };
+  }
+
+  // Rebias the exponent and round the 13 dropped mantissa bits
+  std::uint32_t half = (magnitude - 0x38000000u) >> 13;
+  std::uint32_t dropped = magnitude & 0x1fff;
+  if (dropped > 0x1000 or (dropped == 0x1000 and (half & 1))) {
+    ++half;
+  }
+  return { static_cast<std::uint16_t>(sign | half) };
+}
+
+// Precision policies for FullyConnected
+// storage_type is used for the weights streamed through the forward and
+// backward GEMMs. Gradients, accumulation and the optimizer master copy of
+// the weights always stay in float, so no loss scaling is needed.
+
+struct Fp32Precision
+{
+  using storage_type = float;
+};
+
+struct Bf16Precision
+{
+  using storage_type = BFloat16;
+};
+
+struct Fp16Precision
+{
+  using storage_type = Float16;
+};
+
+}
@@ -0,0 +1,436 @@
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <cstdint>
+#include <cstdlib>
+#include <exception>
+#include <functional>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <numeric>
+#include <random>
+#include <span>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include "binary_dataset.hpp"
+#include "data_loader.hpp"
+#include "data_parallel.hpp"
+#include "dataset.hpp"
+#include "evaluation.hpp"
+#include "loss.hpp"
+#include "optimizer.hpp"
+#include "random.hpp"
+#include "sequence.hpp"
+#include "thread_pool.hpp"
+#include "training_config.hpp"
+
+namespace {
+
+using Dataset = nnets::MappedDataset;
+using Loader = nnets::DataLoader<Dataset>;
+
+struct SearchOptions
+{
+  std::size_t trials = 16;
+  // Trainings running at once, each on its own threads
+  std::size_t jobs = 1;
+  std::size_t threads = 1;
+  // Successive halving instead of random search with median stopping
+  bool halving = false;
+  // Share of the trials promoted to the next rung is 1 / eta
+  std::size_t eta = 3;
+  // Epochs before the median stopping rule applies
+  std::size_t grace_epochs = 3;
+  std::uint64_t seed = 42;
+};
+
+// Training state of a trial between two rungs, the loader restarts from a
+// copy of its RNG so that resumed epochs see the same data order
+// random continues from the validation split, weights and data order are
+// drawn from it in the order of main.cpp.
+struct TrialState
+{
+  explicit TrialState(const nnets::TrainingConfig& config,
+                      std::size_t input_size,
+                      std::size_t num_categories,
+                      std::size_t num_threads,
+                      const nnets::Random& split_random)
+    : net{ nnets::make_network(config,
+                               input_size,
+                               num_categories,
+                               num_threads) }
+    , optimizer{ net, nnets::optimizer_config(config) }
+    , random{ split_random }
+  {
+    net.init_weights(random);
+    loader_rng = random.rng();
+  }
+
+  nnets::Sequence net;
+  nnets::Optimizer optimizer;
+  nnets::Random random;
+  Loader::Rng loader_rng;
+};
+
+struct Trial
+{
+  std::size_t id = 0;
+  nnets::TrainingConfig config;
+  std::unique_ptr<TrialState> state;
+  // Validation accuracy after every trained epoch
+  std::vector<float> accuracies;
+  bool stopped = false;
+
+  [[nodiscard]] float
+  accuracy() const
+  {
+    return accuracies.empty() ? 0.0f : accuracies.back();
+  }
+};
+
+// Random configuration around base, learning rates log-uniform
+// The seed is kept, it also draws the validation split shared by all trials.
+nnets::TrainingConfig
+sample_config(const nnets::TrainingConfig& base, std::mt19937_64& rng)
+{
+  auto uniform = [&](float min, float max) {
+    return std::uniform_real_distribution<float>{ min, max }(rng);
+  };
+  auto pick = [&](std::span<const std::size_t> values) {
+    return values[std::uniform_int_distribution<std::size_t>{
+      0, values.size() - 1 }(rng)];
+  };
+  constexpr std::size_t batch_sizes[] = { 50, 100, 200, 400 };
+  constexpr std::size_t widths[] = { 100, 200, 300, 500 };
+  constexpr std::size_t depths[] = { 1, 2, 3 };
+
+  auto config = base;
+  config.initial_learning_rate = std::pow(10.0f, uniform(-5.0f, -3.0f));
+  config.gamma = uniform(0.85f, 1.0f);
+  config.rms_prop_history_influence = uniform(0.8f, 0.99f);
+  config.batch_size = pick(batch_sizes);
+  config.dropout_rate = uniform(0.0f, 0.3f);
+  config.label_smoothing = uniform(0.0f, 0.2f);
+  config.hidden_sizes.resize(pick(depths));
+  for (auto& width : config.hidden_sizes) {
+    width = pick(widths);
+  }
+  // Funnel shaped like the default network
+  std::ranges::sort(config.hidden_sizes, std::greater{});
+  return config;
+}
+
+// Run fn(item, pool) for every item on jobs threads, each pinned to its own
+// threads CPUs with a pool of that size
+// The pool threads inherit the pinning of the job thread creating them, as
+// does the prefetch thread of a DataLoader.
+void
+run_jobs(std::size_t num_items,
+         const SearchOptions& options,
+         const std::function<void(std::size_t, nnets::ThreadPool&)>& fn)
+{
+  std::size_t num_cpus =
+    std::max<std::size_t>(std::thread::hardware_concurrency(), 1);
+  std::atomic<std::size_t> next = 0;
+  auto jobs = std::vector<std::thread>{};
+  auto errors = std::vector<std::exception_ptr>(options.jobs);
+  for (std::size_t job = 0; job < options.jobs; ++job) {
+    jobs.emplace_back([&, job] {
+      try {
+        // More job threads than CPUs share them round robin
+        auto cpus = std::vector<std::size_t>(options.threads);
+        for (std::size_t t = 0; t < cpus.size(); ++t) {
+          cpus[t] = (job * options.threads + t) % num_cpus;
+        }
+        nnets::pin_current_thread(cpus);
+        auto pool = nnets::ThreadPool{ options.threads };
+        for (std::size_t item = next++; item < num_items; item = next++) {
+          fn(item, pool);
+        }
+      } catch (...) {
+        errors[job] = std::current_exception();
+      }
+    });
+  }
+  for (auto& job : jobs) {
+    job.join();
+  }
+  for (const auto& error : errors) {
+    if (error) {
+      std::rethrow_exception(error);
+    }
+  }
+}
+
+// Shared read-only data of all trials
+struct SearchData
+{
+  const Dataset& dataset;
+  std::size_t num_categories;
+  std::span<const std::size_t> train_indices;
+  std::span<const std::size_t> validation_indices;
+  // State of the RNG seeded with the base seed after drawing the split
+  nnets::Random split_random;
+};
+
+// Train a trial up to num_epochs, evaluating it after every epoch
+// keep_going(trial) decides after an epoch whether the trial continues.
+void
+train_trial(Trial& trial,
+            std::size_t num_epochs,
+            const SearchData& data,
+            nnets::ThreadPool& pool,
+            const std::function<bool(const Trial&)>& keep_going)
+{
+  const auto& config = trial.config;
+  if (not trial.state) {
+    trial.state = std::make_unique<TrialState>(config,
+                                               data.dataset.input_size(),
+                                               data.num_categories,
+                                               pool.size(),
+                                               data.split_random);
+  }
+  auto& state = *trial.state;
+
+  auto trainer = nnets::DataParallel{ state.net, pool };
+  auto evaluator = nnets::Evaluator{ state.net, pool };
+  auto loss = nnets::SoftmaxCrossEntropy{ config.label_smoothing };
+  auto loader = Loader{ data.dataset,
+                        { data.train_indices.begin(),
+                          data.train_indices.end() },
+                        { .batch_size = config.batch_size,
+                          .num_epochs = num_epochs,
+                          .first_epoch = trial.accuracies.size() },
+                        state.loader_rng };
+
+  while (trial.accuracies.size() < num_epochs) {
+    for (std::size_t batch = 0; batch < loader.batches_per_epoch(); ++batch) {
+      const auto& batch_data = loader.next();
+      trainer.zero_grad();
+      trainer.train_batch(batch_data.inputs,
+                          batch_data.size,
+                          state.optimizer.num_steps(),
+                          [&](std::size_t first,
+                              std::span<const float> output,
+                              std::span<float> error_grad) {
+                            auto labels = batch_data.labels.subspan(
+                              first, output.size() / data.num_categories);
+                            return loss.loss_grad(output, labels, error_grad);
+                          });
+      state.optimizer.step();
+    }
+    state.optimizer.set_learning_rate(state.optimizer.learning_rate() *
+                                      config.gamma);
+
+    auto validation =
+      evaluator.evaluate(data.dataset, data.validation_indices);
+    trial.accuracies.push_back(validation.accuracy());
+    if (not keep_going(trial)) {
+      trial.stopped = true;
+      break;
+    }
+  }
+}
+
+// Median of values, which must not be empty
+float
+median(std::vector<float> values)
+{
+  auto middle = values.begin() + values.size() / 2;
+  std::ranges::nth_element(values, middle);
+  return *middle;
+}
+
+}
+
+// Hyperparameter search over TrainingConfig, running several trainings at
+// once on disjoint CPUs
+// Trials share the mapped train dataset, the seed of the base config and the
+// validation split drawn from it, and draw their weights and data order as
+// main.cpp does: nnets on threads threads with the best config reproduces
+// its score.
+// Random search (default) samples trials trials and stops one after an epoch
+// past grace_epochs if its validation accuracy is below the median of the
+// other trials at that epoch. Successive halving trains all trials a few
+// epochs, keeps the best 1 / eta and repeats with eta times the epochs
+// until the survivors train the configured epochs.
+// Usage: nnets_search [--trials n] [--jobs n] [--threads n]
+//                     [--mode random|halving] [--eta n] [--grace-epochs n]
+//                     [--seed n] [key=value ...]
+// key=value arguments set the base config (see training_config.hpp), whose
+// epochs bound every trial.
+int
+main(int argc, char** argv)
+{
+  auto options = SearchOptions{};
+  auto base = nnets::TrainingConfig{};
+  try {
+    for (int i = 1; i < argc; ++i) {
+      auto arg = std::string_view{ argv[i] };
+      if (arg.find('=') != arg.npos) {
+        base.set(arg);
+        continue;
+      }
+      if (i + 1 == argc) {
+        throw std::invalid_argument{ "missing value of " + std::string{ arg } };
+      }
+      auto value = std::string_view{ argv[++i] };
+      auto number = [&] {
+        auto parsed = std::strtoull(value.data(), nullptr, 10);
+        if (parsed == 0 and arg != "--seed") {
+          throw std::invalid_argument{ "invalid value of " +
+                                       std::string{ arg } };
+        }
+        return static_cast<std::size_t>(parsed);
+      };
+      if (arg == "--trials") {
+        options.trials = number();
+      } else if (arg == "--jobs") {
+        options.jobs = number();
+      } else if (arg == "--threads") {
+        options.threads = number();
+      } else if (arg == "--mode" and
+                 (value == "random" or value == "halving")) {
+        options.halving = value == "halving";
+      } else if (arg == "--eta") {
+        options.eta = number();
+        if (options.eta < 2) {
+          throw std::invalid_argument{ "--eta must be at least 2" };
+        }
+      } else if (arg == "--grace-epochs") {
+        options.grace_epochs = number();
+      } else if (arg == "--seed") {
+        options.seed = number();
+      } else {
+        throw std::invalid_argument{ "invalid option " + std::string{ arg } };
+      }
+    }
+  } catch (const std::invalid_argument& error) {
+    std::cerr << error.what() << "\n";
+    return 1;
+  }
+
+  std::cout << "trials=" << options.trials << " jobs=" << options.jobs
+            << " threads=" << options.threads
+            << " mode=" << (options.halving ? "halving" : "random") << "\n";
+  std::cout << "base config " << base.to_string() << "\n";
+
+  // Mapped once, all jobs read the same pages
+  const auto dataset = [&] {
+    auto pool = nnets::ThreadPool{ options.jobs * options.threads };
+    return nnets::load_binary_dataset("data/fashion_mnist_train.bin",
+                                      "data/fashion_mnist_train_vectors.csv",
+                                      "data/fashion_mnist_train_labels.csv",
+                                      &pool);
+  }();
+
+  // One split for all trials, so that their accuracies compare
+  auto split_random = nnets::Random{};
+  split_random.seed(base.seed);
+  auto [train_indices, validation_indices] =
+    nnets::split_indices(dataset.size(),
+                         base.validation_dataset_fraction,
+                         split_random.rng());
+  auto data = SearchData{ dataset,
+                          static_cast<std::size_t>(
+                            nnets::num_categories(dataset)),
+                          train_indices,
+                          validation_indices,
+                          split_random };
+
+  auto rng = std::mt19937_64{ options.seed };
+  auto trials = std::vector<Trial>(options.trials);
+  for (std::size_t t = 0; t < trials.size(); ++t) {
+    trials[t].id = t;
+    trials[t].config = sample_config(base, rng);
+  }
+
+  std::mutex mutex;
+  auto report = [&](const Trial& trial, const char* status) {
+    // Depends on the trial's batch size (see first_layer_sparsity())
+    bool sparse_input =
+      nnets::first_layer_sparsity(trial.config, options.threads) ==
+      nnets::InputSparsity::Sparse;
+    auto lock = std::lock_guard{ mutex };
+    std::cout << "trial=" << trial.id << " epochs=" << trial.accuracies.size()
+              << " success_rate=" << trial.accuracy() << " " << status
+              << " first_layer_input=" << (sparse_input ? "sparse" : "dense")
+              << " config " << trial.config.to_string() << std::endl;
+  };
+
+  if (options.halving) {
+    // Rung k of K trains to epochs * eta^(k - K), the last to all epochs
+    std::size_t num_rungs = 0;
+    for (std::size_t n = trials.size(); n >= options.eta; n /= options.eta) {
+      ++num_rungs;
+    }
+    auto alive = std::vector<Trial*>{};
+    for (auto& trial : trials) {
+      alive.push_back(&trial);
+    }
+    for (std::size_t rung = 0; rung <= num_rungs; ++rung) {
+      double scale = std::pow(static_cast<double>(options.eta),
+                              static_cast<double>(rung) -
+                                static_cast<double>(num_rungs));
+      auto num_epochs = std::max<std::size_t>(
+        static_cast<std::size_t>(
+          std::lround(static_cast<double>(base.epochs) * scale)),
+        1);
+      run_jobs(alive.size(), options, [&](std::size_t i, auto& pool) {
+        train_trial(*alive[i], num_epochs, data, pool, [](const Trial&) {
+          return true;
+        });
+        report(*alive[i], rung == num_rungs ? "done" : "rung");
+      });
+      if (rung == num_rungs) {
+        break;
+      }
+
+      std::ranges::stable_sort(alive, [](const Trial* a, const Trial* b) {
+        return a->accuracy() > b->accuracy();
+      });
+      auto keep = (alive.size() + options.eta - 1) / options.eta;
+      for (std::size_t i = keep; i < alive.size(); ++i) {
+        alive[i]->stopped = true;
+        alive[i]->state.reset();
+      }
+      alive.resize(keep);
+    }
+  } else {
+    // Accuracies of all trials after every epoch, for the median rule
+    auto history = std::vector<std::vector<float>>(base.epochs);
+    run_jobs(trials.size(), options, [&](std::size_t t, auto& pool) {
+      auto& trial = trials[t];
+      train_trial(trial, base.epochs, data, pool, [&](const Trial& trial) {
+        auto lock = std::lock_guard{ mutex };
+        std::size_t epoch = trial.accuracies.size() - 1;
+        auto& others = history[epoch];
+        bool keep_going = epoch + 1 < options.grace_epochs or
+                          others.empty() or
+                          trial.accuracy() >= median(others);
+        others.push_back(trial.accuracy());
+        return keep_going;
+      });
+      report(trial, trial.stopped ? "stopped" : "done");
+      trial.state.reset();
+    });
+  }
+
+  const auto& best = *std::ranges::max_element(
+    trials, [](const Trial& a, const Trial& b) {
+      // Trials stopped early lose against completed ones
+      return std::pair{ not a.stopped, a.accuracy() } <
+             std::pair{ not b.stopped, b.accuracy() };
+    });
+  std::cout << "best trial=" << best.id << " success_rate=" << best.accuracy()
+            << "\n";
+  std::cout << "best config " << best.config.to_string() << std::endl;
+
+  return 0;
+}
@@ -0,0 +1,210 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <exception>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <span>
+#include <stdexcept>
+#include <thread>
+#include <vector>
+
+#include "aligned.hpp"
+#include "module.hpp"
+#include "profiler.hpp"
+
+namespace nnets {
+
+// Options of an InferenceServer
+struct InferenceConfig
+{
+  // Largest micro-batch run through the network at once
+  std::size_t max_batch = 32;
+  // How long the oldest queued request may wait for others to join its batch
+  std::chrono::microseconds max_delay{ 200 };
+  // Threads running batches
+  std::size_t num_workers = 1;
+};
+
+// Counters of an InferenceServer
+struct InferenceStats
+{
+  std::size_t requests = 0;
+  std::size_t batches = 0;
+};
+
+// Serves single-sample inference requests from any number of threads
+// Requests are queued and coalesced into micro-batches of up to max_batch
+// samples, a batch runs once it is full or its oldest request has waited
+// max_delay. Every worker thread owns a replica of the module (see
+// IModule::replicate()), sharing the weights but with activation buffers of
+// its own, and runs whole batches through forward_batch().
+class InferenceServer
+{
+public:
+  using Clock = std::chrono::steady_clock;
+
+  // Serve a module taking input vectors of input_size floats
+  // The weights of the module must not change while the server runs.
+  InferenceServer(const IModule& module,
+                  std::size_t input_size,
+                  InferenceConfig config)
+    : input_size_{ input_size }
+    , config_{ config }
+  {
+    config_.max_batch = std::max<std::size_t>(config_.max_batch, 1);
+    // All replicas first, so that a throwing replicate() leaves no running
+    // worker behind
+    auto replicas = std::vector<std::shared_ptr<IModule>>{};
+    for (std::size_t t = 0; t < std::max<std::size_t>(config_.num_workers, 1);
+         ++t) {
+      replicas.push_back(module.replicate());
+    }
+    for (auto& replica : replicas) {
+      workers_.emplace_back(
+        [this, replica = std::move(replica)] { serve(*replica); });
+    }
+  }
+
+  InferenceServer(const InferenceServer&) = delete;
+  InferenceServer& operator=(const InferenceServer&) = delete;
+
+  // Answers all queued requests, then stops the workers
+  ~InferenceServer()
+  {
+    {
+      auto lock = std::lock_guard{ mutex_ };
+      stopping_ = true;
+    }
+    ready_.notify_all();
+    for (auto& worker : workers_) {
+      worker.join();
+    }
+  }
+
+  // Queue a request, the future receives the module output for the input
+  // Safe to call from several threads at once.
+  std::future<std::vector<float>>
+  submit(std::span<const float> input)
+  {
+    if (input.size() != input_size_) {
+      throw std::invalid_argument{ "input size differs from the server's" };
+    }
+
+    auto request = Request{ { input.begin(), input.end() }, {}, Clock::now() };
+    auto result = request.result.get_future();
+    std::size_t queued = 0;
+    {
+      auto lock = std::lock_guard{ mutex_ };
+      queue_.push_back(std::move(request));
+      queued = queue_.size();
+    }
+    // Wake a worker for a new batch or a batch that just filled up
+    if (queued == 1 or queued >= config_.max_batch) {
+      ready_.notify_one();
+    }
+    return result;
+  }
+
+  [[nodiscard]] InferenceStats
+  stats() const
+  {
+    return { num_requests_.load(std::memory_order_relaxed),
+             num_batches_.load(std::memory_order_relaxed) };
+  }
+
+private:
+  struct Request
+  {
+    std::vector<float> input;
+    std::promise<std::vector<float>> result;
+    Clock::time_point arrival;
+  };
+
+  // Worker: run batches until stopped and the queue is drained
+  void
+  serve(IModule& module)
+  {
+    auto batch = std::vector<Request>{};
+    auto inputs = AlignedVector<float>(config_.max_batch * input_size_);
+
+    for (;;) {
+      {
+        auto lock = std::unique_lock{ mutex_ };
+        ready_.wait(lock, [&] { return stopping_ or not queue_.empty(); });
+        if (queue_.empty()) {
+          return;
+        }
+        // Give later requests until the deadline of the oldest to join
+        auto deadline = queue_.front().arrival + config_.max_delay;
+        ready_.wait_until(lock, deadline, [&] {
+          return stopping_ or queue_.empty() or
+                 queue_.size() >= config_.max_batch;
+        });
+        std::size_t size = std::min(queue_.size(), config_.max_batch);
+        for (std::size_t i = 0; i < size; ++i) {
+          batch.push_back(std::move(queue_.front()));
+          queue_.pop_front();
+        }
+        // Another worker may start on the rest while this batch runs
+        if (not queue_.empty()) {
+          ready_.notify_one();
+        }
+      }
+      if (not batch.empty()) {
+        run(module, batch, inputs);
+        batch.clear();
+      }
+    }
+  }
+
+  void
+  run(IModule& module,
+      std::vector<Request>& batch,
+      AlignedVector<float>& inputs)
+  {
+    NNETS_PROFILE_SCOPE("inference.batch");
+    for (std::size_t i = 0; i < batch.size(); ++i) {
+      std::ranges::copy(batch[i].input,
+                        inputs.begin() +
+                          static_cast<std::ptrdiff_t>(i * input_size_));
+    }
+
+    try {
+      module.forward_batch(
+        std::span{ inputs }.first(batch.size() * input_size_), batch.size());
+    } catch (...) {
+      for (auto& request : batch) {
+        request.result.set_exception(std::current_exception());
+      }
+      return;
+    }
+
+    auto outputs = module.output();
+    std::size_t output_size = outputs.size() / batch.size();
+    for (std::size_t i = 0; i < batch.size(); ++i) {
+      auto output = outputs.subspan(i * output_size, output_size);
+      batch[i].result.set_value({ output.begin(), output.end() });
+    }
+    num_requests_.fetch_add(batch.size(), std::memory_order_relaxed);
+    num_batches_.fetch_add(1, std::memory_order_relaxed);
+  }
+
+  std::size_t input_size_;
+  InferenceConfig config_;
+  std::mutex mutex_;
+  std::condition_variable ready_;
+  std::deque<Request> queue_;
+  bool stopping_ = false;
+  std::atomic<std::size_t> num_requests_ = 0;
+  std::atomic<std::size_t> num_batches_ = 0;
+  std::vector<std::thread> workers_;
+};
+
+}
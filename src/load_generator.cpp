@@ -0,0 +1,146 @@
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <vector>
+
+#include "activation_functions.hpp"
+#include "checkpoint.hpp"
+#include "fully_connected.hpp"
+#include "inference_server.hpp"
+#include "random.hpp"
+#include "sequence.hpp"
+
+namespace {
+
+// Latency percentile in microseconds, latencies must be sorted
+double
+percentile_us(const std::vector<std::chrono::nanoseconds>& latencies, double p)
+{
+  auto rank = static_cast<std::size_t>(p / 100.0 *
+                                       static_cast<double>(latencies.size()));
+  auto latency = latencies[std::min(rank, latencies.size() - 1)];
+  return std::chrono::duration<double, std::micro>(latency).count();
+}
+
+}
+
+// Load generator for InferenceServer: closed-loop clients, each submitting a
+// request and waiting for its answer before the next, against servers with
+// growing micro-batch limits
+// Serves a checkpoint saved by nnets, or the nnets topology with random
+// weights without one.
+// Usage: nnets_load_generator [--checkpoint file] [--clients n]
+//        [--requests n per client] [--max-batch n] [--max-delay-us us]
+//        [--workers n]
+int
+main(int argc, char** argv)
+{
+  std::string checkpoint_path;
+  std::size_t num_clients = 32;
+  std::size_t num_requests = 2000;
+  auto max_batches = std::vector<std::size_t>{ 1, 4, 16, 64 };
+  auto base_config = nnets::InferenceConfig{};
+  for (int i = 1; i + 1 < argc; i += 2) {
+    auto flag = std::string_view{ argv[i] };
+    if (flag == "--checkpoint") {
+      checkpoint_path = argv[i + 1];
+    } else if (flag == "--clients") {
+      num_clients = std::max(std::atoi(argv[i + 1]), 1);
+    } else if (flag == "--requests") {
+      num_requests = std::max(std::atoi(argv[i + 1]), 1);
+    } else if (flag == "--max-batch") {
+      max_batches = { static_cast<std::size_t>(
+        std::max(std::atoi(argv[i + 1]), 1)) };
+    } else if (flag == "--max-delay-us") {
+      base_config.max_delay =
+        std::chrono::microseconds{ std::atoi(argv[i + 1]) };
+    } else if (flag == "--workers") {
+      base_config.num_workers = std::max(std::atoi(argv[i + 1]), 1);
+    } else {
+      std::cerr << "unknown option " << flag << "\n";
+      return 1;
+    }
+  }
+
+  auto random = nnets::Random{};
+  random.seed(42);
+
+  std::size_t input_size = 784;
+  auto net = nnets::Sequence{};
+  if (checkpoint_path.empty()) {
+    using Layer = nnets::FullyConnected<nnets::RelU>;
+    net = nnets::Sequence{ {
+      std::make_shared<Layer>(input_size, 300),
+      std::make_shared<Layer>(300, 200),
+      std::make_shared<Layer>(200, 100),
+      std::make_shared<nnets::FullyConnected<nnets::Identity>>(100, 10),
+    } };
+    net.init_weights(random);
+  } else {
+    net = nnets::make_checkpoint_sequence<nnets::RelU, nnets::Identity>(
+      checkpoint_path);
+    nnets::map_checkpoint(checkpoint_path, net);
+    input_size = nnets::read_checkpoint_topology(checkpoint_path)
+                   .front()
+                   .description.input_size;
+  }
+
+  // Distinct inputs cycled through by the clients
+  constexpr std::size_t num_inputs = 256;
+  auto inputs = std::vector<float>(num_inputs * input_size);
+  random.generate_uniform(inputs, 0.0f, 255.0f);
+
+  std::cout << "max_batch clients requests qps p50_us p99_us mean_batch\n";
+  for (std::size_t max_batch : max_batches) {
+    auto config = base_config;
+    config.max_batch = max_batch;
+    auto server = nnets::InferenceServer{ net, input_size, config };
+
+    auto latencies =
+      std::vector<std::vector<std::chrono::nanoseconds>>(num_clients);
+    auto start_time = std::chrono::steady_clock::now();
+    {
+      auto clients = std::vector<std::jthread>{};
+      for (std::size_t c = 0; c < num_clients; ++c) {
+        clients.emplace_back([&, c] {
+          auto& client_latencies = latencies[c];
+          client_latencies.reserve(num_requests);
+          for (std::size_t r = 0; r < num_requests; ++r) {
+            auto input = std::span{ inputs }.subspan(
+              (c * num_requests + r) % num_inputs * input_size, input_size);
+            auto sent = std::chrono::steady_clock::now();
+            static_cast<void>(server.submit(input).get());
+            client_latencies.push_back(std::chrono::steady_clock::now() -
+                                       sent);
+          }
+        });
+      }
+    }
+    auto end_time = std::chrono::steady_clock::now();
+
+    auto all_latencies = std::vector<std::chrono::nanoseconds>{};
+    for (const auto& client_latencies : latencies) {
+      all_latencies.insert(
+        all_latencies.end(), client_latencies.begin(), client_latencies.end());
+    }
+    std::ranges::sort(all_latencies);
+
+    double seconds =
+      std::chrono::duration<double>(end_time - start_time).count();
+    auto stats = server.stats();
+    std::cout << max_batch << " " << num_clients << " " << all_latencies.size()
+              << " " << static_cast<double>(all_latencies.size()) / seconds
+              << " " << percentile_us(all_latencies, 50) << " "
+              << percentile_us(all_latencies, 99) << " "
+              << static_cast<double>(stats.requests) /
+                   static_cast<double>(stats.batches)
+              << std::endl;
+  }
+
+  return 0;
+}
@@ -0,0 +1,84 @@
+#pragma once
+
+#include <cstddef>
+#include <span>
+#include <stdexcept>
+
+#include "simd.hpp"
+
+namespace nnets {
+
+// Cross-entropy of the softmax of a classifier's logits against integer
+// labels, fused with the softmax so neither probabilities nor one-hot
+// targets are materialized
+// Label smoothing trains against (1 - label_smoothing) * one_hot(label) +
+// label_smoothing / num_categories instead of the one-hot vector. The output
+// layer should be linear (see Identity in activation_functions.hpp).
+class SoftmaxCrossEntropy
+{
+public:
+  explicit SoftmaxCrossEntropy(float label_smoothing = 0.0f,
+                               Accuracy accuracy = Accuracy::Precise)
+    : label_smoothing_{ label_smoothing }
+    , accuracy_{ accuracy }
+  {
+    if (not(label_smoothing >= 0.0f and label_smoothing < 1.0f)) {
+      throw std::invalid_argument{ "label smoothing must be in [0, 1)" };
+    }
+  }
+
+  // Loss summed over a batch of row-major logits with one row per label,
+  // logit_grads receives its gradient softmax(logits) - target
+  // Throws std::out_of_range for a label outside its row, check labels
+  // beforehand inside ThreadPool tasks.
+  float
+  loss_grad(std::span<const float> logits,
+            std::span<const int> labels,
+            std::span<float> logit_grads) const
+  {
+    if (labels.empty()) {
+      return 0.0f;
+    }
+
+    std::size_t num_categories = logits.size() / labels.size();
+    float off_target = label_smoothing_ / static_cast<float>(num_categories);
+    float on_target = 1.0f - label_smoothing_;
+    float loss = 0.0f;
+
+    for (std::size_t i = 0; i < labels.size(); ++i) {
+      auto label = static_cast<std::size_t>(labels[i]);
+      if (label >= num_categories) {
+        throw std::out_of_range{ "label exceeds number of logits" };
+      }
+      const float* row = logits.data() + i * num_categories;
+      float* grad = logit_grads.data() + i * num_categories;
+
+      // Stable log-softmax: log(p[j]) = row[j] - log_sum, max subtracted
+      // inside the kernel
+      float log_sum = kernels().softmax(accuracy_, row, grad, num_categories);
+
+      // -sum(target * log(p)) = log_sum - sum(target * row)
+      float row_sum = 0.0f;
+      for (std::size_t j = 0; j < num_categories; ++j) {
+        row_sum += row[j];
+        grad[j] -= off_target;
+      }
+      grad[label] -= on_target;
+      loss += log_sum - on_target * row[label] - off_target * row_sum;
+    }
+
+    return loss;
+  }
+
+  [[nodiscard]] float
+  label_smoothing() const
+  {
+    return label_smoothing_;
+  }
+
+private:
+  float label_smoothing_;
+  Accuracy accuracy_;
+};
+
+}
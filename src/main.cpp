@@ -1,186 +1,261 @@
 #include <algorithm>
 #include <chrono>
+#include <cstdlib>
+#include <filesystem>
 #include <iostream>
 #include <random>
+#include <stdexcept>
+#include <string_view>
+#include <thread>
 
 #include "activation_functions.hpp"
-#include "dataset.hpp"
-#include "fully_connected.hpp"
+#include "batch_norm.hpp"
+#include "batch_stager.hpp"
+#include "binary_dataset.hpp"
+#include "checkpoint.hpp"
+#include "data_loader.hpp"
+#include "data_parallel.hpp"
+#include "evaluation.hpp"
+#include "loss.hpp"
+#include "optimizer.hpp"
+#include "profiler.hpp"
+#include "quantized.hpp"
 #include "random.hpp"
 #include "sequence.hpp"
-
+#include "simd.hpp"
+#include "thread_pool.hpp"
+#include "training_config.hpp"
+
+// Usage: network [num_threads] [checkpoint] [key=value ...]
+// With a checkpoint path, training state is saved there after every epoch
+// and a run resumes from it if the file exists.
+// key=value arguments override the hyperparameters of TrainingConfig (see
+// training_config.hpp), e.g. hidden_sizes=512,256 initial_learning_rate=3e-4
+// Built with NNETS_PROFILE, setting NNETS_TRACE=trace.json records a Chrome
+// trace and prints a summary per layer and training phase at the end
+// (NNETS_PERF_COUNTERS=1 adds hardware counters).
 int
-main()
+main(int argc, char** argv)
 {
-  constexpr int epochs = 20;
-  constexpr std::size_t batch_size = 200;
-  constexpr float initial_learning_rate = 1e-4f;
-  constexpr float gamma = 0.95;
-  constexpr float rms_prop_smoothing_factor = 1e-8f;
-  constexpr float rms_prop_history_influence = 0.9f;
-  constexpr float validation_dataset_fraction = 0.1f;
-  constexpr std::size_t seed = 1231331231231231;
+  // Leave some cores of the shared server to others
+  constexpr std::size_t max_threads = 48;
+
+  // Results are reproducible for a fixed number of threads
+  std::size_t num_threads = std::clamp<std::size_t>(
+    std::thread::hardware_concurrency(), 1, max_threads);
+  auto checkpoint_path = std::filesystem::path{};
+  auto config = nnets::TrainingConfig{};
+  std::size_t positional = 0;
+  for (int i = 1; i < argc; ++i) {
+    auto arg = std::string_view{ argv[i] };
+    if (arg.find('=') != arg.npos) {
+      try {
+        config.set(arg);
+      } catch (const std::invalid_argument& error) {
+        std::cerr << error.what() << "\n";
+        return 1;
+      }
+    } else if (positional++ == 0) {
+      num_threads = std::max(std::atoi(argv[i]), 1);
+    } else {
+      checkpoint_path = arg;
+    }
+  }
+  std::cout << "num_threads=" << num_threads << "\n";
+  std::cout << "isa=" << nnets::isa_name(nnets::kernels().isa) << "\n";
+  std::cout << "config " << config.to_string() << "\n";
+  // Depends on the shard size of batch_size / num_threads
+  bool sparse_input = nnets::first_layer_sparsity(config, num_threads) ==
+                      nnets::InputSparsity::Sparse;
+  std::cout << "first_layer_input=" << (sparse_input ? "sparse" : "dense")
+            << " (sparse for at most "
+            << nnets::FullyConnected<nnets::RelU>::sparse_input_max_rows
+            << " samples per thread)\n";
+  nnets::start_profiling_from_env();
 
   auto start_time = std::chrono::system_clock::now();
 
   auto random = nnets::Random{};
-  random.seed(seed);
-
-  // Read train dataset
-  auto train_dataset =
-    nnets::read_dataset("data/fashion_mnist_train_vectors.csv",
-                        "data/fashion_mnist_train_labels.csv");
-  const auto full_train_dataset = train_dataset;
-  auto input_vector_size = train_dataset.at(0).first.size();
+  random.seed(config.seed);
+
+  auto pool = nnets::ThreadPool{ num_threads };
+
+  // Map train dataset (converted from CSV on the first run)
+  const auto train_dataset =
+    nnets::load_binary_dataset("data/fashion_mnist_train.bin",
+                               "data/fashion_mnist_train_vectors.csv",
+                               "data/fashion_mnist_train_labels.csv",
+                               &pool);
+  auto input_vector_size = train_dataset.input_size();
   auto num_categories = nnets::num_categories(train_dataset);
   std::cout << "train_dataset_size=" << train_dataset.size() << "\n";
   std::cout << "input_vector_size=" << input_vector_size << "\n";
   std::cout << "num_categories=" << num_categories << "\n";
-
-  // Reserve part of train data for validation
-  std::ranges::shuffle(train_dataset, random.rng());
-  auto validation_data_start =
-    train_dataset.begin() +
-    static_cast<std::size_t>((1.0f - validation_dataset_fraction) *
-                             train_dataset.size());
-  auto validation_dataset =
-    nnets::Dataset{ validation_data_start, train_dataset.end() };
-  train_dataset.erase(validation_data_start, train_dataset.end());
-
-  // Network topology
-  auto net = nnets::Sequence{ {
-    std::make_shared<nnets::FullyConnected<nnets::RelU>>(input_vector_size,
-                                                         300),
-    std::make_shared<nnets::FullyConnected<nnets::RelU>>(300, 200),
-    std::make_shared<nnets::FullyConnected<nnets::RelU>>(200, 100),
-    std::make_shared<nnets::FullyConnected<nnets::RelU>>(100, num_categories),
-  } };
+  std::cout << "forward_macs_per_sample="
+            << nnets::forward_macs(config, input_vector_size, num_categories)
+            << "\n";
+
+  // Reserve part of train data for validation, samples are referred to by
+  // their index in the mapped dataset
+  auto [train_indices, validation_indices] = nnets::split_indices(
+    train_dataset.size(), config.validation_dataset_fraction, random.rng());
+
+  // Network topology (see make_network())
+  // Dropout only acts inside DataParallel::train_batch().
+  auto net = nnets::make_network(
+    config, input_vector_size, num_categories, num_threads);
+  // The output layer yields logits for a fused softmax cross-entropy
+  auto loss = nnets::SoftmaxCrossEntropy{ config.label_smoothing };
   net.init_weights(random);
 
-  // Helper arrays
-  auto expected_vector = std::vector<float>(num_categories);
-  auto error_grad = std::vector<float>(num_categories);
-
-  // Will be lowered progressively
-  float learning_rate = initial_learning_rate;
-
-  // Pass through the dataset in epochs
-  for (int epoch = 0; epoch < epochs; ++epoch) {
-    std::ranges::shuffle(train_dataset, random.rng());
-
-    int batch = 0;
-    float error = 0.0f;
-
-    // Split dataset into mini-batches
-    for (std::size_t batch_start = 0; batch_start < train_dataset.size();
-         batch_start += batch_size, ++batch) {
-      std::size_t current_batch_size =
-        std::min(batch_size, train_dataset.size() - batch_start);
-
-      net.zero_grad();
-
-      float batch_error = 0.0f;
-
-      // Iterate over batch
-      for (std::size_t i = 0; i < current_batch_size; ++i) {
-        // Forward feed
-        const auto& [input, expected_label] = train_dataset[batch_start + i];
-        net.forward(input);
-        const auto output = net.output();
+  // Data-parallel training over mini-batch shards
+  auto trainer = nnets::DataParallel{ net, pool };
+  auto optimizer = nnets::Optimizer{ net, nnets::optimizer_config(config) };
+
+  // Resume an interrupted run, the restored RNG replays the data order
+  std::size_t first_epoch = 0;
+  if (not checkpoint_path.empty() and
+      std::filesystem::exists(checkpoint_path)) {
+    first_epoch =
+      nnets::load_checkpoint(checkpoint_path, net, &optimizer, &random).epoch;
+    std::cout << "resumed from " << checkpoint_path.string() << " at epoch "
+              << first_epoch << "\n";
+  }
 
-        // Compute error
-        expected_vector.assign(num_categories, 0.0f);
-        expected_vector[expected_label] = 1.0f;
+  // Batches are shuffled and gathered on a background thread ahead of
+  // training
+  auto loader = nnets::DataLoader{ train_dataset,
+                                   train_indices,
+                                   { .batch_size = config.batch_size,
+                                     .num_epochs = config.epochs,
+                                     .first_epoch = first_epoch },
+                                   random.rng() };
 
-        for (std::size_t k = 0; k < num_categories; ++k) {
-          error_grad[k] = output[k] - expected_vector[k];
-          batch_error += 0.5f * error_grad[k] * error_grad[k];
-        }
+  // Batched evaluation, one shard of the samples per thread
+  auto evaluator = nnets::Evaluator{ net, pool };
 
-        // Backpropagation
-        net.backward(error_grad);
-      }
+  // Pass through the dataset in epochs
+  auto epochs = static_cast<int>(config.epochs);
+  for (auto epoch = static_cast<int>(first_epoch); epoch < epochs; ++epoch) {
+    NNETS_PROFILE_SCOPE("train.epoch");
+    for (std::size_t batch = 0; batch < loader.batches_per_epoch(); ++batch) {
+      NNETS_PROFILE_SCOPE("train.batch");
+      const auto& batch_data = [&]() -> const nnets::LoaderBatch& {
+        NNETS_PROFILE_SCOPE("train.wait_for_batch");
+        return loader.next();
+      }();
+
+      trainer.zero_grad();
+
+      // Forward feed, error and backpropagation, one shard per thread
+      // Labels are below num_categories by construction, so the loss does
+      // not throw inside the pool
+      auto compute_error = [&](std::size_t first,
+                               std::span<const float> output,
+                               std::span<float> error_grad) {
+        auto labels =
+          batch_data.labels.subspan(first, output.size() / num_categories);
+        return loss.loss_grad(output, labels, error_grad);
+      };
+
+      float batch_error = [&] {
+        NNETS_PROFILE_SCOPE("train.train_batch");
+        return trainer.train_batch(batch_data.inputs,
+                                   batch_data.size,
+                                   optimizer.num_steps(),
+                                   compute_error);
+      }();
 
       // Learning step
-      net.step_grad_rms_prop(
-        learning_rate, rms_prop_history_influence, rms_prop_smoothing_factor);
+      optimizer.step();
 
       std::cout << "epoch=" << epoch << " batch=" << batch
                 << " batch_error=" << batch_error << std::endl;
     }
 
     // Lower the learning rate
-    learning_rate *= gamma;
+    optimizer.set_learning_rate(optimizer.learning_rate() * config.gamma);
 
     // Evaluate classification success on validation data after epoch
-    int success_count = 0;
+    {
+      NNETS_PROFILE_SCOPE("train.validate");
+      auto validation = evaluator.evaluate(train_dataset, validation_indices);
 
-    for (const auto& [input, expected] : validation_dataset) {
-      net.forward(input);
-      auto output = net.output();
-      auto max_category =
-        std::distance(output.begin(), std::ranges::max_element(output));
-
-      if (max_category == expected) {
-        ++success_count;
-      }
+      std::cout << "epoch=" << epoch
+                << " success_rate=" << validation.accuracy() << std::endl;
     }
 
-    float success_rate =
-      static_cast<float>(success_count) / validation_dataset.size();
-
-    std::cout << "epoch=" << epoch << " success_rate=" << success_rate
-              << std::endl;
-  }
-
-  // Evaluate full train dataset
-  int train_success_count = 0;
-  auto train_predictions = std::vector<int>{};
-
-  for (const auto& [input, expected] : full_train_dataset) {
-    net.forward(input);
-    auto output = net.output();
-    auto max_category =
-      std::distance(output.begin(), std::ranges::max_element(output));
-
-    train_predictions.push_back(static_cast<int>(max_category));
-
-    if (max_category == expected) {
-      ++train_success_count;
+    if (not checkpoint_path.empty()) {
+      nnets::save_checkpoint(checkpoint_path,
+                             net,
+                             &optimizer,
+                             &random,
+                             { static_cast<std::size_t>(epoch) + 1 });
     }
   }
 
-  float train_success_rate =
-    static_cast<float>(train_success_count) / full_train_dataset.size();
-  std::cout << "final train dataset success rate " << train_success_rate
+  // Evaluate full train dataset
+  auto train_result = evaluator.evaluate(train_dataset);
+  std::cout << "final train dataset success rate " << train_result.accuracy()
             << std::endl;
-  nnets::write_predictions("trainPredictions", train_predictions);
+  nnets::write_predictions("trainPredictions", train_result.predictions);
 
-  // Read and evaluate test dataset
+  // Map and evaluate test dataset, whose categories must be known from the
+  // train dataset
   const auto test_dataset =
-    nnets::read_dataset("data/fashion_mnist_test_vectors.csv",
-                        "data/fashion_mnist_test_labels.csv");
-  int test_success_count = 0;
-  auto test_predictions = std::vector<int>{};
-
-  for (const auto& [input, expected] : test_dataset) {
-    net.forward(input);
-    auto output = net.output();
-    auto max_category =
-      std::distance(output.begin(), std::ranges::max_element(output));
-
-    test_predictions.push_back(static_cast<int>(max_category));
-
-    if (max_category == expected) {
-      ++test_success_count;
+    nnets::load_binary_dataset("data/fashion_mnist_test.bin",
+                               "data/fashion_mnist_test_vectors.csv",
+                               "data/fashion_mnist_test_labels.csv",
+                               &pool,
+                               static_cast<std::size_t>(num_categories));
+  auto test_result = evaluator.evaluate(test_dataset);
+  std::cout << "final test dataset success rate " << test_result.accuracy()
+            << std::endl;
+  std::cout << "final test dataset top-" << test_result.top_k
+            << " success rate " << test_result.top_k_accuracy() << std::endl;
+  nnets::write_predictions("actualTestPredictions", test_result.predictions);
+
+  // Rows are labels, columns predicted categories
+  std::cout << "test confusion matrix\n";
+  for (std::size_t label = 0; label < test_result.num_categories; ++label) {
+    for (std::size_t predicted = 0; predicted < test_result.num_categories;
+         ++predicted) {
+      std::cout << (predicted == 0 ? "" : " ")
+                << test_result.confusion_count(label, predicted);
     }
+    std::cout << "\n";
   }
 
-  float test_success_rate =
-    static_cast<float>(test_success_count) / test_dataset.size();
-  std::cout << "final test dataset success rate " << test_success_rate
-            << std::endl;
-  nnets::write_predictions("actualTestPredictions", test_predictions);
+  // Int8 post-training quantization, calibrated on part of the train data,
+  // compared against the float network on the test data
+  // (not for convolution blocks, which quantize() does not take)
+  if (config.conv_channels.empty()) {
+    constexpr std::size_t calibration_samples = 1024;
+    auto calibration_stager =
+      nnets::BatchStager{ calibration_samples, input_vector_size };
+    auto calibration_indices = std::span{ train_indices }.first(
+      std::min(calibration_samples, train_indices.size()));
+    // quantize() takes FullyConnected layers only, so without dropout
+    auto inference_net = nnets::fold_for_inference<nnets::RelU>(net);
+    auto quantized_net = nnets::quantize<nnets::RelU, nnets::Identity>(
+      inference_net,
+      calibration_stager.gather(train_dataset, calibration_indices),
+      calibration_indices.size());
+
+    auto report = nnets::compare_quantized(net, quantized_net, test_dataset);
+    std::cout << "int8 test success rate " << report.quantized_accuracy
+              << " (fp32 " << report.reference_accuracy << ", delta "
+              << report.quantized_accuracy - report.reference_accuracy
+              << ", agreement " << report.agreement << ")\n";
+    std::cout << "int8 weights " << report.quantized_weight_bytes
+              << " bytes (fp32 " << report.reference_weight_bytes << ")\n";
+    std::cout << "int8 inference " << report.quantized_seconds << " s (fp32 "
+              << report.reference_seconds << " s)" << std::endl;
+  } else {
+    std::cout << "int8 quantization skipped for convolutions" << std::endl;
+  }
+
+  nnets::finish_profiling(std::cout);
 
   auto end_time = std::chrono::system_clock::now();
   std::cout << "Total runtime: "
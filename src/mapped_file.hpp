@@ -0,0 +1,113 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <filesystem>
+#include <span>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <utility>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace nnets {
+
+// Read-only memory mapping of a whole file
+class MappedFile
+{
+public:
+  MappedFile() = default;
+
+  explicit MappedFile(const std::filesystem::path& path)
+  {
+    int fd = ::open(path.c_str(), O_RDONLY);
+    if (fd < 0) {
+      throw std::runtime_error{ "cannot open " + path.string() };
+    }
+
+    struct stat file_stat = {};
+    if (::fstat(fd, &file_stat) != 0) {
+      ::close(fd);
+      throw std::runtime_error{ "cannot stat " + path.string() };
+    }
+
+    size_ = static_cast<std::size_t>(file_stat.st_size);
+    if (size_ > 0) {
+      data_ = ::mmap(nullptr, size_, PROT_READ, MAP_PRIVATE, fd, 0);
+    }
+    ::close(fd);
+
+    if (data_ == MAP_FAILED) {
+      data_ = nullptr;
+      throw std::runtime_error{ "cannot map " + path.string() };
+    }
+  }
+
+  MappedFile(MappedFile&& other) noexcept
+    : data_{ std::exchange(other.data_, nullptr) }
+    , size_{ std::exchange(other.size_, 0) }
+  {}
+
+  MappedFile&
+  operator=(MappedFile&& other) noexcept
+  {
+    if (this != &other) {
+      unmap();
+      data_ = std::exchange(other.data_, nullptr);
+      size_ = std::exchange(other.size_, 0);
+    }
+    return *this;
+  }
+
+  MappedFile(const MappedFile&) = delete;
+  MappedFile& operator=(const MappedFile&) = delete;
+
+  ~MappedFile() { unmap(); }
+
+  // File contents
+  [[nodiscard]] std::span<const std::uint8_t>
+  bytes() const
+  {
+    return { static_cast<const std::uint8_t*>(data_), size_ };
+  }
+
+  // File contents as text
+  [[nodiscard]] std::string_view
+  text() const
+  {
+    return { static_cast<const char*>(data_), size_ };
+  }
+
+  // Drop the pages of a byte range from memory (the file is unchanged, the
+  // range is read again if accessed), keeping the footprint of a sequential
+  // pass over a large file bounded
+  void
+  discard(std::size_t offset, std::size_t size)
+  {
+    auto page_size = static_cast<std::size_t>(::sysconf(_SC_PAGESIZE));
+    std::size_t begin = (offset + page_size - 1) / page_size * page_size;
+    std::size_t end = (offset + size) / page_size * page_size;
+    if (data_ != nullptr and begin < end) {
+      ::madvise(static_cast<char*>(data_) + begin, end - begin, MADV_DONTNEED);
+    }
+  }
+
+private:
+  void
+  unmap()
+  {
+    if (data_ != nullptr) {
+      ::munmap(data_, size_);
+      data_ = nullptr;
+    }
+  }
+
+  void* data_ = nullptr;
+  std::size_t size_ = 0;
+};
+
+}
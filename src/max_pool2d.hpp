@@ -0,0 +1,270 @@
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <limits>
+#include <memory>
+#include <span>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "conv2d.hpp"
+#include "module.hpp"
+#include "thread_pool.hpp"
+
+namespace nnets {
+
+// Shape and options of a MaxPool2D
+struct MaxPool2DConfig
+{
+  std::size_t channels = 1;
+  std::size_t input_height = 0;
+  std::size_t input_width = 0;
+  std::size_t pool_height = 2;
+  std::size_t pool_width = 2;
+  // 0 for non-overlapping windows (stride of pool_width and pool_height)
+  std::size_t stride = 0;
+  ImageLayout layout = ImageLayout::Nchw;
+
+  [[nodiscard]] std::size_t
+  stride_y() const
+  {
+    return stride == 0 ? pool_height : stride;
+  }
+
+  [[nodiscard]] std::size_t
+  stride_x() const
+  {
+    return stride == 0 ? pool_width : stride;
+  }
+
+  [[nodiscard]] std::size_t
+  output_height() const
+  {
+    return (input_height - pool_height) / stride_y() + 1;
+  }
+
+  [[nodiscard]] std::size_t
+  output_width() const
+  {
+    return (input_width - pool_width) / stride_x() + 1;
+  }
+};
+
+// Max pooling over windows of every channel, without parameters
+// Inputs and outputs are images in config.layout as in Conv2D, the input
+// gradient goes to the maximum of each window (the first one on ties).
+// See IModule for method documentation
+class MaxPool2D : public IModule
+{
+public:
+  explicit MaxPool2D(MaxPool2DConfig config, ThreadPool* pool = nullptr)
+    : config_{ config }
+    , pool_{ pool }
+  {
+    if (config.channels == 0 or config.pool_height == 0 or
+        config.pool_width == 0 or config.pool_height > config.input_height or
+        config.pool_width > config.input_width) {
+      throw std::invalid_argument{ "invalid pooling shape" };
+    }
+
+    input_size_ =
+      config.channels * config.input_height * config.input_width;
+    output_size_ =
+      config.channels * config.output_height() * config.output_width();
+    resize_batch(1);
+  }
+
+  void
+  forward(std::span<const float> input) override
+  {
+    forward_batch(input, 1);
+  }
+
+  void
+  backward(std::span<const float> output_grad) override
+  {
+    backward_batch(output_grad, 1);
+  }
+
+  void
+  forward_batch(std::span<const float> inputs, std::size_t batch) override
+  {
+    resize_batch(batch);
+    run(batch, [&](std::size_t n) {
+      pool_sample(inputs.data() + n * input_size_,
+                  output_.data() + n * output_size_,
+                  argmax_.data() + n * output_size_);
+    });
+  }
+
+  void
+  backward_batch(std::span<const float> output_grads,
+                 std::size_t batch) override
+  {
+    run(batch, [&](std::size_t n) {
+      float* input_grad = input_grad_.data() + n * input_size_;
+      const float* output_grad = output_grads.data() + n * output_size_;
+      const std::uint32_t* argmax = argmax_.data() + n * output_size_;
+      std::fill_n(input_grad, input_size_, 0.0f);
+      for (std::size_t i = 0; i < output_size_; ++i) {
+        input_grad[argmax[i]] += output_grad[i];
+      }
+    });
+  }
+
+  void
+  init_weights(Random& /*random*/) override
+  {}
+
+  void
+  zero_grad() override
+  {}
+
+  [[nodiscard]] std::shared_ptr<IModule>
+  replicate() const override
+  {
+    auto replica = std::make_shared<MaxPool2D>(*this);
+    replica->pool_ = nullptr;
+    return replica;
+  }
+
+  void
+  add_grad(const IModule& /*replica*/) override
+  {}
+
+  [[nodiscard]] std::vector<Parameter>
+  parameters() override
+  {
+    return {};
+  }
+
+  void
+  parameters_updated() override
+  {}
+
+  [[nodiscard]] std::size_t
+  parameter_size() const override
+  {
+    return 0;
+  }
+
+  void
+  bind_parameters(std::shared_ptr<float[]> /*storage*/) override
+  {}
+
+  void
+  bind_grads(std::shared_ptr<float[]> /*storage*/) override
+  {}
+
+  void
+  attach_parameters(std::shared_ptr<float[]> /*storage*/) override
+  {}
+
+  [[nodiscard]] std::span<const float>
+  output() const override
+  {
+    return std::span{ output_ }.first(batch_size_ * output_size_);
+  }
+
+  [[nodiscard]] std::span<const float>
+  input_grad() const override
+  {
+    return std::span{ input_grad_ }.first(batch_size_ * input_size_);
+  }
+
+  [[nodiscard]] std::string
+  name() const override
+  {
+    return "max_pool2d_" + std::to_string(config_.channels) + "x" +
+           std::to_string(config_.input_height) + "x" +
+           std::to_string(config_.input_width) + "_" +
+           std::to_string(config_.pool_height) + "x" +
+           std::to_string(config_.pool_width);
+  }
+
+  [[nodiscard]] const MaxPool2DConfig&
+  config() const
+  {
+    return config_;
+  }
+
+private:
+  template<typename Fn>
+  void
+  run(std::size_t n, Fn&& fn)
+  {
+    if (pool_ != nullptr and n > 1) {
+      pool_->parallel_for(n, fn);
+    } else {
+      for (std::size_t i = 0; i < n; ++i) {
+        fn(i);
+      }
+    }
+  }
+
+  // Maxima of one sample's windows and their input offsets
+  void
+  pool_sample(const float* input, float* output, std::uint32_t* argmax) const
+  {
+    const auto& c = config_;
+    std::size_t out_h = c.output_height();
+    std::size_t out_w = c.output_width();
+    bool nchw = c.layout == ImageLayout::Nchw;
+    // Distance between neighbouring pixels and between channels
+    std::size_t pixel = nchw ? 1 : c.channels;
+    std::size_t channel = nchw ? c.input_height * c.input_width : 1;
+
+    for (std::size_t ch = 0; ch < c.channels; ++ch) {
+      for (std::size_t oy = 0; oy < out_h; ++oy) {
+        for (std::size_t ox = 0; ox < out_w; ++ox) {
+          float best = -std::numeric_limits<float>::infinity();
+          std::size_t best_offset = ch * channel;
+          for (std::size_t ky = 0; ky < c.pool_height; ++ky) {
+            std::size_t y = oy * c.stride_y() + ky;
+            for (std::size_t kx = 0; kx < c.pool_width; ++kx) {
+              std::size_t x = ox * c.stride_x() + kx;
+              std::size_t offset =
+                ch * channel + (y * c.input_width + x) * pixel;
+              if (input[offset] > best) {
+                best = input[offset];
+                best_offset = offset;
+              }
+            }
+          }
+          std::size_t out = nchw ? (ch * out_h + oy) * out_w + ox
+                                 : (oy * out_w + ox) * c.channels + ch;
+          output[out] = best;
+          argmax[out] = static_cast<std::uint32_t>(best_offset);
+        }
+      }
+    }
+  }
+
+  // Grow per-sample buffers to hold a mini-batch (never shrinks)
+  void
+  resize_batch(std::size_t batch)
+  {
+    batch_size_ = batch;
+
+    if (output_.size() < batch * output_size_) {
+      output_.resize(batch * output_size_);
+      argmax_.resize(batch * output_size_);
+      input_grad_.resize(batch * input_size_);
+    }
+  }
+
+  MaxPool2DConfig config_;
+  ThreadPool* pool_;
+  std::size_t input_size_ = 0;
+  std::size_t output_size_ = 0;
+  std::size_t batch_size_ = 1;
+  std::vector<float> output_;
+  // Input offset (within the sample) of every output's maximum
+  std::vector<std::uint32_t> argmax_;
+  std::vector<float> input_grad_;
+};
+
+}
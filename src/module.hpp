@@ -1,11 +1,50 @@
 #pragma once
 
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <optional>
 #include <span>
+#include <string>
+#include <vector>
 
 #include "random.hpp"
+#include "simd.hpp"
 
 namespace nnets {
 
+// Trainable parameter buffer and the gradient accumulated for it
+struct Parameter
+{
+  std::span<float> values;
+  std::span<const float> grads;
+  // Factor applied to grads before the update (e.g. to undo loss scaling)
+  float grad_scale = 1.0f;
+  // Whether weight decay applies (usually not for biases)
+  bool decay = true;
+};
+
+// Module types that checkpoints can rebuild (see make_checkpoint_sequence())
+enum class ModuleKind : std::uint32_t
+{
+  Other,
+  FullyConnected,
+  Dropout
+};
+
+// Type, shape and activation of a module as recorded in checkpoints
+struct ModuleDescription
+{
+  ModuleKind kind = ModuleKind::Other;
+  std::size_t input_size = 0;
+  std::size_t output_size = 0;
+  // Of a layer with an elementwise activation function
+  std::optional<Activation> activation;
+
+  bool
+  operator==(const ModuleDescription&) const = default;
+};
+
 // Interface for neural network components
 class IModule
 {
@@ -20,20 +59,71 @@ public:
   virtual void
   backward(std::span<const float> activation_gradient) = 0;
 
+  // Activate the network for a mini-batch of row-major input vectors
+  // (output() then holds batch row-major output vectors)
+  virtual void
+  forward_batch(std::span<const float> inputs, std::size_t batch) = 0;
+
+  // Backpropagation for the mini-batch from the last call to forward_batch()
+  // (input_grad() then holds batch row-major input gradients)
+  virtual void
+  backward_batch(std::span<const float> activation_gradients,
+                 std::size_t batch) = 0;
+
+  // Switch between training and inference behaviour (e.g. of Dropout and
+  // BatchNorm1d), modules start in inference mode
+  // DataParallel::train_batch() trains its workers in training mode.
+  virtual void
+  set_training(bool /*training*/)
+  {}
+
+  // Number of optimizer steps taken before the next training pass, keys
+  // per-step randomness (e.g. Dropout masks) so that training resumed from a
+  // checkpoint draws the same values
+  virtual void
+  set_step(std::size_t /*step*/)
+  {}
+
   // Reset accumulated weight gradient values to 0
   virtual void
   zero_grad() = 0;
 
-  // Add learning_rate * accumulated gradient from backward() calls
-  // to weights (SGD learning step)
+  // Trainable parameters with their gradients accumulated by backward()
+  // (see Optimizer)
+  [[nodiscard]] virtual std::vector<Parameter>
+  parameters() = 0;
+
+  // Called by the optimizer after it changed the values of parameters()
   virtual void
-  step_grad(float learning_rate) = 0;
+  parameters_updated() = 0;
 
-  // RMSProp learning step
+  // Number of floats of parameter (and gradient) storage, laid out in the
+  // order of parameters()
+  [[nodiscard]] virtual std::size_t
+  parameter_size() const = 0;
+
+  // Move the parameter values into storage (parameter_size() floats, usually
+  // a slice of a network-wide arena) and keep using it
+  virtual void
+  bind_parameters(std::shared_ptr<float[]> storage) = 0;
+
+  // Move the accumulated gradients into storage, see bind_parameters()
   virtual void
-  step_grad_rms_prop(float learning_rate,
-                     float history_influence,
-                     float smoothing_term) = 0;
+  bind_grads(std::shared_ptr<float[]> storage) = 0;
+
+  // Use the values already in storage (parameter_size() floats, e.g. weights
+  // mapped from a checkpoint) as parameters, without copying
+  virtual void
+  attach_parameters(std::shared_ptr<float[]> storage) = 0;
+
+  // Create a module sharing this module's weights but owning its own
+  // activation and gradient buffers (a worker of data-parallel training)
+  [[nodiscard]] virtual std::shared_ptr<IModule>
+  replicate() const = 0;
+
+  // Add gradient accumulated by a module created with replicate()
+  virtual void
+  add_grad(const IModule& replica) = 0;
 
   // Random weights initialization
   virtual void
@@ -46,6 +136,27 @@ public:
   // Gradient of error function for inputs from the last call to backward()
   [[nodiscard]] virtual std::span<const float>
   input_grad() const = 0;
+
+  // Whether backward passes compute input_grad(), a module that does not can
+  // only be the first of a Sequence
+  [[nodiscard]] virtual bool
+  has_input_grad() const
+  {
+    return true;
+  }
+
+  // Short description for profiles and reports, e.g.
+  // "fully_connected_784x300"
+  [[nodiscard]] virtual std::string
+  name() const = 0;
+
+  // Description saved in checkpoints, ModuleKind::Other for modules that
+  // cannot be rebuilt from it
+  [[nodiscard]] virtual ModuleDescription
+  describe() const
+  {
+    return {};
+  }
 };
 
 }
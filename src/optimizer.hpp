@@ -0,0 +1,254 @@
+#pragma once
+
+#include <cmath>
+#include <cstddef>
+#include <memory>
+#include <span>
+#include <utility>
+#include <vector>
+
+#include "aligned.hpp"
+#include "module.hpp"
+#include "profiler.hpp"
+#include "simd.hpp"
+
+namespace nnets {
+
+// Update rule of an Optimizer
+enum class OptimizerKind
+{
+  // Stochastic gradient descent, with momentum if momentum > 0
+  Sgd,
+  RmsProp,
+  Adam,
+  // Adam with weight decay decoupled from the gradient
+  AdamW
+};
+
+// Hyperparameters of an Optimizer
+struct OptimizerConfig
+{
+  OptimizerKind kind = OptimizerKind::Sgd;
+  float learning_rate = 1e-3f;
+  // SGD momentum
+  float momentum = 0.0f;
+  // RMSProp weight of the gradient history
+  float history_influence = 0.9f;
+  // Adam decay rates of the first and second moment estimates
+  float beta1 = 0.9f;
+  float beta2 = 0.999f;
+  // RMSProp smoothing term and Adam denominator offset
+  float epsilon = 1e-8f;
+  // L2 penalty (added to the gradient), or the decoupled decay for AdamW
+  float weight_decay = 0.0f;
+};
+
+// Optimizer updating the parameters of registered modules
+// Every parameter buffer is one flat span with its state in one arena per
+// registered module, so a step is one fused, vectorized pass per buffer
+// (see the optimizer kernels in simd.hpp). Buffers that are adjacent in
+// memory and updated alike (e.g. the arena of a Sequence) are merged into
+// one pass.
+class Optimizer
+{
+public:
+  explicit Optimizer(OptimizerConfig config)
+    : config_{ config }
+  {}
+
+  Optimizer(IModule& module, OptimizerConfig config)
+    : config_{ config }
+  {
+    add_module(module);
+  }
+
+  // Register the parameters of a module as one group
+  // The module must outlive the optimizer and keep its parameter buffers.
+  void
+  add_module(IModule& module)
+  {
+    auto group = Group{ &module, {}, {}, 0 };
+    std::size_t state_size = 0;
+    for (const auto& parameter : module.parameters()) {
+      if (group.parameters.empty() or
+          not merge(group.parameters.back().parameter, parameter)) {
+        group.parameters.push_back({ parameter, {}, {} });
+      }
+      state_size += parameter.values.size();
+    }
+
+    // State of the first moment (or velocity, or history) followed by the
+    // second moment
+    std::size_t num_states = has_second_state() ? 2 : 1;
+    group.state_size = num_states * state_size;
+    group.state = make_aligned_shared<float>(group.state_size);
+    float* first = group.state.get();
+    float* second = first + state_size;
+    for (auto& state : group.parameters) {
+      std::size_t n = state.parameter.values.size();
+      state.first = { first, n };
+      first += n;
+      if (has_second_state()) {
+        state.second = { second, n };
+        second += n;
+      }
+    }
+
+    groups_.push_back(std::move(group));
+  }
+
+  // Apply the accumulated gradients to all registered parameters
+  void
+  step()
+  {
+    NNETS_PROFILE_SCOPE("optimizer.step");
+    ++num_steps_;
+
+    auto step = OptimizerStep{};
+    step.learning_rate = config_.learning_rate;
+    step.epsilon = config_.epsilon;
+
+    switch (config_.kind) {
+      case OptimizerKind::Sgd:
+        step.momentum = config_.momentum;
+        break;
+      case OptimizerKind::RmsProp:
+        step.history_influence = config_.history_influence;
+        break;
+      case OptimizerKind::Adam:
+      case OptimizerKind::AdamW: {
+        step.momentum = config_.beta1;
+        step.history_influence = config_.beta2;
+        auto t = static_cast<float>(num_steps_);
+        step.first_moment_correction =
+          1.0f / (1.0f - std::pow(config_.beta1, t));
+        step.second_moment_correction =
+          1.0f / (1.0f - std::pow(config_.beta2, t));
+        break;
+      }
+    }
+
+    const auto& kernel = kernels();
+
+    for (auto& group : groups_) {
+      for (auto& [parameter, first, second] : group.parameters) {
+        step.grad_scale = parameter.grad_scale;
+        float decay = parameter.decay ? config_.weight_decay : 0.0f;
+        step.l2_decay = config_.kind == OptimizerKind::AdamW ? 0.0f : decay;
+        step.decoupled_decay =
+          config_.kind == OptimizerKind::AdamW ? decay : 0.0f;
+
+        float* values = parameter.values.data();
+        const float* grads = parameter.grads.data();
+        std::size_t n = parameter.values.size();
+
+        switch (config_.kind) {
+          case OptimizerKind::Sgd:
+            kernel.sgd(step, values, grads, first.data(), n);
+            break;
+          case OptimizerKind::RmsProp:
+            kernel.rms_prop(step, values, grads, first.data(), n);
+            break;
+          case OptimizerKind::Adam:
+          case OptimizerKind::AdamW:
+            kernel.adam(step, values, grads, first.data(), second.data(), n);
+            break;
+        }
+      }
+      group.module->parameters_updated();
+    }
+  }
+
+  [[nodiscard]] float
+  learning_rate() const
+  {
+    return config_.learning_rate;
+  }
+
+  void
+  set_learning_rate(float learning_rate)
+  {
+    config_.learning_rate = learning_rate;
+  }
+
+  [[nodiscard]] const OptimizerConfig&
+  config() const
+  {
+    return config_;
+  }
+
+  // Number of steps taken, Adam's bias correction depends on it
+  [[nodiscard]] std::size_t
+  num_steps() const
+  {
+    return num_steps_;
+  }
+
+  void
+  set_num_steps(std::size_t num_steps)
+  {
+    num_steps_ = num_steps;
+  }
+
+  // State arena of every registered module, in registration order (e.g. to
+  // save and restore it with a checkpoint)
+  [[nodiscard]] std::vector<std::span<float>>
+  state()
+  {
+    auto state = std::vector<std::span<float>>{};
+    for (auto& group : groups_) {
+      state.push_back({ group.state.get(), group.state_size });
+    }
+    return state;
+  }
+
+private:
+  // A parameter buffer with its optimizer state (velocity, gradient history
+  // or first moment, and second moment for Adam)
+  struct State
+  {
+    Parameter parameter;
+    std::span<float> first;
+    std::span<float> second;
+  };
+
+  struct Group
+  {
+    IModule* module;
+    std::vector<State> parameters;
+    // Arena holding the state of all parameters
+    std::shared_ptr<float[]> state;
+    std::size_t state_size;
+  };
+
+  // Extend last to cover next if both can be updated as one buffer
+  [[nodiscard]] bool
+  merge(Parameter& last, const Parameter& next) const
+  {
+    bool adjacent =
+      last.values.data() + last.values.size() == next.values.data() and
+      last.grads.data() + last.grads.size() == next.grads.data();
+    bool same_decay =
+      last.decay == next.decay or config_.weight_decay == 0.0f;
+    if (not adjacent or not same_decay or last.grad_scale != next.grad_scale) {
+      return false;
+    }
+    last.values = { last.values.data(),
+                    last.values.size() + next.values.size() };
+    last.grads = { last.grads.data(), last.grads.size() + next.grads.size() };
+    return true;
+  }
+
+  [[nodiscard]] bool
+  has_second_state() const
+  {
+    return config_.kind == OptimizerKind::Adam or
+           config_.kind == OptimizerKind::AdamW;
+  }
+
+  OptimizerConfig config_;
+  std::size_t num_steps_ = 0;
+  std::vector<Group> groups_;
+};
+
+}
@@ -0,0 +1,424 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <deque>
+#include <filesystem>
+#include <fstream>
+#include <iomanip>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <ostream>
+#include <set>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#if defined(__linux__)
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+// Profiling scopes are compiled in only with NNETS_PROFILE defined (CMake
+// option NNETS_PROFILE), otherwise they expand to nothing and their name
+// expressions are not evaluated.
+#define NNETS_PROFILE_CONCAT_IMPL(a, b) a##b
+#define NNETS_PROFILE_CONCAT(a, b) NNETS_PROFILE_CONCAT_IMPL(a, b)
+
+#if defined(NNETS_PROFILE)
+// Record the enclosing scope under name (a string that outlives the profile,
+// see Profiler::intern())
+#define NNETS_PROFILE_SCOPE(name)                                              \
+  ::nnets::ProfileScope NNETS_PROFILE_CONCAT(nnets_profile_scope_,            \
+                                             __LINE__)                         \
+  {                                                                            \
+    name                                                                       \
+  }
+#else
+#define NNETS_PROFILE_SCOPE(name) static_cast<void>(0)
+#endif
+
+namespace nnets {
+
+// Hardware counters of the calling thread through perf_event_open
+// Counts user space cycles and instructions, unavailable (all reads 0) if the
+// kernel or its perf_event_paranoid setting does not allow it.
+class PerfCounters
+{
+public:
+  struct Values
+  {
+    std::uint64_t cycles = 0;
+    std::uint64_t instructions = 0;
+  };
+
+  PerfCounters()
+  {
+#if defined(__linux__)
+    leader_ = open(PERF_COUNT_HW_CPU_CYCLES, -1);
+    if (leader_ >= 0) {
+      member_ = open(PERF_COUNT_HW_INSTRUCTIONS, leader_);
+      if (member_ < 0) {
+        ::close(leader_);
+        leader_ = -1;
+        return;
+      }
+      ::ioctl(leader_, PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
+    }
+#endif
+  }
+
+  PerfCounters(const PerfCounters&) = delete;
+  PerfCounters& operator=(const PerfCounters&) = delete;
+
+  ~PerfCounters()
+  {
+#if defined(__linux__)
+    if (leader_ >= 0) {
+      ::close(member_);
+      ::close(leader_);
+    }
+#endif
+  }
+
+  [[nodiscard]] bool
+  available() const
+  {
+    return leader_ >= 0;
+  }
+
+  [[nodiscard]] Values
+  read() const
+  {
+#if defined(__linux__)
+    // PERF_FORMAT_GROUP: number of events followed by their values
+    std::array<std::uint64_t, 3> buffer = {};
+    if (leader_ >= 0 and
+        ::read(leader_, buffer.data(), sizeof(buffer)) ==
+          static_cast<ssize_t>(sizeof(buffer))) {
+      return { buffer[1], buffer[2] };
+    }
+#endif
+    return {};
+  }
+
+private:
+#if defined(__linux__)
+  static int
+  open(std::uint64_t config, int group)
+  {
+    auto attr = perf_event_attr{};
+    attr.size = sizeof(attr);
+    attr.type = PERF_TYPE_HARDWARE;
+    attr.config = config;
+    attr.disabled = group < 0 ? 1 : 0;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    attr.read_format = PERF_FORMAT_GROUP;
+    return static_cast<int>(
+      ::syscall(SYS_perf_event_open, &attr, 0, -1, group, 0));
+  }
+#endif
+
+  int leader_ = -1;
+  int member_ = -1;
+};
+
+// Collects timed scopes of all threads for a Chrome trace and a summary
+// Every thread appends to its own buffer without locking. Exports must run
+// while no profiled code is running (e.g. after training).
+class Profiler
+{
+public:
+  struct Event
+  {
+    const char* name;
+    std::int64_t start_ns;
+    std::int64_t duration_ns;
+    PerfCounters::Values counters;
+  };
+
+  static Profiler&
+  instance()
+  {
+    static auto profiler = Profiler{};
+    return profiler;
+  }
+
+  // Start recording, optionally with hardware counters
+  void
+  start(bool counters = false)
+  {
+    counters_ = counters;
+    origin_ = std::chrono::steady_clock::now();
+    enabled_.store(true, std::memory_order_relaxed);
+  }
+
+  void
+  stop()
+  {
+    enabled_.store(false, std::memory_order_relaxed);
+  }
+
+  [[nodiscard]] bool
+  enabled() const
+  {
+    return enabled_.load(std::memory_order_relaxed);
+  }
+
+  // Stable copy of a name built at runtime, e.g. from layer sizes
+  const char*
+  intern(std::string_view name)
+  {
+    auto lock = std::lock_guard{ mutex_ };
+    return names_.emplace(name).first->c_str();
+  }
+
+  // Current time and counters of the calling thread
+  [[nodiscard]] std::int64_t
+  now_ns() const
+  {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+             std::chrono::steady_clock::now() - origin_)
+      .count();
+  }
+
+  [[nodiscard]] PerfCounters::Values
+  read_counters()
+  {
+    const auto& counters = thread_buffer().counters;
+    return counters ? counters->read() : PerfCounters::Values{};
+  }
+
+  void
+  record(const Event& event)
+  {
+    thread_buffer().events.push_back(event);
+  }
+
+  // Write all events in the Chrome trace event format (chrome://tracing,
+  // Perfetto)
+  void
+  write_chrome_trace(std::ostream& out)
+  {
+    auto lock = std::lock_guard{ mutex_ };
+    out << "{\"displayTimeUnit\": \"ms\", \"traceEvents\": [";
+    bool first = true;
+    for (std::size_t tid = 0; tid < buffers_.size(); ++tid) {
+      const auto& buffer = *buffers_[tid];
+      for (const auto& event : buffer.events) {
+        out << (first ? "\n" : ",\n") << "{\"name\": \"" << event.name
+            << "\", \"ph\": \"X\", \"pid\": 0, \"tid\": " << tid
+            << ", \"ts\": " << microseconds(event.start_ns)
+            << ", \"dur\": " << microseconds(event.duration_ns);
+        if (buffer.counters and buffer.counters->available()) {
+          out << ", \"args\": {\"cycles\": " << event.counters.cycles
+              << ", \"instructions\": " << event.counters.instructions << "}";
+        }
+        out << "}";
+        first = false;
+      }
+    }
+    out << "\n]}\n";
+  }
+
+  // Print calls, inclusive time and counters per scope name, most expensive
+  // first
+  void
+  write_summary(std::ostream& out)
+  {
+    struct Row
+    {
+      std::size_t calls = 0;
+      std::int64_t total_ns = 0;
+      PerfCounters::Values counters;
+    };
+
+    auto lock = std::lock_guard{ mutex_ };
+    auto rows = std::map<std::string_view, Row>{};
+    std::int64_t end_ns = 0;
+    for (const auto& buffer : buffers_) {
+      for (const auto& event : buffer->events) {
+        auto& row = rows[event.name];
+        ++row.calls;
+        row.total_ns += event.duration_ns;
+        row.counters.cycles += event.counters.cycles;
+        row.counters.instructions += event.counters.instructions;
+        end_ns = std::max(end_ns, event.start_ns + event.duration_ns);
+      }
+    }
+
+    auto sorted = std::vector<std::pair<std::string_view, Row>>(rows.begin(),
+                                                                rows.end());
+    std::ranges::sort(sorted, [](const auto& a, const auto& b) {
+      return a.second.total_ns > b.second.total_ns;
+    });
+
+    auto flags = out.flags();
+    out << std::left << std::setw(48) << "scope" << std::right
+        << std::setw(10) << "calls" << std::setw(12) << "total_ms"
+        << std::setw(12) << "mean_us" << std::setw(8) << "wall%"
+        << std::setw(8) << "ipc" << "\n";
+    out << std::fixed;
+    for (const auto& [name, row] : sorted) {
+      double total_ms = static_cast<double>(row.total_ns) / 1e6;
+      out << std::left << std::setw(48) << name << std::right
+          << std::setw(10) << row.calls << std::setw(12)
+          << std::setprecision(2) << total_ms << std::setw(12)
+          << total_ms * 1e3 / static_cast<double>(row.calls) << std::setw(8)
+          << std::setprecision(1)
+          << 100.0 * static_cast<double>(row.total_ns) /
+               static_cast<double>(std::max<std::int64_t>(end_ns, 1))
+          << std::setw(8) << std::setprecision(2);
+      // Without counters the instructions per cycle are unknown
+      if (row.counters.cycles == 0) {
+        out << "-";
+      } else {
+        out << static_cast<double>(row.counters.instructions) /
+                 static_cast<double>(row.counters.cycles);
+      }
+      out << "\n";
+    }
+    out.flags(flags);
+  }
+
+private:
+  struct ThreadBuffer
+  {
+    std::vector<Event> events;
+    // Only opened when counters were requested
+    std::optional<PerfCounters> counters;
+  };
+
+  Profiler() = default;
+
+  // Buffers are owned by the profiler, so events survive their thread
+  ThreadBuffer&
+  thread_buffer()
+  {
+    thread_local ThreadBuffer* buffer = nullptr;
+    if (buffer == nullptr) {
+      auto lock = std::lock_guard{ mutex_ };
+      buffers_.push_back(std::make_unique<ThreadBuffer>());
+      buffer = buffers_.back().get();
+      if (counters_) {
+        buffer->counters.emplace();
+      }
+    }
+    return *buffer;
+  }
+
+  static std::string
+  microseconds(std::int64_t ns)
+  {
+    char text[32];
+    std::snprintf(text, sizeof(text), "%.3f", static_cast<double>(ns) / 1e3);
+    return text;
+  }
+
+  std::atomic<bool> enabled_ = false;
+  bool counters_ = false;
+  std::chrono::steady_clock::time_point origin_ =
+    std::chrono::steady_clock::now();
+  std::mutex mutex_;
+  std::set<std::string, std::less<>> names_;
+  std::deque<std::unique_ptr<ThreadBuffer>> buffers_;
+};
+
+// Records its lifetime as one event while the profiler is enabled
+class ProfileScope
+{
+public:
+  explicit ProfileScope(const char* name)
+  {
+    auto& profiler = Profiler::instance();
+    if (profiler.enabled()) {
+      name_ = name;
+      counters_ = profiler.read_counters();
+      start_ns_ = profiler.now_ns();
+    }
+  }
+
+  ProfileScope(const ProfileScope&) = delete;
+  ProfileScope& operator=(const ProfileScope&) = delete;
+
+  ~ProfileScope()
+  {
+    if (name_ != nullptr) {
+      auto& profiler = Profiler::instance();
+      std::int64_t end_ns = profiler.now_ns();
+      auto counters = profiler.read_counters();
+      profiler.record({ name_,
+                        start_ns_,
+                        end_ns - start_ns_,
+                        { counters.cycles - counters_.cycles,
+                          counters.instructions - counters_.instructions } });
+    }
+  }
+
+private:
+  const char* name_ = nullptr;
+  std::int64_t start_ns_ = 0;
+  PerfCounters::Values counters_;
+};
+
+// Name for profiling scopes, interned only when profiling is compiled in
+inline const char*
+profile_name(std::string_view name)
+{
+#if defined(NNETS_PROFILE)
+  return Profiler::instance().intern(name);
+#else
+  static_cast<void>(name);
+  return "";
+#endif
+}
+
+// Start profiling if the environment variable NNETS_TRACE names a trace
+// file (NNETS_PERF_COUNTERS=1 adds hardware counters)
+// Returns whether profiling started, always false without NNETS_PROFILE.
+inline bool
+start_profiling_from_env()
+{
+#if defined(NNETS_PROFILE)
+  if (const char* path = std::getenv("NNETS_TRACE"); path and *path) {
+    const char* counters = std::getenv("NNETS_PERF_COUNTERS");
+    Profiler::instance().start(counters and
+                               std::string_view{ counters } == "1");
+    return true;
+  }
+#endif
+  return false;
+}
+
+// Write the trace file named by NNETS_TRACE and print the summary table
+inline void
+finish_profiling(std::ostream& summary)
+{
+#if defined(NNETS_PROFILE)
+  auto& profiler = Profiler::instance();
+  if (not profiler.enabled()) {
+    return;
+  }
+  profiler.stop();
+  auto path = std::filesystem::path{ std::getenv("NNETS_TRACE") };
+  auto file = std::ofstream{ path };
+  profiler.write_chrome_trace(file);
+  profiler.write_summary(summary);
+  summary << "trace written to " << path.string() << std::endl;
+#else
+  static_cast<void>(summary);
+#endif
+}
+
+}
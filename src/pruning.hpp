@@ -0,0 +1,254 @@
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <numeric>
+#include <span>
+#include <stdexcept>
+#include <utility>
+#include <vector>
+
+#include "fully_connected.hpp"
+#include "module.hpp"
+#include "sequence.hpp"
+#include "simd.hpp"
+
+namespace nnets {
+
+// What Pruner zeroes at once
+enum class PruningGranularity
+{
+  // Single weights (unstructured, exported as SparseFormat::Csr)
+  Weight,
+  // sparse_block_size consecutive outputs of one input (exported as
+  // SparseFormat::Block)
+  Block,
+  // Whole output neurons, incoming weights and bias (removed by
+  // remove_pruned_neurons())
+  Neuron
+};
+
+struct PruningConfig
+{
+  PruningGranularity granularity = PruningGranularity::Weight;
+  // Share of the weights (blocks, neurons) of every layer zeroed at the end
+  float target_sparsity = 0.9f;
+  // Optimizer steps over which the sparsity ramps up from 0, and the steps
+  // between two mask updates
+  std::size_t begin_step = 0;
+  std::size_t end_step = 1000;
+  std::size_t frequency = 100;
+};
+
+// Weights and bias of a FullyConnected layer seen by Pruner
+struct PrunableLayer
+{
+  IModule* module = nullptr;
+  std::span<float> weights;
+  std::span<float> bias;
+};
+
+// Layers of a Sequence that Pruner may prune: every
+// FullyConnected<ActivationFn, Precision> except the output layer, whose
+// few weights decide between the categories
+// Other modules (e.g. Dropout) are skipped.
+template<typename ActivationFn, typename Precision = Fp32Precision>
+[[nodiscard]] std::vector<PrunableLayer>
+prunable_layers(Sequence& net)
+{
+  using Layer = FullyConnected<ActivationFn, Precision>;
+
+  auto layers = std::vector<PrunableLayer>{};
+  const auto& modules = net.modules();
+  for (std::size_t l = 0; l + 1 < modules.size(); ++l) {
+    if (auto* layer = dynamic_cast<Layer*>(modules[l].get())) {
+      layers.push_back({ layer, layer->weights(), layer->bias() });
+    }
+  }
+  return layers;
+}
+
+// Gradual magnitude pruning: every frequency steps between begin_step and
+// end_step, the smallest weights (blocks by L2 norm, neurons by the L2 norm
+// of their incoming weights) of every layer are masked, with the share
+// growing as target * (1 - (1 - progress)^3) so that most are pruned early
+// while the network can still recover.
+// Call step() after every optimizer step, it zeroes the masked weights again
+// since the optimizer moves them.
+class Pruner
+{
+public:
+  Pruner(std::vector<PrunableLayer> layers, PruningConfig config)
+    : layers_{ std::move(layers) }
+    , config_{ config }
+  {
+    if (not(config.target_sparsity >= 0.0f and
+            config.target_sparsity < 1.0f) or
+        config.end_step < config.begin_step or config.frequency == 0) {
+      throw std::invalid_argument{ "invalid pruning config" };
+    }
+
+    for (const auto& layer : layers_) {
+      masks_.emplace_back(layer.weights.size(), std::uint8_t{ 1 });
+    }
+  }
+
+  void
+  step()
+  {
+    if (step_ >= config_.begin_step and step_ <= config_.end_step and
+        (step_ - config_.begin_step) % config_.frequency == 0) {
+      update_masks(sparsity(step_));
+    }
+    ++step_;
+    apply_masks();
+  }
+
+  // Share of the weights scheduled to be pruned at step
+  [[nodiscard]] float
+  sparsity(std::size_t step) const
+  {
+    if (step < config_.begin_step) {
+      return 0.0f;
+    }
+    if (step >= config_.end_step) {
+      return config_.target_sparsity;
+    }
+    float progress = static_cast<float>(step - config_.begin_step) /
+                     static_cast<float>(config_.end_step - config_.begin_step);
+    float rest = 1.0f - progress;
+    return config_.target_sparsity * (1.0f - rest * rest * rest);
+  }
+
+  // Share of the weights of the layers that are zero
+  [[nodiscard]] float
+  weight_sparsity() const
+  {
+    std::size_t zeros = 0;
+    std::size_t total = 0;
+    for (const auto& layer : layers_) {
+      zeros +=
+        static_cast<std::size_t>(std::ranges::count(layer.weights, 0.0f));
+      total += layer.weights.size();
+    }
+    return total == 0 ? 0.0f
+                      : static_cast<float>(zeros) / static_cast<float>(total);
+  }
+
+private:
+  void
+  update_masks(float sparsity)
+  {
+    for (std::size_t l = 0; l < layers_.size(); ++l) {
+      const auto& layer = layers_[l];
+      std::size_t outputs = layer.bias.size();
+      std::size_t inputs = layer.weights.size() / outputs;
+
+      // Squared norm of every group, with the weight offsets of a group
+      // being first + i * stride for i < count
+      std::size_t groups = 0;
+      std::size_t count = 0;
+      std::size_t stride = 0;
+      auto first = [&](std::size_t g) -> std::size_t {
+        switch (config_.granularity) {
+          case PruningGranularity::Weight:
+            return g;
+          case PruningGranularity::Block:
+            return (g / inputs) * sparse_block_size * inputs + g % inputs;
+          case PruningGranularity::Neuron:
+            return g * inputs;
+        }
+        return 0;
+      };
+      switch (config_.granularity) {
+        case PruningGranularity::Weight:
+          groups = layer.weights.size();
+          count = 1;
+          stride = 1;
+          break;
+        case PruningGranularity::Block:
+          groups = (outputs + sparse_block_size - 1) / sparse_block_size *
+                   inputs;
+          count = sparse_block_size;
+          stride = inputs;
+          break;
+        case PruningGranularity::Neuron:
+          groups = outputs;
+          count = inputs;
+          stride = 1;
+          break;
+      }
+
+      scores_.resize(groups);
+      for (std::size_t g = 0; g < groups; ++g) {
+        float score = 0.0f;
+        for (std::size_t i = 0, w = first(g);
+             i < count and w < layer.weights.size();
+             ++i, w += stride) {
+          score += layer.weights[w] * layer.weights[w];
+        }
+        if (config_.granularity == PruningGranularity::Neuron) {
+          score += layer.bias[g] * layer.bias[g];
+        }
+        scores_[g] = score;
+      }
+
+      // Mask the pruned groups with the smallest scores, on ties the first
+      auto pruned = static_cast<std::size_t>(
+        std::lround(sparsity * static_cast<float>(groups)));
+      order_.resize(groups);
+      std::iota(order_.begin(), order_.end(), std::size_t{ 0 });
+      auto smaller = [&](std::size_t a, std::size_t b) {
+        return scores_[a] < scores_[b] or (scores_[a] == scores_[b] and a < b);
+      };
+      std::ranges::nth_element(order_, order_.begin() + pruned, smaller);
+
+      auto& mask = masks_[l];
+      std::ranges::fill(mask, std::uint8_t{ 1 });
+      for (std::size_t p = 0; p < pruned; ++p) {
+        std::size_t g = order_[p];
+        for (std::size_t i = 0, w = first(g);
+             i < count and w < layer.weights.size();
+             ++i, w += stride) {
+          mask[w] = 0;
+        }
+      }
+    }
+  }
+
+  void
+  apply_masks()
+  {
+    for (std::size_t l = 0; l < layers_.size(); ++l) {
+      const auto& layer = layers_[l];
+      const auto& mask = masks_[l];
+      for (std::size_t w = 0; w < layer.weights.size(); ++w) {
+        layer.weights[w] = mask[w] != 0 ? layer.weights[w] : 0.0f;
+      }
+      // A neuron is pruned with its bias, its output is then constant
+      if (config_.granularity == PruningGranularity::Neuron) {
+        std::size_t inputs = layer.weights.size() / layer.bias.size();
+        for (std::size_t j = 0; j < layer.bias.size(); ++j) {
+          bool alive = std::ranges::any_of(
+            std::span{ mask }.subspan(j * inputs, inputs),
+            [](std::uint8_t bit) { return bit != 0; });
+          layer.bias[j] = alive ? layer.bias[j] : 0.0f;
+        }
+      }
+      layer.module->parameters_updated();
+    }
+  }
+
+  std::vector<PrunableLayer> layers_;
+  PruningConfig config_;
+  std::size_t step_ = 0;
+  // 0 for every pruned weight
+  std::vector<std::vector<std::uint8_t>> masks_;
+  // Scratch of update_masks()
+  std::vector<float> scores_;
+  std::vector<std::size_t> order_;
+};
+
+}
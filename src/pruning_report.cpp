@@ -0,0 +1,235 @@
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <filesystem>
+#include <iostream>
+#include <iterator>
+#include <span>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "activation_functions.hpp"
+#include "batch_norm.hpp"
+#include "binary_dataset.hpp"
+#include "checkpoint.hpp"
+#include "data_loader.hpp"
+#include "data_parallel.hpp"
+#include "loss.hpp"
+#include "optimizer.hpp"
+#include "pruning.hpp"
+#include "random.hpp"
+#include "sequence.hpp"
+#include "sparse_inference.hpp"
+#include "thread_pool.hpp"
+
+namespace {
+
+constexpr std::size_t batch_size = 200;
+constexpr float learning_rate = 3e-5f;
+constexpr float label_smoothing = 0.1f;
+
+const char*
+granularity_name(nnets::PruningGranularity granularity)
+{
+  switch (granularity) {
+    case nnets::PruningGranularity::Weight:
+      return "weight";
+    case nnets::PruningGranularity::Block:
+      return "block";
+    case nnets::PruningGranularity::Neuron:
+      return "neuron";
+  }
+  return "";
+}
+
+// Test accuracy and latency of a network run one sample at a time, as when
+// serving
+template<typename DatasetT, typename NetT>
+void
+report(const char* granularity,
+       float sparsity,
+       const char* format,
+       std::size_t weight_bytes,
+       const DatasetT& dataset,
+       NetT& net)
+{
+  using clock = std::chrono::steady_clock;
+
+  auto input = std::vector<float>(dataset.input_size());
+  std::size_t correct = 0;
+  auto start = clock::now();
+  for (std::size_t i = 0; i < dataset.size(); ++i) {
+    std::ranges::copy(dataset.input(i), input.begin());
+    net.forward(input);
+    auto output = net.output();
+    auto predicted =
+      std::distance(output.begin(), std::ranges::max_element(output));
+    correct += predicted == dataset.label(i);
+  }
+  auto seconds = std::chrono::duration<double>(clock::now() - start).count();
+
+  auto samples = static_cast<double>(std::max<std::size_t>(dataset.size(), 1));
+  std::cout << granularity << " " << sparsity << " " << format << " "
+            << static_cast<double>(correct) / samples << " " << weight_bytes
+            << " " << seconds / samples * 1e6 << std::endl;
+}
+
+std::size_t
+dense_weight_bytes(nnets::Sequence& net)
+{
+  std::size_t bytes = 0;
+  for (const auto& module : net.modules()) {
+    auto parameters = module->parameters();
+    if (not parameters.empty()) {
+      // Bias first, then weights
+      bytes += parameters.back().values.size() * sizeof(float);
+    }
+  }
+  return bytes;
+}
+
+}
+
+// Speed and accuracy of the trained network pruned to several sparsities
+// Every setting restarts from the checkpoint, fine-tunes with gradual
+// pruning for a number of epochs and is measured on the test data as a
+// dense network and in its sparse export (Csr after weight pruning, Block
+// after block pruning, smaller dense layers after neuron pruning).
+// Usage: nnets_pruning_report checkpoint [epochs] [num_threads]
+int
+main(int argc, char** argv)
+{
+  if (argc < 2) {
+    std::cerr << "usage: nnets_pruning_report checkpoint [epochs] "
+                 "[num_threads]\n";
+    return 1;
+  }
+  auto checkpoint_path = std::filesystem::path{ argv[1] };
+  std::size_t epochs = argc > 2 ? std::max(std::atoi(argv[2]), 1) : 2;
+  std::size_t num_threads =
+    std::max<std::size_t>(std::thread::hardware_concurrency(), 1);
+  if (argc > 3) {
+    num_threads = std::max(std::atoi(argv[3]), 1);
+  }
+
+  auto random = nnets::Random{};
+  random.seed(42);
+  auto pool = nnets::ThreadPool{ num_threads };
+
+  const auto train_dataset =
+    nnets::load_binary_dataset("data/fashion_mnist_train.bin",
+                               "data/fashion_mnist_train_vectors.csv",
+                               "data/fashion_mnist_train_labels.csv",
+                               &pool);
+  auto num_categories = nnets::num_categories(train_dataset);
+  const auto test_dataset =
+    nnets::load_binary_dataset("data/fashion_mnist_test.bin",
+                               "data/fashion_mnist_test_vectors.csv",
+                               "data/fashion_mnist_test_labels.csv",
+                               &pool,
+                               static_cast<std::size_t>(num_categories));
+  auto indices = std::vector<std::size_t>(train_dataset.size());
+  for (std::size_t i = 0; i < indices.size(); ++i) {
+    indices[i] = i;
+  }
+
+  // The trained network without dropout
+  auto load = [&] {
+    auto net =
+      nnets::make_checkpoint_sequence<nnets::RelU, nnets::Identity>(
+        checkpoint_path);
+    nnets::load_checkpoint(checkpoint_path, net);
+    return nnets::fold_for_inference<nnets::RelU>(net);
+  };
+
+  std::cout << "granularity sparsity format test_accuracy weight_bytes "
+               "microseconds_per_sample\n";
+  auto baseline = load();
+  report("none",
+         0.0f,
+         "dense",
+         dense_weight_bytes(baseline),
+         test_dataset,
+         baseline);
+
+  for (auto granularity : { nnets::PruningGranularity::Weight,
+                            nnets::PruningGranularity::Block,
+                            nnets::PruningGranularity::Neuron }) {
+    for (float sparsity : { 0.5f, 0.75f, 0.9f, 0.95f }) {
+      auto net = load();
+      auto trainer = nnets::DataParallel{ net, pool };
+      auto optimizer =
+        nnets::Optimizer{ net,
+                          { .kind = nnets::OptimizerKind::RmsProp,
+                            .learning_rate = learning_rate } };
+      auto loss = nnets::SoftmaxCrossEntropy{ label_smoothing };
+      auto loader = nnets::DataLoader{
+        train_dataset,
+        indices,
+        { .batch_size = batch_size, .num_epochs = epochs },
+        random.rng()
+      };
+
+      // Prune over the first two thirds, recover in the rest
+      std::size_t steps = epochs * loader.batches_per_epoch();
+      auto pruner = nnets::Pruner{
+        nnets::prunable_layers<nnets::RelU>(net),
+        { .granularity = granularity,
+          .target_sparsity = sparsity,
+          .end_step = steps * 2 / 3,
+          .frequency = std::max<std::size_t>(steps / 30, 1) }
+      };
+
+      for (std::size_t step = 0; step < steps; ++step) {
+        const auto& batch = loader.next();
+        trainer.zero_grad();
+        trainer.train_batch(batch.inputs,
+                            batch.size,
+                            optimizer.num_steps(),
+                            [&](std::size_t first,
+                                std::span<const float> output,
+                                std::span<float> error_grad) {
+                              auto labels = batch.labels.subspan(
+                                first, output.size() / num_categories);
+                              return loss.loss_grad(
+                                output, labels, error_grad);
+                            });
+        optimizer.step();
+        pruner.step();
+      }
+
+      auto name = granularity_name(granularity);
+      report(name,
+             sparsity,
+             "dense",
+             dense_weight_bytes(net),
+             test_dataset,
+             net);
+      if (granularity == nnets::PruningGranularity::Neuron) {
+        auto smaller =
+          nnets::remove_pruned_neurons<nnets::RelU, nnets::Identity>(net);
+        report(name,
+               sparsity,
+               "removed",
+               dense_weight_bytes(smaller),
+               test_dataset,
+               smaller);
+        continue;
+      }
+      auto format = granularity == nnets::PruningGranularity::Weight
+                      ? nnets::SparseFormat::Csr
+                      : nnets::SparseFormat::Block;
+      auto sparse =
+        nnets::sparsify<nnets::RelU, nnets::Identity>(net, format);
+      report(name,
+             sparsity,
+             format == nnets::SparseFormat::Csr ? "csr" : "block",
+             sparse.weight_bytes(),
+             test_dataset,
+             sparse);
+    }
+  }
+
+  return 0;
+}
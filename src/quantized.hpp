@@ -0,0 +1,529 @@
+#pragma once
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <span>
+#include <stdexcept>
+#include <type_traits>
+#include <vector>
+
+#include "aligned.hpp"
+#include "fully_connected.hpp"
+#include "sequence.hpp"
+#include "simd.hpp"
+
+namespace nnets {
+
+namespace detail {
+
+// Rows of quantized weights are zero padded to a multiple of this, so the
+// int8 kernels never handle a partial vector
+inline constexpr std::size_t quantized_row_align = 64;
+
+// Signature of the int8 kernels:
+// out[j] = sum(x[p] * w[j * k + p]) for j < n, accumulated in int32
+// x holds k uint8 values, w holds n rows of k int8 values, k is a multiple of
+// quantized_row_align
+using GemvU8S8 = void (*)(const std::uint8_t* x,
+                          const std::int8_t* w,
+                          std::size_t k,
+                          std::size_t n,
+                          std::int32_t* out);
+
+namespace scalar {
+
+inline void
+gemv_u8s8(const std::uint8_t* x, const std::int8_t* w, std::size_t k,
+          std::size_t n, std::int32_t* out)
+{
+  for (std::size_t j = 0; j < n; ++j) {
+    std::int32_t sum = 0;
+    for (std::size_t p = 0; p < k; ++p) {
+      sum += static_cast<std::int32_t>(x[p]) * w[j * k + p];
+    }
+    out[j] = sum;
+  }
+}
+
+}
+
+#ifdef NNETS_X86_DISPATCH
+
+namespace avx2 {
+
+__attribute__((target("avx2"))) inline std::int32_t
+sum_lanes(__m256i acc)
+{
+  __m128i sum = _mm_add_epi32(_mm256_castsi256_si128(acc),
+                              _mm256_extracti128_si256(acc, 1));
+  sum = _mm_add_epi32(sum, _mm_shuffle_epi32(sum, 0x4e));
+  sum = _mm_add_epi32(sum, _mm_shuffle_epi32(sum, 0xb1));
+  return _mm_cvtsi128_si32(sum);
+}
+
+// u8 * s8 products widened to int16, pairs summed into int32 by vpmaddwd
+// (exact, unlike vpmaddubsw which saturates int16)
+__attribute__((target("avx2"))) inline void
+gemv_u8s8(const std::uint8_t* x, const std::int8_t* w, std::size_t k,
+          std::size_t n, std::int32_t* out)
+{
+  constexpr std::size_t rows = 4;
+
+  std::size_t j = 0;
+  for (; j + rows <= n; j += rows) {
+    __m256i acc[rows];
+    for (auto& value : acc) {
+      value = _mm256_setzero_si256();
+    }
+    for (std::size_t p = 0; p < k; p += 16) {
+      __m256i x_vec = _mm256_cvtepu8_epi16(
+        _mm_loadu_si128(reinterpret_cast<const __m128i*>(x + p)));
+      for (std::size_t r = 0; r < rows; ++r) {
+        __m256i w_vec = _mm256_cvtepi8_epi16(_mm_loadu_si128(
+          reinterpret_cast<const __m128i*>(w + (j + r) * k + p)));
+        acc[r] = _mm256_add_epi32(acc[r], _mm256_madd_epi16(x_vec, w_vec));
+      }
+    }
+    for (std::size_t r = 0; r < rows; ++r) {
+      out[j + r] = sum_lanes(acc[r]);
+    }
+  }
+  scalar::gemv_u8s8(x, w + j * k, k, n - j, out + j);
+}
+
+}
+
+namespace avx512_vnni {
+
+// vpdpbusd multiplies u8 by s8 and adds groups of 4 into int32 lanes
+__attribute__((target("avx512f,avx512vnni"))) inline void
+gemv_u8s8(const std::uint8_t* x, const std::int8_t* w, std::size_t k,
+          std::size_t n, std::int32_t* out)
+{
+  constexpr std::size_t rows = 4;
+
+  std::size_t j = 0;
+  for (; j + rows <= n; j += rows) {
+    __m512i acc[rows];
+    for (auto& value : acc) {
+      value = _mm512_setzero_si512();
+    }
+    for (std::size_t p = 0; p < k; p += 64) {
+      __m512i x_vec = _mm512_loadu_si512(x + p);
+      for (std::size_t r = 0; r < rows; ++r) {
+        acc[r] = _mm512_dpbusd_epi32(
+          acc[r], x_vec, _mm512_loadu_si512(w + (j + r) * k + p));
+      }
+    }
+    for (std::size_t r = 0; r < rows; ++r) {
+      alignas(64) std::int32_t lanes[16];
+      _mm512_store_si512(lanes, acc[r]);
+      std::int32_t sum = 0;
+      for (std::int32_t value : lanes) {
+        sum += value;
+      }
+      out[j + r] = sum;
+    }
+  }
+  scalar::gemv_u8s8(x, w + j * k, k, n - j, out + j);
+}
+
+}
+
+#endif
+
+// int8 kernel for the running CPU, follows the instruction set of kernels()
+inline GemvU8S8
+gemv_u8s8_kernel()
+{
+  static const GemvU8S8 selected = []() -> GemvU8S8 {
+#ifdef NNETS_X86_DISPATCH
+    if (kernels().isa == Isa::Avx512 and
+        __builtin_cpu_supports("avx512vnni")) {
+      return avx512_vnni::gemv_u8s8;
+    }
+    if (kernels().isa != Isa::Scalar) {
+      return avx2::gemv_u8s8;
+    }
+#endif
+    return scalar::gemv_u8s8;
+  }();
+  return selected;
+}
+
+}
+
+// Affine mapping of a float range onto uint8:
+// value = scale * (quantized - zero_point)
+struct QuantizationParams
+{
+  float scale = 1.0f;
+  std::int32_t zero_point = 0;
+
+  // Parameters covering [min, max], widened to include 0 so that zero
+  // (e.g. ReLU outputs and padding) is represented exactly
+  [[nodiscard]] static QuantizationParams
+  from_range(float min, float max)
+  {
+    min = std::min(min, 0.0f);
+    max = std::max(max, 0.0f);
+    if (max - min <= 0.0f) {
+      return {};
+    }
+    auto params = QuantizationParams{};
+    params.scale = (max - min) / 255.0f;
+    params.zero_point =
+      static_cast<std::int32_t>(std::lround(-min / params.scale));
+    return params;
+  }
+};
+
+// Inference-only layer of a QuantizedSequence, int8 here or sparse (see
+// sparse_inference.hpp)
+class IQuantizedModule
+{
+public:
+  virtual ~IQuantizedModule() = default;
+
+  // Activate the layer for a mini-batch of row-major input vectors
+  virtual void
+  forward_batch(std::span<const float> inputs, std::size_t batch) = 0;
+
+  // Activation results from the last call to forward_batch()
+  [[nodiscard]] virtual std::span<const float>
+  output() const = 0;
+
+  // Bytes of weight storage, and what the fp32 layer needed
+  [[nodiscard]] virtual std::size_t
+  weight_bytes() const = 0;
+
+  [[nodiscard]] virtual std::size_t
+  reference_weight_bytes() const = 0;
+};
+
+// Fully connected layer with int8 weights and uint8 inputs
+// Weights are quantized symmetrically per output channel, inputs with the
+// affine parameters calibrated for the layer. Dot products accumulate in
+// int32 and are rescaled to float before the bias and the activation.
+template<typename ActivationFn>
+class QuantizedFullyConnected : public IQuantizedModule
+{
+public:
+  QuantizedFullyConnected(std::span<const float> weights,
+                          std::span<const float> bias,
+                          ActivationFn activation_fn,
+                          QuantizationParams input_params)
+    : input_size_{ weights.size() / bias.size() }
+    , output_size_{ bias.size() }
+    , row_size_{ (input_size_ + detail::quantized_row_align - 1) /
+                 detail::quantized_row_align * detail::quantized_row_align }
+    , activation_fn_{ activation_fn }
+    , input_params_{ input_params }
+    , weights_(output_size_ * row_size_, 0)
+    , output_scales_(output_size_)
+    , bias_(output_size_)
+    , quantized_input_(row_size_, 0)
+    , accumulators_(output_size_)
+  {
+    for (std::size_t j = 0; j < output_size_; ++j) {
+      auto row = weights.subspan(j * input_size_, input_size_);
+
+      float max_abs = 0.0f;
+      for (float value : row) {
+        max_abs = std::max(max_abs, std::abs(value));
+      }
+      float weight_scale = max_abs > 0.0f ? max_abs / 127.0f : 1.0f;
+
+      std::int32_t row_sum = 0;
+      for (std::size_t p = 0; p < input_size_; ++p) {
+        auto quantized = static_cast<std::int8_t>(
+          std::lround(std::clamp(row[p] / weight_scale, -127.0f, 127.0f)));
+        weights_[j * row_size_ + p] = quantized;
+        row_sum += quantized;
+      }
+
+      // The input zero point contributes -zero_point * row_sum to every
+      // accumulator, folded into the bias
+      output_scales_[j] = input_params_.scale * weight_scale;
+      bias_[j] = bias[j] - output_scales_[j] *
+                             static_cast<float>(input_params_.zero_point) *
+                             static_cast<float>(row_sum);
+    }
+  }
+
+  void
+  forward_batch(std::span<const float> inputs, std::size_t batch) override
+  {
+    output_.resize(batch * output_size_);
+
+    auto kernel = detail::gemv_u8s8_kernel();
+    float inverse_scale = 1.0f / input_params_.scale;
+    auto zero_point = static_cast<float>(input_params_.zero_point);
+
+    for (std::size_t b = 0; b < batch; ++b) {
+      const float* input = inputs.data() + b * input_size_;
+      for (std::size_t p = 0; p < input_size_; ++p) {
+        // Clamped to [0, 255] first, so adding 0.5 rounds to nearest
+        float value =
+          std::clamp(input[p] * inverse_scale + zero_point, 0.0f, 255.0f);
+        quantized_input_[p] = static_cast<std::uint8_t>(value + 0.5f);
+      }
+
+      kernel(quantized_input_.data(),
+             weights_.data(),
+             row_size_,
+             output_size_,
+             accumulators_.data());
+
+      float* output = output_.data() + b * output_size_;
+      for (std::size_t j = 0; j < output_size_; ++j) {
+        output[j] = activation_fn_(
+          static_cast<float>(accumulators_[j]) * output_scales_[j] + bias_[j]);
+      }
+    }
+  }
+
+  [[nodiscard]] std::span<const float>
+  output() const override
+  {
+    return output_;
+  }
+
+  [[nodiscard]] std::size_t
+  weight_bytes() const override
+  {
+    return weights_.size() * sizeof(std::int8_t);
+  }
+
+  [[nodiscard]] std::size_t
+  reference_weight_bytes() const override
+  {
+    return input_size_ * output_size_ * sizeof(float);
+  }
+
+private:
+  std::size_t input_size_;
+  std::size_t output_size_;
+  // Padded length of a weight row
+  std::size_t row_size_;
+  ActivationFn activation_fn_;
+  QuantizationParams input_params_;
+  AlignedVector<std::int8_t> weights_;
+  // Input scale times the weight scale of each output channel
+  std::vector<float> output_scales_;
+  std::vector<float> bias_;
+  AlignedVector<std::uint8_t> quantized_input_;
+  std::vector<std::int32_t> accumulators_;
+  std::vector<float> output_;
+};
+
+// Inference-only network of quantized layers, built by quantize() (or of
+// sparse layers, built by sparsify())
+class QuantizedSequence
+{
+public:
+  explicit QuantizedSequence(
+    std::vector<std::unique_ptr<IQuantizedModule>> modules)
+    : modules_{ std::move(modules) }
+  {}
+
+  // Activate the network (access activation results with output())
+  void
+  forward(std::span<const float> input)
+  {
+    forward_batch(input, 1);
+  }
+
+  // Activate the network for a mini-batch of row-major input vectors
+  void
+  forward_batch(std::span<const float> inputs, std::size_t batch)
+  {
+    for (auto& module : modules_) {
+      module->forward_batch(inputs, batch);
+      inputs = module->output();
+    }
+  }
+
+  [[nodiscard]] std::span<const float>
+  output() const
+  {
+    return modules_.back()->output();
+  }
+
+  [[nodiscard]] std::size_t
+  weight_bytes() const
+  {
+    std::size_t bytes = 0;
+    for (const auto& module : modules_) {
+      bytes += module->weight_bytes();
+    }
+    return bytes;
+  }
+
+  [[nodiscard]] std::size_t
+  reference_weight_bytes() const
+  {
+    std::size_t bytes = 0;
+    for (const auto& module : modules_) {
+      bytes += module->reference_weight_bytes();
+    }
+    return bytes;
+  }
+
+private:
+  std::vector<std::unique_ptr<IQuantizedModule>> modules_;
+};
+
+// Post-training quantization of a trained Sequence of
+// FullyConnected<ActivationFn, Precision> layers, the last one may be a
+// FullyConnected<OutputActivationFn, Precision>
+// The input range of every layer is calibrated by running the float network
+// over num_samples row-major calibration inputs.
+// Throws std::invalid_argument for other module types.
+template<typename ActivationFn,
+         typename OutputActivationFn = ActivationFn,
+         typename Precision = Fp32Precision>
+[[nodiscard]] QuantizedSequence
+quantize(Sequence& net,
+         std::span<const float> calibration_inputs,
+         std::size_t num_samples)
+{
+  using Layer = FullyConnected<ActivationFn, Precision>;
+  using OutputLayer = FullyConnected<OutputActivationFn, Precision>;
+
+  const auto& layers = net.modules();
+  if (layers.empty() or num_samples == 0) {
+    throw std::invalid_argument{ "nothing to quantize" };
+  }
+  for (std::size_t l = 0; l < layers.size(); ++l) {
+    bool supported = l + 1 < layers.size()
+                       ? dynamic_cast<Layer*>(layers[l].get()) != nullptr
+                       : dynamic_cast<OutputLayer*>(layers[l].get()) != nullptr;
+    if (not supported) {
+      throw std::invalid_argument{
+        "quantize() expects a Sequence of FullyConnected layers"
+      };
+    }
+  }
+
+  // Smallest and largest input value seen by each layer
+  std::size_t input_size = calibration_inputs.size() / num_samples;
+  auto min = std::vector<float>(layers.size(), 0.0f);
+  auto max = std::vector<float>(layers.size(), 0.0f);
+  auto observe = [&](std::size_t l, std::span<const float> values) {
+    auto [lo, hi] = std::ranges::minmax(values);
+    min[l] = std::min(min[l], lo);
+    max[l] = std::max(max[l], hi);
+  };
+
+  constexpr std::size_t calibration_batch = 256;
+  for (std::size_t first = 0; first < num_samples;
+       first += calibration_batch) {
+    std::size_t batch = std::min(calibration_batch, num_samples - first);
+    auto inputs =
+      calibration_inputs.subspan(first * input_size, batch * input_size);
+
+    net.forward_batch(inputs, batch);
+
+    observe(0, inputs);
+    for (std::size_t l = 1; l < layers.size(); ++l) {
+      observe(l, layers[l - 1]->output());
+    }
+  }
+
+  auto modules = std::vector<std::unique_ptr<IQuantizedModule>>{};
+  auto add_module = [&]<typename LayerT>(LayerT& layer, std::size_t l) {
+    using Fn = std::remove_cvref_t<decltype(layer.activation_fn())>;
+    modules.push_back(std::make_unique<QuantizedFullyConnected<Fn>>(
+      layer.weights(),
+      layer.bias(),
+      layer.activation_fn(),
+      QuantizationParams::from_range(min[l], max[l])));
+  };
+  for (std::size_t l = 0; l + 1 < layers.size(); ++l) {
+    add_module(static_cast<Layer&>(*layers[l]), l);
+  }
+  add_module(static_cast<OutputLayer&>(*layers.back()), layers.size() - 1);
+  return QuantizedSequence{ std::move(modules) };
+}
+
+// Classification accuracy of a float network and its quantized version
+struct QuantizationReport
+{
+  std::size_t num_samples = 0;
+  float reference_accuracy = 0.0f;
+  float quantized_accuracy = 0.0f;
+  // Fraction of samples where both networks predict the same category
+  float agreement = 0.0f;
+  double reference_seconds = 0.0;
+  double quantized_seconds = 0.0;
+  std::size_t reference_weight_bytes = 0;
+  std::size_t quantized_weight_bytes = 0;
+};
+
+// Compare reference and quantized on every sample of a dataset (see
+// BatchStager for the dataset requirements), one sample at a time as when
+// serving
+template<typename DatasetT>
+[[nodiscard]] QuantizationReport
+compare_quantized(IModule& reference,
+                  QuantizedSequence& quantized,
+                  const DatasetT& dataset)
+{
+  using clock = std::chrono::steady_clock;
+
+  auto argmax = [](std::span<const float> output) {
+    return static_cast<int>(
+      std::distance(output.begin(), std::ranges::max_element(output)));
+  };
+
+  auto input = std::vector<float>(dataset.input_size());
+  auto reference_predictions = std::vector<int>(dataset.size());
+  auto quantized_predictions = std::vector<int>(dataset.size());
+
+  auto report = QuantizationReport{};
+  report.num_samples = dataset.size();
+  report.reference_weight_bytes = quantized.reference_weight_bytes();
+  report.quantized_weight_bytes = quantized.weight_bytes();
+
+  auto start = clock::now();
+  for (std::size_t i = 0; i < dataset.size(); ++i) {
+    std::ranges::copy(dataset.input(i), input.begin());
+    reference.forward(input);
+    reference_predictions[i] = argmax(reference.output());
+  }
+  auto middle = clock::now();
+  for (std::size_t i = 0; i < dataset.size(); ++i) {
+    std::ranges::copy(dataset.input(i), input.begin());
+    quantized.forward(input);
+    quantized_predictions[i] = argmax(quantized.output());
+  }
+  auto end = clock::now();
+
+  report.reference_seconds =
+    std::chrono::duration<double>(middle - start).count();
+  report.quantized_seconds =
+    std::chrono::duration<double>(end - middle).count();
+
+  std::size_t reference_correct = 0;
+  std::size_t quantized_correct = 0;
+  std::size_t agreeing = 0;
+  for (std::size_t i = 0; i < dataset.size(); ++i) {
+    reference_correct += reference_predictions[i] == dataset.label(i);
+    quantized_correct += quantized_predictions[i] == dataset.label(i);
+    agreeing += reference_predictions[i] == quantized_predictions[i];
+  }
+  if (dataset.size() > 0) {
+    auto total = static_cast<float>(dataset.size());
+    report.reference_accuracy = static_cast<float>(reference_correct) / total;
+    report.quantized_accuracy = static_cast<float>(quantized_correct) / total;
+    report.agreement = static_cast<float>(agreeing) / total;
+  }
+  return report;
+}
+
+}
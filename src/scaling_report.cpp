@@ -0,0 +1,116 @@
+#include <chrono>
+#include <cstdlib>
+#include <iostream>
+#include <thread>
+#include <vector>
+
+#include "activation_functions.hpp"
+#include "data_parallel.hpp"
+#include "fully_connected.hpp"
+#include "optimizer.hpp"
+#include "random.hpp"
+#include "sequence.hpp"
+#include "static_sequence.hpp"
+#include "thread_pool.hpp"
+
+// Data-parallel training throughput for 1 to N threads on random data with
+// the Fashion-MNIST topology
+// Usage: nnets_scaling_report [max_threads]
+int
+main(int argc, char** argv)
+{
+  constexpr std::size_t input_size = 784;
+  constexpr std::size_t num_categories = 10;
+  constexpr std::size_t batch_size = 200;
+  constexpr int num_batches = 50;
+
+  std::size_t max_threads = std::thread::hardware_concurrency();
+  if (argc > 1) {
+    max_threads = std::max(std::atoi(argv[1]), 1);
+  }
+
+  auto random = nnets::Random{};
+  random.seed(42);
+
+  auto inputs = std::vector<float>(batch_size * input_size);
+  random.generate_uniform(inputs, 0.0f, 255.0f);
+
+  auto compute_error = [&](std::size_t first,
+                           std::span<const float> output,
+                           std::span<float> error_grad) {
+    float error = 0.0f;
+    for (std::size_t idx = 0; idx < output.size(); ++idx) {
+      float expected = (first + idx / num_categories) % num_categories ==
+                           idx % num_categories
+                         ? 1.0f
+                         : 0.0f;
+      error_grad[idx] = output[idx] - expected;
+      error += 0.5f * error_grad[idx] * error_grad[idx];
+    }
+    return error;
+  };
+
+  // Dynamic (Sequence) and compile-time (StaticSequence) variants of the
+  // topology
+  auto make_sequence = [&] {
+    return nnets::Sequence{ {
+      std::make_shared<nnets::FullyConnected<nnets::RelU>>(input_size, 300),
+      std::make_shared<nnets::FullyConnected<nnets::RelU>>(300, 200),
+      std::make_shared<nnets::FullyConnected<nnets::RelU>>(200, 100),
+      std::make_shared<nnets::FullyConnected<nnets::RelU>>(100,
+                                                           num_categories),
+    } };
+  };
+  auto make_static_sequence = [] {
+    return nnets::StaticSequence<
+      nnets::StaticFullyConnected<input_size, 300, nnets::RelU>,
+      nnets::StaticFullyConnected<300, 200, nnets::RelU>,
+      nnets::StaticFullyConnected<200, 100, nnets::RelU>,
+      nnets::StaticFullyConnected<100, num_categories, nnets::RelU>>{};
+  };
+
+  std::cout << "network threads samples_per_second speedup efficiency\n";
+
+  auto report = [&](const char* name, auto make_net) {
+    double single_thread_rate = 0.0;
+
+    for (std::size_t num_threads = 1; num_threads <= max_threads;
+         num_threads = num_threads < max_threads
+                         ? std::min(num_threads * 2, max_threads)
+                         : num_threads + 1) {
+      auto net = make_net();
+      net.init_weights(random);
+
+      auto pool = nnets::ThreadPool{ num_threads };
+      auto trainer = nnets::DataParallel{ net, pool };
+      auto optimizer =
+        nnets::Optimizer{ net,
+                          { .kind = nnets::OptimizerKind::RmsProp,
+                            .learning_rate = 1e-4f } };
+
+      auto start_time = std::chrono::steady_clock::now();
+
+      for (int batch = 0; batch < num_batches; ++batch) {
+        trainer.zero_grad();
+        trainer.train_batch(
+          inputs, batch_size, optimizer.num_steps(), compute_error);
+        optimizer.step();
+      }
+
+      auto end_time = std::chrono::steady_clock::now();
+      double seconds =
+        std::chrono::duration<double>(end_time - start_time).count();
+      double rate = num_batches * batch_size / seconds;
+      if (num_threads == 1) {
+        single_thread_rate = rate;
+      }
+      double speedup = rate / single_thread_rate;
+
+      std::cout << name << " " << num_threads << " " << rate << " "
+                << speedup << " " << speedup / num_threads << std::endl;
+    }
+  };
+
+  report("sequence", make_sequence);
+  report("static_sequence", make_static_sequence);
+}
@@ -1,49 +1,139 @@
 #pragma once
 
+#include <algorithm>
+#include <iterator>
 #include <memory>
-#include <ranges>
 #include <span>
+#include <stdexcept>
+#include <string>
+#include <utility>
+#include <vector>
 
+#include "aligned.hpp"
 #include "module.hpp"
+#include "profiler.hpp"
+#include "simd.hpp"
 
 namespace nnets {
 
 // Neural network layers arranged in a linear sequence
+// The parameters of all modules live in one cache line aligned arena and
+// their gradients in another, each module gets a slice of both. Zeroing and
+// summing gradients are then single linear passes.
 class Sequence : public IModule
 {
 public:
   Sequence() = default;
 
+  // Throws std::invalid_argument if a module but the first has no input
+  // gradient (see IModule::has_input_grad())
   explicit Sequence(std::vector<std::shared_ptr<IModule>> modules)
     : modules_{ std::move(modules) }
-  {}
+  {
+    for (std::size_t i = 1; i < modules_.size(); ++i) {
+      if (not modules_[i]->has_input_grad()) {
+        throw std::invalid_argument{ modules_[i]->name() +
+                                     " has no input gradient and must be "
+                                     "the first module" };
+      }
+    }
+    bind_parameters(make_aligned_shared<float>(parameter_size()));
+    bind_grads(make_aligned_shared<float>(parameter_size()));
+    name_profile_scopes();
+  }
 
   void
   forward(std::span<const float> input) override
   {
-    for (auto& module : modules_) {
-      module->forward(input);
-      input = module->output();
+    for (std::size_t i = 0; i < modules_.size(); ++i) {
+      NNETS_PROFILE_SCOPE(profile_names_[i].forward);
+      modules_[i]->forward(input);
+      input = modules_[i]->output();
     }
   }
 
   void
   backward(std::span<const float> output_grad) override
   {
-    for (auto& module : modules_ | std::views::reverse) {
-      module->backward(output_grad);
-      output_grad = module->input_grad();
+    for (std::size_t i = modules_.size(); i-- > 0;) {
+      NNETS_PROFILE_SCOPE(profile_names_[i].backward);
+      modules_[i]->backward(output_grad);
+      output_grad = modules_[i]->input_grad();
     }
   }
 
   void
-  zero_grad() override
+  forward_batch(std::span<const float> inputs, std::size_t batch) override
+  {
+    for (std::size_t i = 0; i < modules_.size(); ++i) {
+      NNETS_PROFILE_SCOPE(profile_names_[i].forward_batch);
+      modules_[i]->forward_batch(inputs, batch);
+      inputs = modules_[i]->output();
+    }
+  }
+
+  void
+  backward_batch(std::span<const float> output_grads,
+                 std::size_t batch) override
+  {
+    for (std::size_t i = modules_.size(); i-- > 0;) {
+      NNETS_PROFILE_SCOPE(profile_names_[i].backward_batch);
+      modules_[i]->backward_batch(output_grads, batch);
+      output_grads = modules_[i]->input_grad();
+    }
+  }
+
+  void
+  set_training(bool training) override
+  {
+    for (auto& module : modules_) {
+      module->set_training(training);
+    }
+  }
+
+  void
+  set_step(std::size_t step) override
   {
     for (auto& module : modules_) {
-      module->zero_grad();
+      module->set_step(step);
     }
   }
 
+  void
+  zero_grad() override
+  {
+    std::fill_n(grads_.get(), parameter_size(), 0.0f);
+  }
+
+  [[nodiscard]] std::shared_ptr<IModule>
+  replicate() const override
+  {
+    return std::make_shared<Sequence>(replica());
+  }
+
+  // Sequence of replicas of all modules, sharing the parameter arena but
+  // with a gradient arena of its own (see IModule::replicate())
+  [[nodiscard]] Sequence
+  replica() const
+  {
+    auto replica = Sequence{};
+    for (const auto& module : modules_) {
+      replica.modules_.push_back(module->replicate());
+    }
+    replica.parameters_ = parameters_;
+    replica.bind_grads(make_aligned_shared<float>(parameter_size()));
+    replica.name_profile_scopes();
+    return replica;
+  }
+
+  void
+  add_grad(const IModule& replica) override
+  {
+    const auto& other = static_cast<const Sequence&>(replica);
+
+    kernels().axpy(1.0f, other.grads_.get(), grads_.get(), parameter_size());
+  }
+
   void
   init_weights(Random& random) override
   {
@@ -52,23 +142,83 @@ public:
     }
   }
 
+  [[nodiscard]] std::vector<Parameter>
+  parameters() override
+  {
+    auto parameters = std::vector<Parameter>{};
+    for (auto& module : modules_) {
+      std::ranges::copy(module->parameters(), std::back_inserter(parameters));
+    }
+    return parameters;
+  }
+
+  void
+  parameters_updated() override
+  {
+    for (auto& module : modules_) {
+      module->parameters_updated();
+    }
+  }
+
+  [[nodiscard]] std::size_t
+  parameter_size() const override
+  {
+    std::size_t size = 0;
+    for (const auto& module : modules_) {
+      size += module->parameter_size();
+    }
+    return size;
+  }
+
+  void
+  bind_parameters(std::shared_ptr<float[]> storage) override
+  {
+    // Slices alias the arena, so it lives as long as any module uses it
+    std::size_t offset = 0;
+    for (auto& module : modules_) {
+      module->bind_parameters(
+        std::shared_ptr<float[]>{ storage, storage.get() + offset });
+      offset += module->parameter_size();
+    }
+    parameters_ = std::move(storage);
+  }
+
   void
-  step_grad(float coeff) override
+  bind_grads(std::shared_ptr<float[]> storage) override
   {
+    std::size_t offset = 0;
     for (auto& module : modules_) {
-      module->step_grad(coeff);
+      module->bind_grads(
+        std::shared_ptr<float[]>{ storage, storage.get() + offset });
+      offset += module->parameter_size();
     }
+    grads_ = std::move(storage);
   }
 
   void
-  step_grad_rms_prop(float learning_rate,
-                     float history_influence,
-                     float smoothing_term) override
+  attach_parameters(std::shared_ptr<float[]> storage) override
   {
+    std::size_t offset = 0;
     for (auto& module : modules_) {
-      module->step_grad_rms_prop(
-        learning_rate, history_influence, smoothing_term);
+      module->attach_parameters(
+        std::shared_ptr<float[]>{ storage, storage.get() + offset });
+      offset += module->parameter_size();
     }
+    parameters_ = std::move(storage);
+  }
+
+  // All parameter values, in the order of parameters()
+  [[nodiscard]] std::span<float>
+  parameter_arena()
+  {
+    return { parameters_.get(), parameter_size() };
+  }
+
+  // All accumulated gradients, in the order of parameters()
+  [[nodiscard]] std::span<float>
+  grad_arena()
+  {
+    return { grads_.get(), parameter_size() };
   }
 
   [[nodiscard]] std::span<const float>
@@ -83,8 +233,57 @@ public:
     return modules_.front()->input_grad();
   }
 
+  [[nodiscard]] bool
+  has_input_grad() const override
+  {
+    return modules_.empty() or modules_.front()->has_input_grad();
+  }
+
+  [[nodiscard]] std::string
+  name() const override
+  {
+    return "sequence";
+  }
+
+  // Modules in the order inputs pass through them
+  [[nodiscard]] std::span<const std::shared_ptr<IModule>>
+  modules() const
+  {
+    return modules_;
+  }
+
 private:
+  // Scope names of every module call, e.g.
+  // "layer0.fully_connected_784x300.forward_batch"
+  struct ProfileNames
+  {
+    const char* forward;
+    const char* backward;
+    const char* forward_batch;
+    const char* backward_batch;
+  };
+
+  void
+  name_profile_scopes()
+  {
+#if defined(NNETS_PROFILE)
+    profile_names_.clear();
+    for (std::size_t i = 0; i < modules_.size(); ++i) {
+      auto prefix = "layer" + std::to_string(i) + "." + modules_[i]->name();
+      profile_names_.push_back({ profile_name(prefix + ".forward"),
+                                 profile_name(prefix + ".backward"),
+                                 profile_name(prefix + ".forward_batch"),
+                                 profile_name(prefix + ".backward_batch") });
+    }
+#endif
+  }
+
   std::vector<std::shared_ptr<IModule>> modules_;
+#if defined(NNETS_PROFILE)
+  std::vector<ProfileNames> profile_names_;
+#endif
+  std::shared_ptr<float[]> parameters_;
+  std::shared_ptr<float[]> grads_;
 };
 
 }
@@ -0,0 +1,161 @@
+#include <algorithm>
+#include <condition_variable>
+#include <cstdlib>
+#include <deque>
+#include <exception>
+#include <future>
+#include <iostream>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <vector>
+
+#include "activation_functions.hpp"
+#include "checkpoint.hpp"
+#include "csv_parser.hpp"
+#include "inference_server.hpp"
+
+namespace {
+
+// Futures of submitted lines in input order, bounded so a large input does
+// not queue up in memory
+class ResponseQueue
+{
+public:
+  explicit ResponseQueue(std::size_t capacity)
+    : capacity_{ capacity }
+  {}
+
+  void
+  push(std::future<std::vector<float>> response)
+  {
+    auto lock = std::unique_lock{ mutex_ };
+    changed_.wait(lock, [&] { return responses_.size() < capacity_; });
+    responses_.push_back(std::move(response));
+    changed_.notify_all();
+  }
+
+  void
+  close()
+  {
+    auto lock = std::lock_guard{ mutex_ };
+    closed_ = true;
+    changed_.notify_all();
+  }
+
+  [[nodiscard]] bool
+  empty()
+  {
+    auto lock = std::lock_guard{ mutex_ };
+    return responses_.empty();
+  }
+
+  // Next response, false once closed and empty
+  bool
+  pop(std::future<std::vector<float>>& response)
+  {
+    auto lock = std::unique_lock{ mutex_ };
+    changed_.wait(lock, [&] { return closed_ or not responses_.empty(); });
+    if (responses_.empty()) {
+      return false;
+    }
+    response = std::move(responses_.front());
+    responses_.pop_front();
+    changed_.notify_all();
+    return true;
+  }
+
+private:
+  std::size_t capacity_;
+  std::mutex mutex_;
+  std::condition_variable changed_;
+  std::deque<std::future<std::vector<float>>> responses_;
+  bool closed_ = false;
+};
+
+}
+
+// Classifies input vectors with a checkpoint saved by nnets, as a batched
+// inference server on stdin and stdout
+// Every input line holds the comma-separated values of one input vector, the
+// predicted category is written on a line of its own in the same order.
+// Lines are submitted as soon as they are read, so piped or concurrent input
+// is coalesced into micro-batches.
+// Usage: nnets_serve checkpoint [--max-batch n] [--max-delay-us us]
+//        [--workers n]
+int
+main(int argc, char** argv)
+{
+  if (argc < 2) {
+    std::cerr << "usage: nnets_serve checkpoint [--max-batch n] "
+                 "[--max-delay-us us] [--workers n]\n";
+    return 1;
+  }
+
+  auto config = nnets::InferenceConfig{};
+  for (int i = 2; i + 1 < argc; i += 2) {
+    auto flag = std::string_view{ argv[i] };
+    if (flag == "--max-batch") {
+      config.max_batch = std::max(std::atoi(argv[i + 1]), 1);
+    } else if (flag == "--max-delay-us") {
+      config.max_delay = std::chrono::microseconds{ std::atoi(argv[i + 1]) };
+    } else if (flag == "--workers") {
+      config.num_workers = std::max(std::atoi(argv[i + 1]), 1);
+    } else {
+      std::cerr << "unknown option " << flag << "\n";
+      return 1;
+    }
+  }
+
+  try {
+    auto net =
+      nnets::make_checkpoint_sequence<nnets::RelU, nnets::Identity>(argv[1]);
+    nnets::map_checkpoint(argv[1], net);
+    std::size_t input_size =
+      nnets::read_checkpoint_topology(argv[1]).front().description.input_size;
+
+    auto server = nnets::InferenceServer{ net, input_size, config };
+    auto responses =
+      ResponseQueue{ 4 * config.max_batch * config.num_workers };
+
+    auto writer = std::thread{ [&] {
+      auto response = std::future<std::vector<float>>{};
+      while (responses.pop(response)) {
+        try {
+          auto output = response.get();
+          std::cout << std::distance(output.begin(),
+                                     std::ranges::max_element(output))
+                    << '\n';
+        } catch (const std::exception& e) {
+          std::cout << "error: " << e.what() << '\n';
+        }
+        // Flush once caught up, so interactive clients see every answer
+        if (responses.empty()) {
+          std::cout.flush();
+        }
+      }
+    } };
+
+    auto line = std::string{};
+    auto matrix = nnets::CsvMatrix<float>{};
+    while (std::getline(std::cin, line)) {
+      try {
+        nnets::parse_csv(line, matrix, nullptr);
+        responses.push(server.submit(matrix.values));
+      } catch (...) {
+        // Report the bad line in order with the other responses
+        auto failed = std::promise<std::vector<float>>{};
+        failed.set_exception(std::current_exception());
+        responses.push(failed.get_future());
+      }
+    }
+    responses.close();
+    writer.join();
+  } catch (const std::exception& e) {
+    std::cerr << e.what() << "\n";
+    return 1;
+  }
+
+  return 0;
+}
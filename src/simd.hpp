@@ -0,0 +1,1971 @@
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <string_view>
+
+#include "half.hpp"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define NNETS_X86_DISPATCH 1
+#include <immintrin.h>
+#endif
+
+namespace nnets {
+
+// Outputs per block of Kernels::block_sparse_gemv
+inline constexpr std::size_t sparse_block_size = 16;
+
+// Instruction set extensions the vector kernels are compiled for
+enum class Isa
+{
+  Scalar,
+  Avx2,
+  Avx512
+};
+
+// Hyperparameters of one fused optimizer update (see optimizer.hpp)
+// Every update first forms g = grad_scale * grad + l2_decay * param and
+// scales the parameter by 1 - learning_rate * decoupled_decay
+struct OptimizerStep
+{
+  float learning_rate = 0.0f;
+  float grad_scale = 1.0f;
+  float l2_decay = 0.0f;
+  float decoupled_decay = 0.0f;
+  // SGD momentum or Adam beta1
+  float momentum = 0.0f;
+  // RMSProp history influence or Adam beta2
+  float history_influence = 0.0f;
+  float epsilon = 0.0f;
+  // Adam bias corrections 1 / (1 - beta^t)
+  float first_moment_correction = 1.0f;
+  float second_moment_correction = 1.0f;
+};
+
+// Element-wise activation functions with vector kernels
+enum class ActivationKind
+{
+  Identity,
+  Step,
+  Relu,
+  LeakyRelu,
+  Sigmoid,
+  Tanh,
+  // Tanh approximation of x * Phi(x)
+  Gelu
+};
+
+// Accuracy of the polynomial exp behind sigmoid, tanh, GELU and softmax,
+// as the largest relative error of exp
+enum class Accuracy
+{
+  // About 1e-7, a few ulp
+  Precise,
+  // About 5e-6
+  Balanced,
+  // About 1e-4
+  Fast
+};
+
+// Activation function applied by the activation kernels
+struct Activation
+{
+  ActivationKind kind = ActivationKind::Relu;
+  // Negative slope of LeakyRelu, steepness of Sigmoid
+  float parameter = 0.0f;
+  Accuracy accuracy = Accuracy::Precise;
+
+  bool
+  operator==(const Activation&) const = default;
+};
+
+// Vector kernels for the dense layers and optimizers
+// One table per instruction set, the best one for the running CPU is picked
+// once at startup (see kernels())
+struct Kernels
+{
+  Isa isa;
+
+  // Register tile (rows x columns of C) of gemm_micro_kernel
+  std::size_t gemm_mr;
+  std::size_t gemm_nr;
+
+  // C[mr x nr] += alpha * packed A micro-panel * packed B micro-panel
+  void (*gemm_micro_kernel)(std::size_t kc,
+                            float alpha,
+                            const float* a,
+                            const float* b,
+                            float* c,
+                            std::size_t ldc,
+                            std::size_t mr,
+                            std::size_t nr);
+
+  // sum(x[i] * y[i])
+  float (*dot)(const float* x, const float* y, std::size_t n);
+
+  // y[i] += alpha * x[i]
+  void (*axpy)(float alpha, const float* x, float* y, std::size_t n);
+
+  // Fused optimizer updates of params from grads, one pass each
+  // SGD with momentum: velocity = momentum * velocity + g,
+  // param -= learning_rate * velocity
+  void (*sgd)(const OptimizerStep& step,
+              float* params,
+              const float* grads,
+              float* velocity,
+              std::size_t n);
+
+  // RMSProp: history is the running average of g^2,
+  // param -= learning_rate / sqrt(history + epsilon) * g
+  void (*rms_prop)(const OptimizerStep& step,
+                   float* params,
+                   const float* grads,
+                   float* history,
+                   std::size_t n);
+
+  // Adam: first and second are the running averages of g and g^2,
+  // param -= learning_rate * first' / (sqrt(second') + epsilon) with the
+  // bias corrected moments first' and second'
+  void (*adam)(const OptimizerStep& step,
+               float* params,
+               const float* grads,
+               float* first,
+               float* second,
+               std::size_t n);
+
+  // dst[i] = src[i] widened to float
+  void (*widen_bf16)(const BFloat16* src, float* dst, std::size_t n);
+  void (*widen_fp16)(const Float16* src, float* dst, std::size_t n);
+
+  // dst[i] = src[i] rounded to nearest even
+  void (*narrow_bf16)(const float* src, BFloat16* dst, std::size_t n);
+  void (*narrow_fp16)(const float* src, Float16* dst, std::size_t n);
+
+  // y[i] = f(x[i])
+  void (*activate)(const Activation& f,
+                   const float* x,
+                   float* y,
+                   std::size_t n);
+
+  // dx[i] = dy[i] * f'(x[i]), y holds the f(x) of the forward pass
+  // Sigmoid and tanh derive f' from y alone, without another exp.
+  void (*activate_grad)(const Activation& f,
+                        const float* x,
+                        const float* y,
+                        const float* dy,
+                        float* dx,
+                        std::size_t n);
+
+  // y = exp(x - max(x)) / sum(exp(x - max(x))) of one row
+  // Returns log(sum(exp(x))), so log(y[i]) = x[i] - the result.
+  float (*softmax)(Accuracy accuracy, const float* x, float* y, std::size_t n);
+
+  // Inverted dropout: y[i] = scale * x[i] if the top 24 of the counter-based
+  // random bits of element i under key are at least threshold, 0 otherwise
+  // The bits are a hash of (key, i) (see detail::random_bits()), so a
+  // backward pass recomputes the mask of its forward pass instead of storing
+  // it.
+  void (*dropout)(std::uint32_t key,
+                  std::uint32_t threshold,
+                  float scale,
+                  const float* x,
+                  float* y,
+                  std::size_t n);
+
+  // y[j] += sum(values[i] * w[indices[i] * ldw + j]) for j < n, the product
+  // of a sparse vector with nnz nonzeros and a row-major matrix w
+  // Columns of y are kept in registers while the nonzeros stream through.
+  void (*sparse_gemv)(std::size_t nnz,
+                      const std::uint32_t* indices,
+                      const float* values,
+                      const float* w,
+                      std::size_t ldw,
+                      float* y,
+                      std::size_t n);
+
+  // sum(values[i] * x[indices[i]]) for i < nnz, a row of a CSR matrix times
+  // a dense vector
+  float (*sparse_dot)(std::size_t nnz,
+                      const std::uint32_t* indices,
+                      const float* values,
+                      const float* x);
+
+  // y[j] += sum(x[indices[i]] * blocks[i * sparse_block_size + j]) for
+  // j < sparse_block_size, a block row of a matrix stored as nblocks columns
+  // of sparse_block_size values times a dense vector
+  void (*block_sparse_gemv)(std::size_t nblocks,
+                            const std::uint32_t* indices,
+                            const float* blocks,
+                            const float* x,
+                            float* y);
+};
+
+namespace detail {
+
+// exp(x) = 2^n * exp(r) with r = x - n * ln(2) in [-ln(2)/2, ln(2)/2] and
+// exp(r) ~ 1 + r + r^2 * q(r), coefficients of q from the highest degree
+// Minimax fits of the relative error, precise is the Cephes expf polynomial.
+inline constexpr float exp_precise[] = { 1.9875691500e-4f, 1.3981999507e-3f,
+                                         8.3334519073e-3f, 4.1665795894e-2f,
+                                         1.6666665459e-1f, 5.0000001201e-1f };
+inline constexpr float exp_balanced[] = { 4.127774691e-2f,
+                                          1.675351484e-1f,
+                                          5.000511611e-1f };
+inline constexpr float exp_fast[] = { 1.666281396e-1f, 5.039410834e-1f };
+
+// Inputs are clamped so 2^n stays a normal float
+inline constexpr float exp_min = -87.0f;
+inline constexpr float exp_max = 88.0f;
+inline constexpr float log2e = 1.44269504088896341f;
+// ln(2) split in a part exact in float and the rest
+inline constexpr float ln2_hi = 0.693359375f;
+inline constexpr float ln2_lo = -2.12194440e-4f;
+
+// GELU(x) = x * sigmoid(2 * sqrt(2 / pi) * (x + 0.044715 * x^3)), the
+// sigmoid argument is -x * (gelu_a + gelu_b * x^2)
+inline constexpr float gelu_a = -1.59576912160573071f;
+inline constexpr float gelu_b = gelu_a * 0.044715f;
+
+// Multipliers of hash32(), an invertible integer hash with low bias
+inline constexpr std::uint32_t hash_multiplier_1 = 0x7feb352du;
+inline constexpr std::uint32_t hash_multiplier_2 = 0x846ca68bu;
+
+inline constexpr std::uint32_t
+hash32(std::uint32_t x)
+{
+  x = (x ^ (x >> 16)) * hash_multiplier_1;
+  x = (x ^ (x >> 15)) * hash_multiplier_2;
+  return x ^ (x >> 16);
+}
+
+// Random bits at position counter of the stream key, two hash rounds so
+// streams of different keys are unrelated
+inline constexpr std::uint32_t
+random_bits(std::uint32_t key, std::uint32_t counter)
+{
+  return hash32(hash32(counter) ^ key);
+}
+
+}
+
+namespace detail::scalar {
+
+inline constexpr std::size_t gemm_mr = 4;
+inline constexpr std::size_t gemm_nr = 8;
+
+inline void
+gemm_micro_kernel(std::size_t kc, float alpha, const float* a, const float* b,
+                  float* c, std::size_t ldc, std::size_t mr, std::size_t nr)
+{
+  float acc[gemm_mr][gemm_nr] = {};
+
+  for (std::size_t p = 0; p < kc; ++p) {
+    for (std::size_t r = 0; r < gemm_mr; ++r) {
+      float a_val = a[p * gemm_mr + r];
+      for (std::size_t col = 0; col < gemm_nr; ++col) {
+        acc[r][col] += a_val * b[p * gemm_nr + col];
+      }
+    }
+  }
+
+  for (std::size_t r = 0; r < mr; ++r) {
+    for (std::size_t col = 0; col < nr; ++col) {
+      c[r * ldc + col] += alpha * acc[r][col];
+    }
+  }
+}
+
+inline float
+dot(const float* x, const float* y, std::size_t n)
+{
+  // Independent partial sums let the compiler vectorize the reduction
+  constexpr std::size_t lanes = 8;
+  float partial[lanes] = {};
+  std::size_t n_main = n - n % lanes;
+  for (std::size_t i = 0; i < n_main; i += lanes) {
+    for (std::size_t l = 0; l < lanes; ++l) {
+      partial[l] += x[i + l] * y[i + l];
+    }
+  }
+
+  float sum = 0.0f;
+  for (std::size_t i = n_main; i < n; ++i) {
+    sum += x[i] * y[i];
+  }
+  for (float value : partial) {
+    sum += value;
+  }
+  return sum;
+}
+
+inline void
+axpy(float alpha, const float* x, float* y, std::size_t n)
+{
+  for (std::size_t i = 0; i < n; ++i) {
+    y[i] += alpha * x[i];
+  }
+}
+
+inline void
+sgd(const OptimizerStep& step, float* params, const float* grads,
+    float* velocity, std::size_t n)
+{
+  float keep = 1.0f - step.learning_rate * step.decoupled_decay;
+  for (std::size_t i = 0; i < n; ++i) {
+    float grad = step.grad_scale * grads[i] + step.l2_decay * params[i];
+    velocity[i] = step.momentum * velocity[i] + grad;
+    params[i] = keep * params[i] - step.learning_rate * velocity[i];
+  }
+}
+
+inline void
+rms_prop(const OptimizerStep& step, float* params, const float* grads,
+         float* history, std::size_t n)
+{
+  float keep = 1.0f - step.learning_rate * step.decoupled_decay;
+  for (std::size_t i = 0; i < n; ++i) {
+    float grad = step.grad_scale * grads[i] + step.l2_decay * params[i];
+    history[i] = step.history_influence * history[i] +
+                 (1.0f - step.history_influence) * grad * grad;
+    params[i] =
+      keep * params[i] -
+      (step.learning_rate / std::sqrt(history[i] + step.epsilon)) * grad;
+  }
+}
+
+inline void
+adam(const OptimizerStep& step, float* params, const float* grads,
+     float* first, float* second, std::size_t n)
+{
+  float keep = 1.0f - step.learning_rate * step.decoupled_decay;
+  for (std::size_t i = 0; i < n; ++i) {
+    float grad = step.grad_scale * grads[i] + step.l2_decay * params[i];
+    first[i] = step.momentum * first[i] + (1.0f - step.momentum) * grad;
+    second[i] = step.history_influence * second[i] +
+                (1.0f - step.history_influence) * grad * grad;
+    float denominator =
+      std::sqrt(second[i] * step.second_moment_correction) + step.epsilon;
+    params[i] = keep * params[i] - step.learning_rate *
+                                     first[i] * step.first_moment_correction /
+                                     denominator;
+  }
+}
+
+inline void
+widen_bf16(const BFloat16* src, float* dst, std::size_t n)
+{
+  for (std::size_t i = 0; i < n; ++i) {
+    dst[i] = to_float(src[i]);
+  }
+}
+
+inline void
+widen_fp16(const Float16* src, float* dst, std::size_t n)
+{
+  for (std::size_t i = 0; i < n; ++i) {
+    dst[i] = to_float(src[i]);
+  }
+}
+
+inline void
+narrow_bf16(const float* src, BFloat16* dst, std::size_t n)
+{
+  for (std::size_t i = 0; i < n; ++i) {
+    dst[i] = from_float<BFloat16>(src[i]);
+  }
+}
+
+inline void
+narrow_fp16(const float* src, Float16* dst, std::size_t n)
+{
+  for (std::size_t i = 0; i < n; ++i) {
+    dst[i] = from_float<Float16>(src[i]);
+  }
+}
+
+template<std::size_t Terms>
+inline float
+approx_exp(float x, const float (&q)[Terms])
+{
+  x = std::min(std::max(x, exp_min), exp_max);
+  float n = std::nearbyint(x * log2e);
+  float r = x - n * ln2_hi;
+  r = r - n * ln2_lo;
+  float p = q[0];
+  for (std::size_t k = 1; k < Terms; ++k) {
+    p = p * r + q[k];
+  }
+  return std::ldexp(p * r * r + r + 1.0f, static_cast<int>(n));
+}
+
+inline float
+approx_exp(float x, Accuracy accuracy)
+{
+  switch (accuracy) {
+    case Accuracy::Fast:
+      return approx_exp(x, exp_fast);
+    case Accuracy::Balanced:
+      return approx_exp(x, exp_balanced);
+    default:
+      return approx_exp(x, exp_precise);
+  }
+}
+
+// f(x) of one value
+inline float
+activate(const Activation& f, float x)
+{
+  switch (f.kind) {
+    case ActivationKind::Identity:
+      return x;
+    case ActivationKind::Step:
+      return x >= 0.0f ? 1.0f : 0.0f;
+    case ActivationKind::Relu:
+      return std::max(0.0f, x);
+    case ActivationKind::LeakyRelu:
+      return x >= 0.0f ? x : f.parameter * x;
+    case ActivationKind::Sigmoid:
+      return 1.0f / (1.0f + approx_exp(-f.parameter * x, f.accuracy));
+    case ActivationKind::Tanh:
+      return 1.0f - 2.0f / (approx_exp(2.0f * x, f.accuracy) + 1.0f);
+    case ActivationKind::Gelu:
+      return x / (1.0f + approx_exp(x * (gelu_a + gelu_b * x * x),
+                                    f.accuracy));
+  }
+  return x;
+}
+
+// f'(x) of one value with y = f(x)
+inline float
+activate_grad(const Activation& f, float x, float y)
+{
+  switch (f.kind) {
+    case ActivationKind::Identity:
+      return 1.0f;
+    case ActivationKind::Step:
+      return 0.0f;
+    case ActivationKind::Relu:
+      return x >= 0.0f ? 1.0f : 0.0f;
+    case ActivationKind::LeakyRelu:
+      return x >= 0.0f ? 1.0f : f.parameter;
+    case ActivationKind::Sigmoid:
+      return f.parameter * y * (1.0f - y);
+    case ActivationKind::Tanh:
+      return 1.0f - y * y;
+    case ActivationKind::Gelu: {
+      float s =
+        1.0f /
+        (1.0f + approx_exp(x * (gelu_a + gelu_b * x * x), f.accuracy));
+      return s - x * s * (1.0f - s) * (gelu_a + 3.0f * gelu_b * x * x);
+    }
+  }
+  return 1.0f;
+}
+
+inline void
+activate(const Activation& f, const float* x, float* y, std::size_t n)
+{
+  for (std::size_t i = 0; i < n; ++i) {
+    y[i] = activate(f, x[i]);
+  }
+}
+
+inline void
+activate_grad(const Activation& f, const float* x, const float* y,
+              const float* dy, float* dx, std::size_t n)
+{
+  for (std::size_t i = 0; i < n; ++i) {
+    dx[i] = dy[i] * activate_grad(f, x[i], y[i]);
+  }
+}
+
+inline float
+softmax(Accuracy accuracy, const float* x, float* y, std::size_t n)
+{
+  float max = -INFINITY;
+  for (std::size_t i = 0; i < n; ++i) {
+    max = std::max(max, x[i]);
+  }
+  float sum = 0.0f;
+  for (std::size_t i = 0; i < n; ++i) {
+    y[i] = approx_exp(x[i] - max, accuracy);
+    sum += y[i];
+  }
+  float scale = 1.0f / sum;
+  for (std::size_t i = 0; i < n; ++i) {
+    y[i] *= scale;
+  }
+  return max + std::log(sum);
+}
+
+inline void
+dropout(std::uint32_t key, std::uint32_t threshold, float scale,
+        const float* x, float* y, std::size_t n)
+{
+  for (std::size_t i = 0; i < n; ++i) {
+    auto bits = random_bits(key, static_cast<std::uint32_t>(i)) >> 8;
+    y[i] = bits >= threshold ? scale * x[i] : 0.0f;
+  }
+}
+
+inline void
+sparse_gemv(std::size_t nnz, const std::uint32_t* indices, const float* values,
+            const float* w, std::size_t ldw, float* y, std::size_t n)
+{
+  for (std::size_t i = 0; i < nnz; ++i) {
+    const float* row = w + indices[i] * ldw;
+    for (std::size_t j = 0; j < n; ++j) {
+      y[j] += values[i] * row[j];
+    }
+  }
+}
+
+inline float
+sparse_dot(std::size_t nnz, const std::uint32_t* indices, const float* values,
+           const float* x)
+{
+  float sum = 0.0f;
+  for (std::size_t i = 0; i < nnz; ++i) {
+    sum += values[i] * x[indices[i]];
+  }
+  return sum;
+}
+
+inline void
+block_sparse_gemv(std::size_t nblocks, const std::uint32_t* indices,
+                  const float* blocks, const float* x, float* y)
+{
+  for (std::size_t i = 0; i < nblocks; ++i) {
+    const float* block = blocks + i * sparse_block_size;
+    for (std::size_t j = 0; j < sparse_block_size; ++j) {
+      y[j] += x[indices[i]] * block[j];
+    }
+  }
+}
+
+}
+
+#ifdef NNETS_X86_DISPATCH
+
+namespace detail::avx2 {
+
+#define NNETS_TARGET_AVX2 __attribute__((target("avx2,fma,f16c")))
+
+inline constexpr std::size_t gemm_mr = 6;
+inline constexpr std::size_t gemm_nr = 16;
+
+NNETS_TARGET_AVX2 inline void
+gemm_micro_kernel(std::size_t kc, float alpha, const float* a, const float* b,
+                  float* c, std::size_t ldc, std::size_t mr, std::size_t nr)
+{
+  __m256 acc[gemm_mr][2];
+  for (auto& row : acc) {
+    row[0] = _mm256_setzero_ps();
+    row[1] = _mm256_setzero_ps();
+  }
+
+  for (std::size_t p = 0; p < kc; ++p) {
+    __m256 b0 = _mm256_loadu_ps(b + p * gemm_nr);
+    __m256 b1 = _mm256_loadu_ps(b + p * gemm_nr + 8);
+    for (std::size_t r = 0; r < gemm_mr; ++r) {
+      __m256 a_val = _mm256_broadcast_ss(a + p * gemm_mr + r);
+      acc[r][0] = _mm256_fmadd_ps(a_val, b0, acc[r][0]);
+      acc[r][1] = _mm256_fmadd_ps(a_val, b1, acc[r][1]);
+    }
+  }
+
+  __m256 alpha_vec = _mm256_set1_ps(alpha);
+
+  if (mr == gemm_mr and nr == gemm_nr) {
+    for (std::size_t r = 0; r < gemm_mr; ++r) {
+      float* c_row = c + r * ldc;
+      _mm256_storeu_ps(
+        c_row,
+        _mm256_fmadd_ps(alpha_vec, acc[r][0], _mm256_loadu_ps(c_row)));
+      _mm256_storeu_ps(
+        c_row + 8,
+        _mm256_fmadd_ps(alpha_vec, acc[r][1], _mm256_loadu_ps(c_row + 8)));
+    }
+    return;
+  }
+
+  // Edge tile
+  alignas(32) float tile[gemm_mr][gemm_nr];
+  for (std::size_t r = 0; r < gemm_mr; ++r) {
+    _mm256_store_ps(tile[r], acc[r][0]);
+    _mm256_store_ps(tile[r] + 8, acc[r][1]);
+  }
+  for (std::size_t r = 0; r < mr; ++r) {
+    for (std::size_t col = 0; col < nr; ++col) {
+      c[r * ldc + col] += alpha * tile[r][col];
+    }
+  }
+}
+
+NNETS_TARGET_AVX2 inline float
+dot(const float* x, const float* y, std::size_t n)
+{
+  __m256 acc0 = _mm256_setzero_ps();
+  __m256 acc1 = _mm256_setzero_ps();
+  std::size_t i = 0;
+  for (; i + 16 <= n; i += 16) {
+    acc0 =
+      _mm256_fmadd_ps(_mm256_loadu_ps(x + i), _mm256_loadu_ps(y + i), acc0);
+    acc1 = _mm256_fmadd_ps(
+      _mm256_loadu_ps(x + i + 8), _mm256_loadu_ps(y + i + 8), acc1);
+  }
+
+  alignas(32) float lanes[8];
+  _mm256_store_ps(lanes, _mm256_add_ps(acc0, acc1));
+  float sum = 0.0f;
+  for (float value : lanes) {
+    sum += value;
+  }
+  for (; i < n; ++i) {
+    sum += x[i] * y[i];
+  }
+  return sum;
+}
+
+NNETS_TARGET_AVX2 inline void
+axpy(float alpha, const float* x, float* y, std::size_t n)
+{
+  __m256 alpha_vec = _mm256_set1_ps(alpha);
+  std::size_t i = 0;
+  for (; i + 8 <= n; i += 8) {
+    __m256 y_vec = _mm256_loadu_ps(y + i);
+    _mm256_storeu_ps(
+      y + i, _mm256_fmadd_ps(alpha_vec, _mm256_loadu_ps(x + i), y_vec));
+  }
+  for (; i < n; ++i) {
+    y[i] += alpha * x[i];
+  }
+}
+
+NNETS_TARGET_AVX2 inline void
+sgd(const OptimizerStep& step, float* params, const float* grads,
+    float* velocity, std::size_t n)
+{
+  __m256 grad_scale = _mm256_set1_ps(step.grad_scale);
+  __m256 l2_decay = _mm256_set1_ps(step.l2_decay);
+  __m256 keep =
+    _mm256_set1_ps(1.0f - step.learning_rate * step.decoupled_decay);
+  __m256 rate = _mm256_set1_ps(step.learning_rate);
+  __m256 momentum = _mm256_set1_ps(step.momentum);
+  std::size_t i = 0;
+  for (; i + 8 <= n; i += 8) {
+    __m256 param = _mm256_loadu_ps(params + i);
+    __m256 grad = _mm256_fmadd_ps(
+      l2_decay, param, _mm256_mul_ps(grad_scale, _mm256_loadu_ps(grads + i)));
+    __m256 vel = _mm256_fmadd_ps(momentum, _mm256_loadu_ps(velocity + i), grad);
+    _mm256_storeu_ps(velocity + i, vel);
+    _mm256_storeu_ps(params + i,
+                     _mm256_fnmadd_ps(rate, vel, _mm256_mul_ps(keep, param)));
+  }
+  scalar::sgd(step, params + i, grads + i, velocity + i, n - i);
+}
+
+NNETS_TARGET_AVX2 inline void
+rms_prop(const OptimizerStep& step, float* params, const float* grads,
+         float* history, std::size_t n)
+{
+  __m256 grad_scale = _mm256_set1_ps(step.grad_scale);
+  __m256 l2_decay = _mm256_set1_ps(step.l2_decay);
+  __m256 keep =
+    _mm256_set1_ps(1.0f - step.learning_rate * step.decoupled_decay);
+  __m256 influence = _mm256_set1_ps(step.history_influence);
+  __m256 complement = _mm256_set1_ps(1.0f - step.history_influence);
+  __m256 rate = _mm256_set1_ps(step.learning_rate);
+  __m256 epsilon = _mm256_set1_ps(step.epsilon);
+  std::size_t i = 0;
+  for (; i + 8 <= n; i += 8) {
+    __m256 param = _mm256_loadu_ps(params + i);
+    __m256 grad = _mm256_fmadd_ps(
+      l2_decay, param, _mm256_mul_ps(grad_scale, _mm256_loadu_ps(grads + i)));
+    __m256 hist = _mm256_mul_ps(influence, _mm256_loadu_ps(history + i));
+    hist = _mm256_fmadd_ps(_mm256_mul_ps(complement, grad), grad, hist);
+    _mm256_storeu_ps(history + i, hist);
+    __m256 factor =
+      _mm256_div_ps(rate, _mm256_sqrt_ps(_mm256_add_ps(hist, epsilon)));
+    _mm256_storeu_ps(
+      params + i, _mm256_fnmadd_ps(factor, grad, _mm256_mul_ps(keep, param)));
+  }
+  scalar::rms_prop(step, params + i, grads + i, history + i, n - i);
+}
+
+NNETS_TARGET_AVX2 inline void
+adam(const OptimizerStep& step, float* params, const float* grads,
+     float* first, float* second, std::size_t n)
+{
+  __m256 grad_scale = _mm256_set1_ps(step.grad_scale);
+  __m256 l2_decay = _mm256_set1_ps(step.l2_decay);
+  __m256 keep =
+    _mm256_set1_ps(1.0f - step.learning_rate * step.decoupled_decay);
+  __m256 beta1 = _mm256_set1_ps(step.momentum);
+  __m256 complement1 = _mm256_set1_ps(1.0f - step.momentum);
+  __m256 beta2 = _mm256_set1_ps(step.history_influence);
+  __m256 complement2 = _mm256_set1_ps(1.0f - step.history_influence);
+  __m256 rate = _mm256_set1_ps(step.learning_rate *
+                               step.first_moment_correction);
+  __m256 correction2 = _mm256_set1_ps(step.second_moment_correction);
+  __m256 epsilon = _mm256_set1_ps(step.epsilon);
+  std::size_t i = 0;
+  for (; i + 8 <= n; i += 8) {
+    __m256 param = _mm256_loadu_ps(params + i);
+    __m256 grad = _mm256_fmadd_ps(
+      l2_decay, param, _mm256_mul_ps(grad_scale, _mm256_loadu_ps(grads + i)));
+    __m256 m = _mm256_fmadd_ps(
+      complement1, grad, _mm256_mul_ps(beta1, _mm256_loadu_ps(first + i)));
+    __m256 v =
+      _mm256_fmadd_ps(_mm256_mul_ps(complement2, grad),
+                      grad,
+                      _mm256_mul_ps(beta2, _mm256_loadu_ps(second + i)));
+    _mm256_storeu_ps(first + i, m);
+    _mm256_storeu_ps(second + i, v);
+    __m256 denominator =
+      _mm256_add_ps(_mm256_sqrt_ps(_mm256_mul_ps(v, correction2)), epsilon);
+    _mm256_storeu_ps(params + i,
+                     _mm256_fnmadd_ps(rate,
+                                      _mm256_div_ps(m, denominator),
+                                      _mm256_mul_ps(keep, param)));
+  }
+  scalar::adam(step, params + i, grads + i, first + i, second + i, n - i);
+}
+
+NNETS_TARGET_AVX2 inline void
+widen_bf16(const BFloat16* src, float* dst, std::size_t n)
+{
+  std::size_t i = 0;
+  for (; i + 8 <= n; i += 8) {
+    __m256i bits = _mm256_cvtepu16_epi32(
+      _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + i)));
+    _mm256_storeu_ps(dst + i,
+                     _mm256_castsi256_ps(_mm256_slli_epi32(bits, 16)));
+  }
+  scalar::widen_bf16(src + i, dst + i, n - i);
+}
+
+NNETS_TARGET_AVX2 inline void
+widen_fp16(const Float16* src, float* dst, std::size_t n)
+{
+  std::size_t i = 0;
+  for (; i + 8 <= n; i += 8) {
+    _mm256_storeu_ps(dst + i,
+                     _mm256_cvtph_ps(_mm_loadu_si128(
+                       reinterpret_cast<const __m128i*>(src + i))));
+  }
+  scalar::widen_fp16(src + i, dst + i, n - i);
+}
+
+NNETS_TARGET_AVX2 inline void
+narrow_bf16(const float* src, BFloat16* dst, std::size_t n)
+{
+  __m256i round_bias = _mm256_set1_epi32(0x7fff);
+  __m256i one = _mm256_set1_epi32(1);
+  __m256i quiet_bit = _mm256_set1_epi32(0x400000);
+  std::size_t i = 0;
+  for (; i + 8 <= n; i += 8) {
+    __m256 value = _mm256_loadu_ps(src + i);
+    __m256i bits = _mm256_castps_si256(value);
+    __m256i lsb = _mm256_and_si256(_mm256_srli_epi32(bits, 16), one);
+    __m256i rounded =
+      _mm256_add_epi32(bits, _mm256_add_epi32(lsb, round_bias));
+    __m256 nan = _mm256_cmp_ps(value, value, _CMP_UNORD_Q);
+    rounded = _mm256_blendv_epi8(rounded,
+                                 _mm256_or_si256(bits, quiet_bit),
+                                 _mm256_castps_si256(nan));
+    // Pack the upper halves of the 8 lanes into 8 consecutive uint16
+    __m256i upper = _mm256_srli_epi32(rounded, 16);
+    __m256i packed = _mm256_permute4x64_epi64(
+      _mm256_packus_epi32(upper, upper), 0xd8);
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(dst + i),
+                     _mm256_castsi256_si128(packed));
+  }
+  scalar::narrow_bf16(src + i, dst + i, n - i);
+}
+
+NNETS_TARGET_AVX2 inline void
+narrow_fp16(const float* src, Float16* dst, std::size_t n)
+{
+  std::size_t i = 0;
+  for (; i + 8 <= n; i += 8) {
+    _mm_storeu_si128(
+      reinterpret_cast<__m128i*>(dst + i),
+      _mm256_cvtps_ph(_mm256_loadu_ps(src + i), _MM_FROUND_TO_NEAREST_INT));
+  }
+  scalar::narrow_fp16(src + i, dst + i, n - i);
+}
+
+template<std::size_t Terms>
+NNETS_TARGET_AVX2 inline __m256
+approx_exp(__m256 x, const __m256 (&q)[Terms])
+{
+  x = _mm256_min_ps(_mm256_max_ps(x, _mm256_set1_ps(exp_min)),
+                    _mm256_set1_ps(exp_max));
+  __m256 n =
+    _mm256_round_ps(_mm256_mul_ps(x, _mm256_set1_ps(log2e)),
+                    _MM_FROUND_TO_NEAREST_INT | _MM_FROUND_NO_EXC);
+  __m256 r = _mm256_fnmadd_ps(n, _mm256_set1_ps(ln2_hi), x);
+  r = _mm256_fnmadd_ps(n, _mm256_set1_ps(ln2_lo), r);
+  __m256 p = q[0];
+  for (std::size_t k = 1; k < Terms; ++k) {
+    p = _mm256_fmadd_ps(p, r, q[k]);
+  }
+  p = _mm256_fmadd_ps(
+    p, _mm256_mul_ps(r, r), _mm256_add_ps(r, _mm256_set1_ps(1.0f)));
+  // 2^n built in the exponent field
+  __m256i exponent = _mm256_slli_epi32(
+    _mm256_add_epi32(_mm256_cvtps_epi32(n), _mm256_set1_epi32(127)), 23);
+  return _mm256_mul_ps(p, _mm256_castsi256_ps(exponent));
+}
+
+// 1 / (1 + exp(z))
+template<std::size_t Terms>
+NNETS_TARGET_AVX2 inline __m256
+reciprocal_one_plus_exp(__m256 z, const __m256 (&q)[Terms])
+{
+  __m256 one = _mm256_set1_ps(1.0f);
+  return _mm256_div_ps(one, _mm256_add_ps(one, approx_exp(z, q)));
+}
+
+template<std::size_t Terms>
+NNETS_TARGET_AVX2 inline void
+activate(const Activation& f, const float (&coefficients)[Terms],
+         const float* x, float* y, std::size_t n)
+{
+  __m256 q[Terms];
+  for (std::size_t k = 0; k < Terms; ++k) {
+    q[k] = _mm256_set1_ps(coefficients[k]);
+  }
+  __m256 zero = _mm256_setzero_ps();
+  __m256 one = _mm256_set1_ps(1.0f);
+  __m256 two = _mm256_set1_ps(2.0f);
+  __m256 parameter = _mm256_set1_ps(f.parameter);
+  __m256 gelu_a_vec = _mm256_set1_ps(gelu_a);
+  __m256 gelu_b_vec = _mm256_set1_ps(gelu_b);
+  std::size_t i = 0;
+  for (; i + 8 <= n; i += 8) {
+    __m256 v = _mm256_loadu_ps(x + i);
+    __m256 result;
+    switch (f.kind) {
+      case ActivationKind::Identity:
+        result = v;
+        break;
+      case ActivationKind::Step:
+        result = _mm256_and_ps(_mm256_cmp_ps(v, zero, _CMP_GE_OQ), one);
+        break;
+      case ActivationKind::Relu:
+        result = _mm256_max_ps(v, zero);
+        break;
+      case ActivationKind::LeakyRelu:
+        result = _mm256_blendv_ps(_mm256_mul_ps(parameter, v),
+                                  v,
+                                  _mm256_cmp_ps(v, zero, _CMP_GE_OQ));
+        break;
+      case ActivationKind::Sigmoid:
+        result = reciprocal_one_plus_exp(
+          _mm256_mul_ps(_mm256_sub_ps(zero, parameter), v), q);
+        break;
+      case ActivationKind::Tanh:
+        result = _mm256_fnmadd_ps(
+          two, reciprocal_one_plus_exp(_mm256_mul_ps(two, v), q), one);
+        break;
+      default:
+        result = _mm256_mul_ps(
+          v,
+          reciprocal_one_plus_exp(
+            _mm256_mul_ps(
+              v,
+              _mm256_fmadd_ps(gelu_b_vec, _mm256_mul_ps(v, v), gelu_a_vec)),
+            q));
+        break;
+    }
+    _mm256_storeu_ps(y + i, result);
+  }
+  scalar::activate(f, x + i, y + i, n - i);
+}
+
+NNETS_TARGET_AVX2 inline void
+activate(const Activation& f, const float* x, float* y, std::size_t n)
+{
+  switch (f.accuracy) {
+    case Accuracy::Fast:
+      return activate(f, exp_fast, x, y, n);
+    case Accuracy::Balanced:
+      return activate(f, exp_balanced, x, y, n);
+    default:
+      return activate(f, exp_precise, x, y, n);
+  }
+}
+
+template<std::size_t Terms>
+NNETS_TARGET_AVX2 inline void
+activate_grad(const Activation& f, const float (&coefficients)[Terms],
+              const float* x, const float* y, const float* dy, float* dx,
+              std::size_t n)
+{
+  __m256 q[Terms];
+  for (std::size_t k = 0; k < Terms; ++k) {
+    q[k] = _mm256_set1_ps(coefficients[k]);
+  }
+  __m256 zero = _mm256_setzero_ps();
+  __m256 one = _mm256_set1_ps(1.0f);
+  __m256 parameter = _mm256_set1_ps(f.parameter);
+  __m256 gelu_a_vec = _mm256_set1_ps(gelu_a);
+  __m256 gelu_b_vec = _mm256_set1_ps(gelu_b);
+  __m256 gelu_3b_vec = _mm256_set1_ps(3.0f * gelu_b);
+  std::size_t i = 0;
+  for (; i + 8 <= n; i += 8) {
+    __m256 v = _mm256_loadu_ps(x + i);
+    __m256 out = _mm256_loadu_ps(y + i);
+    __m256 grad = _mm256_loadu_ps(dy + i);
+    __m256 result;
+    switch (f.kind) {
+      case ActivationKind::Identity:
+        result = grad;
+        break;
+      case ActivationKind::Step:
+        result = zero;
+        break;
+      case ActivationKind::Relu:
+        result = _mm256_and_ps(_mm256_cmp_ps(v, zero, _CMP_GE_OQ), grad);
+        break;
+      case ActivationKind::LeakyRelu:
+        result = _mm256_blendv_ps(_mm256_mul_ps(parameter, grad),
+                                  grad,
+                                  _mm256_cmp_ps(v, zero, _CMP_GE_OQ));
+        break;
+      case ActivationKind::Sigmoid:
+        result = _mm256_mul_ps(
+          _mm256_mul_ps(parameter, grad),
+          _mm256_mul_ps(out, _mm256_sub_ps(one, out)));
+        break;
+      case ActivationKind::Tanh:
+        result = _mm256_mul_ps(grad, _mm256_fnmadd_ps(out, out, one));
+        break;
+      default: {
+        __m256 v2 = _mm256_mul_ps(v, v);
+        __m256 s = reciprocal_one_plus_exp(
+          _mm256_mul_ps(v, _mm256_fmadd_ps(gelu_b_vec, v2, gelu_a_vec)), q);
+        __m256 slope = _mm256_fmadd_ps(gelu_3b_vec, v2, gelu_a_vec);
+        // s - x * s * (1 - s) * slope
+        __m256 derivative = _mm256_fnmadd_ps(
+          _mm256_mul_ps(v, s), _mm256_mul_ps(_mm256_sub_ps(one, s), slope), s);
+        result = _mm256_mul_ps(grad, derivative);
+        break;
+      }
+    }
+    _mm256_storeu_ps(dx + i, result);
+  }
+  scalar::activate_grad(f, x + i, y + i, dy + i, dx + i, n - i);
+}
+
+NNETS_TARGET_AVX2 inline void
+activate_grad(const Activation& f, const float* x, const float* y,
+              const float* dy, float* dx, std::size_t n)
+{
+  switch (f.accuracy) {
+    case Accuracy::Fast:
+      return activate_grad(f, exp_fast, x, y, dy, dx, n);
+    case Accuracy::Balanced:
+      return activate_grad(f, exp_balanced, x, y, dy, dx, n);
+    default:
+      return activate_grad(f, exp_precise, x, y, dy, dx, n);
+  }
+}
+
+template<std::size_t Terms>
+NNETS_TARGET_AVX2 inline float
+softmax(const float (&coefficients)[Terms], const float* x, float* y,
+        std::size_t n)
+{
+  __m256 q[Terms];
+  for (std::size_t k = 0; k < Terms; ++k) {
+    q[k] = _mm256_set1_ps(coefficients[k]);
+  }
+
+  __m256 max_vec = _mm256_set1_ps(-INFINITY);
+  std::size_t i = 0;
+  for (; i + 8 <= n; i += 8) {
+    max_vec = _mm256_max_ps(max_vec, _mm256_loadu_ps(x + i));
+  }
+  alignas(32) float lanes[8];
+  _mm256_store_ps(lanes, max_vec);
+  float max = -INFINITY;
+  for (float value : lanes) {
+    max = std::max(max, value);
+  }
+  for (; i < n; ++i) {
+    max = std::max(max, x[i]);
+  }
+
+  max_vec = _mm256_set1_ps(max);
+  __m256 sum_vec = _mm256_setzero_ps();
+  for (i = 0; i + 8 <= n; i += 8) {
+    __m256 e = approx_exp(_mm256_sub_ps(_mm256_loadu_ps(x + i), max_vec), q);
+    _mm256_storeu_ps(y + i, e);
+    sum_vec = _mm256_add_ps(sum_vec, e);
+  }
+  _mm256_store_ps(lanes, sum_vec);
+  float sum = 0.0f;
+  for (float value : lanes) {
+    sum += value;
+  }
+  for (; i < n; ++i) {
+    y[i] = scalar::approx_exp(x[i] - max, coefficients);
+    sum += y[i];
+  }
+
+  __m256 scale = _mm256_set1_ps(1.0f / sum);
+  for (i = 0; i + 8 <= n; i += 8) {
+    _mm256_storeu_ps(y + i, _mm256_mul_ps(scale, _mm256_loadu_ps(y + i)));
+  }
+  for (; i < n; ++i) {
+    y[i] *= 1.0f / sum;
+  }
+  return max + std::log(sum);
+}
+
+NNETS_TARGET_AVX2 inline float
+softmax(Accuracy accuracy, const float* x, float* y, std::size_t n)
+{
+  switch (accuracy) {
+    case Accuracy::Fast:
+      return softmax(exp_fast, x, y, n);
+    case Accuracy::Balanced:
+      return softmax(exp_balanced, x, y, n);
+    default:
+      return softmax(exp_precise, x, y, n);
+  }
+}
+
+NNETS_TARGET_AVX2 inline __m256i
+hash32(__m256i x)
+{
+  x = _mm256_xor_si256(x, _mm256_srli_epi32(x, 16));
+  x = _mm256_mullo_epi32(
+    x, _mm256_set1_epi32(static_cast<int>(hash_multiplier_1)));
+  x = _mm256_xor_si256(x, _mm256_srli_epi32(x, 15));
+  x = _mm256_mullo_epi32(
+    x, _mm256_set1_epi32(static_cast<int>(hash_multiplier_2)));
+  return _mm256_xor_si256(x, _mm256_srli_epi32(x, 16));
+}
+
+NNETS_TARGET_AVX2 inline void
+dropout(std::uint32_t key, std::uint32_t threshold, float scale,
+        const float* x, float* y, std::size_t n)
+{
+  __m256i key_vec = _mm256_set1_epi32(static_cast<int>(key));
+  // 24 bit values compare the same signed, threshold 0 keeps everything
+  __m256i below = _mm256_set1_epi32(static_cast<int>(threshold) - 1);
+  __m256i counter = _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7);
+  __m256i step = _mm256_set1_epi32(8);
+  __m256 scale_vec = _mm256_set1_ps(scale);
+
+  std::size_t i = 0;
+  for (; i + 8 <= n; i += 8) {
+    __m256i bits = _mm256_srli_epi32(
+      hash32(_mm256_xor_si256(hash32(counter), key_vec)), 8);
+    __m256 keep = _mm256_castsi256_ps(_mm256_cmpgt_epi32(bits, below));
+    _mm256_storeu_ps(
+      y + i,
+      _mm256_and_ps(keep, _mm256_mul_ps(scale_vec, _mm256_loadu_ps(x + i))));
+    counter = _mm256_add_epi32(counter, step);
+  }
+  for (; i < n; ++i) {
+    auto bits = random_bits(key, static_cast<std::uint32_t>(i)) >> 8;
+    y[i] = bits >= threshold ? scale * x[i] : 0.0f;
+  }
+}
+
+// Columns [0, 8 * Vectors) of sparse_gemv()
+template<std::size_t Vectors>
+NNETS_TARGET_AVX2 inline void
+sparse_gemv_tile(std::size_t nnz, const std::uint32_t* indices,
+                 const float* values, const float* w, std::size_t ldw,
+                 float* y)
+{
+  __m256 acc[Vectors];
+  for (std::size_t t = 0; t < Vectors; ++t) {
+    acc[t] = _mm256_loadu_ps(y + 8 * t);
+  }
+  for (std::size_t i = 0; i < nnz; ++i) {
+    __m256 value = _mm256_set1_ps(values[i]);
+    const float* row = w + indices[i] * ldw;
+    for (std::size_t t = 0; t < Vectors; ++t) {
+      acc[t] = _mm256_fmadd_ps(value, _mm256_loadu_ps(row + 8 * t), acc[t]);
+    }
+  }
+  for (std::size_t t = 0; t < Vectors; ++t) {
+    _mm256_storeu_ps(y + 8 * t, acc[t]);
+  }
+}
+
+NNETS_TARGET_AVX2 inline void
+sparse_gemv(std::size_t nnz, const std::uint32_t* indices, const float* values,
+            const float* w, std::size_t ldw, float* y, std::size_t n)
+{
+  constexpr std::size_t tile = 64;
+  std::size_t j = 0;
+  for (; j + tile <= n; j += tile) {
+    sparse_gemv_tile<tile / 8>(nnz, indices, values, w + j, ldw, y + j);
+  }
+
+  switch ((n - j) / 8) {
+    case 7:
+      sparse_gemv_tile<7>(nnz, indices, values, w + j, ldw, y + j);
+      break;
+    case 6:
+      sparse_gemv_tile<6>(nnz, indices, values, w + j, ldw, y + j);
+      break;
+    case 5:
+      sparse_gemv_tile<5>(nnz, indices, values, w + j, ldw, y + j);
+      break;
+    case 4:
+      sparse_gemv_tile<4>(nnz, indices, values, w + j, ldw, y + j);
+      break;
+    case 3:
+      sparse_gemv_tile<3>(nnz, indices, values, w + j, ldw, y + j);
+      break;
+    case 2:
+      sparse_gemv_tile<2>(nnz, indices, values, w + j, ldw, y + j);
+      break;
+    case 1:
+      sparse_gemv_tile<1>(nnz, indices, values, w + j, ldw, y + j);
+      break;
+    default:
+      break;
+  }
+  j += (n - j) / 8 * 8;
+  scalar::sparse_gemv(nnz, indices, values, w + j, ldw, y + j, n - j);
+}
+
+NNETS_TARGET_AVX2 inline float
+sparse_dot(std::size_t nnz, const std::uint32_t* indices, const float* values,
+           const float* x)
+{
+  __m256 acc0 = _mm256_setzero_ps();
+  __m256 acc1 = _mm256_setzero_ps();
+  std::size_t i = 0;
+  for (; i + 16 <= nnz; i += 16) {
+    auto index0 = _mm256_loadu_si256(
+      reinterpret_cast<const __m256i*>(indices + i));
+    auto index1 = _mm256_loadu_si256(
+      reinterpret_cast<const __m256i*>(indices + i + 8));
+    acc0 = _mm256_fmadd_ps(_mm256_loadu_ps(values + i),
+                           _mm256_i32gather_ps(x, index0, 4),
+                           acc0);
+    acc1 = _mm256_fmadd_ps(_mm256_loadu_ps(values + i + 8),
+                           _mm256_i32gather_ps(x, index1, 4),
+                           acc1);
+  }
+
+  alignas(32) float lanes[8];
+  _mm256_store_ps(lanes, _mm256_add_ps(acc0, acc1));
+  float sum = 0.0f;
+  for (float value : lanes) {
+    sum += value;
+  }
+  for (; i < nnz; ++i) {
+    sum += values[i] * x[indices[i]];
+  }
+  return sum;
+}
+
+NNETS_TARGET_AVX2 inline void
+block_sparse_gemv(std::size_t nblocks, const std::uint32_t* indices,
+                  const float* blocks, const float* x, float* y)
+{
+  static_assert(sparse_block_size == 16);
+  __m256 acc0 = _mm256_loadu_ps(y);
+  __m256 acc1 = _mm256_loadu_ps(y + 8);
+  for (std::size_t i = 0; i < nblocks; ++i) {
+    __m256 value = _mm256_set1_ps(x[indices[i]]);
+    const float* block = blocks + i * sparse_block_size;
+    acc0 = _mm256_fmadd_ps(value, _mm256_loadu_ps(block), acc0);
+    acc1 = _mm256_fmadd_ps(value, _mm256_loadu_ps(block + 8), acc1);
+  }
+  _mm256_storeu_ps(y, acc0);
+  _mm256_storeu_ps(y + 8, acc1);
+}
+
+#undef NNETS_TARGET_AVX2
+
+}
+
+namespace detail::avx512 {
+
+#define NNETS_TARGET_AVX512 __attribute__((target("avx512f,avx2,fma")))
+
+inline constexpr std::size_t gemm_mr = 12;
+inline constexpr std::size_t gemm_nr = 32;
+
+// Full-width forms of intrinsics whose unmasked versions GCC expands with an
+// undefined passthrough vector, raising false uninitialized warnings: the
+// masked versions over all lanes, and horizontal reductions through memory
+// instead of _mm512_reduce_*_ps()
+inline constexpr __mmask16 all_lanes = 0xffff;
+
+NNETS_TARGET_AVX512 inline __m512
+max_ps(__m512 a, __m512 b)
+{
+  return _mm512_mask_max_ps(a, all_lanes, a, b);
+}
+
+NNETS_TARGET_AVX512 inline __m512
+min_ps(__m512 a, __m512 b)
+{
+  return _mm512_mask_min_ps(a, all_lanes, a, b);
+}
+
+NNETS_TARGET_AVX512 inline __m512
+sqrt_ps(__m512 a)
+{
+  return _mm512_mask_sqrt_ps(a, all_lanes, a);
+}
+
+NNETS_TARGET_AVX512 inline __m512
+round_nearest_ps(__m512 a)
+{
+  return _mm512_mask_roundscale_ps(
+    a, all_lanes, a, _MM_FROUND_TO_NEAREST_INT | _MM_FROUND_NO_EXC);
+}
+
+// a * 2^floor(b)
+NNETS_TARGET_AVX512 inline __m512
+scalef_ps(__m512 a, __m512 b)
+{
+  return _mm512_mask_scalef_ps(a, all_lanes, a, b);
+}
+
+template<unsigned Shift>
+NNETS_TARGET_AVX512 inline __m512i
+srli_epi32(__m512i a)
+{
+  return _mm512_mask_srli_epi32(a, all_lanes, a, Shift);
+}
+
+// base[indices]
+NNETS_TARGET_AVX512 inline __m512
+gather_ps(__m512i indices, const float* base)
+{
+  return _mm512_mask_i32gather_ps(
+    _mm512_setzero_ps(), all_lanes, indices, base, 4);
+}
+
+NNETS_TARGET_AVX512 inline float
+reduce_add(__m512 a)
+{
+  alignas(64) float lanes[16];
+  _mm512_store_ps(lanes, a);
+  float sum = 0.0f;
+  for (float value : lanes) {
+    sum += value;
+  }
+  return sum;
+}
+
+NNETS_TARGET_AVX512 inline float
+reduce_max(__m512 a)
+{
+  alignas(64) float lanes[16];
+  _mm512_store_ps(lanes, a);
+  float max = lanes[0];
+  for (float value : lanes) {
+    max = std::max(max, value);
+  }
+  return max;
+}
+
+NNETS_TARGET_AVX512 inline void
+gemm_micro_kernel(std::size_t kc, float alpha, const float* a, const float* b,
+                  float* c, std::size_t ldc, std::size_t mr, std::size_t nr)
+{
+  __m512 acc[gemm_mr][2];
+  for (auto& row : acc) {
+    row[0] = _mm512_setzero_ps();
+    row[1] = _mm512_setzero_ps();
+  }
+
+  for (std::size_t p = 0; p < kc; ++p) {
+    __m512 b0 = _mm512_loadu_ps(b + p * gemm_nr);
+    __m512 b1 = _mm512_loadu_ps(b + p * gemm_nr + 16);
+    for (std::size_t r = 0; r < gemm_mr; ++r) {
+      __m512 a_val = _mm512_set1_ps(a[p * gemm_mr + r]);
+      acc[r][0] = _mm512_fmadd_ps(a_val, b0, acc[r][0]);
+      acc[r][1] = _mm512_fmadd_ps(a_val, b1, acc[r][1]);
+    }
+  }
+
+  __m512 alpha_vec = _mm512_set1_ps(alpha);
+
+  // Masked loads and stores cover partial columns of edge tiles
+  auto mask0 = static_cast<__mmask16>(nr >= 16 ? 0xffff : (1u << nr) - 1);
+  auto mask1 =
+    static_cast<__mmask16>(nr >= 32 ? 0xffff : nr > 16 ? (1u << (nr - 16)) - 1
+                                                        : 0);
+  for (std::size_t r = 0; r < mr; ++r) {
+    float* c_row = c + r * ldc;
+    _mm512_mask_storeu_ps(
+      c_row,
+      mask0,
+      _mm512_fmadd_ps(
+        alpha_vec, acc[r][0], _mm512_maskz_loadu_ps(mask0, c_row)));
+    _mm512_mask_storeu_ps(
+      c_row + 16,
+      mask1,
+      _mm512_fmadd_ps(
+        alpha_vec, acc[r][1], _mm512_maskz_loadu_ps(mask1, c_row + 16)));
+  }
+}
+
+NNETS_TARGET_AVX512 inline float
+dot(const float* x, const float* y, std::size_t n)
+{
+  __m512 acc0 = _mm512_setzero_ps();
+  __m512 acc1 = _mm512_setzero_ps();
+  std::size_t i = 0;
+  for (; i + 32 <= n; i += 32) {
+    acc0 =
+      _mm512_fmadd_ps(_mm512_loadu_ps(x + i), _mm512_loadu_ps(y + i), acc0);
+    acc1 = _mm512_fmadd_ps(
+      _mm512_loadu_ps(x + i + 16), _mm512_loadu_ps(y + i + 16), acc1);
+  }
+  for (; i < n; i += 16) {
+    auto mask = static_cast<__mmask16>(
+      n - i >= 16 ? 0xffff : (1u << (n - i)) - 1);
+    acc0 = _mm512_fmadd_ps(_mm512_maskz_loadu_ps(mask, x + i),
+                           _mm512_maskz_loadu_ps(mask, y + i),
+                           acc0);
+  }
+  return reduce_add(_mm512_add_ps(acc0, acc1));
+}
+
+NNETS_TARGET_AVX512 inline void
+axpy(float alpha, const float* x, float* y, std::size_t n)
+{
+  __m512 alpha_vec = _mm512_set1_ps(alpha);
+  for (std::size_t i = 0; i < n; i += 16) {
+    auto mask = static_cast<__mmask16>(
+      n - i >= 16 ? 0xffff : (1u << (n - i)) - 1);
+    _mm512_mask_storeu_ps(y + i,
+                          mask,
+                          _mm512_fmadd_ps(alpha_vec,
+                                          _mm512_maskz_loadu_ps(mask, x + i),
+                                          _mm512_maskz_loadu_ps(mask, y + i)));
+  }
+}
+
+NNETS_TARGET_AVX512 inline void
+sgd(const OptimizerStep& step, float* params, const float* grads,
+    float* velocity, std::size_t n)
+{
+  __m512 grad_scale = _mm512_set1_ps(step.grad_scale);
+  __m512 l2_decay = _mm512_set1_ps(step.l2_decay);
+  __m512 keep =
+    _mm512_set1_ps(1.0f - step.learning_rate * step.decoupled_decay);
+  __m512 rate = _mm512_set1_ps(step.learning_rate);
+  __m512 momentum = _mm512_set1_ps(step.momentum);
+  for (std::size_t i = 0; i < n; i += 16) {
+    auto mask = static_cast<__mmask16>(
+      n - i >= 16 ? 0xffff : (1u << (n - i)) - 1);
+    __m512 param = _mm512_maskz_loadu_ps(mask, params + i);
+    __m512 grad = _mm512_fmadd_ps(
+      l2_decay,
+      param,
+      _mm512_mul_ps(grad_scale, _mm512_maskz_loadu_ps(mask, grads + i)));
+    __m512 vel = _mm512_fmadd_ps(
+      momentum, _mm512_maskz_loadu_ps(mask, velocity + i), grad);
+    _mm512_mask_storeu_ps(velocity + i, mask, vel);
+    _mm512_mask_storeu_ps(
+      params + i,
+      mask,
+      _mm512_fnmadd_ps(rate, vel, _mm512_mul_ps(keep, param)));
+  }
+}
+
+NNETS_TARGET_AVX512 inline void
+rms_prop(const OptimizerStep& step, float* params, const float* grads,
+         float* history, std::size_t n)
+{
+  __m512 grad_scale = _mm512_set1_ps(step.grad_scale);
+  __m512 l2_decay = _mm512_set1_ps(step.l2_decay);
+  __m512 keep =
+    _mm512_set1_ps(1.0f - step.learning_rate * step.decoupled_decay);
+  __m512 influence = _mm512_set1_ps(step.history_influence);
+  __m512 complement = _mm512_set1_ps(1.0f - step.history_influence);
+  __m512 rate = _mm512_set1_ps(step.learning_rate);
+  __m512 epsilon = _mm512_set1_ps(step.epsilon);
+  for (std::size_t i = 0; i < n; i += 16) {
+    auto mask = static_cast<__mmask16>(
+      n - i >= 16 ? 0xffff : (1u << (n - i)) - 1);
+    __m512 param = _mm512_maskz_loadu_ps(mask, params + i);
+    __m512 grad = _mm512_fmadd_ps(
+      l2_decay,
+      param,
+      _mm512_mul_ps(grad_scale, _mm512_maskz_loadu_ps(mask, grads + i)));
+    __m512 hist =
+      _mm512_mul_ps(influence, _mm512_maskz_loadu_ps(mask, history + i));
+    hist = _mm512_fmadd_ps(_mm512_mul_ps(complement, grad), grad, hist);
+    _mm512_mask_storeu_ps(history + i, mask, hist);
+    __m512 denominator = _mm512_add_ps(hist, epsilon);
+    denominator = sqrt_ps(denominator);
+    __m512 factor = _mm512_div_ps(rate, denominator);
+    _mm512_mask_storeu_ps(
+      params + i,
+      mask,
+      _mm512_fnmadd_ps(factor, grad, _mm512_mul_ps(keep, param)));
+  }
+}
+
+NNETS_TARGET_AVX512 inline void
+adam(const OptimizerStep& step, float* params, const float* grads,
+     float* first, float* second, std::size_t n)
+{
+  __m512 grad_scale = _mm512_set1_ps(step.grad_scale);
+  __m512 l2_decay = _mm512_set1_ps(step.l2_decay);
+  __m512 keep =
+    _mm512_set1_ps(1.0f - step.learning_rate * step.decoupled_decay);
+  __m512 beta1 = _mm512_set1_ps(step.momentum);
+  __m512 complement1 = _mm512_set1_ps(1.0f - step.momentum);
+  __m512 beta2 = _mm512_set1_ps(step.history_influence);
+  __m512 complement2 = _mm512_set1_ps(1.0f - step.history_influence);
+  __m512 rate = _mm512_set1_ps(step.learning_rate *
+                               step.first_moment_correction);
+  __m512 correction2 = _mm512_set1_ps(step.second_moment_correction);
+  __m512 epsilon = _mm512_set1_ps(step.epsilon);
+  for (std::size_t i = 0; i < n; i += 16) {
+    auto mask = static_cast<__mmask16>(
+      n - i >= 16 ? 0xffff : (1u << (n - i)) - 1);
+    __m512 param = _mm512_maskz_loadu_ps(mask, params + i);
+    __m512 grad = _mm512_fmadd_ps(
+      l2_decay,
+      param,
+      _mm512_mul_ps(grad_scale, _mm512_maskz_loadu_ps(mask, grads + i)));
+    __m512 m = _mm512_fmadd_ps(
+      complement1,
+      grad,
+      _mm512_mul_ps(beta1, _mm512_maskz_loadu_ps(mask, first + i)));
+    __m512 v = _mm512_fmadd_ps(
+      _mm512_mul_ps(complement2, grad),
+      grad,
+      _mm512_mul_ps(beta2, _mm512_maskz_loadu_ps(mask, second + i)));
+    _mm512_mask_storeu_ps(first + i, mask, m);
+    _mm512_mask_storeu_ps(second + i, mask, v);
+    __m512 denominator = _mm512_mul_ps(v, correction2);
+    denominator = sqrt_ps(denominator);
+    denominator = _mm512_add_ps(denominator, epsilon);
+    _mm512_mask_storeu_ps(params + i,
+                          mask,
+                          _mm512_fnmadd_ps(rate,
+                                           _mm512_div_ps(m, denominator),
+                                           _mm512_mul_ps(keep, param)));
+  }
+}
+
+template<std::size_t Terms>
+NNETS_TARGET_AVX512 inline __m512
+approx_exp(__m512 x, const __m512 (&q)[Terms])
+{
+  x = max_ps(x, _mm512_set1_ps(exp_min));
+  x = min_ps(x, _mm512_set1_ps(exp_max));
+  __m512 n = round_nearest_ps(_mm512_mul_ps(x, _mm512_set1_ps(log2e)));
+  __m512 r = _mm512_fnmadd_ps(n, _mm512_set1_ps(ln2_hi), x);
+  r = _mm512_fnmadd_ps(n, _mm512_set1_ps(ln2_lo), r);
+  __m512 p = q[0];
+  for (std::size_t k = 1; k < Terms; ++k) {
+    p = _mm512_fmadd_ps(p, r, q[k]);
+  }
+  p = _mm512_fmadd_ps(
+    p, _mm512_mul_ps(r, r), _mm512_add_ps(r, _mm512_set1_ps(1.0f)));
+  return scalef_ps(p, n);
+}
+
+// 1 / (1 + exp(z))
+template<std::size_t Terms>
+NNETS_TARGET_AVX512 inline __m512
+reciprocal_one_plus_exp(__m512 z, const __m512 (&q)[Terms])
+{
+  __m512 one = _mm512_set1_ps(1.0f);
+  return _mm512_div_ps(one, _mm512_add_ps(one, approx_exp(z, q)));
+}
+
+template<std::size_t Terms>
+NNETS_TARGET_AVX512 inline void
+activate(const Activation& f, const float (&coefficients)[Terms],
+         const float* x, float* y, std::size_t n)
+{
+  __m512 q[Terms];
+  for (std::size_t k = 0; k < Terms; ++k) {
+    q[k] = _mm512_set1_ps(coefficients[k]);
+  }
+  __m512 zero = _mm512_setzero_ps();
+  __m512 one = _mm512_set1_ps(1.0f);
+  __m512 two = _mm512_set1_ps(2.0f);
+  __m512 parameter = _mm512_set1_ps(f.parameter);
+  __m512 gelu_a_vec = _mm512_set1_ps(gelu_a);
+  __m512 gelu_b_vec = _mm512_set1_ps(gelu_b);
+  for (std::size_t i = 0; i < n; i += 16) {
+    auto mask = static_cast<__mmask16>(
+      n - i >= 16 ? 0xffff : (1u << (n - i)) - 1);
+    __m512 v = _mm512_maskz_loadu_ps(mask, x + i);
+    __m512 result;
+    switch (f.kind) {
+      case ActivationKind::Identity:
+        result = v;
+        break;
+      case ActivationKind::Step:
+        result =
+          _mm512_maskz_mov_ps(_mm512_cmp_ps_mask(v, zero, _CMP_GE_OQ), one);
+        break;
+      case ActivationKind::Relu:
+        result = max_ps(v, zero);
+        break;
+      case ActivationKind::LeakyRelu:
+        result = _mm512_mask_mov_ps(_mm512_mul_ps(parameter, v),
+                                    _mm512_cmp_ps_mask(v, zero, _CMP_GE_OQ),
+                                    v);
+        break;
+      case ActivationKind::Sigmoid:
+        result = reciprocal_one_plus_exp(
+          _mm512_mul_ps(_mm512_sub_ps(zero, parameter), v), q);
+        break;
+      case ActivationKind::Tanh:
+        result = _mm512_fnmadd_ps(
+          two, reciprocal_one_plus_exp(_mm512_mul_ps(two, v), q), one);
+        break;
+      default:
+        result = _mm512_mul_ps(
+          v,
+          reciprocal_one_plus_exp(
+            _mm512_mul_ps(
+              v,
+              _mm512_fmadd_ps(gelu_b_vec, _mm512_mul_ps(v, v), gelu_a_vec)),
+            q));
+        break;
+    }
+    _mm512_mask_storeu_ps(y + i, mask, result);
+  }
+}
+
+NNETS_TARGET_AVX512 inline void
+activate(const Activation& f, const float* x, float* y, std::size_t n)
+{
+  switch (f.accuracy) {
+    case Accuracy::Fast:
+      return activate(f, exp_fast, x, y, n);
+    case Accuracy::Balanced:
+      return activate(f, exp_balanced, x, y, n);
+    default:
+      return activate(f, exp_precise, x, y, n);
+  }
+}
+
+template<std::size_t Terms>
+NNETS_TARGET_AVX512 inline void
+activate_grad(const Activation& f, const float (&coefficients)[Terms],
+              const float* x, const float* y, const float* dy, float* dx,
+              std::size_t n)
+{
+  __m512 q[Terms];
+  for (std::size_t k = 0; k < Terms; ++k) {
+    q[k] = _mm512_set1_ps(coefficients[k]);
+  }
+  __m512 zero = _mm512_setzero_ps();
+  __m512 one = _mm512_set1_ps(1.0f);
+  __m512 parameter = _mm512_set1_ps(f.parameter);
+  __m512 gelu_a_vec = _mm512_set1_ps(gelu_a);
+  __m512 gelu_b_vec = _mm512_set1_ps(gelu_b);
+  __m512 gelu_3b_vec = _mm512_set1_ps(3.0f * gelu_b);
+  for (std::size_t i = 0; i < n; i += 16) {
+    auto mask = static_cast<__mmask16>(
+      n - i >= 16 ? 0xffff : (1u << (n - i)) - 1);
+    __m512 v = _mm512_maskz_loadu_ps(mask, x + i);
+    __m512 out = _mm512_maskz_loadu_ps(mask, y + i);
+    __m512 grad = _mm512_maskz_loadu_ps(mask, dy + i);
+    __m512 result;
+    switch (f.kind) {
+      case ActivationKind::Identity:
+        result = grad;
+        break;
+      case ActivationKind::Step:
+        result = zero;
+        break;
+      case ActivationKind::Relu:
+        result =
+          _mm512_maskz_mov_ps(_mm512_cmp_ps_mask(v, zero, _CMP_GE_OQ), grad);
+        break;
+      case ActivationKind::LeakyRelu:
+        result = _mm512_mask_mov_ps(_mm512_mul_ps(parameter, grad),
+                                    _mm512_cmp_ps_mask(v, zero, _CMP_GE_OQ),
+                                    grad);
+        break;
+      case ActivationKind::Sigmoid:
+        result = _mm512_mul_ps(
+          _mm512_mul_ps(parameter, grad),
+          _mm512_mul_ps(out, _mm512_sub_ps(one, out)));
+        break;
+      case ActivationKind::Tanh:
+        result = _mm512_mul_ps(grad, _mm512_fnmadd_ps(out, out, one));
+        break;
+      default: {
+        __m512 v2 = _mm512_mul_ps(v, v);
+        __m512 s = reciprocal_one_plus_exp(
+          _mm512_mul_ps(v, _mm512_fmadd_ps(gelu_b_vec, v2, gelu_a_vec)), q);
+        __m512 slope = _mm512_fmadd_ps(gelu_3b_vec, v2, gelu_a_vec);
+        // s - x * s * (1 - s) * slope
+        __m512 derivative = _mm512_fnmadd_ps(
+          _mm512_mul_ps(v, s), _mm512_mul_ps(_mm512_sub_ps(one, s), slope), s);
+        result = _mm512_mul_ps(grad, derivative);
+        break;
+      }
+    }
+    _mm512_mask_storeu_ps(dx + i, mask, result);
+  }
+}
+
+NNETS_TARGET_AVX512 inline void
+activate_grad(const Activation& f, const float* x, const float* y,
+              const float* dy, float* dx, std::size_t n)
+{
+  switch (f.accuracy) {
+    case Accuracy::Fast:
+      return activate_grad(f, exp_fast, x, y, dy, dx, n);
+    case Accuracy::Balanced:
+      return activate_grad(f, exp_balanced, x, y, dy, dx, n);
+    default:
+      return activate_grad(f, exp_precise, x, y, dy, dx, n);
+  }
+}
+
+template<std::size_t Terms>
+NNETS_TARGET_AVX512 inline float
+softmax(const float (&coefficients)[Terms], const float* x, float* y,
+        std::size_t n)
+{
+  __m512 q[Terms];
+  for (std::size_t k = 0; k < Terms; ++k) {
+    q[k] = _mm512_set1_ps(coefficients[k]);
+  }
+
+  __m512 max_vec = _mm512_set1_ps(-INFINITY);
+  for (std::size_t i = 0; i < n; i += 16) {
+    auto mask = static_cast<__mmask16>(
+      n - i >= 16 ? 0xffff : (1u << (n - i)) - 1);
+    max_vec = _mm512_mask_max_ps(
+      max_vec, mask, max_vec, _mm512_maskz_loadu_ps(mask, x + i));
+  }
+  float max = reduce_max(max_vec);
+  max_vec = _mm512_set1_ps(max);
+
+  __m512 sum_vec = _mm512_setzero_ps();
+  for (std::size_t i = 0; i < n; i += 16) {
+    auto mask = static_cast<__mmask16>(
+      n - i >= 16 ? 0xffff : (1u << (n - i)) - 1);
+    __m512 e = approx_exp(
+      _mm512_sub_ps(_mm512_maskz_loadu_ps(mask, x + i), max_vec), q);
+    _mm512_mask_storeu_ps(y + i, mask, e);
+    sum_vec = _mm512_mask_add_ps(sum_vec, mask, sum_vec, e);
+  }
+
+  float sum = reduce_add(sum_vec);
+  __m512 scale = _mm512_set1_ps(1.0f / sum);
+  for (std::size_t i = 0; i < n; i += 16) {
+    auto mask = static_cast<__mmask16>(
+      n - i >= 16 ? 0xffff : (1u << (n - i)) - 1);
+    _mm512_mask_storeu_ps(
+      y + i, mask, _mm512_mul_ps(scale, _mm512_maskz_loadu_ps(mask, y + i)));
+  }
+  return max + std::log(sum);
+}
+
+NNETS_TARGET_AVX512 inline float
+softmax(Accuracy accuracy, const float* x, float* y, std::size_t n)
+{
+  switch (accuracy) {
+    case Accuracy::Fast:
+      return softmax(exp_fast, x, y, n);
+    case Accuracy::Balanced:
+      return softmax(exp_balanced, x, y, n);
+    default:
+      return softmax(exp_precise, x, y, n);
+  }
+}
+
+NNETS_TARGET_AVX512 inline __m512i
+hash32(__m512i x)
+{
+  x = _mm512_xor_si512(x, srli_epi32<16>(x));
+  x = _mm512_mullo_epi32(
+    x, _mm512_set1_epi32(static_cast<int>(hash_multiplier_1)));
+  x = _mm512_xor_si512(x, srli_epi32<15>(x));
+  x = _mm512_mullo_epi32(
+    x, _mm512_set1_epi32(static_cast<int>(hash_multiplier_2)));
+  return _mm512_xor_si512(x, srli_epi32<16>(x));
+}
+
+NNETS_TARGET_AVX512 inline void
+dropout(std::uint32_t key, std::uint32_t threshold, float scale,
+        const float* x, float* y, std::size_t n)
+{
+  __m512i key_vec = _mm512_set1_epi32(static_cast<int>(key));
+  __m512i threshold_vec = _mm512_set1_epi32(static_cast<int>(threshold));
+  __m512i counter =
+    _mm512_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15);
+  __m512i step = _mm512_set1_epi32(16);
+  __m512 scale_vec = _mm512_set1_ps(scale);
+
+  for (std::size_t i = 0; i < n; i += 16) {
+    auto mask = static_cast<__mmask16>(
+      n - i >= 16 ? 0xffff : (1u << (n - i)) - 1);
+    __m512i bits = hash32(_mm512_xor_si512(hash32(counter), key_vec));
+    bits = srli_epi32<8>(bits);
+    __mmask16 keep = _mm512_cmpge_epu32_mask(bits, threshold_vec);
+    _mm512_mask_storeu_ps(
+      y + i,
+      mask,
+      _mm512_maskz_mul_ps(
+        keep, scale_vec, _mm512_maskz_loadu_ps(mask, x + i)));
+    counter = _mm512_add_epi32(counter, step);
+  }
+}
+
+// Columns [0, n) of sparse_gemv() with n <= 16 * Vectors, the last vector
+// masked to the remaining columns
+template<std::size_t Vectors>
+NNETS_TARGET_AVX512 inline void
+sparse_gemv_tile(std::size_t nnz, const std::uint32_t* indices,
+                 const float* values, const float* w, std::size_t ldw,
+                 float* y, std::size_t n)
+{
+  __mmask16 masks[Vectors];
+  __m512 acc[Vectors];
+  for (std::size_t t = 0; t < Vectors; ++t) {
+    std::size_t rest = n - 16 * t;
+    masks[t] =
+      static_cast<__mmask16>(rest >= 16 ? 0xffff : (1u << rest) - 1);
+    acc[t] = _mm512_maskz_loadu_ps(masks[t], y + 16 * t);
+  }
+  for (std::size_t i = 0; i < nnz; ++i) {
+    __m512 value = _mm512_set1_ps(values[i]);
+    const float* row = w + indices[i] * ldw;
+    for (std::size_t t = 0; t < Vectors; ++t) {
+      acc[t] = _mm512_fmadd_ps(
+        value, _mm512_maskz_loadu_ps(masks[t], row + 16 * t), acc[t]);
+    }
+  }
+  for (std::size_t t = 0; t < Vectors; ++t) {
+    _mm512_mask_storeu_ps(y + 16 * t, masks[t], acc[t]);
+  }
+}
+
+NNETS_TARGET_AVX512 inline void
+sparse_gemv(std::size_t nnz, const std::uint32_t* indices, const float* values,
+            const float* w, std::size_t ldw, float* y, std::size_t n)
+{
+  constexpr std::size_t tile = 128;
+  std::size_t j = 0;
+  for (; j + tile <= n; j += tile) {
+    sparse_gemv_tile<tile / 16>(nnz, indices, values, w + j, ldw, y + j, tile);
+  }
+
+  std::size_t rest = n - j;
+  switch ((rest + 15) / 16) {
+    case 8:
+      sparse_gemv_tile<8>(nnz, indices, values, w + j, ldw, y + j, rest);
+      break;
+    case 7:
+      sparse_gemv_tile<7>(nnz, indices, values, w + j, ldw, y + j, rest);
+      break;
+    case 6:
+      sparse_gemv_tile<6>(nnz, indices, values, w + j, ldw, y + j, rest);
+      break;
+    case 5:
+      sparse_gemv_tile<5>(nnz, indices, values, w + j, ldw, y + j, rest);
+      break;
+    case 4:
+      sparse_gemv_tile<4>(nnz, indices, values, w + j, ldw, y + j, rest);
+      break;
+    case 3:
+      sparse_gemv_tile<3>(nnz, indices, values, w + j, ldw, y + j, rest);
+      break;
+    case 2:
+      sparse_gemv_tile<2>(nnz, indices, values, w + j, ldw, y + j, rest);
+      break;
+    case 1:
+      sparse_gemv_tile<1>(nnz, indices, values, w + j, ldw, y + j, rest);
+      break;
+    default:
+      break;
+  }
+}
+
+NNETS_TARGET_AVX512 inline float
+sparse_dot(std::size_t nnz, const std::uint32_t* indices, const float* values,
+           const float* x)
+{
+  __m512 acc0 = _mm512_setzero_ps();
+  __m512 acc1 = _mm512_setzero_ps();
+  std::size_t i = 0;
+  for (; i + 32 <= nnz; i += 32) {
+    __m512i index0 = _mm512_loadu_si512(indices + i);
+    __m512i index1 = _mm512_loadu_si512(indices + i + 16);
+    acc0 =
+      _mm512_fmadd_ps(_mm512_loadu_ps(values + i), gather_ps(index0, x), acc0);
+    acc1 = _mm512_fmadd_ps(
+      _mm512_loadu_ps(values + i + 16), gather_ps(index1, x), acc1);
+  }
+  for (; i < nnz; i += 16) {
+    auto mask = static_cast<__mmask16>(
+      nnz - i >= 16 ? 0xffff : (1u << (nnz - i)) - 1);
+    __m512i index = _mm512_maskz_loadu_epi32(mask, indices + i);
+    acc0 = _mm512_fmadd_ps(
+      _mm512_maskz_loadu_ps(mask, values + i),
+      _mm512_mask_i32gather_ps(_mm512_setzero_ps(), mask, index, x, 4),
+      acc0);
+  }
+  return reduce_add(_mm512_add_ps(acc0, acc1));
+}
+
+NNETS_TARGET_AVX512 inline void
+block_sparse_gemv(std::size_t nblocks, const std::uint32_t* indices,
+                  const float* blocks, const float* x, float* y)
+{
+  static_assert(sparse_block_size == 16);
+  // Two accumulators hide the FMA latency
+  __m512 acc0 = _mm512_loadu_ps(y);
+  __m512 acc1 = _mm512_setzero_ps();
+  std::size_t i = 0;
+  for (; i + 2 <= nblocks; i += 2) {
+    const float* block = blocks + i * sparse_block_size;
+    acc0 = _mm512_fmadd_ps(
+      _mm512_set1_ps(x[indices[i]]), _mm512_loadu_ps(block), acc0);
+    acc1 = _mm512_fmadd_ps(_mm512_set1_ps(x[indices[i + 1]]),
+                           _mm512_loadu_ps(block + sparse_block_size),
+                           acc1);
+  }
+  if (i < nblocks) {
+    acc0 = _mm512_fmadd_ps(_mm512_set1_ps(x[indices[i]]),
+                           _mm512_loadu_ps(blocks + i * sparse_block_size),
+                           acc0);
+  }
+  _mm512_storeu_ps(y, _mm512_add_ps(acc0, acc1));
+}
+
+#undef NNETS_TARGET_AVX512
+
+}
+
+#endif
+
+namespace detail {
+
+// Kernel table of an instruction set
+template<Isa isa>
+inline constexpr Kernels kernel_table = {
+  Isa::Scalar,               scalar::gemm_mr,    scalar::gemm_nr,
+  scalar::gemm_micro_kernel, scalar::dot,        scalar::axpy,
+  scalar::sgd,               scalar::rms_prop,   scalar::adam,
+  scalar::widen_bf16,        scalar::widen_fp16, scalar::narrow_bf16,
+  scalar::narrow_fp16,       scalar::activate,   scalar::activate_grad,
+  scalar::softmax,           scalar::dropout,    scalar::sparse_gemv,
+  scalar::sparse_dot,        scalar::block_sparse_gemv,
+};
+
+#ifdef NNETS_X86_DISPATCH
+
+template<>
+inline constexpr Kernels kernel_table<Isa::Avx2> = {
+  Isa::Avx2,               avx2::gemm_mr,    avx2::gemm_nr,
+  avx2::gemm_micro_kernel, avx2::dot,        avx2::axpy,
+  avx2::sgd,               avx2::rms_prop,   avx2::adam,
+  avx2::widen_bf16,        avx2::widen_fp16, avx2::narrow_bf16,
+  avx2::narrow_fp16,       avx2::activate,   avx2::activate_grad,
+  avx2::softmax,           avx2::dropout,    avx2::sparse_gemv,
+  avx2::sparse_dot,        avx2::block_sparse_gemv,
+};
+
+// Precision conversions are bound by memory bandwidth, AVX2 is enough
+template<>
+inline constexpr Kernels kernel_table<Isa::Avx512> = {
+  Isa::Avx512,               avx512::gemm_mr,  avx512::gemm_nr,
+  avx512::gemm_micro_kernel, avx512::dot,      avx512::axpy,
+  avx512::sgd,               avx512::rms_prop, avx512::adam,
+  avx2::widen_bf16,          avx2::widen_fp16, avx2::narrow_bf16,
+  avx2::narrow_fp16,         avx512::activate, avx512::activate_grad,
+  avx512::softmax,           avx512::dropout,  avx512::sparse_gemv,
+  avx512::sparse_dot,        avx512::block_sparse_gemv,
+};
+
+#endif
+
+// Best instruction set supported by the CPU, can be lowered with the
+// NNETS_ISA environment variable (scalar, avx2, avx512)
+inline Isa
+detect_isa()
+{
+  auto isa = Isa::Scalar;
+
+#ifdef NNETS_X86_DISPATCH
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx2") and __builtin_cpu_supports("fma") and
+      __builtin_cpu_supports("f16c")) {
+    isa = Isa::Avx2;
+  }
+  if (isa == Isa::Avx2 and __builtin_cpu_supports("avx512f")) {
+    isa = Isa::Avx512;
+  }
+#endif
+
+  if (const char* requested = std::getenv("NNETS_ISA")) {
+    auto name = std::string_view{ requested };
+    if (name == "scalar") {
+      isa = Isa::Scalar;
+    } else if (name == "avx2" and isa == Isa::Avx512) {
+      isa = Isa::Avx2;
+    }
+  }
+
+  return isa;
+}
+
+}
+
+// Kernels for the running CPU, selected on first use
+inline const Kernels&
+kernels()
+{
+  static const Kernels& selected = []() -> const Kernels& {
+    switch (detail::detect_isa()) {
+#ifdef NNETS_X86_DISPATCH
+      case Isa::Avx512:
+        return detail::kernel_table<Isa::Avx512>;
+      case Isa::Avx2:
+        return detail::kernel_table<Isa::Avx2>;
+#endif
+      default:
+        return detail::kernel_table<Isa::Scalar>;
+    }
+  }();
+  return selected;
+}
+
+// Printable name of an instruction set
+inline std::string_view
+isa_name(Isa isa)
+{
+  switch (isa) {
+    case Isa::Avx512:
+      return "avx512";
+    case Isa::Avx2:
+      return "avx2";
+    default:
+      return "scalar";
+  }
+}
+
+}
@@ -0,0 +1,370 @@
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <span>
+#include <stdexcept>
+#include <string>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+#include "aligned.hpp"
+#include "fully_connected.hpp"
+#include "quantized.hpp"
+#include "sequence.hpp"
+#include "simd.hpp"
+
+namespace nnets {
+
+// Storage of the nonzero weights of a SparseFullyConnected
+enum class SparseFormat
+{
+  // Compressed sparse rows: per output the input indices and values of its
+  // nonzero weights (suits PruningGranularity::Weight)
+  Csr,
+  // Per tile of sparse_block_size outputs the inputs with any nonzero
+  // weight and the tile's sparse_block_size weights of each (suits
+  // PruningGranularity::Block)
+  Block
+};
+
+// Inference-only fully connected layer storing only the nonzero weights of a
+// pruned layer
+// One sample runs sparse_dot() per output (Csr) or block_sparse_gemv() per
+// tile (Block). Larger Csr batches are transposed to feature-major, so every
+// nonzero weight scales a whole row of inputs in sparse_gemv().
+template<typename ActivationFn>
+class SparseFullyConnected : public IQuantizedModule
+{
+public:
+  // Batches from this size on run the Csr product on transposed inputs
+  static constexpr std::size_t transposed_batch = 4;
+
+  SparseFullyConnected(std::span<const float> weights,
+                       std::span<const float> bias,
+                       ActivationFn activation_fn,
+                       SparseFormat format)
+    : input_size_{ weights.size() / bias.size() }
+    , output_size_{ bias.size() }
+    , activation_fn_{ activation_fn }
+    , format_{ format }
+    , bias_(bias.begin(), bias.end())
+  {
+    if (format == SparseFormat::Csr) {
+      starts_.push_back(0);
+      for (std::size_t j = 0; j < output_size_; ++j) {
+        for (std::size_t k = 0; k < input_size_; ++k) {
+          if (float value = weights[j * input_size_ + k]; value != 0.0f) {
+            indices_.push_back(static_cast<std::uint32_t>(k));
+            values_.push_back(value);
+          }
+        }
+        starts_.push_back(static_cast<std::uint32_t>(indices_.size()));
+      }
+      return;
+    }
+
+    // Rows past output_size_ of the last tile are zero
+    std::size_t tiles = num_tiles();
+    starts_.push_back(0);
+    for (std::size_t t = 0; t < tiles; ++t) {
+      std::size_t rows =
+        std::min(sparse_block_size, output_size_ - t * sparse_block_size);
+      for (std::size_t k = 0; k < input_size_; ++k) {
+        auto block = std::vector<float>(sparse_block_size, 0.0f);
+        bool nonzero = false;
+        for (std::size_t r = 0; r < rows; ++r) {
+          block[r] = weights[(t * sparse_block_size + r) * input_size_ + k];
+          nonzero = nonzero or block[r] != 0.0f;
+        }
+        if (nonzero) {
+          indices_.push_back(static_cast<std::uint32_t>(k));
+          values_.insert(values_.end(), block.begin(), block.end());
+        }
+      }
+      starts_.push_back(static_cast<std::uint32_t>(indices_.size()));
+    }
+    bias_.resize(tiles * sparse_block_size, 0.0f);
+  }
+
+  void
+  forward_batch(std::span<const float> inputs, std::size_t batch) override
+  {
+    const auto& kernel = kernels();
+    potential_.resize(batch * output_size_);
+    output_.resize(batch * output_size_);
+
+    if (format_ == SparseFormat::Block) {
+      tile_.resize(sparse_block_size);
+      for (std::size_t b = 0; b < batch; ++b) {
+        const float* input = inputs.data() + b * input_size_;
+        float* potential = potential_.data() + b * output_size_;
+        for (std::size_t t = 0; t < num_tiles(); ++t) {
+          std::size_t first = t * sparse_block_size;
+          std::copy_n(bias_.data() + first, sparse_block_size, tile_.data());
+          kernel.block_sparse_gemv(starts_[t + 1] - starts_[t],
+                                   indices_.data() + starts_[t],
+                                   values_.data() +
+                                     starts_[t] * sparse_block_size,
+                                   input,
+                                   tile_.data());
+          std::copy_n(tile_.data(),
+                      std::min(sparse_block_size, output_size_ - first),
+                      potential + first);
+        }
+      }
+    } else if (batch < transposed_batch) {
+      for (std::size_t b = 0; b < batch; ++b) {
+        const float* input = inputs.data() + b * input_size_;
+        float* potential = potential_.data() + b * output_size_;
+        for (std::size_t j = 0; j < output_size_; ++j) {
+          std::size_t start = starts_[j];
+          potential[j] = bias_[j] + kernel.sparse_dot(starts_[j + 1] - start,
+                                                      indices_.data() + start,
+                                                      values_.data() + start,
+                                                      input);
+        }
+      }
+    } else {
+      // potential^T = weights * inputs^T, one row of batch values per output
+      transposed_.resize(input_size_ * batch);
+      transposed_potential_.resize(output_size_ * batch);
+      for (std::size_t b = 0; b < batch; ++b) {
+        for (std::size_t k = 0; k < input_size_; ++k) {
+          transposed_[k * batch + b] = inputs[b * input_size_ + k];
+        }
+      }
+      std::ranges::fill(transposed_potential_, 0.0f);
+      for (std::size_t j = 0; j < output_size_; ++j) {
+        kernel.sparse_gemv(starts_[j + 1] - starts_[j],
+                           indices_.data() + starts_[j],
+                           values_.data() + starts_[j],
+                           transposed_.data(),
+                           batch,
+                           transposed_potential_.data() + j * batch,
+                           batch);
+      }
+      for (std::size_t b = 0; b < batch; ++b) {
+        for (std::size_t j = 0; j < output_size_; ++j) {
+          potential_[b * output_size_ + j] =
+            transposed_potential_[j * batch + b] + bias_[j];
+        }
+      }
+    }
+
+    std::size_t size = batch * output_size_;
+    activation_fn_.apply(std::span{ potential_ }.first(size),
+                         std::span{ output_ }.first(size),
+                         output_size_);
+  }
+
+  [[nodiscard]] std::span<const float>
+  output() const override
+  {
+    return output_;
+  }
+
+  [[nodiscard]] std::size_t
+  weight_bytes() const override
+  {
+    return values_.size() * sizeof(float) +
+           (indices_.size() + starts_.size()) * sizeof(std::uint32_t);
+  }
+
+  [[nodiscard]] std::size_t
+  reference_weight_bytes() const override
+  {
+    return input_size_ * output_size_ * sizeof(float);
+  }
+
+  // Stored weights, including the zeros of Block tiles
+  [[nodiscard]] std::size_t
+  stored_weights() const
+  {
+    return values_.size();
+  }
+
+private:
+  [[nodiscard]] std::size_t
+  num_tiles() const
+  {
+    return format_ == SparseFormat::Block
+             ? (output_size_ + sparse_block_size - 1) / sparse_block_size
+             : 0;
+  }
+
+  std::size_t input_size_;
+  std::size_t output_size_;
+  ActivationFn activation_fn_;
+  SparseFormat format_;
+  // Padded to whole tiles for Block
+  std::vector<float> bias_;
+  // Per output (Csr) or tile (Block) the first of its entries in indices_,
+  // and the values of every entry (sparse_block_size for Block)
+  std::vector<std::uint32_t> starts_;
+  std::vector<std::uint32_t> indices_;
+  AlignedVector<float> values_;
+  std::vector<float> potential_;
+  std::vector<float> output_;
+  std::vector<float> tile_;
+  std::vector<float> transposed_;
+  std::vector<float> transposed_potential_;
+};
+
+// Sparse inference copy of a pruned Sequence of
+// FullyConnected<ActivationFn, Precision> layers, the last one may be a
+// FullyConnected<OutputActivationFn, Precision>, every layer stored in format
+// Throws std::invalid_argument for other module types.
+template<typename ActivationFn,
+         typename OutputActivationFn = ActivationFn,
+         typename Precision = Fp32Precision>
+[[nodiscard]] QuantizedSequence
+sparsify(const Sequence& net, SparseFormat format)
+{
+  using Layer = FullyConnected<ActivationFn, Precision>;
+  using OutputLayer = FullyConnected<OutputActivationFn, Precision>;
+
+  const auto& layers = net.modules();
+  auto modules = std::vector<std::unique_ptr<IQuantizedModule>>{};
+  auto add_module = [&]<typename LayerT>(LayerT& layer) {
+    using Fn = std::remove_cvref_t<decltype(layer.activation_fn())>;
+    modules.push_back(std::make_unique<SparseFullyConnected<Fn>>(
+      layer.weights(), layer.bias(), layer.activation_fn(), format));
+  };
+  for (std::size_t l = 0; l < layers.size(); ++l) {
+    if (l + 1 < layers.size()) {
+      if (auto* layer = dynamic_cast<Layer*>(layers[l].get())) {
+        add_module(*layer);
+        continue;
+      }
+    } else if (auto* layer =
+                 dynamic_cast<OutputLayer*>(layers[l].get())) {
+      add_module(*layer);
+      continue;
+    }
+    throw std::invalid_argument{
+      "sparsify() expects a Sequence of FullyConnected layers"
+    };
+  }
+  return QuantizedSequence{ std::move(modules) };
+}
+
+// Copy of a Sequence of FullyConnected<ActivationFn, Precision> layers (the
+// last one a FullyConnected<OutputActivationFn, Precision>) without the
+// hidden neurons whose incoming weights are all zero, e.g. after
+// PruningGranularity::Neuron
+// Such a neuron outputs the constant f(bias), which is folded into the bias
+// of the next layer before the next layer's inputs shrink, so the outputs
+// are unchanged. Throws std::invalid_argument for other module types and
+// when all neurons of a layer are pruned.
+template<typename ActivationFn,
+         typename OutputActivationFn = ActivationFn,
+         typename Precision = Fp32Precision>
+[[nodiscard]] Sequence
+remove_pruned_neurons(const Sequence& net)
+{
+  using Layer = FullyConnected<ActivationFn, Precision>;
+  using OutputLayer = FullyConnected<OutputActivationFn, Precision>;
+
+  const auto& layers = net.modules();
+  if (layers.empty()) {
+    throw std::invalid_argument{ "nothing to remove neurons from" };
+  }
+  auto weights = std::vector<std::span<const float>>{};
+  auto biases = std::vector<std::span<const float>>{};
+  auto activations = std::vector<ActivationFn>{};
+  auto output_activation = OutputActivationFn{};
+  for (std::size_t l = 0; l < layers.size(); ++l) {
+    auto* layer = layers[l].get();
+    if (l + 1 < layers.size()) {
+      if (auto* fc = dynamic_cast<Layer*>(layer)) {
+        weights.push_back(fc->weights());
+        biases.push_back(fc->bias());
+        activations.push_back(fc->activation_fn());
+        continue;
+      }
+    } else if (auto* fc = dynamic_cast<OutputLayer*>(layer)) {
+      weights.push_back(fc->weights());
+      biases.push_back(fc->bias());
+      output_activation = fc->activation_fn();
+      continue;
+    }
+    throw std::invalid_argument{
+      "remove_pruned_neurons() expects a Sequence of FullyConnected layers"
+    };
+  }
+
+  // Inputs kept by the current layer and the bias it inherits from removed
+  // neurons of the previous one
+  std::size_t input_size = weights[0].size() / biases[0].size();
+  auto kept_inputs = std::vector<std::size_t>(input_size);
+  for (std::size_t k = 0; k < input_size; ++k) {
+    kept_inputs[k] = k;
+  }
+  auto removed_inputs = std::vector<std::pair<std::size_t, float>>{};
+
+  auto modules = std::vector<std::shared_ptr<IModule>>{};
+  for (std::size_t l = 0; l < layers.size(); ++l) {
+    bool output_layer = l + 1 == layers.size();
+    std::size_t outputs = biases[l].size();
+    std::size_t inputs = weights[l].size() / outputs;
+
+    auto bias = std::vector<float>(biases[l].begin(), biases[l].end());
+    for (std::size_t j = 0; j < outputs; ++j) {
+      for (auto [k, value] : removed_inputs) {
+        bias[j] += weights[l][j * inputs + k] * value;
+      }
+    }
+
+    auto kept = std::vector<std::size_t>{};
+    auto removed = std::vector<std::pair<std::size_t, float>>{};
+    for (std::size_t j = 0; j < outputs; ++j) {
+      auto row = weights[l].subspan(j * inputs, inputs);
+      bool alive =
+        output_layer or std::ranges::any_of(kept_inputs, [&](std::size_t k) {
+          return row[k] != 0.0f;
+        });
+      if (alive) {
+        kept.push_back(j);
+      } else {
+        removed.emplace_back(j, activations[l](bias[j]));
+      }
+    }
+    if (kept.empty()) {
+      throw std::invalid_argument{ "all neurons of layer " +
+                                   std::to_string(l) + " are pruned" };
+    }
+
+    auto copy_weights = [&](auto& target) {
+      std::size_t kept_size = kept_inputs.size();
+      for (std::size_t r = 0; r < kept.size(); ++r) {
+        for (std::size_t c = 0; c < kept_size; ++c) {
+          target.weights()[r * kept_size + c] =
+            weights[l][kept[r] * inputs + kept_inputs[c]];
+        }
+        target.bias()[r] = bias[kept[r]];
+      }
+      target.parameters_updated();
+    };
+    if (output_layer) {
+      auto target = std::make_shared<OutputLayer>(
+        kept_inputs.size(), kept.size(), output_activation);
+      copy_weights(*target);
+      modules.push_back(target);
+    } else {
+      auto target = std::make_shared<Layer>(
+        kept_inputs.size(), kept.size(), activations[l]);
+      copy_weights(*target);
+      modules.push_back(target);
+    }
+
+    kept_inputs = std::move(kept);
+    removed_inputs = std::move(removed);
+  }
+  return Sequence{ std::move(modules) };
+}
+
+}
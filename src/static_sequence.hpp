@@ -0,0 +1,432 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <cstddef>
+#include <memory>
+#include <span>
+#include <string>
+#include <tuple>
+#include <utility>
+#include <vector>
+
+#include "aligned.hpp"
+#include "gemm.hpp"
+#include "module.hpp"
+#include "random.hpp"
+#include "simd.hpp"
+
+namespace nnets {
+
+// Buffer of Size floats per sample
+// A single sample lives in an inline array, mini-batches in aligned storage
+// that grows on demand (never shrinks).
+template<std::size_t Size>
+class BatchBuffer
+{
+public:
+  [[nodiscard]] float*
+  data(std::size_t batch)
+  {
+    if (batch <= 1) {
+      return single_.data();
+    }
+    if (batched_.size() < batch * Size) {
+      batched_.resize(batch * Size);
+    }
+    return batched_.data();
+  }
+
+  [[nodiscard]] const float*
+  data(std::size_t batch) const
+  {
+    return batch <= 1 ? single_.data() : batched_.data();
+  }
+
+private:
+  alignas(64) std::array<float, Size> single_{};
+  AlignedVector<float> batched_;
+};
+
+// Fully connected layer with sizes fixed at compile time, a stage of
+// StaticSequence
+// Bias, activation and activation derivative are applied in the epilogue of
+// the forward GEMM, so the potential is never written out and backward does
+// not re-evaluate the derivative. Weights are always float.
+template<std::size_t InputSize, std::size_t OutputSize, typename ActivationFn>
+class StaticFullyConnected
+{
+public:
+  static constexpr std::size_t input_size = InputSize;
+  static constexpr std::size_t output_size = OutputSize;
+  // Bias followed by weights
+  static constexpr std::size_t parameter_size =
+    OutputSize + InputSize * OutputSize;
+
+  explicit StaticFullyConnected(ActivationFn activation_fn = {})
+    : activation_fn_{ activation_fn }
+  {}
+
+  // Use parameter_size floats of parameters and of gradients
+  void
+  bind(float* parameters, float* grads)
+  {
+    bias_ = { parameters, OutputSize };
+    weights_ = { parameters + OutputSize, InputSize * OutputSize };
+    bias_grad_ = { grads, OutputSize };
+    weight_grad_ = { grads + OutputSize, InputSize * OutputSize };
+  }
+
+  void
+  forward(const float* inputs, std::size_t batch)
+  {
+    input_ = inputs;
+    float* output = output_.data(batch);
+    float* derivative = derivative_.data(batch);
+
+    // output = activation(inputs * weights^T + bias), derivative captured
+    // from the same potential and output
+    auto epilogue = [&](std::size_t i, std::size_t j, float* c,
+                        std::size_t count) {
+      float* d = derivative + i * OutputSize + j;
+      for (std::size_t t = 0; t < count; ++t) {
+        float potential = c[t] + bias_[j + t];
+        c[t] = activation_fn_(potential);
+        d[t] = activation_fn_.derivative(potential, c[t]);
+      }
+    };
+    gemm(Transpose::No,
+         Transpose::Yes,
+         batch,
+         OutputSize,
+         InputSize,
+         1.0f,
+         inputs,
+         InputSize,
+         weights_.data(),
+         InputSize,
+         0.0f,
+         output,
+         OutputSize,
+         epilogue);
+  }
+
+  void
+  backward(const float* output_grads, std::size_t batch)
+  {
+    // Potential gradient overwrites the derivative of the forward pass
+    float* potential_grad = derivative_.data(batch);
+    for (std::size_t b = 0; b < batch; ++b) {
+      for (std::size_t j = 0; j < OutputSize; ++j) {
+        std::size_t idx = b * OutputSize + j;
+        potential_grad[idx] *= output_grads[idx];
+        bias_grad_[j] += potential_grad[idx];
+      }
+    }
+
+    // weight_grad += potential_grad^T * inputs
+    gemm(Transpose::Yes,
+         Transpose::No,
+         OutputSize,
+         InputSize,
+         batch,
+         1.0f,
+         potential_grad,
+         OutputSize,
+         input_,
+         InputSize,
+         1.0f,
+         weight_grad_.data(),
+         InputSize);
+
+    // input_grad = potential_grad * weights
+    gemm(Transpose::No,
+         Transpose::No,
+         batch,
+         InputSize,
+         OutputSize,
+         1.0f,
+         potential_grad,
+         OutputSize,
+         weights_.data(),
+         InputSize,
+         0.0f,
+         input_grad_.data(batch),
+         InputSize);
+  }
+
+  void
+  init_weights(Random& random)
+  {
+    random.generate_normal(
+      weights_, 0.0f, std::sqrt(2.0f / (InputSize * OutputSize)));
+  }
+
+  void
+  append_parameters(std::vector<Parameter>& parameters)
+  {
+    parameters.push_back({ bias_, bias_grad_, 1.0f, false });
+    parameters.push_back({ weights_, weight_grad_, 1.0f, true });
+  }
+
+  [[nodiscard]] const float*
+  output(std::size_t batch) const
+  {
+    return output_.data(batch);
+  }
+
+  [[nodiscard]] const float*
+  input_grad(std::size_t batch) const
+  {
+    return input_grad_.data(batch);
+  }
+
+  [[nodiscard]] std::span<float>
+  weights()
+  {
+    return weights_;
+  }
+
+  [[nodiscard]] std::span<float>
+  bias()
+  {
+    return bias_;
+  }
+
+private:
+  ActivationFn activation_fn_;
+  std::span<float> bias_;
+  std::span<float> weights_;
+  std::span<float> bias_grad_;
+  std::span<float> weight_grad_;
+  const float* input_ = nullptr;
+  BatchBuffer<OutputSize> output_;
+  BatchBuffer<OutputSize> derivative_;
+  BatchBuffer<InputSize> input_grad_;
+};
+
+// Layers arranged in a linear sequence fixed at compile time
+// Alternative to Sequence for topologies known when compiling: layers are
+// stored by value and called without virtual dispatch, and adjacent sizes
+// are checked by the compiler. Only the network as a whole is an IModule, so
+// it still works with Optimizer and DataParallel. Parameters and gradients
+// live in one arena each, like in Sequence.
+// See IModule for method documentation
+template<typename... Layers>
+class StaticSequence final : public IModule
+{
+  static_assert(sizeof...(Layers) > 0, "empty StaticSequence");
+
+  static constexpr std::size_t num_layers = sizeof...(Layers);
+
+  using First = std::tuple_element_t<0, std::tuple<Layers...>>;
+  using Last = std::tuple_element_t<num_layers - 1, std::tuple<Layers...>>;
+
+  static constexpr bool
+  chained()
+  {
+    constexpr auto inputs = std::array{ Layers::input_size... };
+    constexpr auto outputs = std::array{ Layers::output_size... };
+    for (std::size_t i = 1; i < num_layers; ++i) {
+      if (inputs[i] != outputs[i - 1]) {
+        return false;
+      }
+    }
+    return true;
+  }
+
+  static_assert(chained(), "layer input size differs from previous output");
+
+public:
+  static constexpr std::size_t input_size = First::input_size;
+  static constexpr std::size_t output_size = Last::output_size;
+  static constexpr std::size_t total_parameter_size =
+    (Layers::parameter_size + ...);
+
+  StaticSequence()
+    : StaticSequence(Layers{}...)
+  {}
+
+  explicit StaticSequence(Layers... layers)
+    : layers_{ std::move(layers)... }
+    , parameters_{ make_aligned_shared<float>(total_parameter_size) }
+    , grads_{ make_aligned_shared<float>(total_parameter_size) }
+  {
+    bind_layers();
+  }
+
+  void
+  forward(std::span<const float> input) override
+  {
+    forward_batch(input, 1);
+  }
+
+  void
+  backward(std::span<const float> output_grad) override
+  {
+    backward_batch(output_grad, 1);
+  }
+
+  void
+  forward_batch(std::span<const float> inputs, std::size_t batch) override
+  {
+    batch_size_ = batch;
+    const float* input = inputs.data();
+    std::apply(
+      [&](auto&... layer) {
+        ((layer.forward(input, batch), input = layer.output(batch)), ...);
+      },
+      layers_);
+  }
+
+  void
+  backward_batch(std::span<const float> output_grads,
+                 std::size_t batch) override
+  {
+    backward_from<num_layers - 1>(output_grads.data(), batch);
+  }
+
+  void
+  zero_grad() override
+  {
+    std::fill_n(grads_.get(), total_parameter_size, 0.0f);
+  }
+
+  [[nodiscard]] std::shared_ptr<IModule>
+  replicate() const override
+  {
+    // Copies share the parameter arena, gradients are their own
+    auto replica = std::make_shared<StaticSequence>(*this);
+    replica->grads_ = make_aligned_shared<float>(total_parameter_size);
+    replica->bind_layers();
+    return replica;
+  }
+
+  void
+  add_grad(const IModule& replica) override
+  {
+    const auto& other = static_cast<const StaticSequence&>(replica);
+
+    kernels().axpy(
+      1.0f, other.grads_.get(), grads_.get(), total_parameter_size);
+  }
+
+  void
+  init_weights(Random& random) override
+  {
+    std::apply([&](auto&... layer) { (layer.init_weights(random), ...); },
+               layers_);
+  }
+
+  [[nodiscard]] std::vector<Parameter>
+  parameters() override
+  {
+    auto parameters = std::vector<Parameter>{};
+    std::apply(
+      [&](auto&... layer) { (layer.append_parameters(parameters), ...); },
+      layers_);
+    return parameters;
+  }
+
+  void
+  parameters_updated() override
+  {}
+
+  [[nodiscard]] std::size_t
+  parameter_size() const override
+  {
+    return total_parameter_size;
+  }
+
+  void
+  bind_parameters(std::shared_ptr<float[]> storage) override
+  {
+    std::copy_n(parameters_.get(), total_parameter_size, storage.get());
+    parameters_ = std::move(storage);
+    bind_layers();
+  }
+
+  void
+  bind_grads(std::shared_ptr<float[]> storage) override
+  {
+    std::copy_n(grads_.get(), total_parameter_size, storage.get());
+    grads_ = std::move(storage);
+    bind_layers();
+  }
+
+  void
+  attach_parameters(std::shared_ptr<float[]> storage) override
+  {
+    parameters_ = std::move(storage);
+    bind_layers();
+  }
+
+  [[nodiscard]] std::span<const float>
+  output() const override
+  {
+    return { std::get<num_layers - 1>(layers_).output(batch_size_),
+             batch_size_ * output_size };
+  }
+
+  [[nodiscard]] std::span<const float>
+  input_grad() const override
+  {
+    return { std::get<0>(layers_).input_grad(batch_size_),
+             batch_size_ * input_size };
+  }
+
+  [[nodiscard]] std::string
+  name() const override
+  {
+    return "static_sequence";
+  }
+
+  // Layer I of the sequence
+  template<std::size_t I>
+  [[nodiscard]] auto&
+  layer()
+  {
+    return std::get<I>(layers_);
+  }
+
+  // All parameter values, in the order of parameters()
+  [[nodiscard]] std::span<float>
+  parameter_arena()
+  {
+    return { parameters_.get(), total_parameter_size };
+  }
+
+private:
+  // Give every layer its slice of the arenas
+  void
+  bind_layers()
+  {
+    std::size_t offset = 0;
+    std::apply(
+      [&](auto&... layer) {
+        ((layer.bind(parameters_.get() + offset, grads_.get() + offset),
+          offset += layer.parameter_size),
+         ...);
+      },
+      layers_);
+  }
+
+  template<std::size_t I>
+  void
+  backward_from(const float* output_grads, std::size_t batch)
+  {
+    auto& layer = std::get<I>(layers_);
+    layer.backward(output_grads, batch);
+    if constexpr (I > 0) {
+      backward_from<I - 1>(layer.input_grad(batch), batch);
+    }
+  }
+
+  std::tuple<Layers...> layers_;
+  std::size_t batch_size_ = 1;
+  std::shared_ptr<float[]> parameters_;
+  std::shared_ptr<float[]> grads_;
+};
+
+}
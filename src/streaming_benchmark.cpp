@@ -0,0 +1,108 @@
+#include <chrono>
+#include <cstdlib>
+#include <iostream>
+#include <numeric>
+#include <string>
+
+#include <sys/resource.h>
+
+#include "activation_functions.hpp"
+#include "binary_dataset.hpp"
+#include "data_loader.hpp"
+#include "fully_connected.hpp"
+#include "optimizer.hpp"
+#include "random.hpp"
+#include "sequence.hpp"
+#include "streaming_dataset.hpp"
+
+// Peak resident memory of the process in MiB
+double
+peak_rss_mib()
+{
+  struct rusage usage = {};
+  ::getrusage(RUSAGE_SELF, &usage);
+  return static_cast<double>(usage.ru_maxrss) / 1024.0;
+}
+
+// Training throughput of one epoch fed by the streaming loader and by the
+// in-memory loader over a mapped binary dataset
+// The streaming pass runs first, so its peak memory is not inflated by the
+// mapping.
+// Usage: nnets_streaming_benchmark <dataset.bin> [shard_size]
+//        [window_shards]
+int
+main(int argc, char** argv)
+{
+  if (argc < 2) {
+    std::cerr << "usage: " << argv[0]
+              << " <dataset.bin> [shard_size] [window_shards]\n";
+    return 1;
+  }
+  constexpr std::size_t batch_size = 200;
+  std::size_t shard_size = argc > 2 ? std::stoul(argv[2]) : 10 * batch_size;
+  std::size_t window_shards = argc > 3 ? std::stoul(argv[3]) : 4;
+
+  auto random = nnets::Random{};
+  random.seed(42);
+
+  auto stream = nnets::StreamingDataset{ argv[1], shard_size };
+  std::size_t input_size = stream.input_size();
+  std::size_t num_categories = 10;
+  auto config = nnets::DataLoaderConfig{ .batch_size = batch_size,
+                                         .num_categories = num_categories };
+
+  // Train one epoch from a loader, returns samples per second
+  auto train = [&](auto& loader) {
+    auto net = nnets::Sequence{ {
+      std::make_shared<nnets::FullyConnected<nnets::RelU>>(input_size, 300),
+      std::make_shared<nnets::FullyConnected<nnets::RelU>>(300, 200),
+      std::make_shared<nnets::FullyConnected<nnets::RelU>>(200, 100),
+      std::make_shared<nnets::FullyConnected<nnets::RelU>>(100,
+                                                           num_categories),
+    } };
+    net.init_weights(random);
+    auto optimizer = nnets::Optimizer{ net,
+                                       { .kind = nnets::OptimizerKind::RmsProp,
+                                         .learning_rate = 1e-4f } };
+    auto output_grads = std::vector<float>{};
+
+    auto start_time = std::chrono::steady_clock::now();
+    std::size_t num_samples = 0;
+    for (std::size_t b = 0; b < loader.batches_per_epoch(); ++b) {
+      const auto& batch = loader.next();
+      net.zero_grad();
+      net.forward_batch(batch.inputs, batch.size);
+      auto output = net.output();
+      output_grads.resize(output.size());
+      for (std::size_t i = 0; i < output.size(); ++i) {
+        output_grads[i] = output[i] - batch.targets[i];
+      }
+      net.backward_batch(output_grads, batch.size);
+      optimizer.step();
+      num_samples += batch.size;
+    }
+    auto end_time = std::chrono::steady_clock::now();
+    return static_cast<double>(num_samples) /
+           std::chrono::duration<double>(end_time - start_time).count();
+  };
+
+  std::cout << "loader samples_per_second peak_rss_mib\n";
+
+  {
+    auto loader = nnets::StreamingDataLoader{
+      stream, window_shards, config, random.rng()
+    };
+    double rate = train(loader);
+    std::cout << "streaming " << rate << " " << peak_rss_mib() << std::endl;
+  }
+
+  {
+    const auto dataset = nnets::MappedDataset{ argv[1] };
+    auto indices = std::vector<std::size_t>(dataset.size());
+    std::iota(indices.begin(), indices.end(), 0);
+    auto loader =
+      nnets::DataLoader{ dataset, std::move(indices), config, random.rng() };
+    double rate = train(loader);
+    std::cout << "in_memory " << rate << " " << peak_rss_mib() << std::endl;
+  }
+}
@@ -0,0 +1,396 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <exception>
+#include <filesystem>
+#include <future>
+#include <numeric>
+#include <span>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "aligned.hpp"
+#include "binary_dataset.hpp"
+#include "data_loader.hpp"
+
+namespace nnets {
+
+namespace detail {
+
+// Owned file descriptor, closed on destruction
+class FileDescriptor
+{
+public:
+  explicit FileDescriptor(int fd)
+    : fd_{ fd }
+  {}
+
+  FileDescriptor(const FileDescriptor&) = delete;
+  FileDescriptor& operator=(const FileDescriptor&) = delete;
+
+  ~FileDescriptor()
+  {
+    if (fd_ >= 0) {
+      ::close(fd_);
+    }
+  }
+
+  [[nodiscard]] int
+  get() const
+  {
+    return fd_;
+  }
+
+private:
+  int fd_;
+};
+
+}
+
+// Binary dataset file (see BinaryDatasetHeader) read in shards of
+// consecutive samples instead of being mapped as a whole
+// Reads go straight to the file, so the dataset may be far larger than RAM.
+// The checksum is not verified, that would need a pass over the whole file.
+class StreamingDataset
+{
+public:
+  StreamingDataset(const std::filesystem::path& path, std::size_t shard_size)
+    : path_{ path }
+    , shard_size_{ shard_size }
+    , fd_{ ::open(path.c_str(), O_RDONLY) }
+  {
+    if (shard_size_ == 0) {
+      throw std::invalid_argument{ "shard size must be positive" };
+    }
+    if (fd_.get() < 0) {
+      throw std::runtime_error{ "cannot open " + path.string() };
+    }
+
+    read_exact(&header_, sizeof(header_), 0);
+    auto file_size =
+      static_cast<std::size_t>(::lseek(fd_.get(), 0, SEEK_END));
+    std::size_t data_size = header_.num_samples * (header_.input_size + 1);
+    if (header_.magic != BinaryDatasetHeader::expected_magic or
+        header_.version != BinaryDatasetHeader::current_version or
+        file_size != sizeof(header_) + data_size) {
+      throw std::runtime_error{ "not a binary dataset: " + path.string() };
+    }
+  }
+
+  StreamingDataset(const StreamingDataset&) = delete;
+  StreamingDataset& operator=(const StreamingDataset&) = delete;
+
+  // Number of samples
+  [[nodiscard]] std::size_t
+  size() const
+  {
+    return header_.num_samples;
+  }
+
+  // Length of every input vector
+  [[nodiscard]] std::size_t
+  input_size() const
+  {
+    return header_.input_size;
+  }
+
+  // Number of samples per shard (the last shard may be shorter)
+  [[nodiscard]] std::size_t
+  shard_size() const
+  {
+    return shard_size_;
+  }
+
+  [[nodiscard]] std::size_t
+  num_shards() const
+  {
+    return (size() + shard_size_ - 1) / shard_size_;
+  }
+
+  // Number of samples in a shard
+  [[nodiscard]] std::size_t
+  shard_samples(std::size_t shard) const
+  {
+    return std::min(shard_size_, size() - shard * shard_size_);
+  }
+
+  // Read a shard into inputs (row-major) and labels, which must hold
+  // shard_samples(shard) samples
+  // Safe to call from several threads at once.
+  void
+  read_shard(std::size_t shard,
+             std::span<std::uint8_t> inputs,
+             std::span<std::uint8_t> labels) const
+  {
+    std::size_t first = shard * shard_size_;
+    std::size_t count = shard_samples(shard);
+    std::size_t inputs_offset = sizeof(header_);
+    std::size_t labels_offset = inputs_offset + size() * input_size();
+
+    read_exact(inputs.data(),
+               count * input_size(),
+               inputs_offset + first * input_size());
+    read_exact(labels.data(), count, labels_offset + first);
+  }
+
+private:
+  void
+  read_exact(void* dst, std::size_t size, std::size_t offset) const
+  {
+    auto* bytes = static_cast<char*>(dst);
+    while (size > 0) {
+      auto count =
+        ::pread(fd_.get(), bytes, size, static_cast<off_t>(offset));
+      if (count <= 0) {
+        throw std::runtime_error{ "cannot read " + path_.string() };
+      }
+      auto n = static_cast<std::size_t>(count);
+      bytes += n;
+      offset += n;
+      size -= n;
+    }
+  }
+
+  std::filesystem::path path_;
+  std::size_t shard_size_;
+  detail::FileDescriptor fd_;
+  BinaryDatasetHeader header_;
+};
+
+// Samples of a few shards of a StreamingDataset held in memory
+// A dataset for BatchStager, indexed from 0 in the order of the loaded shards.
+class ShardWindow
+{
+public:
+  ShardWindow(std::size_t input_size, std::size_t capacity)
+    : input_size_{ input_size }
+    , inputs_(input_size * capacity)
+    , labels_(capacity)
+  {}
+
+  // Replace the contents with the given shards
+  void
+  load(const StreamingDataset& dataset, std::span<const std::size_t> shards)
+  {
+    size_ = 0;
+    for (std::size_t shard : shards) {
+      std::size_t count = dataset.shard_samples(shard);
+      if (size_ + count > labels_.size()) {
+        throw std::length_error{ "shards exceed window capacity" };
+      }
+      dataset.read_shard(
+        shard,
+        std::span{ inputs_ }.subspan(size_ * input_size_, count * input_size_),
+        std::span{ labels_ }.subspan(size_, count));
+      size_ += count;
+    }
+  }
+
+  // Number of loaded samples
+  [[nodiscard]] std::size_t
+  size() const
+  {
+    return size_;
+  }
+
+  [[nodiscard]] std::size_t
+  input_size() const
+  {
+    return input_size_;
+  }
+
+  [[nodiscard]] std::span<const std::uint8_t>
+  input(std::size_t i) const
+  {
+    return std::span{ inputs_ }.subspan(i * input_size_, input_size_);
+  }
+
+  [[nodiscard]] int
+  label(std::size_t i) const
+  {
+    return labels_[i];
+  }
+
+private:
+  std::size_t input_size_;
+  std::size_t size_ = 0;
+  AlignedVector<std::uint8_t> inputs_;
+  std::vector<std::uint8_t> labels_;
+};
+
+// DataLoader over a StreamingDataset
+// Every epoch visits the shards in a random order, window_shards of them at
+// a time. Samples are shuffled within each window, while the next window is
+// read on another thread. Memory use is two windows plus the batch ring,
+// independent of the size of the dataset.
+// The shard size must be a multiple of the batch size, so every shard
+// contributes the same number of batches wherever it ends up in the order.
+class StreamingDataLoader
+{
+public:
+  using Rng = detail::BatchRing::Rng;
+  // Called on the producer thread for the input vector of every sample
+  using Augmentation = detail::BatchRing::Augmentation;
+
+  // Stream the given shards of the dataset, which must outlive the loader
+  StreamingDataLoader(const StreamingDataset& dataset,
+                      std::vector<std::size_t> shards,
+                      std::size_t window_shards,
+                      DataLoaderConfig config,
+                      Rng rng,
+                      Augmentation augmentation = {})
+    : dataset_{ dataset }
+    , shards_{ std::move(shards) }
+    , window_shards_{ std::max<std::size_t>(window_shards, 1) }
+    , config_{ config }
+    , rng_{ std::move(rng) }
+    , windows_{ ShardWindow{ dataset.input_size(),
+                             window_shards_ * dataset.shard_size() },
+                ShardWindow{ dataset.input_size(),
+                             window_shards_ * dataset.shard_size() } }
+    , ring_{ config, dataset.input_size(), std::move(augmentation) }
+  {
+    if (dataset.shard_size() % config_.batch_size != 0) {
+      throw std::invalid_argument{
+        "shard size must be a multiple of the batch size"
+      };
+    }
+    producer_ = std::thread{ [this] { produce(); } };
+  }
+
+  // Stream all shards of the dataset
+  StreamingDataLoader(const StreamingDataset& dataset,
+                      std::size_t window_shards,
+                      DataLoaderConfig config,
+                      Rng rng,
+                      Augmentation augmentation = {})
+    : StreamingDataLoader(dataset,
+                          all_shards(dataset),
+                          window_shards,
+                          config,
+                          std::move(rng),
+                          std::move(augmentation))
+  {}
+
+  StreamingDataLoader(const StreamingDataLoader&) = delete;
+  StreamingDataLoader& operator=(const StreamingDataLoader&) = delete;
+
+  ~StreamingDataLoader()
+  {
+    ring_.stop();
+    producer_.join();
+  }
+
+  [[nodiscard]] std::size_t
+  batches_per_epoch() const
+  {
+    std::size_t batches = 0;
+    for (std::size_t shard : shards_) {
+      batches += (dataset_.shard_samples(shard) + config_.batch_size - 1) /
+                 config_.batch_size;
+    }
+    return batches;
+  }
+
+  // Wait for the next batch, see DataLoader::next()
+  const LoaderBatch&
+  next()
+  {
+    return ring_.next(config_.num_epochs * batches_per_epoch());
+  }
+
+private:
+  static std::vector<std::size_t>
+  all_shards(const StreamingDataset& dataset)
+  {
+    auto shards = std::vector<std::size_t>(dataset.num_shards());
+    std::iota(shards.begin(), shards.end(), 0);
+    return shards;
+  }
+
+  // Start reading the shards of window step (counted over all epochs)
+  std::future<void>
+  load_window(std::size_t step)
+  {
+    std::size_t windows_per_epoch =
+      (shards_.size() + window_shards_ - 1) / window_shards_;
+    std::size_t first = step % windows_per_epoch * window_shards_;
+    if (first == 0 and config_.shuffle) {
+      std::ranges::shuffle(shards_, rng_);
+    }
+
+    auto shards = std::vector<std::size_t>(
+      shards_.begin() + first,
+      shards_.begin() + std::min(first + window_shards_, shards_.size()));
+    return std::async(
+      std::launch::async,
+      [&window = windows_[step % 2], &dataset = dataset_, shards] {
+        window.load(dataset, shards);
+      });
+  }
+
+  void
+  produce()
+  {
+    try {
+      if (shards_.empty()) {
+        return;
+      }
+      std::size_t windows_per_epoch =
+        (shards_.size() + window_shards_ - 1) / window_shards_;
+      std::size_t num_steps = config_.num_epochs * windows_per_epoch;
+      auto indices = std::vector<std::size_t>{};
+
+      auto pending = load_window(0);
+      for (std::size_t step = 0; step < num_steps; ++step) {
+        pending.get();
+        if (step + 1 < num_steps) {
+          pending = load_window(step + 1);
+        }
+
+        const auto& window = windows_[step % 2];
+        indices.resize(window.size());
+        std::iota(indices.begin(), indices.end(), 0);
+        if (config_.shuffle) {
+          std::ranges::shuffle(indices, rng_);
+        }
+
+        std::size_t epoch = step / windows_per_epoch;
+        for (std::size_t start = 0; start < indices.size();
+             start += config_.batch_size) {
+          std::size_t size =
+            std::min(config_.batch_size, indices.size() - start);
+          if (not ring_.produce(window,
+                                std::span{ indices }.subspan(start, size),
+                                epoch,
+                                rng_)) {
+            return;
+          }
+        }
+      }
+    } catch (...) {
+      ring_.fail(std::current_exception());
+    }
+  }
+
+  const StreamingDataset& dataset_;
+  std::vector<std::size_t> shards_;
+  std::size_t window_shards_;
+  DataLoaderConfig config_;
+  Rng rng_;
+  // Window being consumed and window being read
+  std::array<ShardWindow, 2> windows_;
+  detail::BatchRing ring_;
+  std::thread producer_;
+};
+
+}
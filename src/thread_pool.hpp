@@ -0,0 +1,159 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <functional>
+#include <mutex>
+#include <span>
+#include <thread>
+#include <vector>
+
+#ifdef __linux__
+#include <pthread.h>
+#include <sched.h>
+#endif
+
+namespace nnets {
+
+// Restrict the calling thread to the given CPUs, threads it starts later
+// (e.g. the workers of a ThreadPool) inherit the restriction
+// Returns false if pinning failed or is unsupported (it is Linux only).
+inline bool
+pin_current_thread(std::span<const std::size_t> cpus)
+{
+#ifdef __linux__
+  cpu_set_t set;
+  CPU_ZERO(&set);
+  for (std::size_t cpu : cpus) {
+    if (cpu < CPU_SETSIZE) {
+      CPU_SET(cpu, &set);
+    }
+  }
+  return pthread_setaffinity_np(pthread_self(), sizeof(set), &set) == 0;
+#else
+  return false;
+#endif
+}
+
+// Fixed set of worker threads running blocking parallel loops
+// The calling thread takes part in every loop, so a pool of size 1 spawns no
+// threads at all
+class ThreadPool
+{
+public:
+  explicit ThreadPool(std::size_t num_threads)
+    : num_threads_{ std::max<std::size_t>(num_threads, 1) }
+  {
+    for (std::size_t t = 1; t < num_threads_; ++t) {
+      workers_.emplace_back([this] { worker_loop(); });
+    }
+  }
+
+  ThreadPool(const ThreadPool&) = delete;
+  ThreadPool& operator=(const ThreadPool&) = delete;
+
+  ~ThreadPool()
+  {
+    {
+      auto lock = std::unique_lock{ mutex_ };
+      stop_ = true;
+    }
+    wake_.notify_all();
+    for (auto& worker : workers_) {
+      worker.join();
+    }
+  }
+
+  // Number of threads including the caller
+  [[nodiscard]] std::size_t
+  size() const
+  {
+    return num_threads_;
+  }
+
+  // Call fn(i) for every i in [0, n) and wait until all calls are finished
+  void
+  parallel_for(std::size_t n, const std::function<void(std::size_t)>& fn)
+  {
+    if (num_threads_ == 1 or n <= 1) {
+      for (std::size_t i = 0; i < n; ++i) {
+        fn(i);
+      }
+      return;
+    }
+
+    {
+      auto lock = std::unique_lock{ mutex_ };
+      task_ = &fn;
+      num_tasks_ = n;
+      next_task_ = 0;
+      ++generation_;
+    }
+    wake_.notify_all();
+
+    run_tasks();
+
+    // Close the loop once no worker is inside it anymore
+    auto lock = std::unique_lock{ mutex_ };
+    done_.wait(lock, [this] { return busy_ == 0; });
+    task_ = nullptr;
+  }
+
+private:
+  void
+  worker_loop()
+  {
+    std::size_t seen_generation = 0;
+
+    while (true) {
+      {
+        auto lock = std::unique_lock{ mutex_ };
+        wake_.wait(
+          lock, [&] { return stop_ or generation_ != seen_generation; });
+        if (stop_) {
+          return;
+        }
+        seen_generation = generation_;
+
+        // Woke up after the loop was already finished by others
+        if (task_ == nullptr) {
+          continue;
+        }
+        ++busy_;
+      }
+
+      run_tasks();
+
+      auto lock = std::unique_lock{ mutex_ };
+      if (--busy_ == 0) {
+        done_.notify_all();
+      }
+    }
+  }
+
+  // Claim and run tasks of the current loop until none are left
+  void
+  run_tasks()
+  {
+    for (std::size_t i = next_task_.fetch_add(1); i < num_tasks_;
+         i = next_task_.fetch_add(1)) {
+      (*task_)(i);
+    }
+  }
+
+  std::size_t num_threads_;
+  std::vector<std::thread> workers_;
+  std::mutex mutex_;
+  std::condition_variable wake_;
+  std::condition_variable done_;
+  const std::function<void(std::size_t)>* task_ = nullptr;
+  std::size_t num_tasks_ = 0;
+  std::atomic<std::size_t> next_task_ = 0;
+  std::size_t busy_ = 0;
+  std::size_t generation_ = 0;
+  bool stop_ = false;
+};
+
+}
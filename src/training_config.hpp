@@ -0,0 +1,317 @@
+#pragma once
+
+#include <algorithm>
+#include <charconv>
+#include <cstddef>
+#include <cmath>
+#include <cstdint>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <system_error>
+#include <utility>
+#include <vector>
+
+#include "activation_functions.hpp"
+#include "conv2d.hpp"
+#include "dropout.hpp"
+#include "fully_connected.hpp"
+#include "max_pool2d.hpp"
+#include "optimizer.hpp"
+#include "sequence.hpp"
+
+namespace nnets {
+
+// Hyperparameters of a training run as in main.cpp, settable at runtime from
+// key=value strings whose keys are the member names (see set())
+struct TrainingConfig
+{
+  std::size_t epochs = 20;
+  // Split in one shard per thread, the first layer skips zero inputs only if
+  // shards have at most FullyConnected::sparse_input_max_rows (12) samples
+  // (see first_layer_sparsity())
+  std::size_t batch_size = 200;
+  float initial_learning_rate = 1e-4f;
+  // Learning rate factor after every epoch
+  float gamma = 0.95f;
+  float rms_prop_smoothing_factor = 1e-8f;
+  float rms_prop_history_influence = 0.9f;
+  float validation_dataset_fraction = 0.1f;
+  float label_smoothing = 0.1f;
+  float dropout_rate = 0.1f;
+  // Output channels of convolution blocks in front of the hidden layers,
+  // written as a comma-separated list, none by default (see make_network())
+  std::vector<std::size_t> conv_channels;
+  // Widths of the hidden layers, written as a comma-separated list
+  std::vector<std::size_t> hidden_sizes = { 300, 200, 100 };
+  std::uint64_t seed = 1231331231231231;
+
+  // Set one member from its text, throws std::invalid_argument for unknown
+  // keys and malformed or out-of-range values, which leave the config
+  // unchanged
+  void
+  set(std::string_view key, std::string_view value)
+  {
+    auto updated = *this;
+    if (key == "epochs") {
+      updated.epochs = parse<std::size_t>(key, value);
+    } else if (key == "batch_size") {
+      updated.batch_size = parse<std::size_t>(key, value);
+    } else if (key == "initial_learning_rate") {
+      updated.initial_learning_rate = parse<float>(key, value);
+    } else if (key == "gamma") {
+      updated.gamma = parse<float>(key, value);
+    } else if (key == "rms_prop_smoothing_factor") {
+      updated.rms_prop_smoothing_factor = parse<float>(key, value);
+    } else if (key == "rms_prop_history_influence") {
+      updated.rms_prop_history_influence = parse<float>(key, value);
+    } else if (key == "validation_dataset_fraction") {
+      updated.validation_dataset_fraction = parse<float>(key, value);
+    } else if (key == "label_smoothing") {
+      updated.label_smoothing = parse<float>(key, value);
+    } else if (key == "dropout_rate") {
+      updated.dropout_rate = parse<float>(key, value);
+    } else if (key == "conv_channels") {
+      updated.conv_channels = parse_list(key, value);
+    } else if (key == "hidden_sizes") {
+      updated.hidden_sizes = parse_list(key, value);
+    } else if (key == "seed") {
+      updated.seed = parse<std::uint64_t>(key, value);
+    } else {
+      throw std::invalid_argument{ "unknown setting " + std::string{ key } };
+    }
+
+    if (not updated.valid()) {
+      throw std::invalid_argument{ "invalid value for " + std::string{ key } +
+                                   ": " + std::string{ value } };
+    }
+    *this = std::move(updated);
+  }
+
+  // Set one member from "key=value"
+  void
+  set(std::string_view setting)
+  {
+    auto equals = setting.find('=');
+    if (equals == setting.npos) {
+      throw std::invalid_argument{ "expected key=value, got " +
+                                   std::string{ setting } };
+    }
+    set(setting.substr(0, equals), setting.substr(equals + 1));
+  }
+
+  // All members as space-separated key=value settings, accepted by set()
+  [[nodiscard]] std::string
+  to_string() const
+  {
+    auto result = std::string{};
+    auto add = [&](std::string_view key, const std::string& value) {
+      if (not result.empty()) {
+        result += ' ';
+      }
+      result.append(key).append("=").append(value);
+    };
+    auto list = [](const std::vector<std::size_t>& values) {
+      auto text = std::string{};
+      for (std::size_t value : values) {
+        if (not text.empty()) {
+          text += ',';
+        }
+        text += std::to_string(value);
+      }
+      return text;
+    };
+    add("epochs", std::to_string(epochs));
+    add("batch_size", std::to_string(batch_size));
+    add("initial_learning_rate", format(initial_learning_rate));
+    add("gamma", format(gamma));
+    add("rms_prop_smoothing_factor", format(rms_prop_smoothing_factor));
+    add("rms_prop_history_influence", format(rms_prop_history_influence));
+    add("validation_dataset_fraction", format(validation_dataset_fraction));
+    add("label_smoothing", format(label_smoothing));
+    add("dropout_rate", format(dropout_rate));
+    add("conv_channels", list(conv_channels));
+    add("hidden_sizes", list(hidden_sizes));
+    add("seed", std::to_string(seed));
+    return result;
+  }
+
+private:
+  // Whether the values are in the ranges the network, the loss and
+  // split_indices() accept (comparisons are false for NaN)
+  [[nodiscard]] bool
+  valid() const
+  {
+    auto in_unit = [](float value) { return value >= 0.0f and value < 1.0f; };
+    return epochs > 0 and batch_size > 0 and not hidden_sizes.empty() and
+           std::ranges::count(hidden_sizes, 0) == 0 and
+           std::ranges::count(conv_channels, 0) == 0 and
+           initial_learning_rate > 0.0f and gamma > 0.0f and
+           rms_prop_smoothing_factor > 0.0f and
+           in_unit(rms_prop_history_influence) and
+           validation_dataset_fraction > 0.0f and
+           validation_dataset_fraction < 1.0f and in_unit(label_smoothing) and
+           in_unit(dropout_rate);
+  }
+
+  template<typename T>
+  static T
+  parse(std::string_view key, std::string_view value)
+  {
+    T result{};
+    auto [end, error] =
+      std::from_chars(value.data(), value.data() + value.size(), result);
+    if (error != std::errc{} or end != value.data() + value.size()) {
+      throw std::invalid_argument{ "invalid value for " + std::string{ key } +
+                                   ": " + std::string{ value } };
+    }
+    return result;
+  }
+
+  // Comma-separated list, empty for an empty value
+  static std::vector<std::size_t>
+  parse_list(std::string_view key, std::string_view value)
+  {
+    auto result = std::vector<std::size_t>{};
+    for (auto rest = value; not rest.empty();) {
+      auto comma = rest.find(',');
+      result.push_back(parse<std::size_t>(key, rest.substr(0, comma)));
+      rest.remove_prefix(comma == rest.npos ? rest.size() : comma + 1);
+    }
+    return result;
+  }
+
+  // Shortest text that parses back to the same float
+  static std::string
+  format(float value)
+  {
+    char buffer[32];
+    auto end = std::to_chars(buffer, buffer + sizeof(buffer), value).ptr;
+    return { buffer, end };
+  }
+};
+
+// Input mode of the first fully connected layer of make_network():
+// InputSparsity::Sparse if it takes the pixels (no convolution blocks) and
+// the batches split over num_threads DataParallel workers give shards small
+// enough for the sparse path to run (FullyConnected::sparse_input_max_rows),
+// the dense GEMMs win on larger ones
+[[nodiscard]] inline InputSparsity
+first_layer_sparsity(const TrainingConfig& config, std::size_t num_threads)
+{
+  std::size_t shard_size = (config.batch_size + num_threads - 1) / num_threads;
+  return config.conv_channels.empty() and
+             shard_size <= FullyConnected<RelU>::sparse_input_max_rows
+           ? InputSparsity::Sparse
+           : InputSparsity::Dense;
+}
+
+// Side of the square single-channel images of input_size pixels (e.g. 28 for
+// the 784 of Fashion-MNIST), throws std::invalid_argument if they are not
+[[nodiscard]] inline std::size_t
+image_side(std::size_t input_size)
+{
+  auto side = static_cast<std::size_t>(
+    std::lround(std::sqrt(static_cast<double>(input_size))));
+  if (side * side != input_size) {
+    throw std::invalid_argument{
+      "convolutions need square single-channel images"
+    };
+  }
+  return side;
+}
+
+// Multiply-adds of a forward pass of one sample through make_network(), to
+// compare the accuracy of topologies per FLOP
+[[nodiscard]] inline std::size_t
+forward_macs(const TrainingConfig& config,
+             std::size_t input_size,
+             std::size_t num_categories)
+{
+  std::size_t macs = 0;
+  std::size_t size = input_size;
+  if (not config.conv_channels.empty()) {
+    std::size_t side = image_side(input_size);
+    std::size_t channels = 1;
+    for (std::size_t output_channels : config.conv_channels) {
+      macs += output_channels * side * side * channels * 3 * 3;
+      channels = output_channels;
+      side /= 2;
+    }
+    size = channels * side * side;
+  }
+  for (std::size_t width : config.hidden_sizes) {
+    macs += size * width;
+    size = width;
+  }
+  return macs + size * num_categories;
+}
+
+// The network of main.cpp for a config: optional convolution blocks, ReLU
+// hidden layers of the configured widths, each but the last followed by
+// dropout, and a linear output layer for SoftmaxCrossEntropy
+// Inputs are read as 1 x side x side NCHW images by the convolution blocks,
+// each a 3x3 ReLU Conv2D with padding 1 of conv_channels[i] channels and a
+// 2x2 MaxPool2D halving the side.
+// The first fully connected layer skips the zero pixels of its inputs if
+// first_layer_sparsity() allows.
+[[nodiscard]] inline Sequence
+make_network(const TrainingConfig& config,
+             std::size_t input_size,
+             std::size_t num_categories,
+             std::size_t num_threads)
+{
+  // Weights may be stored as Bf16Precision or Fp16Precision to halve the
+  // memory traffic of the GEMMs, training stays in float
+  using Layer = FullyConnected<RelU, Fp32Precision>;
+  using OutputLayer = FullyConnected<Identity, Fp32Precision>;
+
+  auto modules = std::vector<std::shared_ptr<IModule>>{};
+  std::size_t size = input_size;
+  if (not config.conv_channels.empty()) {
+    // No pool, DataParallel already runs the replicas on the threads
+    std::size_t side = image_side(input_size);
+    std::size_t channels = 1;
+    for (std::size_t output_channels : config.conv_channels) {
+      modules.push_back(std::make_shared<Conv2D<RelU>>(
+        Conv2DConfig{ .input_channels = channels,
+                      .input_height = side,
+                      .input_width = side,
+                      .output_channels = output_channels,
+                      .padding = 1 }));
+      modules.push_back(std::make_shared<MaxPool2D>(
+        MaxPool2DConfig{ .channels = output_channels,
+                         .input_height = side,
+                         .input_width = side }));
+      channels = output_channels;
+      side /= 2;
+    }
+    size = channels * side * side;
+  }
+  for (std::size_t l = 0; l < config.hidden_sizes.size(); ++l) {
+    std::size_t width = config.hidden_sizes[l];
+    auto sparsity =
+      l == 0 ? first_layer_sparsity(config, num_threads) : InputSparsity::Dense;
+    modules.push_back(std::make_shared<Layer>(
+      size, width, RelU{}, Fp32Precision{}, sparsity));
+    if (l + 1 < config.hidden_sizes.size()) {
+      modules.push_back(std::make_shared<Dropout>(width, config.dropout_rate));
+    }
+    size = width;
+  }
+  modules.push_back(std::make_shared<OutputLayer>(size, num_categories));
+  return Sequence{ std::move(modules) };
+}
+
+// RMSProp as configured
+[[nodiscard]] inline OptimizerConfig
+optimizer_config(const TrainingConfig& config)
+{
+  return { .kind = OptimizerKind::RmsProp,
+           .learning_rate = config.initial_learning_rate,
+           .history_influence = config.rms_prop_history_influence,
+           .epsilon = config.rms_prop_smoothing_factor };
+}
+
+}
@@ -57,31 +57,79 @@ public:
     sequence_.backward(output_grad);
   }
 
+  void
+  forward_batch(std::span<const float> inputs, std::size_t batch) override
+  {
+    sequence_.forward_batch(inputs, batch);
+  }
+
+  void
+  backward_batch(std::span<const float> output_grads,
+                 std::size_t batch) override
+  {
+    sequence_.backward_batch(output_grads, batch);
+  }
+
   void
   zero_grad() override
   {
     sequence_.zero_grad();
   }
 
+  [[nodiscard]] std::shared_ptr<IModule>
+  replicate() const override
+  {
+    auto replica = std::make_shared<XorNet>();
+    replica->sequence_ = sequence_.replica();
+    return replica;
+  }
+
+  void
+  add_grad(const IModule& replica) override
+  {
+    sequence_.add_grad(static_cast<const XorNet&>(replica).sequence_);
+  }
+
   void
   init_weights(Random& random) override
   {
     sequence_.init_weights(random);
   }
 
+  [[nodiscard]] std::vector<Parameter>
+  parameters() override
+  {
+    return sequence_.parameters();
+  }
+
+  void
+  parameters_updated() override
+  {
+    sequence_.parameters_updated();
+  }
+
+  [[nodiscard]] std::size_t
+  parameter_size() const override
+  {
+    return sequence_.parameter_size();
+  }
+
+  void
+  bind_parameters(std::shared_ptr<float[]> storage) override
+  {
+    sequence_.bind_parameters(std::move(storage));
+  }
+
   void
-  step_grad(float coeff) override
+  bind_grads(std::shared_ptr<float[]> storage) override
   {
-    sequence_.step_grad(coeff);
+    sequence_.bind_grads(std::move(storage));
   }
 
   void
-  step_grad_rms_prop(float learning_rate,
-                     float history_influence,
-                     float smoothing_term) override
+  attach_parameters(std::shared_ptr<float[]> storage) override
   {
-    sequence_.step_grad_rms_prop(
-      learning_rate, history_influence, smoothing_term);
+    sequence_.attach_parameters(std::move(storage));
   }
 
   [[nodiscard]] std::span<const float>
@@ -96,6 +144,12 @@ public:
     return sequence_.input_grad();
   }
 
+  [[nodiscard]] std::string
+  name() const override
+  {
+    return "xor_net";
+  }
+
 private:
   Sequence sequence_;
 };